@@ -19,8 +19,10 @@
 #pragma once
 
 #include <assert.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <limits.h>
+#include <string.h>
 #include <sys/stat.h>
 
 
@@ -44,6 +46,32 @@ typedef uint32_t a1fs_ino_t;
 /** Magic value that can be used to identify an a1fs image. */
 #define A1FS_MAGIC 0xC5C369A1C5C369A1ul
 
+/**
+ * Optional on-disk formats, chosen by mkfs and recorded in the superblock's
+ * features. Tools refuse images with features they do not know.
+ */
+/** Directories hold variable-length entries (a1fs_dirent), not a1fs_dentry. */
+#define A1FS_FEATURE_DIRENT 0x1
+/** Variable-length entries also store a hash of the name; needs DIRENT. */
+#define A1FS_FEATURE_DIRENT_HASH 0x2
+/** All features this version knows. */
+#define A1FS_FEATURES_KNOWN (A1FS_FEATURE_DIRENT | A1FS_FEATURE_DIRENT_HASH)
+
+/**
+ * Inode table chunks.
+ *
+ * The inode table laid out by mkfs is followed, when it fills up, by chunks of
+ * A1FS_INODE_CHUNK_BLOCKS blocks allocated from the data blocks. The chunk map
+ * in the superblock holds the first block of each chunk; the inodes of chunk i
+ * are numbered from the end of the fixed table plus i * A1FS_INODE_CHUNK_INODES
+ * (see a1fs_inode_at()). The inode bitmap is sized by mkfs for the inodes that
+ * chunks can add, and chunks are never freed.
+ */
+#define A1FS_INODE_CHUNK_BLOCKS 4
+
+/** Maximum number of inode table chunks; the chunk map is in the superblock. */
+#define A1FS_INODE_CHUNKS_MAX 1000
+
 /** a1fs superblock. */
 typedef struct a1fs_superblock {
 	/** Must match A1FS_MAGIC. */
@@ -64,23 +92,55 @@ typedef struct a1fs_superblock {
 	unsigned int blocks_count;	  /* Blocks count */
 	unsigned int free_blocks_count; /* Free blocks count */
 	unsigned int free_inodes_count; /* Free inodes count */
+	unsigned int clean_block_start; /* Blocks from here on were never allocated and are all zeros */
+	unsigned int inode_chunks_count; /* Inode table chunks in the data blocks */
+	unsigned int inode_chunks[A1FS_INODE_CHUNKS_MAX]; /* First block of each chunk */
+	unsigned int uninit_inode_start; /* Inodes of the fixed table from here on were never initialized; 0 if none */
+	unsigned int next_generation; /* Generation of the next inode allocated */
+	unsigned int features;        /* A1FS_FEATURE_* flags set by mkfs */
 
 } a1fs_superblock;
 
+/** Check that this version knows the image's features, in a valid combination. */
+static inline bool a1fs_features_ok(const a1fs_superblock *sb)
+{
+	if (sb->features & ~A1FS_FEATURES_KNOWN)
+		return false;
+	return !(sb->features & A1FS_FEATURE_DIRENT_HASH) || (sb->features & A1FS_FEATURE_DIRENT);
+}
+
 // Superblock must fit into a single block
 static_assert(sizeof(a1fs_superblock) <= A1FS_BLOCK_SIZE,
               "superblock is too large");
 
 
-/** Extent - a contiguous range of blocks. */
+/**
+ * Extent - a contiguous range of blocks.
+ *
+ * The extents of a file are kept in logical order: the n-th block of the file
+ * is found by summing extent lengths. An extent that starts at block 0 is a
+ * hole - it is not backed by any blocks and reads as zeros (block 0 always
+ * holds the superblock, so it is never a data block). An extent with
+ * A1FS_EXTENT_UNWRITTEN set in its count is allocated but has never been
+ * written, and also reads as zeros.
+ */
 typedef struct a1fs_extent {
-	/** Starting block of the extent. */
+	/** Starting block of the extent; 0 for a hole. */
 	a1fs_blk_t start;
-	/** Number of blocks in the extent. */
+	/** Number of blocks in the extent, possibly with A1FS_EXTENT_UNWRITTEN. */
 	a1fs_blk_t count;
 
 } a1fs_extent;
 
+/** Flag in a1fs_extent.count marking allocated but unwritten blocks. */
+#define A1FS_EXTENT_UNWRITTEN 0x80000000u
+
+/** Maximum number of blocks in a single extent (and in a single file). */
+#define A1FS_EXTENT_LEN_MAX (A1FS_EXTENT_UNWRITTEN - 1)
+
+/** Maximum number of extents per file; the extent table is a single block. */
+#define A1FS_EXTENTS_MAX (A1FS_BLOCK_SIZE / sizeof(a1fs_extent))
+
 
 /** a1fs inode. */
 typedef struct a1fs_inode {
@@ -120,13 +180,68 @@ typedef struct a1fs_inode {
 	int entry_count;
 	unsigned int  num_extents;  /* number of extent */
 	unsigned int extent_table;
-	char padding[9];
+	/** Changes each time the inode number is reused (see next_generation). */
+	uint32_t generation;
+	char padding[5];
 
 } a1fs_inode;
 
 // A single block must fit an integral number of inodes
 static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
 
+/** Number of inodes in a block of the inode table. */
+#define A1FS_INODES_PER_BLOCK (A1FS_BLOCK_SIZE / sizeof(a1fs_inode))
+
+/** Number of inodes in an inode table chunk. */
+#define A1FS_INODE_CHUNK_INODES (A1FS_INODE_CHUNK_BLOCKS * A1FS_INODES_PER_BLOCK)
+
+/** Number of inodes the fixed inode table has room for. */
+static inline uint64_t a1fs_table_inodes(const a1fs_superblock *sb)
+{
+	return (uint64_t)sb->inode_table_count * A1FS_INODES_PER_BLOCK;
+}
+
+/**
+ * Check the inode count and the chunk map: the fixed inode table may have
+ * unused room at the end, but chunks only follow once it is full, and they
+ * must lie within the data blocks.
+ */
+static inline bool a1fs_inode_layout_ok(const a1fs_superblock *sb)
+{
+	uint64_t table_inodes = a1fs_table_inodes(sb);
+	if (sb->inode_chunks_count == 0)
+		return sb->inodes_count <= table_inodes;
+	if (sb->inode_chunks_count > A1FS_INODE_CHUNKS_MAX ||
+		sb->inodes_count != table_inodes + (uint64_t)sb->inode_chunks_count * A1FS_INODE_CHUNK_INODES)
+		return false;
+	for (unsigned int i = 0; i < sb->inode_chunks_count; i++)
+	{
+		if (sb->inode_chunks[i] < sb->first_data_block ||
+			(uint64_t)sb->inode_chunks[i] + A1FS_INODE_CHUNK_BLOCKS > sb->blocks_count)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Locate an inode in the fixed inode table or in an inode table chunk.
+ *
+ * @param image  pointer to the start of the image.
+ * @param ino    inode number; must be less than the superblock's inodes_count.
+ * @return       pointer to the inode.
+ */
+static inline a1fs_inode *a1fs_inode_at(void *image, a1fs_ino_t ino)
+{
+	const a1fs_superblock *sb = (const a1fs_superblock *)image;
+	unsigned char *base = (unsigned char *)image;
+	uint64_t table_inodes = a1fs_table_inodes(sb);
+	if (ino < table_inodes)
+		return (a1fs_inode *)(base + (size_t)sb->first_ino * A1FS_BLOCK_SIZE) + ino;
+	uint64_t i = ino - table_inodes;
+	a1fs_blk_t chunk = sb->inode_chunks[i / A1FS_INODE_CHUNK_INODES];
+	return (a1fs_inode *)(base + (size_t)chunk * A1FS_BLOCK_SIZE) + i % A1FS_INODE_CHUNK_INODES;
+}
+
 
 /** Maximum file name (path component) length. Includes the null terminator. */
 #define A1FS_NAME_MAX 252
@@ -144,3 +259,181 @@ typedef struct a1fs_dentry {
 } a1fs_dentry;
 
 static_assert(sizeof(a1fs_dentry) == 256, "invalid dentry size");
+
+
+/**
+ * Variable-length directory entry (with A1FS_FEATURE_DIRENT).
+ *
+ * The header is followed by the name hash (with A1FS_FEATURE_DIRENT_HASH, see
+ * a1fs_name_hash()), then by the name and its null terminator. Entries are
+ * 4-byte aligned and never cross a block; rec_len covers the entry and any
+ * free space up to the next one, so the last entry of a block reaches its end.
+ * Removing an entry adds its space to the entry before it; the first entry of
+ * a block is freed in place by setting its ino to 0. A block with no entries
+ * is a single free entry spanning the whole block.
+ */
+typedef struct a1fs_dirent {
+	/** Inode number; 0 for a free entry. */
+	a1fs_ino_t ino;
+	/** Bytes from the start of this entry to the start of the next one. */
+	uint16_t rec_len;
+	/** Name length, without the null terminator. */
+	uint8_t name_len;
+	uint8_t pad;
+
+} a1fs_dirent;
+
+static_assert(sizeof(a1fs_dirent) == 8, "invalid dirent size");
+static_assert(A1FS_NAME_MAX - 1 <= UINT8_MAX, "name length does not fit");
+
+/** A directory entry in either format, as returned by a1fs_dir_next(). */
+typedef struct a1fs_dir_rec {
+	/** Offset of the entry in its block. */
+	uint32_t off;
+	/** Space the entry takes in the block, including free space after it. */
+	uint32_t len;
+	/** Inode number; 0 for a free entry. */
+	a1fs_ino_t ino;
+	/** Stored name hash; only with A1FS_FEATURE_DIRENT_HASH. */
+	uint32_t hash;
+	/** Name length, without the null terminator. */
+	uint32_t name_len;
+	/** The null-terminated name; empty for a free variable-length entry. */
+	const char *name;
+
+} a1fs_dir_rec;
+
+/**
+ * Unit of directory positions: an entry's position is its byte offset in the
+ * directory divided by this (the readdir offsets are built from it).
+ */
+static inline uint32_t a1fs_dir_slot_size(uint32_t features)
+{
+	return (features & A1FS_FEATURE_DIRENT) ? 4 : sizeof(a1fs_dentry);
+}
+
+/** Space an entry with a name of the given length needs in a block. */
+static inline uint32_t a1fs_dirent_size(uint32_t features, uint32_t name_len)
+{
+	if (!(features & A1FS_FEATURE_DIRENT))
+		return sizeof(a1fs_dentry);
+	uint32_t size = sizeof(a1fs_dirent) + name_len + 1;
+	if (features & A1FS_FEATURE_DIRENT_HASH)
+		size += sizeof(uint32_t);
+	return (size + 3) & ~3u;
+}
+
+/** Hash of a name (32-bit FNV-1a), stored to skip most name comparisons. */
+static inline uint32_t a1fs_name_hash(const char *name, uint32_t len)
+{
+	uint32_t h = 2166136261u;
+	for (uint32_t i = 0; i < len; i++)
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	return h;
+}
+
+/**
+ * Step to the next entry of a directory block.
+ *
+ * Start with rec zeroed; each call decodes the entry after the one in rec.
+ * Stops at the end of the block, and at an entry that is malformed or runs
+ * past the block, in which case rec->off is left at that entry and is less
+ * than A1FS_BLOCK_SIZE.
+ *
+ * @param features  superblock features.
+ * @param block     pointer to the start of the block.
+ * @param rec       previous entry; receives the next one.
+ * @return          true if an entry was decoded; false at the end of the block.
+ */
+static inline bool a1fs_dir_next(uint32_t features, const unsigned char *block, a1fs_dir_rec *rec)
+{
+	rec->off += rec->len;
+	rec->len = 0;
+	if (rec->off >= A1FS_BLOCK_SIZE)
+		return false;
+	if (!(features & A1FS_FEATURE_DIRENT))
+	{
+		const a1fs_dentry *d = (const a1fs_dentry *)(block + rec->off);
+		rec->ino = d->ino;
+		rec->hash = 0;
+		rec->name = d->name;
+		rec->name_len = strnlen(d->name, A1FS_NAME_MAX);
+		if (rec->name_len == A1FS_NAME_MAX)
+			return false;
+		rec->len = sizeof(a1fs_dentry);
+		return true;
+	}
+	const a1fs_dirent *d = (const a1fs_dirent *)(block + rec->off);
+	uint32_t head = sizeof(a1fs_dirent) + ((features & A1FS_FEATURE_DIRENT_HASH) ? sizeof(uint32_t) : 0);
+	if (d->rec_len < sizeof(a1fs_dirent) || d->rec_len % 4 != 0 || rec->off + d->rec_len > A1FS_BLOCK_SIZE)
+		return false;
+	rec->ino = d->ino;
+	rec->hash = 0;
+	rec->name = "";
+	rec->name_len = 0;
+	if (d->ino != 0)
+	{
+		const char *name = (const char *)d + head;
+		if (head + d->name_len + 1 > d->rec_len || d->name_len == 0 || name[d->name_len] != '\0' ||
+			memchr(name, '\0', d->name_len) != NULL)
+			return false;
+		if (features & A1FS_FEATURE_DIRENT_HASH)
+			memcpy(&rec->hash, d + 1, sizeof(uint32_t));
+		rec->name = name;
+		rec->name_len = d->name_len;
+	}
+	rec->len = d->rec_len;
+	return true;
+}
+
+/**
+ * Write an entry into a directory block, or free one with ino 0 and an empty
+ * name. A fixed-size entry is the whole a1fs_dentry and len is ignored; a
+ * variable-length one takes len bytes, at least a1fs_dirent_size() of the name.
+ */
+static inline void a1fs_dir_write(uint32_t features, unsigned char *block, uint32_t off, uint32_t len,
+								  a1fs_ino_t ino, const char *name)
+{
+	uint32_t name_len = strlen(name);
+	if (!(features & A1FS_FEATURE_DIRENT))
+	{
+		a1fs_dentry *d = (a1fs_dentry *)(block + off);
+		memset(d, 0, sizeof(*d));
+		d->ino = ino;
+		memcpy(d->name, name, name_len);
+		return;
+	}
+	a1fs_dirent *d = (a1fs_dirent *)(block + off);
+	d->ino = ino;
+	d->rec_len = len;
+	d->name_len = name_len;
+	d->pad = 0;
+	char *dst = (char *)(d + 1);
+	if (features & A1FS_FEATURE_DIRENT_HASH)
+	{
+		uint32_t hash = a1fs_name_hash(name, name_len);
+		memcpy(dst, &hash, sizeof(hash));
+		dst += sizeof(hash);
+	}
+	memcpy(dst, name, name_len + 1);
+}
+
+/**
+ * Change the space a variable-length entry takes, to give free space after it
+ * to a new entry or to take in the space of a removed one. Fixed-size entries
+ * do not change.
+ */
+static inline void a1fs_dir_set_len(uint32_t features, unsigned char *block, uint32_t off, uint32_t len)
+{
+	if (features & A1FS_FEATURE_DIRENT)
+		((a1fs_dirent *)(block + off))->rec_len = len;
+}
+
+/** Point an entry at another inode, keeping its name (as rename does). */
+static inline void a1fs_dir_set_ino(uint32_t features, unsigned char *block, uint32_t off, a1fs_ino_t ino)
+{
+	if (features & A1FS_FEATURE_DIRENT)
+		((a1fs_dirent *)(block + off))->ino = ino;
+	else
+		((a1fs_dentry *)(block + off))->ino = ino;
+}
@@ -0,0 +1,738 @@
+/**
+ * a1fs low-level FUSE driver.
+ *
+ * A second front end over liba1fs, on the FUSE low-level API, where the kernel
+ * names files by node ID instead of by path. The node ID of a file is its
+ * inode number plus one (FUSE_ROOT_ID is the root directory, inode 0), so once
+ * the kernel has looked a name up, every later operation on the file goes
+ * straight to its slot in the inode table through the inode-based calls in
+ * fs_ops.h, without walking the path again. Each entry carries the generation
+ * of its inode, so the kernel never takes a new file for a deleted one that
+ * had the same inode number. Each node pins its inode (see fs_pin()) once per
+ * lookup the kernel has not yet forgotten and once per open file, so a file
+ * unlinked or renamed over while the kernel still refers to it keeps its inode
+ * and data until the last forget() and release() drop those pins.
+ *
+ * Takes the same options as a1fs, except -o trace: traces record paths, which
+ * this driver never sees.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Using 2.9.x FUSE API
+#define FUSE_USE_VERSION 29
+#include <fuse_lowlevel.h>
+
+#include "a1fs.h"
+#include "defrag.h"
+#include "driver.h"
+#include "fs_ctx.h"
+#include "fs_ops.h"
+#include "grow.h"
+#include "options.h"
+#include "stats.h"
+
+
+/** Node ID of the statistics file; past the node ID of any inode. */
+#define A1FS_STATS_NODE ((fuse_ino_t)UINT32_MAX + 2)
+
+/** Inode number to report for directory entries, as the high-level API does. */
+#define A1FS_UNKNOWN_INO 0xffffffff
+
+/** Driver state, kept as the FUSE session user data. */
+typedef struct ll_ctx
+{
+	fs_ctx fs;
+	/** How long the kernel may keep names and attributes, in seconds. */
+	double timeout;
+	/** Let the kernel keep file data across opens (-o cache). */
+	bool keep_cache;
+
+} ll_ctx;
+
+/** Reply buffer for a readdir() call. */
+typedef struct dir_buf
+{
+	fuse_req_t req;
+	char *data;
+	/** Buffer size, as requested by the kernel. */
+	size_t size;
+	/** Bytes filled so far. */
+	size_t len;
+
+} dir_buf;
+
+static ll_ctx *get_ctx(fuse_req_t req)
+{
+	return (ll_ctx *)fuse_req_userdata(req);
+}
+
+static a1fs_ino_t node_to_ino(fuse_ino_t node)
+{
+	return (a1fs_ino_t)(node - 1);
+}
+
+static fuse_ino_t ino_to_node(a1fs_ino_t ino)
+{
+	return (fuse_ino_t)ino + 1;
+}
+
+/** Check if name in the directory parent is the statistics file. */
+static bool is_stats_entry(fuse_ino_t parent, const char *name)
+{
+	return parent == FUSE_ROOT_ID && strcmp(name, A1FS_STATS_NAME) == 0;
+}
+
+/**
+ * Fill in the entry returned to the kernel for an inode.
+ *
+ * @return  0 on success; -errno on error.
+ */
+static int get_entry(ll_ctx *ctx, a1fs_ino_t ino, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(*e));
+	int ret = fs_getattr_ino(&ctx->fs, ino, &e->attr);
+	if (ret != 0)
+		return ret;
+	e->ino = ino_to_node(ino);
+	e->generation = fs_generation(&ctx->fs, ino);
+	e->attr.st_ino = e->ino;
+	e->attr_timeout = ctx->timeout;
+	e->entry_timeout = ctx->timeout;
+	return 0;
+}
+
+/**
+ * Reply with an entry for an inode, or with the error. The kernel counts the
+ * entry as a lookup of the node, so the inode is pinned until it is forgotten.
+ */
+static void reply_entry(fuse_req_t req, a1fs_ino_t ino, int ret)
+{
+	struct fuse_entry_param e;
+	if (ret == 0)
+		ret = get_entry(get_ctx(req), ino, &e);
+	if (ret == 0)
+		ret = fs_pin(&get_ctx(req)->fs, ino, 1);
+	if (ret != 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_entry(req, &e);
+}
+
+/**
+ * Finish initialization once FUSE is running; see a1fs_driver_start().
+ *
+ * @param userdata  the driver state.
+ * @param conn      connection capabilities.
+ */
+static void a1fs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	// A1FS_IOC_RESIZE may be issued on the mount point
+	if (conn->capable & FUSE_CAP_IOCTL_DIR)
+		conn->want |= FUSE_CAP_IOCTL_DIR;
+	a1fs_driver_start(&((ll_ctx *)userdata)->fs);
+}
+
+/**
+ * Cleanup the file system.
+ *
+ * Called when the file system is unmounted. Must cleanup all the resources
+ * created in a1fs_driver_init().
+ */
+static void a1fs_ll_destroy(void *userdata)
+{
+	fs_unmount(&((ll_ctx *)userdata)->fs);
+}
+
+/** Look up a name; see fs_lookup_at(). The statistics file is never cached. */
+static void a1fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	ll_ctx *ctx = get_ctx(req);
+	if (is_stats_entry(parent, name))
+	{
+		struct fuse_entry_param e = {.ino = A1FS_STATS_NODE};
+		a1fs_stats_getattr(&ctx->fs, &e.attr);
+		e.attr.st_ino = e.ino;
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	if (parent == A1FS_STATS_NODE)
+	{
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	uint64_t start = stats_now();
+	a1fs_ino_t ino = 0;
+	int ret = fs_lookup_at(&ctx->fs, node_to_ino(parent), name, &ino);
+	stats_record(&ctx->fs.stats, STATS_LOOKUP, start, ret);
+	if (ret == -ENOENT)
+	{
+		// a negative entry: the kernel remembers the miss for as long as it
+		// would a name that exists, until it creates the name itself
+		struct fuse_entry_param e = {.ino = 0, .entry_timeout = ctx->timeout};
+		fuse_reply_entry(req, &e);
+		return;
+	}
+	reply_entry(req, ino, ret);
+}
+
+/**
+ * Drop the pins of lookups the kernel has forgotten; frees an unlinked inode
+ * that is no longer open.
+ */
+static void a1fs_ll_forget(fuse_req_t req, fuse_ino_t node, unsigned long nlookup)
+{
+	if (node != A1FS_STATS_NODE)
+		fs_unpin(&get_ctx(req)->fs, node_to_ino(node), nlookup);
+	fuse_reply_none(req);
+}
+
+/** lstat() callback; see fs_getattr(). */
+static void a1fs_ll_getattr(fuse_req_t req, fuse_ino_t node, struct fuse_file_info *fi)
+{
+	(void)fi; // unused
+	ll_ctx *ctx = get_ctx(req);
+	struct stat st;
+	if (node == A1FS_STATS_NODE)
+	{
+		a1fs_stats_getattr(&ctx->fs, &st);
+		st.st_ino = node;
+		fuse_reply_attr(req, &st, 0);
+		return;
+	}
+	uint64_t start = stats_now();
+	int ret = fs_getattr_ino(&ctx->fs, node_to_ino(node), &st);
+	stats_record(&ctx->fs.stats, STATS_GETATTR, start, ret);
+	if (ret != 0)
+	{
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	st.st_ino = node;
+	fuse_reply_attr(req, &st, ctx->timeout);
+}
+
+/**
+ * truncate() and utimensat() callback; see fs_truncate() and fs_utimens().
+ * Only the size and the modification time can be changed; the access time is
+ * not stored.
+ */
+static void a1fs_ll_setattr(fuse_req_t req, fuse_ino_t node, struct stat *attr, int to_set,
+							struct fuse_file_info *fi)
+{
+	(void)fi; // unused
+	ll_ctx *ctx = get_ctx(req);
+	if (node == A1FS_STATS_NODE)
+	{
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+	{
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+	a1fs_ino_t ino = node_to_ino(node);
+	int ret = 0;
+	if (to_set & FUSE_SET_ATTR_SIZE)
+	{
+		uint64_t start = stats_now();
+		ret = fs_truncate_ino(&ctx->fs, ino, attr->st_size);
+		stats_record(&ctx->fs.stats, STATS_TRUNCATE, start, ret);
+	}
+	if (ret == 0 && (to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW)))
+	{
+		struct timespec times[2] = {attr->st_atim, attr->st_mtim};
+		uint64_t start = stats_now();
+		ret = fs_utimens_ino(&ctx->fs, ino, (to_set & FUSE_SET_ATTR_MTIME_NOW) ? NULL : times);
+		stats_record(&ctx->fs.stats, STATS_UTIMENS, start, ret);
+	}
+	struct stat st;
+	if (ret == 0)
+		ret = fs_getattr_ino(&ctx->fs, ino, &st);
+	if (ret != 0)
+	{
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	st.st_ino = node;
+	fuse_reply_attr(req, &st, ctx->timeout);
+}
+
+/** Add a directory entry to the reply; a fs_filldir_t. */
+static int dir_buf_add(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	dir_buf *b = (dir_buf *)buf;
+	struct stat entry_st = {.st_ino = A1FS_UNKNOWN_INO};
+	if (st != NULL)
+	{
+		entry_st.st_ino = ino_to_node(st->st_ino);
+		entry_st.st_mode = st->st_mode;
+	}
+	size_t len = fuse_add_direntry(b->req, b->data + b->len, b->size - b->len, name, &entry_st, off);
+	if (len > b->size - b->len)
+		return 1;
+	b->len += len;
+	return 0;
+}
+
+/**
+ * readdir() callback; see fs_readdir(). Each call lists from the offset of the
+ * entry where the last one stopped, so reading a directory in parts costs no
+ * more than reading it at once. Entries carry their node ID and type.
+ */
+static void a1fs_ll_readdir(fuse_req_t req, fuse_ino_t node, size_t size, off_t off,
+							struct fuse_file_info *fi)
+{
+	(void)fi; // unused
+	ll_ctx *ctx = get_ctx(req);
+	if (node == A1FS_STATS_NODE)
+	{
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	dir_buf b = {.req = req, .data = (char *)malloc(size), .size = size};
+	if (b.data == NULL)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	uint64_t start = stats_now();
+	int ret = fs_readdir_ino(&ctx->fs, node_to_ino(node), off, &b, dir_buf_add);
+	stats_record(&ctx->fs.stats, STATS_READDIR, start, ret);
+	if (ret != 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, b.data, b.len);
+	free(b.data);
+}
+
+/** mkdir() callback; see fs_mkdir(). */
+static void a1fs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	ll_ctx *ctx = get_ctx(req);
+	if (is_stats_entry(parent, name))
+	{
+		fuse_reply_err(req, EEXIST);
+		return;
+	}
+	uint64_t start = stats_now();
+	a1fs_ino_t ino = 0;
+	int ret = fs_mkdir_at(&ctx->fs, node_to_ino(parent), name, mode, &ino);
+	stats_record(&ctx->fs.stats, STATS_MKDIR, start, ret);
+	reply_entry(req, ino, ret);
+}
+
+/** rmdir() callback; see fs_rmdir(). */
+static void a1fs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	ll_ctx *ctx = get_ctx(req);
+	uint64_t start = stats_now();
+	int ret = fs_rmdir_at(&ctx->fs, node_to_ino(parent), name);
+	stats_record(&ctx->fs.stats, STATS_RMDIR, start, ret);
+	fuse_reply_err(req, -ret);
+}
+
+/** open()/creat() callback; see fs_create(). */
+static void a1fs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+						   struct fuse_file_info *fi)
+{
+	ll_ctx *ctx = get_ctx(req);
+	if (is_stats_entry(parent, name))
+	{
+		fuse_reply_err(req, EEXIST);
+		return;
+	}
+	uint64_t start = stats_now();
+	a1fs_ino_t ino = 0;
+	int ret = fs_create_at(&ctx->fs, node_to_ino(parent), name, mode, &ino);
+	stats_record(&ctx->fs.stats, STATS_CREATE, start, ret);
+	struct fuse_entry_param e;
+	if (ret == 0)
+		ret = get_entry(ctx, ino, &e);
+	// one pin for the lookup, one for the open file
+	if (ret == 0)
+		ret = fs_pin(&ctx->fs, ino, 2);
+	if (ret != 0)
+	{
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fi->keep_cache = ctx->keep_cache;
+	fuse_reply_create(req, &e, fi);
+}
+
+/**
+ * open() callback. A regular file is pinned until it is released. Opening the
+ * statistics file takes a snapshot of the text, which is what its reads
+ * return, so that a reader sees consistent numbers.
+ */
+static void a1fs_ll_open(fuse_req_t req, fuse_ino_t node, struct fuse_file_info *fi)
+{
+	ll_ctx *ctx = get_ctx(req);
+	if (node != A1FS_STATS_NODE)
+	{
+		int ret = fs_pin(&ctx->fs, node_to_ino(node), 1);
+		if (ret != 0)
+		{
+			fuse_reply_err(req, -ret);
+			return;
+		}
+		fi->keep_cache = ctx->keep_cache;
+		fuse_reply_open(req, fi);
+		return;
+	}
+	int ret = a1fs_stats_open(&ctx->fs, fi);
+	if (ret != 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_open(req, fi);
+}
+
+/** unlink() callback; see fs_unlink(). */
+static void a1fs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	ll_ctx *ctx = get_ctx(req);
+	if (is_stats_entry(parent, name))
+	{
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	uint64_t start = stats_now();
+	int ret = fs_unlink_at(&ctx->fs, node_to_ino(parent), name);
+	stats_record(&ctx->fs.stats, STATS_UNLINK, start, ret);
+	fuse_reply_err(req, -ret);
+}
+
+/**
+ * rename() callback; see fs_rename_at(), which checks that a directory is not
+ * moved into its own subtree. The FUSE 2.9 API passes no flags.
+ */
+static void a1fs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent,
+						   const char *newname)
+{
+	ll_ctx *ctx = get_ctx(req);
+	if (is_stats_entry(parent, name) || is_stats_entry(newparent, newname))
+	{
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	uint64_t start = stats_now();
+	int ret = fs_rename_at(&ctx->fs, node_to_ino(parent), name, node_to_ino(newparent), newname, 0);
+	stats_record(&ctx->fs.stats, STATS_RENAME, start, ret);
+	fuse_reply_err(req, -ret);
+}
+
+/** pread() callback; see fs_read(). */
+static void a1fs_ll_read(fuse_req_t req, fuse_ino_t node, size_t size, off_t off,
+						 struct fuse_file_info *fi)
+{
+	ll_ctx *ctx = get_ctx(req);
+	char *buf = (char *)malloc(size);
+	if (buf == NULL)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	int ret;
+	if (node == A1FS_STATS_NODE)
+		ret = a1fs_stats_read((const char *)(uintptr_t)fi->fh, buf, size, off);
+	else
+	{
+		uint64_t start = stats_now();
+		ret = fs_read_ino(&ctx->fs, node_to_ino(node), buf, size, off);
+		stats_record(&ctx->fs.stats, STATS_READ, start, ret);
+	}
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, buf, ret);
+	free(buf);
+}
+
+/** pwrite() callback; see fs_write(). */
+static void a1fs_ll_write(fuse_req_t req, fuse_ino_t node, const char *buf, size_t size,
+						  off_t off, struct fuse_file_info *fi)
+{
+	(void)fi; // unused
+	ll_ctx *ctx = get_ctx(req);
+	uint64_t start = stats_now();
+	int ret = fs_write_ino(&ctx->fs, node_to_ino(node), buf, size, off);
+	stats_record(&ctx->fs.stats, STATS_WRITE, start, ret);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+/** statvfs() callback; see fs_statfs(). */
+static void a1fs_ll_statfs(fuse_req_t req, fuse_ino_t node)
+{
+	(void)node; // unused
+	ll_ctx *ctx = get_ctx(req);
+	struct statvfs st;
+	uint64_t start = stats_now();
+	int ret = fs_statfs(&ctx->fs, &st);
+	stats_record(&ctx->fs.stats, STATS_STATFS, start, ret);
+	if (ret != 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_statfs(req, &st);
+}
+
+/** fallocate() callback; see fs_fallocate(). */
+static void a1fs_ll_fallocate(fuse_req_t req, fuse_ino_t node, int mode, off_t offset,
+							  off_t length, struct fuse_file_info *fi)
+{
+	(void)fi; // unused
+	ll_ctx *ctx = get_ctx(req);
+	if (node == A1FS_STATS_NODE)
+	{
+		fuse_reply_err(req, EACCES);
+		return;
+	}
+	uint64_t start = stats_now();
+	int ret = fs_fallocate_ino(&ctx->fs, node_to_ino(node), mode, offset, length);
+	stats_record(&ctx->fs.stats, STATS_FALLOCATE, start, ret);
+	fuse_reply_err(req, -ret);
+}
+
+/** getxattr() callback; see fs_getxattr(). A size of 0 asks for the length. */
+static void a1fs_ll_getxattr(fuse_req_t req, fuse_ino_t node, const char *name, size_t size)
+{
+	ll_ctx *ctx = get_ctx(req);
+	if (node == A1FS_STATS_NODE)
+	{
+		fuse_reply_err(req, ENODATA);
+		return;
+	}
+	char *value = NULL;
+	if (size > 0 && (value = (char *)malloc(size)) == NULL)
+	{
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	uint64_t start = stats_now();
+	int ret = fs_getxattr_ino(&ctx->fs, node_to_ino(node), name, value, size);
+	stats_record(&ctx->fs.stats, STATS_GETXATTR, start, ret);
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else if (size == 0)
+		fuse_reply_xattr(req, ret);
+	else
+		fuse_reply_buf(req, value, ret);
+	free(value);
+}
+
+/**
+ * Flush a file on close.
+ *
+ * Called on each close() of a file descriptor. Allocates blocks for the
+ * appended data buffered by delayed allocation; see fs_flush().
+ */
+static void a1fs_ll_flush(fuse_req_t req, fuse_ino_t node, struct fuse_file_info *fi)
+{
+	(void)fi; // unused
+	ll_ctx *ctx = get_ctx(req);
+	if (node == A1FS_STATS_NODE)
+	{
+		fuse_reply_err(req, 0);
+		return;
+	}
+	uint64_t start = stats_now();
+	int ret = fs_flush_ino(&ctx->fs, node_to_ino(node));
+	stats_record(&ctx->fs.stats, STATS_FLUSH, start, ret);
+	fuse_reply_err(req, -ret);
+}
+
+/**
+ * Release an open file, when the last file descriptor of it is closed, and
+ * drop its pin; frees an unlinked file the kernel has also forgotten.
+ */
+static void a1fs_ll_release(fuse_req_t req, fuse_ino_t node, struct fuse_file_info *fi)
+{
+	ll_ctx *ctx = get_ctx(req);
+	if (node == A1FS_STATS_NODE)
+	{
+		free((char *)(uintptr_t)fi->fh);
+		fuse_reply_err(req, 0);
+		return;
+	}
+	uint64_t start = stats_now();
+	int ret = fs_flush_ino(&ctx->fs, node_to_ino(node));
+	stats_record(&ctx->fs.stats, STATS_RELEASE, start, ret);
+	fs_unpin(&ctx->fs, node_to_ino(node), 1);
+	fuse_reply_err(req, -ret);
+}
+
+/** fsync() callback; see fs_fsync(). */
+static void a1fs_ll_fsync(fuse_req_t req, fuse_ino_t node, int datasync,
+						  struct fuse_file_info *fi)
+{
+	(void)datasync; // unused
+	(void)fi;		// unused
+	ll_ctx *ctx = get_ctx(req);
+	if (node == A1FS_STATS_NODE)
+	{
+		fuse_reply_err(req, 0);
+		return;
+	}
+	uint64_t start = stats_now();
+	int ret = fs_fsync_ino(&ctx->fs, node_to_ino(node));
+	stats_record(&ctx->fs.stats, STATS_FSYNC, start, ret);
+	fuse_reply_err(req, -ret);
+}
+
+/**
+ * ioctl() callback; see fs_defrag() and fs_resize(). The kernel copies in and
+ * out as many bytes as the command encodes.
+ */
+static void a1fs_ll_ioctl(fuse_req_t req, fuse_ino_t node, int cmd, void *arg,
+						  struct fuse_file_info *fi, unsigned flags, const void *in_buf,
+						  size_t in_bufsz, size_t out_bufsz)
+{
+	(void)arg; // unused
+	(void)fi;  // unused
+	ll_ctx *ctx = get_ctx(req);
+	if (flags & FUSE_IOCTL_COMPAT)
+	{
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+	if (node == A1FS_STATS_NODE)
+	{
+		fuse_reply_err(req, ENOTTY);
+		return;
+	}
+	uint64_t start = stats_now();
+	int ret;
+	switch ((unsigned int)cmd)
+	{
+	case A1FS_IOC_DEFRAG:
+	{
+		a1fs_defrag_info info;
+		if (in_bufsz < sizeof(info) || out_bufsz < sizeof(info))
+		{
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		memcpy(&info, in_buf, sizeof(info));
+		ret = fs_defrag_ino(&ctx->fs, node_to_ino(node), &info);
+		stats_record(&ctx->fs.stats, STATS_DEFRAG, start, ret);
+		if (ret != 0)
+			fuse_reply_err(req, -ret);
+		else
+			fuse_reply_ioctl(req, 0, &info, sizeof(info));
+		return;
+	}
+	case A1FS_IOC_RESIZE:
+	{
+		// issued on any file or directory of the file system
+		uint64_t size;
+		if (in_bufsz < sizeof(size))
+		{
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		memcpy(&size, in_buf, sizeof(size));
+		ret = fs_resize(&ctx->fs, size);
+		stats_record(&ctx->fs.stats, STATS_RESIZE, start, ret);
+		if (ret != 0)
+			fuse_reply_err(req, -ret);
+		else
+			fuse_reply_ioctl(req, 0, NULL, 0);
+		return;
+	}
+	default:
+		fuse_reply_err(req, ENOTTY);
+		return;
+	}
+}
+
+static struct fuse_lowlevel_ops a1fs_ll_ops = {
+	.init = a1fs_ll_init,
+	.destroy = a1fs_ll_destroy,
+	.lookup = a1fs_ll_lookup,
+	.forget = a1fs_ll_forget,
+	.getattr = a1fs_ll_getattr,
+	.setattr = a1fs_ll_setattr,
+	.readdir = a1fs_ll_readdir,
+	.mkdir = a1fs_ll_mkdir,
+	.rmdir = a1fs_ll_rmdir,
+	.create = a1fs_ll_create,
+	.open = a1fs_ll_open,
+	.unlink = a1fs_ll_unlink,
+	.rename = a1fs_ll_rename,
+	.read = a1fs_ll_read,
+	.write = a1fs_ll_write,
+	.statfs = a1fs_ll_statfs,
+	.fallocate = a1fs_ll_fallocate,
+	.getxattr = a1fs_ll_getxattr,
+	.flush = a1fs_ll_flush,
+	.release = a1fs_ll_release,
+	.fsync = a1fs_ll_fsync,
+	.ioctl = a1fs_ll_ioctl,
+};
+
+int main(int argc, char *argv[])
+{
+	a1fs_opts opts = {0}; // defaults are all 0
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (!a1fs_opt_parse(&args, &opts))
+		return 1;
+	if (opts.trace_file != NULL)
+	{
+		fprintf(stderr, "-o trace is not supported by %s; use a1fs\n", argv[0]);
+		return 1;
+	}
+
+	char *mountpoint = NULL;
+	int foreground = 0;
+	if (fuse_parse_cmdline(&args, &mountpoint, NULL, &foreground) != 0)
+		return 1;
+	if (opts.help)
+		return 0;
+
+	// The FUSE low-level API has no kernel_cache or timeout options; the
+	// driver sets them in its replies instead
+	ll_ctx ctx = {.timeout = 1.0};
+	if (opts.cache)
+	{
+		ctx.timeout = opts.cache_timeout ? opts.cache_timeout : A1FS_CACHE_TIMEOUT;
+		ctx.keep_cache = true;
+	}
+	if (!a1fs_driver_init(&ctx.fs, &opts))
+	{
+		fprintf(stderr, "Failed to mount the file system\n");
+		return 1;
+	}
+
+	int err = 1;
+	struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+	if (ch != NULL)
+	{
+		struct fuse_session *se = fuse_lowlevel_new(&args, &a1fs_ll_ops, sizeof(a1fs_ll_ops), &ctx);
+		if (se != NULL)
+		{
+			if (fuse_set_signal_handlers(se) != -1)
+			{
+				fuse_session_add_chan(se, ch);
+				if (fuse_daemonize(foreground) != -1)
+					err = fuse_session_loop(se) != 0;
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	fuse_opt_free_args(&args);
+	free(mountpoint);
+	return err;
+}
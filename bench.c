@@ -0,0 +1,654 @@
+/**
+ * a1fs in-process benchmark.
+ *
+ * Drives liba1fs directly (no kernel mount): every benchmark formats a fresh
+ * image, mounts it in-process and times each file system call. Results are
+ * printed to stdout as JSON lines, one object per measurement, with the rate
+ * and latency percentiles, so that runs can be diffed and compared across
+ * mount options.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "format.h"
+#include "fs_ops.h"
+#include "map.h"
+
+
+/** Command line options. */
+typedef struct bench_opts
+{
+	/** Scratch image file path. */
+	const char *img_path;
+	/** Comma-separated list of benchmarks to run. */
+	const char *tests;
+	/** Number of files for the metadata benchmark. */
+	size_t n_files;
+	/** File size in bytes for the data benchmarks. */
+	size_t file_size;
+	/** Request size in bytes for the data benchmarks. */
+	size_t io_size;
+	/** Largest directory for the directory scaling benchmark. */
+	size_t max_entries;
+	/** Deepest path for the path resolution benchmark. */
+	size_t max_depth;
+	/** Random seed. */
+	uint64_t seed;
+	/** Feature flags of the scratch image (the directory entry format). */
+	unsigned int features;
+	/** Mount options. */
+	fs_mount_opts mount;
+
+	/** Print help and exit. */
+	bool help;
+
+} bench_opts;
+
+static const char *help_str = "\
+Usage: %s [options]\n\
+\n\
+Run a1fs benchmarks in-process on a scratch image and print the results as\n\
+JSON lines (one object per measurement) to stdout.\n\
+\n\
+Options:\n\
+    -t list   benchmarks to run, comma-separated; default: all of\n\
+              meta,data,dirscale,deeppath\n\
+    -f path   scratch image file; default: /tmp/a1fs-bench.img (removed\n\
+              when done)\n\
+    -n num    number of files for the metadata benchmark; default: 4096\n\
+    -s size   file size in bytes for the data benchmarks; default: 64 MiB\n\
+    -b size   request size in bytes for the data benchmarks; default: 4096\n\
+    -N num    largest directory for dirscale (1, 10, 100, ... up to num);\n\
+              default: 1000000\n\
+    -D num    deepest path for deeppath (1, 2, 4, ... up to num);\n\
+              default: 64\n\
+    -S seed   random seed; default: 1\n\
+    -e fmt    directory entry format: fixed, var or hash (see mkfs.a1fs);\n\
+              default: fixed\n\
+    -o opt    mount option: nodelalloc or discard; may be repeated\n\
+    -h        print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+static bool parse_args(int argc, char *argv[], bench_opts *opts)
+{
+	int o;
+	while ((o = getopt(argc, argv, "t:f:n:s:b:N:D:S:e:o:h")) != -1)
+	{
+		switch (o)
+		{
+		case 't':
+			opts->tests = optarg;
+			break;
+		case 'f':
+			opts->img_path = optarg;
+			break;
+		case 'n':
+			opts->n_files = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			opts->file_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			opts->io_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'N':
+			opts->max_entries = strtoul(optarg, NULL, 10);
+			break;
+		case 'D':
+			opts->max_depth = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			opts->seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'e':
+			if (!fs_parse_dir_format(optarg, &opts->features))
+			{
+				fprintf(stderr, "Unknown directory entry format %s\n", optarg);
+				return false;
+			}
+			break;
+		case 'o':
+			if (strcmp(optarg, "nodelalloc") == 0)
+				opts->mount.nodelalloc = true;
+			else if (strcmp(optarg, "discard") == 0)
+				opts->mount.discard = true;
+			else
+			{
+				fprintf(stderr, "Unknown mount option %s\n", optarg);
+				return false;
+			}
+			break;
+
+		case 'h':
+			opts->help = true;
+			return true; // skip other arguments
+
+		case '?':
+			return false;
+		default:
+			return false;
+		}
+	}
+
+	if (opts->n_files == 0 || opts->file_size == 0 || opts->io_size == 0 ||
+		opts->max_entries == 0 || opts->max_depth == 0)
+	{
+		fprintf(stderr, "Counts and sizes must be positive\n");
+		return false;
+	}
+	return true;
+}
+
+/** Check if benchmark name is in the comma-separated list. */
+static bool test_enabled(const bench_opts *opts, const char *name)
+{
+	size_t len = strlen(name);
+	for (const char *p = opts->tests; p != NULL && *p != '\0';)
+	{
+		const char *end = strchr(p, ',');
+		size_t n = end != NULL ? (size_t)(end - p) : strlen(p);
+		if (n == len && strncmp(p, name, n) == 0)
+			return true;
+		p = end != NULL ? end + 1 : NULL;
+	}
+	return false;
+}
+
+/** Current time in nanoseconds. */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** xorshift64 pseudo-random number generator. */
+static uint64_t next_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+/** Latencies of the operations of one measurement. */
+typedef struct lat_log
+{
+	/** Latency of each operation in nanoseconds. */
+	uint64_t *ns;
+	/** Number of operations recorded. */
+	size_t n;
+	/** Time when the measurement started. */
+	uint64_t start;
+
+} lat_log;
+
+static bool lat_init(lat_log *log, size_t max_ops)
+{
+	log->ns = malloc((max_ops > 0 ? max_ops : 1) * sizeof(uint64_t));
+	log->n = 0;
+	log->start = now_ns();
+	if (log->ns == NULL)
+	{
+		perror("malloc");
+		return false;
+	}
+	return true;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/** Latency at percentile p (0-100) of the sorted latencies. */
+static uint64_t percentile(const lat_log *log, double p)
+{
+	if (log->n == 0)
+		return 0;
+	size_t idx = (size_t)(p / 100 * (log->n - 1) + 0.5);
+	return log->ns[idx];
+}
+
+/**
+ * Print the results of a measurement and free the log.
+ *
+ * @param bench  benchmark name.
+ * @param n      benchmark parameter (file count, directory size, ...).
+ * @param log    operation latencies.
+ * @param bytes  bytes transferred per operation; 0 for metadata operations.
+ */
+static void lat_report(const char *bench, size_t n, lat_log *log, size_t bytes)
+{
+	uint64_t elapsed = now_ns() - log->start;
+	double secs = elapsed / 1e9;
+	qsort(log->ns, log->n, sizeof(uint64_t), cmp_u64);
+
+	printf("{\"bench\":\"%s\",\"n\":%zu,\"ops\":%zu,\"secs\":%.6f,\"ops_per_sec\":%.1f",
+		   bench, n, log->n, secs, secs > 0 ? log->n / secs : 0);
+	if (bytes > 0)
+		printf(",\"mib_per_sec\":%.1f", secs > 0 ? (double)log->n * bytes / (1 << 20) / secs : 0);
+	printf(",\"p50_ns\":%lu,\"p90_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu}\n",
+		   (unsigned long)percentile(log, 50), (unsigned long)percentile(log, 90),
+		   (unsigned long)percentile(log, 99), (unsigned long)percentile(log, 99.9),
+		   (unsigned long)(log->n > 0 ? log->ns[log->n - 1] : 0));
+	fflush(stdout);
+	free(log->ns);
+	log->ns = NULL;
+}
+
+/** Print a measurement that stopped early because of an error. */
+static void report_error(const char *bench, size_t n, size_t done, int err)
+{
+	printf("{\"bench\":\"%s\",\"n\":%zu,\"ops\":%zu,\"error\":\"%s\"}\n",
+		   bench, n, done, strerror(-err));
+	fflush(stdout);
+}
+
+/** Record the latency of an operation that started at time t0. */
+static void lat_add(lat_log *log, uint64_t t0)
+{
+	log->ns[log->n++] = now_ns() - t0;
+}
+
+/**
+ * Format a fresh scratch image and mount it.
+ *
+ * @param fs        file system context to initialize.
+ * @param opts      command line options.
+ * @param n_inodes  number of inodes.
+ * @param n_blocks  number of data blocks needed; metadata is added on top.
+ * @return          true on success; false on failure.
+ */
+static bool bench_setup(fs_ctx *fs, const bench_opts *opts, size_t n_inodes, size_t n_blocks)
+{
+	size_t meta_blocks = 8 + n_inodes * sizeof(a1fs_inode) / A1FS_BLOCK_SIZE + n_blocks / (A1FS_BLOCK_SIZE * 8);
+	size_t size = (n_blocks + meta_blocks + 64) * A1FS_BLOCK_SIZE;
+
+	// Start from an empty sparse file so earlier runs leave nothing behind
+	int fd = open(opts->img_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		perror(opts->img_path);
+		return false;
+	}
+	if (ftruncate(fd, size) != 0)
+	{
+		perror("ftruncate");
+		close(fd);
+		return false;
+	}
+	close(fd);
+
+	void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
+	if (image == NULL)
+		return false;
+	bool formatted = fs_format(image, size, n_inodes, opts->features);
+	munmap(image, size);
+	if (!formatted)
+	{
+		fprintf(stderr, "Failed to format the image\n");
+		return false;
+	}
+
+	memset(fs, 0, sizeof(*fs));
+	if (!fs_mount(fs, opts->img_path, &opts->mount))
+	{
+		fprintf(stderr, "Failed to mount the image\n");
+		return false;
+	}
+	fs_start(fs);
+	return true;
+}
+
+/** Create, look up, stat and unlink n_files files in one directory. */
+static bool bench_meta(const bench_opts *opts)
+{
+	size_t n = opts->n_files;
+	fs_ctx fs;
+	if (!bench_setup(&fs, opts, n + 16, n + n / 16 + 16))
+		return false;
+
+	char path[64];
+	uint64_t rand_state = opts->seed;
+	lat_log log = {0};
+	size_t *order = malloc(n * sizeof(size_t));
+	if (order == NULL)
+	{
+		perror("malloc");
+		fs_unmount(&fs);
+		return false;
+	}
+	// look up and stat in random order
+	for (size_t i = 0; i < n; i++)
+		order[i] = i;
+	for (size_t i = n; i > 1; i--)
+	{
+		size_t j = next_rand(&rand_state) % i;
+		size_t tmp = order[i - 1];
+		order[i - 1] = order[j];
+		order[j] = tmp;
+	}
+
+	bool ok = fs_mkdir(&fs, "/m", 0755) == 0 && lat_init(&log, n);
+	for (size_t i = 0; ok && i < n; i++)
+	{
+		snprintf(path, sizeof(path), "/m/f%zu", i);
+		uint64_t t0 = now_ns();
+		int ret = fs_create(&fs, path, S_IFREG | 0644);
+		lat_add(&log, t0);
+		if (ret != 0)
+		{
+			report_error("create", n, i, ret);
+			goto end;
+		}
+	}
+	if (ok)
+		lat_report("create", n, &log, 0);
+
+	ok = ok && lat_init(&log, n);
+	for (size_t i = 0; ok && i < n; i++)
+	{
+		a1fs_ino_t ino;
+		snprintf(path, sizeof(path), "/m/f%zu", order[i]);
+		uint64_t t0 = now_ns();
+		fs_lookup(&fs, path, &ino);
+		lat_add(&log, t0);
+	}
+	if (ok)
+		lat_report("lookup", n, &log, 0);
+
+	ok = ok && lat_init(&log, n);
+	for (size_t i = 0; ok && i < n; i++)
+	{
+		struct stat st;
+		snprintf(path, sizeof(path), "/m/f%zu", order[i]);
+		uint64_t t0 = now_ns();
+		fs_getattr(&fs, path, &st);
+		lat_add(&log, t0);
+	}
+	if (ok)
+		lat_report("stat", n, &log, 0);
+
+	ok = ok && lat_init(&log, n);
+	for (size_t i = 0; ok && i < n; i++)
+	{
+		snprintf(path, sizeof(path), "/m/f%zu", i);
+		uint64_t t0 = now_ns();
+		fs_unlink(&fs, path);
+		lat_add(&log, t0);
+	}
+	if (ok)
+		lat_report("unlink", n, &log, 0);
+
+end:
+	free(log.ns);
+	free(order);
+	fs_unmount(&fs);
+	return ok;
+}
+
+/** Sequential and random writes and reads of a single file. */
+static bool bench_data(const bench_opts *opts)
+{
+	size_t io = opts->io_size;
+	size_t n_ops = opts->file_size / io;
+	if (n_ops == 0)
+		n_ops = 1;
+	size_t file_size = n_ops * io;
+	fs_ctx fs;
+	if (!bench_setup(&fs, opts, 16, file_size / A1FS_BLOCK_SIZE + 16))
+		return false;
+
+	uint64_t rand_state = opts->seed;
+	char *buf = malloc(io);
+	lat_log log = {0};
+	bool ok = buf != NULL && fs_create(&fs, "/data", S_IFREG | 0644) == 0;
+	if (buf != NULL)
+		memset(buf, 0xa1, io);
+
+	// the closing flush is part of the sequential write, as it is for close()
+	ok = ok && lat_init(&log, n_ops);
+	for (size_t i = 0; ok && i < n_ops; i++)
+	{
+		uint64_t t0 = now_ns();
+		int ret = fs_write(&fs, "/data", buf, io, i * io);
+		lat_add(&log, t0);
+		if (ret < 0)
+		{
+			report_error("seqwrite", file_size, i, ret);
+			ok = false;
+		}
+	}
+	if (ok)
+	{
+		// charged to the last write
+		uint64_t t0 = now_ns();
+		fs_flush(&fs, "/data");
+		log.ns[log.n - 1] += now_ns() - t0;
+		lat_report("seqwrite", file_size, &log, io);
+	}
+
+	ok = ok && lat_init(&log, n_ops);
+	for (size_t i = 0; ok && i < n_ops; i++)
+	{
+		uint64_t t0 = now_ns();
+		fs_read(&fs, "/data", buf, io, i * io);
+		lat_add(&log, t0);
+	}
+	if (ok)
+		lat_report("seqread", file_size, &log, io);
+
+	ok = ok && lat_init(&log, n_ops);
+	for (size_t i = 0; ok && i < n_ops; i++)
+	{
+		off_t offset = (next_rand(&rand_state) % n_ops) * io;
+		uint64_t t0 = now_ns();
+		int ret = fs_write(&fs, "/data", buf, io, offset);
+		lat_add(&log, t0);
+		if (ret < 0)
+		{
+			report_error("randwrite", file_size, i, ret);
+			ok = false;
+		}
+	}
+	if (ok)
+		lat_report("randwrite", file_size, &log, io);
+
+	ok = ok && lat_init(&log, n_ops);
+	for (size_t i = 0; ok && i < n_ops; i++)
+	{
+		off_t offset = (next_rand(&rand_state) % n_ops) * io;
+		uint64_t t0 = now_ns();
+		fs_read(&fs, "/data", buf, io, offset);
+		lat_add(&log, t0);
+	}
+	if (ok)
+		lat_report("randread", file_size, &log, io);
+
+	free(log.ns);
+	free(buf);
+	fs_unmount(&fs);
+	return true;
+}
+
+/**
+ * Directory scaling: for directories of 1, 10, 100, ... entries, the rate of
+ * creating the entries and of looking up random entries once it is full.
+ * Stops at the first size that cannot be created.
+ */
+static bool bench_dirscale(const bench_opts *opts)
+{
+	uint64_t rand_state = opts->seed;
+	bool full = false;
+	for (size_t n = 1; !full && n <= opts->max_entries; n *= 10)
+	{
+		fs_ctx fs;
+		if (!bench_setup(&fs, opts, n + 16, n + n / 16 + 16))
+			return false;
+
+		char path[64];
+		lat_log log = {0};
+		bool ok = fs_mkdir(&fs, "/d", 0755) == 0 && lat_init(&log, n);
+		for (size_t i = 0; ok && i < n; i++)
+		{
+			snprintf(path, sizeof(path), "/d/%zu", i);
+			uint64_t t0 = now_ns();
+			int ret = fs_create(&fs, path, S_IFREG | 0644);
+			lat_add(&log, t0);
+			if (ret != 0)
+			{
+				report_error("dirscale_create", n, i, ret);
+				full = true;
+				break;
+			}
+		}
+		if (ok && !full)
+			lat_report("dirscale_create", n, &log, 0);
+		free(log.ns);
+		log.ns = NULL;
+
+		size_t samples = n <= 10000 ? 10000 : 1000;
+		ok = ok && !full && lat_init(&log, samples);
+		for (size_t i = 0; ok && i < samples; i++)
+		{
+			a1fs_ino_t ino;
+			snprintf(path, sizeof(path), "/d/%lu", (unsigned long)(next_rand(&rand_state) % n));
+			uint64_t t0 = now_ns();
+			fs_lookup(&fs, path, &ino);
+			lat_add(&log, t0);
+		}
+		if (ok)
+			lat_report("dirscale_lookup", n, &log, 0);
+		free(log.ns);
+		fs_unmount(&fs);
+
+		// the next size would overflow
+		if (n > SIZE_MAX / 10)
+			break;
+	}
+	return true;
+}
+
+/**
+ * Path resolution: stat of the deepest directory of a chain of depth 1, 2, 4,
+ * ... nested directories.
+ */
+static bool bench_deeppath(const bench_opts *opts)
+{
+	size_t max_depth = opts->max_depth;
+	// "/d" per level must fit in a path
+	if (max_depth > (A1FS_PATH_MAX - 1) / 2)
+		max_depth = (A1FS_PATH_MAX - 1) / 2;
+	fs_ctx fs;
+	if (!bench_setup(&fs, opts, max_depth + 16, 2 * max_depth + 16))
+		return false;
+
+	char path[A1FS_PATH_MAX] = "";
+	size_t depth = 0;
+	bool ok = true;
+	for (size_t target = 1; ok; target *= 2)
+	{
+		if (target > max_depth)
+			target = max_depth;
+		for (; depth < target; depth++)
+		{
+			strcat(path, "/d");
+			int ret = fs_mkdir(&fs, path, 0755);
+			if (ret != 0)
+			{
+				report_error("deeppath", target, depth, ret);
+				ok = false;
+				break;
+			}
+		}
+		if (!ok)
+			break;
+
+		size_t samples = 10000;
+		lat_log log;
+		if (!lat_init(&log, samples))
+		{
+			ok = false;
+			break;
+		}
+		for (size_t i = 0; i < samples; i++)
+		{
+			struct stat st;
+			uint64_t t0 = now_ns();
+			fs_getattr(&fs, path, &st);
+			lat_add(&log, t0);
+		}
+		lat_report("deeppath", depth, &log, 0);
+		if (target == max_depth)
+			break;
+	}
+	fs_unmount(&fs);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	bench_opts opts = {
+		.img_path = "/tmp/a1fs-bench.img",
+		.tests = "meta,data,dirscale,deeppath",
+		.n_files = 4096,
+		.file_size = 64 << 20,
+		.io_size = 4096,
+		.max_entries = 1000000,
+		.max_depth = 64,
+		.seed = 1,
+	};
+	if (!parse_args(argc, argv, &opts))
+	{
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help)
+	{
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+	if (opts.seed == 0)
+		opts.seed = 1;
+
+	printf("{\"bench\":\"config\",\"n_files\":%zu,\"file_size\":%zu,\"io_size\":%zu,"
+		   "\"max_entries\":%zu,\"max_depth\":%zu,\"seed\":%lu,\"dir_format\":\"%s\","
+		   "\"delalloc\":%s,\"discard\":%s}\n",
+		   opts.n_files, opts.file_size, opts.io_size, opts.max_entries, opts.max_depth,
+		   (unsigned long)opts.seed, fs_dir_format_name(opts.features), opts.mount.nodelalloc ? "false" : "true",
+		   opts.mount.discard ? "true" : "false");
+
+	bool ok = true;
+	if (ok && test_enabled(&opts, "meta"))
+		ok = bench_meta(&opts);
+	if (ok && test_enabled(&opts, "data"))
+		ok = bench_data(&opts);
+	if (ok && test_enabled(&opts, "dirscale"))
+		ok = bench_dirscale(&opts);
+	if (ok && test_enabled(&opts, "deeppath"))
+		ok = bench_deeppath(&opts);
+
+	unlink(opts.img_path);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,313 @@
+/**
+ * a1fs delayed allocation implementation.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dalloc.h"
+#include "helper.h"
+
+
+dalloc_buf *dalloc_find(fs_ctx *fs, a1fs_ino_t ino)
+{
+	for (dalloc_buf *b = fs->dalloc_bufs; b != NULL; b = b->next)
+	{
+		if (b->ino == ino)
+			return b;
+	}
+	return NULL;
+}
+
+uint64_t dalloc_size(fs_ctx *fs, const a1fs_inode *inode)
+{
+	dalloc_buf *b = dalloc_find(fs, inode->inode);
+	return b != NULL ? b->start + b->len : inode->size;
+}
+
+/** Unlink a buffer from the list, release its reservation and free it. */
+static void dalloc_remove(fs_ctx *fs, dalloc_buf *b)
+{
+	dalloc_buf **link = &fs->dalloc_bufs;
+	while (*link != b)
+		link = &(*link)->next;
+	*link = b->next;
+	fs->reserved_blocks -= b->reserved;
+	fs->dalloc_bytes -= b->len;
+	free(b->data);
+	free(b);
+}
+
+/**
+ * Get the number of blocks that a flush can surely place in the extents a file
+ * has left: with every block in a separate extent, one per extent; otherwise
+ * what the longest free runs hold, one run per extent, as a flush takes the
+ * longest free run whenever the rest does not fit in one (see dalloc_flush()).
+ *
+ * @param fs     file system context.
+ * @param inode  inode of the file, with no extents past its buffer's start.
+ * @param need   number of blocks to place.
+ * @return       number of blocks that fit; at least need if they all do.
+ */
+static unsigned int dalloc_room(fs_ctx *fs, const a1fs_inode *inode, unsigned int need)
+{
+	// one extent may go to a hole before the buffer
+	if (inode->num_extents + 1 >= A1FS_EXTENTS_MAX)
+		return 0;
+	unsigned int slots = A1FS_EXTENTS_MAX - inode->num_extents - 1;
+	if (need <= slots)
+		return slots;
+
+	// min-heap of the slots longest free runs
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+	unsigned int heap[A1FS_EXTENTS_MAX];
+	unsigned int n = 0;
+	unsigned int run = 0;
+	fs->stats.bitmap_bits_scanned += sb->blocks_count;
+	for (unsigned int i = 0; i <= sb->blocks_count; i++)
+	{
+		if (i < sb->blocks_count && check_bit((fs->block_bitmap_pointer)[i / 8], i % 8) == 0)
+		{
+			run++;
+			continue;
+		}
+		if (run == 0 || (n == slots && run <= heap[0]))
+		{
+			run = 0;
+			continue;
+		}
+		// push the run, or let it take the place of the shortest one
+		unsigned int pos = n < slots ? n++ : 0;
+		heap[pos] = run;
+		run = 0;
+		while (pos > 0 && heap[(pos - 1) / 2] > heap[pos])
+		{
+			unsigned int parent = (pos - 1) / 2, tmp = heap[parent];
+			heap[parent] = heap[pos];
+			heap[pos] = tmp;
+			pos = parent;
+		}
+		for (;;)
+		{
+			unsigned int min = pos, left = 2 * pos + 1, right = left + 1;
+			if (left < n && heap[left] < heap[min])
+				min = left;
+			if (right < n && heap[right] < heap[min])
+				min = right;
+			if (min == pos)
+				break;
+			unsigned int tmp = heap[min];
+			heap[min] = heap[pos];
+			heap[pos] = tmp;
+			pos = min;
+		}
+	}
+	uint64_t room = 0;
+	for (unsigned int i = 0; i < n; i++)
+	{
+		room += heap[i];
+	}
+	return room < UINT32_MAX ? (unsigned int)room : UINT32_MAX;
+}
+
+int dalloc_write(fs_ctx *fs, a1fs_inode *inode, const char *buf, size_t size, uint64_t offset)
+{
+	if (!fs->delalloc)
+		return 0;
+	dalloc_buf *b = dalloc_find(fs, inode->inode);
+	if (b != NULL && (offset < b->start || offset > b->start + b->len ||
+					  offset + size - b->start > DALLOC_BUF_MAX))
+	{
+		// Not an append to this buffer (or it is full); put it on disk first
+		int ret = dalloc_flush(fs, inode->inode);
+		memcpy(inode, a1fs_inode_at(fs->image, inode->inode), sizeof(struct a1fs_inode));
+		if (ret != 0)
+			return ret;
+		b = NULL;
+	}
+	if (b == NULL)
+	{
+		if (offset != inode->size || offset % A1FS_BLOCK_SIZE != 0 ||
+			get_file_blocks(fs, inode) > offset / A1FS_BLOCK_SIZE ||
+			size > DALLOC_BUF_MAX || inode->num_extents + 2 > A1FS_EXTENTS_MAX)
+			return 0;
+		b = calloc(1, sizeof(dalloc_buf));
+		if (b == NULL)
+			return -ENOMEM;
+		b->ino = inode->inode;
+		b->start = offset;
+		b->next = fs->dalloc_bufs;
+		fs->dalloc_bufs = b;
+	}
+
+	// Reserve the blocks the buffer grows by
+	size_t end = offset + size - b->start;
+	if (end > b->len)
+	{
+		unsigned int blocks = ceil_divide(end, A1FS_BLOCK_SIZE);
+		if (blocks - b->reserved > get_avail_blocks(fs))
+		{
+			if (b->len == 0)
+				dalloc_remove(fs, b);
+			return -ENOSPC;
+		}
+		if (blocks > b->placeable && (b->placeable = dalloc_room(fs, inode, blocks)) < blocks)
+		{
+			// Free space is too fragmented for the extents the file has left.
+			// Put what is buffered, which fits, on disk and let this write go
+			// there too, so that it fails on the first block that does not
+			if (b->len == 0)
+			{
+				dalloc_remove(fs, b);
+				return 0;
+			}
+			int ret = dalloc_flush(fs, inode->inode);
+			memcpy(inode, a1fs_inode_at(fs->image, inode->inode), sizeof(struct a1fs_inode));
+			return ret;
+		}
+		if (end > b->capacity)
+		{
+			size_t capacity = b->capacity ? b->capacity : 16 * A1FS_BLOCK_SIZE;
+			while (capacity < end)
+				capacity *= 2;
+			if (capacity > DALLOC_BUF_MAX)
+				capacity = DALLOC_BUF_MAX;
+			unsigned char *data = realloc(b->data, capacity);
+			if (data == NULL)
+			{
+				if (b->len == 0)
+					dalloc_remove(fs, b);
+				return -ENOMEM;
+			}
+			b->data = data;
+			b->capacity = capacity;
+		}
+		fs->reserved_blocks += blocks - b->reserved;
+		b->reserved = blocks;
+		fs->dalloc_bytes += end - b->len;
+		b->len = end;
+	}
+	memcpy(b->data + (offset - b->start), buf, size);
+
+	// Only the timestamp reaches the inode table until the buffer is flushed
+	struct a1fs_inode *disk_inode = a1fs_inode_at(fs->image, inode->inode);
+	clock_gettime(CLOCK_REALTIME, &(disk_inode->mtime));
+	inode->mtime = disk_inode->mtime;
+
+	// This write is buffered either way; a buffer that fails to flush stays
+	// for fsync or release to retry and report
+	if (fs->dalloc_bytes > DALLOC_TOTAL_MAX)
+		dalloc_flush_all(fs);
+	return size;
+}
+
+void dalloc_read(fs_ctx *fs, a1fs_ino_t ino, char *buf, size_t size, uint64_t offset)
+{
+	dalloc_buf *b = dalloc_find(fs, ino);
+	if (b == NULL || offset + size <= b->start || offset >= b->start + b->len)
+		return;
+	uint64_t from = offset > b->start ? offset : b->start;
+	uint64_t to = offset + size < b->start + b->len ? offset + size : b->start + b->len;
+	memcpy(buf + (from - offset), b->data + (from - b->start), to - from);
+}
+
+int dalloc_flush(fs_ctx *fs, a1fs_ino_t ino)
+{
+	dalloc_buf *b = dalloc_find(fs, ino);
+	if (b == NULL)
+		return 0;
+	struct a1fs_inode *inode = a1fs_inode_at(fs->image, ino);
+	uint64_t lblk = b->start / A1FS_BLOCK_SIZE;
+	unsigned int nblocks = b->reserved;
+	unsigned char *data = b->data;
+	size_t len = b->len;
+
+	// The buffer stays until its data is on disk; each run allocated below
+	// takes its blocks out of the reservation
+	int ret = 0;
+	uint64_t file_blocks = get_file_blocks(fs, inode);
+	if (file_blocks < lblk)
+	{
+		struct a1fs_extent hole = {0, lblk - file_blocks};
+		ret = replace_extent_range(fs, inode, file_blocks, hole.count, hole);
+	}
+	unsigned int done = 0;
+	while (ret == 0 && done < nblocks)
+	{
+		// One run for the whole range if possible, continuing the last extent
+		unsigned int count = nblocks - done;
+		a1fs_blk_t goal = get_goal_blk(fs, inode, lblk + done);
+		int blk = blk_range_is_free(fs, goal, count) ? (int)goal : get_blk_by_length(fs, count);
+		if (blk == -1)
+			blk = get_consecutive_blk(fs, &count);
+		if (blk == -1)
+		{
+			ret = -ENOSPC;
+			break;
+		}
+		struct a1fs_extent extent = {blk, count};
+		ret = replace_extent_range(fs, inode, lblk + done, count, extent);
+		if (ret != 0)
+			break;
+		claim_blk_range(fs, blk, count);
+		b->reserved -= count;
+		fs->reserved_blocks -= count;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			update_bitmap_by_index(fs->dirty_bitmap, blk + i, 1);
+		}
+
+		size_t from = (size_t)done * A1FS_BLOCK_SIZE;
+		size_t n = (size_t)count * A1FS_BLOCK_SIZE;
+		unsigned char *dst = fs->image + (size_t)blk * A1FS_BLOCK_SIZE;
+		if (from + n > len)
+		{
+			// bytes past the end of file in the last block must be zero
+			memset(dst + (len - from), 0, from + n - len);
+			n = len - from;
+		}
+		memcpy(dst, data + from, n);
+		done += count;
+	}
+	if (done == nblocks)
+	{
+		inode->size = b->start + len;
+		dalloc_remove(fs, b);
+		return 0;
+	}
+	// What did not fit stays buffered, from the first block not on disk, for
+	// a later flush to retry
+	size_t flushed = (size_t)done * A1FS_BLOCK_SIZE;
+	memmove(data, data + flushed, len - flushed);
+	b->start += flushed;
+	b->len -= flushed;
+	fs->dalloc_bytes -= flushed;
+	b->placeable = 0;
+	inode->size = b->start;
+	return ret;
+}
+
+int dalloc_flush_all(fs_ctx *fs)
+{
+	int ret = 0;
+	// a buffer that fails to flush stays in the list
+	dalloc_buf *b = fs->dalloc_bufs;
+	while (b != NULL)
+	{
+		dalloc_buf *next = b->next;
+		int err = dalloc_flush(fs, b->ino);
+		if (ret == 0)
+			ret = err;
+		b = next;
+	}
+	return ret;
+}
+
+void dalloc_discard(fs_ctx *fs, a1fs_ino_t ino)
+{
+	dalloc_buf *b = dalloc_find(fs, ino);
+	if (b != NULL)
+		dalloc_remove(fs, b);
+}
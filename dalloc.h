@@ -0,0 +1,112 @@
+/**
+ * a1fs delayed allocation header file.
+ *
+ * Data appended at the end of a file is kept in a per-inode memory buffer and
+ * only counted against the free space (reserved). Blocks are chosen when the
+ * buffer is flushed - on flush/release/fsync, when another operation needs the
+ * on-disk state of the file, or when buffered data exceeds its memory limit -
+ * so the whole appended range can be placed in one contiguous extent.
+ *
+ * While a file has a buffer, its on-disk size is the offset where the buffer
+ * starts (a block boundary), and no extents cover the buffered range.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Maximum number of bytes buffered for a single file. */
+#define DALLOC_BUF_MAX (16 * 1024 * 1024)
+
+/** Maximum number of bytes buffered for all files together. */
+#define DALLOC_TOTAL_MAX (64 * 1024 * 1024)
+
+/** Appended data of a file that has not been allocated on disk yet. */
+typedef struct dalloc_buf {
+	/** Inode number of the file. */
+	a1fs_ino_t ino;
+	/** File offset of the first buffered byte; a multiple of the block size. */
+	uint64_t start;
+	/** Number of buffered bytes. */
+	size_t len;
+	/** Size of the data buffer in bytes. */
+	size_t capacity;
+	/** Number of blocks reserved for the buffered data. */
+	unsigned int reserved;
+	/**
+	 * Number of blocks known to fit in the extents the file has left, as of
+	 * the last check of the free space; the buffer does not grow past it
+	 * without another check.
+	 */
+	unsigned int placeable;
+	/** Buffered data. */
+	unsigned char *data;
+	/** Next buffer in the list. */
+	struct dalloc_buf *next;
+
+} dalloc_buf;
+
+/** Find the buffer of given inode; NULL if it has none. */
+dalloc_buf *dalloc_find(fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Get the size of a file including its buffered data.
+ *
+ * @param fs     file system context.
+ * @param inode  inode of the file.
+ * @return       file size in bytes.
+ */
+uint64_t dalloc_size(fs_ctx *fs, const a1fs_inode *inode);
+
+/**
+ * Try to buffer a write instead of allocating blocks for it.
+ *
+ * Only appends are buffered: writes that start at a block-aligned end of file
+ * past the last extent, and writes that land inside or right after an
+ * existing buffer. A buffer does not grow past what the free space can hold
+ * in the extents the file has left; it is flushed instead, and the write goes
+ * to disk, where it fails if it does not fit.
+ *
+ * @param fs      file system context.
+ * @param inode   inode of the file; refreshed if the buffer had to be flushed.
+ * @param buf     data to write.
+ * @param size    number of bytes to write.
+ * @param offset  file offset to write at.
+ * @return        size if the data was buffered; 0 if the write must go to
+ *                disk (the file has no buffer then); -errno on error.
+ */
+int dalloc_write(fs_ctx *fs, a1fs_inode *inode, const char *buf, size_t size, uint64_t offset);
+
+/**
+ * Copy buffered data that overlaps a read into the read buffer.
+ *
+ * @param fs      file system context.
+ * @param ino     inode number of the file.
+ * @param buf     read buffer, already filled with the on-disk data.
+ * @param size    number of bytes read.
+ * @param offset  file offset of the read.
+ */
+void dalloc_read(fs_ctx *fs, a1fs_ino_t ino, char *buf, size_t size, uint64_t offset);
+
+/**
+ * Allocate blocks for the buffered data of a file and write it out. On error,
+ * what is on disk so far stays there and the rest stays buffered, reserved,
+ * for a later flush to retry.
+ *
+ * @param fs   file system context.
+ * @param ino  inode number of the file.
+ * @return     0 on success (or if the file has no buffer); -errno on error.
+ */
+int dalloc_flush(fs_ctx *fs, a1fs_ino_t ino);
+
+/** Flush the buffers of all files; return 0 or the first error. */
+int dalloc_flush_all(fs_ctx *fs);
+
+/** Drop the buffer of a file being removed and release its reservation. */
+void dalloc_discard(fs_ctx *fs, a1fs_ino_t ino);
@@ -0,0 +1,319 @@
+/**
+ * a1fs online defragmenter.
+ *
+ * Walks files and directories of a mounted a1fs file system and asks the file
+ * system to move each fragmented file into one contiguous run, one file per
+ * request (see defrag.h). With a rate limit, it sleeps between files so that
+ * the data moved stays under the limit, and can be left running in the
+ * background on a live file system. With -d, sparse directories are repacked
+ * as well.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "defrag.h"
+
+
+/** Command line options. */
+typedef struct defrag_opts
+{
+	/** Files and directories to defragment. */
+	char **paths;
+	int n_paths;
+	/** Largest amount of data to move per second, in bytes; 0 for no limit. */
+	uint64_t rate;
+	/** Only files with at least this many fragments are moved. */
+	unsigned int min_fragments;
+	/** Also repack directories (see defrag.h). */
+	bool dirs;
+	/** Only report, do not move anything. */
+	bool dry_run;
+	/** Print a line per file. */
+	bool verbose;
+
+	/** Print help and exit. */
+	bool help;
+
+} defrag_opts;
+
+/** Totals for the summary. */
+typedef struct defrag_totals
+{
+	uint64_t files;
+	uint64_t moved_files;
+	uint64_t blocks_moved;
+	uint64_t fragments_before;
+	uint64_t fragments_after;
+	uint64_t extents_before;
+	uint64_t extents_after;
+	/** Files skipped for lack of a large enough free run. */
+	uint64_t no_space;
+	uint64_t dirs;
+	uint64_t repacked_dirs;
+	uint64_t dir_blocks_freed;
+	uint64_t errors;
+
+} defrag_totals;
+
+static const char *help_str = "\
+Usage: %s [options] path...\n\
+\n\
+Defragment files on a mounted a1fs file system: each file with data in\n\
+more than one run is moved into a single contiguous run. Directories are\n\
+walked recursively.\n\
+\n\
+Options:\n\
+    -r MiB  move at most MiB mebibytes of data per second; default: no limit\n\
+    -m num  only move files with at least num fragments; default: 2\n\
+    -d      also repack directories less than %d%% full, freeing their\n\
+            empty blocks; entries that move may be listed twice or\n\
+            missed by a listing in progress\n\
+    -n      only report the fragments of each file\n\
+    -v      print a line per file\n\
+    -h      print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname, A1FS_DIR_REPACK_FILL);
+}
+
+static bool parse_args(int argc, char *argv[], defrag_opts *opts)
+{
+	int o;
+	while ((o = getopt(argc, argv, "r:m:dnvh")) != -1)
+	{
+		switch (o)
+		{
+		case 'r':
+			opts->rate = strtoull(optarg, NULL, 10) << 20;
+			break;
+		case 'm':
+			opts->min_fragments = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			opts->dirs = true;
+			break;
+		case 'n':
+			opts->dry_run = true;
+			break;
+		case 'v':
+			opts->verbose = true;
+			break;
+
+		case 'h':
+			opts->help = true;
+			return true; // skip other arguments
+
+		case '?':
+			return false;
+		default:
+			return false;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		fprintf(stderr, "Missing path\n");
+		return false;
+	}
+	opts->paths = argv + optind;
+	opts->n_paths = argc - optind;
+	if (opts->min_fragments < 2)
+	{
+		fprintf(stderr, "Minimum number of fragments must be at least 2\n");
+		return false;
+	}
+	return true;
+}
+
+/** Options and totals, for the nftw() callback. */
+static defrag_opts *g_opts;
+static defrag_totals g_totals;
+/** Time the walk started. */
+static struct timespec g_start;
+
+static double elapsed_secs(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - g_start.tv_sec) + (now.tv_nsec - g_start.tv_nsec) / 1e9;
+}
+
+/** Sleep until the data moved so far is within the rate limit. */
+static void throttle(void)
+{
+	if (g_opts->rate == 0)
+		return;
+	double target = (double)g_totals.blocks_moved * A1FS_BLOCK_SIZE / g_opts->rate;
+	double wait = target - elapsed_secs();
+	if (wait <= 0)
+		return;
+	struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+/** Query or defragment a file; return false on error. */
+static bool defrag_file(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		perror(path);
+		return false;
+	}
+	a1fs_defrag_info info = {.flags = A1FS_DEFRAG_QUERY};
+	if (ioctl(fd, A1FS_IOC_DEFRAG, &info) != 0)
+	{
+		if (errno == ENOTTY || errno == ENOSYS)
+			fprintf(stderr, "%s: not on an a1fs file system\n", path);
+		else
+			perror(path);
+		close(fd);
+		return false;
+	}
+	if (!g_opts->dry_run && info.fragments_before >= g_opts->min_fragments)
+	{
+		info.flags = 0;
+		if (ioctl(fd, A1FS_IOC_DEFRAG, &info) != 0)
+		{
+			if (errno != ENOSPC)
+			{
+				perror(path);
+				close(fd);
+				return false;
+			}
+			// keep going; smaller files may still fit
+			g_totals.no_space++;
+			info.extents_after = info.extents_before;
+			info.fragments_after = info.fragments_before;
+			if (g_opts->verbose)
+				printf("%s: no free run large enough\n", path);
+		}
+	}
+	close(fd);
+
+	g_totals.files++;
+	g_totals.extents_before += info.extents_before;
+	g_totals.extents_after += info.extents_after;
+	g_totals.fragments_before += info.fragments_before;
+	g_totals.fragments_after += info.fragments_after;
+	if (info.blocks_moved > 0)
+	{
+		g_totals.moved_files++;
+		g_totals.blocks_moved += info.blocks_moved;
+	}
+	if (g_opts->verbose)
+	{
+		printf("%s: %u extents, %u fragments", path, info.extents_before, info.fragments_before);
+		if (!g_opts->dry_run && info.extents_after != info.extents_before)
+			printf(" -> %u extents, %u fragments", info.extents_after, info.fragments_after);
+		printf("\n");
+	}
+	throttle();
+	return true;
+}
+
+/** Query or repack a directory; return false on error. */
+static bool defrag_dir(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+	{
+		perror(path);
+		return false;
+	}
+	a1fs_defrag_info info = {.flags = g_opts->dry_run ? A1FS_DEFRAG_QUERY : 0};
+	if (ioctl(fd, A1FS_IOC_DEFRAG, &info) != 0)
+	{
+		if (errno == ENOTTY || errno == ENOSYS)
+			fprintf(stderr, "%s: not on an a1fs file system\n", path);
+		else
+			perror(path);
+		close(fd);
+		return false;
+	}
+	close(fd);
+
+	g_totals.dirs++;
+	if (info.blocks_freed > 0)
+	{
+		g_totals.repacked_dirs++;
+		g_totals.dir_blocks_freed += info.blocks_freed;
+	}
+	if (g_opts->verbose && info.blocks_freed > 0)
+		printf("%s: repacked, %u blocks freed\n", path, info.blocks_freed);
+	return true;
+}
+
+static int visit(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	(void)ftw; // unused
+	if (type == FTW_F && S_ISREG(st->st_mode) && !defrag_file(path))
+		g_totals.errors++;
+	else if (type == FTW_D && g_opts->dirs && !defrag_dir(path))
+		g_totals.errors++;
+	else if (type == FTW_DNR || type == FTW_NS)
+	{
+		fprintf(stderr, "%s: cannot read\n", path);
+		g_totals.errors++;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	defrag_opts opts = {.min_fragments = 2};
+	if (!parse_args(argc, argv, &opts))
+	{
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help)
+	{
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	g_opts = &opts;
+	clock_gettime(CLOCK_MONOTONIC, &g_start);
+	for (int i = 0; i < opts.n_paths; i++)
+	{
+		// stay on the file system the path is on
+		if (nftw(opts.paths[i], visit, 16, FTW_PHYS | FTW_MOUNT) != 0)
+		{
+			perror(opts.paths[i]);
+			g_totals.errors++;
+		}
+	}
+
+	printf("%lu files, %lu moved, %lu MiB moved in %.1f s; extents %lu -> %lu, fragments %lu -> %lu",
+		   (unsigned long)g_totals.files, (unsigned long)g_totals.moved_files,
+		   (unsigned long)(g_totals.blocks_moved * A1FS_BLOCK_SIZE >> 20), elapsed_secs(),
+		   (unsigned long)g_totals.extents_before, (unsigned long)g_totals.extents_after,
+		   (unsigned long)g_totals.fragments_before, (unsigned long)g_totals.fragments_after);
+	if (g_totals.no_space > 0)
+		printf("; %lu files did not fit", (unsigned long)g_totals.no_space);
+	if (opts.dirs)
+		printf("; %lu directories, %lu repacked, %lu blocks freed", (unsigned long)g_totals.dirs,
+			   (unsigned long)g_totals.repacked_dirs, (unsigned long)g_totals.dir_blocks_freed);
+	printf("\n");
+	return g_totals.errors > 0 ? 1 : 0;
+}
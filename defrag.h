@@ -0,0 +1,57 @@
+/**
+ * a1fs online defragmentation interface header file.
+ *
+ * A mounted file is defragmented with the A1FS_IOC_DEFRAG ioctl on an open
+ * file descriptor (see fs_defrag() in fs_ops.h). The file's data blocks are
+ * copied into one free run, in file order, and a new extent table describing
+ * them is written into a fresh block; the inode is then switched to the new
+ * table with a single update and the old blocks are freed. Until that update
+ * the file is entirely described by its old blocks, so an interrupted
+ * defragmentation never leaves a half-moved file. Holes stay holes.
+ *
+ * A request moves one file, so a1fs-defrag can walk a tree one file at a time,
+ * sleeping between requests to keep under an I/O rate limit, without holding
+ * up other operations for long.
+ *
+ * On a directory, the request repacks the entries instead, if they take fewer
+ * than A1FS_DIR_REPACK_FILL percent of the space in its blocks: live entries
+ * are packed, in order, from the start of the first block, and the blocks left
+ * empty are freed, so that lookups and listings scan only about as many blocks
+ * as the entries need. Entries that move get new readdir offsets, so a
+ * listing of the directory in progress may return some entries twice or miss
+ * them.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+
+/** Only report the current layout; do not move anything. */
+#define A1FS_DEFRAG_QUERY 0x1
+
+/** Directories with entries in less than this percentage of their space are repacked. */
+#define A1FS_DIR_REPACK_FILL 50
+
+/** Defragmentation request and result. */
+typedef struct a1fs_defrag_info {
+	/** A1FS_DEFRAG_* flags; set by the caller. */
+	uint32_t flags;
+	/** Extents in the extent table before the request. */
+	uint32_t extents_before;
+	/** Runs of blocks contiguous on disk before the request. */
+	uint32_t fragments_before;
+	/** Extents in the extent table after the request. */
+	uint32_t extents_after;
+	/** Runs of blocks contiguous on disk after the request. */
+	uint32_t fragments_after;
+	/** Directory blocks freed by repacking the entries. */
+	uint32_t blocks_freed;
+	/** Number of data blocks copied. */
+	uint64_t blocks_moved;
+
+} a1fs_defrag_info;
+
+/** Defragment the file (see above). */
+#define A1FS_IOC_DEFRAG _IOWR('a', 1, a1fs_defrag_info)
@@ -0,0 +1,240 @@
+/**
+ * a1fs discard (hole punching) implementation.
+ */
+
+// fallocate() is a GNU extension
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+
+#include "discard.h"
+
+
+/** Insert a range into a list at given index; return false if out of memory. */
+static bool list_insert(discard_list *list, size_t idx, discard_range range)
+{
+	if (list->count == list->capacity)
+	{
+		size_t capacity = list->capacity ? list->capacity * 2 : 64;
+		discard_range *ranges = realloc(list->ranges, capacity * sizeof(discard_range));
+		if (ranges == NULL)
+			return false;
+		list->ranges = ranges;
+		list->capacity = capacity;
+	}
+	memmove(&list->ranges[idx + 1], &list->ranges[idx], (list->count - idx) * sizeof(discard_range));
+	list->ranges[idx] = range;
+	list->count++;
+	return true;
+}
+
+/** Remove the range at given index from a list. */
+static void list_remove(discard_list *list, size_t idx)
+{
+	memmove(&list->ranges[idx], &list->ranges[idx + 1], (list->count - idx - 1) * sizeof(discard_range));
+	list->count--;
+}
+
+/** Punch all pending ranges out of the image file. Called with the lock held. */
+static void punch_pending(discard_ctx *d)
+{
+	for (size_t i = 0; i < d->pending.count; i++)
+	{
+		discard_range r = d->pending.ranges[i];
+		if (fallocate(d->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					  (off_t)r.start * A1FS_BLOCK_SIZE, (off_t)r.count * A1FS_BLOCK_SIZE) != 0)
+		{
+			// The blocks keep their old contents and stay dirty
+			perror("discard: fallocate");
+			continue;
+		}
+		// Not being able to record it only means the blocks get zeroed anyway
+		list_insert(&d->done, d->done.count, r);
+	}
+	d->pending.count = 0;
+	d->pending_blocks = 0;
+}
+
+/** Discard thread: punch queued ranges in batches. */
+static void *discard_thread(void *arg)
+{
+	discard_ctx *d = (discard_ctx *)arg;
+	pthread_mutex_lock(&d->lock);
+	while (!d->stop)
+	{
+		if (d->pending_blocks < DISCARD_BATCH_BLOCKS)
+		{
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += DISCARD_DELAY_SEC;
+			pthread_cond_timedwait(&d->cond, &d->lock, &deadline);
+		}
+		// Holding the lock while punching keeps discard_cancel() from handing
+		// out a block that is about to be punched
+		punch_pending(d);
+	}
+	pthread_mutex_unlock(&d->lock);
+	return NULL;
+}
+
+bool discard_init(fs_ctx *fs, const char *img_path)
+{
+	discard_ctx *d = calloc(1, sizeof(discard_ctx));
+	if (d == NULL)
+		return false;
+	d->fd = open(img_path, O_RDWR);
+	if (d->fd < 0)
+	{
+		perror(img_path);
+		free(d);
+		return false;
+	}
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->cond, NULL);
+	fs->discard = d;
+	return true;
+}
+
+void discard_start(fs_ctx *fs)
+{
+	discard_ctx *d = fs->discard;
+	if (d == NULL)
+		return;
+	if (pthread_create(&d->thread, NULL, discard_thread, d) != 0)
+	{
+		fprintf(stderr, "Failed to start the discard thread; discarding synchronously\n");
+		return;
+	}
+	d->running = true;
+}
+
+void discard_destroy(fs_ctx *fs)
+{
+	discard_ctx *d = fs->discard;
+	if (d == NULL)
+		return;
+	if (d->running)
+	{
+		pthread_mutex_lock(&d->lock);
+		d->stop = true;
+		pthread_cond_signal(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+		pthread_join(d->thread, NULL);
+	}
+
+	punch_pending(d);
+	close(d->fd);
+	pthread_mutex_destroy(&d->lock);
+	pthread_cond_destroy(&d->cond);
+	free(d->pending.ranges);
+	free(d->done.ranges);
+	free(d);
+	fs->discard = NULL;
+}
+
+void discard_queue(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count)
+{
+	discard_ctx *d = fs->discard;
+	pthread_mutex_lock(&d->lock);
+	discard_list *list = &d->pending;
+	// First range that starts after the new one
+	size_t idx = 0;
+	while (idx < list->count && list->ranges[idx].start < start)
+		idx++;
+	bool merged = false;
+	if (idx > 0 && list->ranges[idx - 1].start + list->ranges[idx - 1].count == start)
+	{
+		list->ranges[idx - 1].count += count;
+		merged = true;
+	}
+	if (idx < list->count && start + count == list->ranges[idx].start)
+	{
+		if (merged)
+		{
+			list->ranges[idx - 1].count += list->ranges[idx].count;
+			list_remove(list, idx);
+		}
+		else
+		{
+			list->ranges[idx].start = start;
+			list->ranges[idx].count += count;
+			merged = true;
+		}
+	}
+	discard_range range = {start, count};
+	// If the queue cannot grow the range is simply not discarded
+	if (merged || list_insert(list, idx, range))
+	{
+		d->pending_blocks += count;
+		if (!d->running)
+			punch_pending(d);
+		else if (d->pending_blocks >= DISCARD_BATCH_BLOCKS)
+			pthread_cond_signal(&d->cond);
+	}
+	pthread_mutex_unlock(&d->lock);
+}
+
+void discard_cancel(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count)
+{
+	discard_ctx *d = fs->discard;
+	pthread_mutex_lock(&d->lock);
+	// Punched blocks read as zeros and need no zeroing on allocation
+	for (size_t i = 0; i < d->done.count; i++)
+	{
+		discard_range r = d->done.ranges[i];
+		for (a1fs_blk_t b = r.start; b < r.start + r.count; b++)
+		{
+			fs->dirty_bitmap[b / 8] &= ~(1 << b % 8);
+		}
+	}
+	d->done.count = 0;
+
+	a1fs_blk_t end = start + count;
+	discard_list *list = &d->pending;
+	for (size_t i = 0; i < list->count;)
+	{
+		discard_range *r = &list->ranges[i];
+		a1fs_blk_t r_end = r->start + r->count;
+		if (r_end <= start || r->start >= end)
+		{
+			i++;
+			continue;
+		}
+		a1fs_blk_t from = r->start > start ? r->start : start;
+		a1fs_blk_t to = r_end < end ? r_end : end;
+		d->pending_blocks -= to - from;
+		if (r->start < start && r_end > end)
+		{
+			// Split around the allocated range; if the list cannot grow, the
+			// tail is dropped from the queue instead
+			discard_range tail = {end, r_end - end};
+			r->count = start - r->start;
+			if (!list_insert(list, i + 1, tail))
+				d->pending_blocks -= tail.count;
+			i += 2;
+		}
+		else if (r->start < start)
+		{
+			r->count = start - r->start;
+			i++;
+		}
+		else if (r_end > end)
+		{
+			r->count = r_end - end;
+			r->start = end;
+			i++;
+		}
+		else
+		{
+			list_remove(list, i);
+		}
+	}
+	pthread_mutex_unlock(&d->lock);
+}
@@ -0,0 +1,98 @@
+/**
+ * a1fs discard (hole punching) header file.
+ *
+ * With the "discard" mount option, block ranges freed by the file system are
+ * punched out of the image file, so that a sparse image only uses host disk
+ * space for live data. Freed ranges are queued, coalesced with adjacent ones
+ * and punched in batches by a background thread. Allocating a block cancels
+ * any pending discard of it. Punched blocks read back as zeros, so they no
+ * longer need zeroing when they are allocated again.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Number of queued blocks that wakes up the discard thread early. */
+#define DISCARD_BATCH_BLOCKS 256
+
+/** Maximum time a freed range waits in the queue, in seconds. */
+#define DISCARD_DELAY_SEC 1
+
+/** A range of blocks. */
+typedef struct discard_range {
+	a1fs_blk_t start;
+	a1fs_blk_t count;
+
+} discard_range;
+
+/** A growable array of block ranges. */
+typedef struct discard_list {
+	discard_range *ranges;
+	size_t count;
+	size_t capacity;
+
+} discard_list;
+
+/** Discard queue state. */
+typedef struct discard_ctx {
+	/** Image file descriptor used for hole punching. */
+	int fd;
+	/** Background thread that punches queued ranges. */
+	pthread_t thread;
+	/** Protects everything below. */
+	pthread_mutex_t lock;
+	/** Signals the thread that there is work or that it must stop. */
+	pthread_cond_t cond;
+	/** Whether the background thread is running. */
+	bool running;
+	/** Set to stop the thread. */
+	bool stop;
+	/** Freed ranges waiting to be punched, sorted and coalesced. */
+	discard_list pending;
+	/** Total number of blocks in pending ranges. */
+	uint64_t pending_blocks;
+	/** Punched ranges whose dirty bits have not been cleared yet. */
+	discard_list done;
+
+} discard_ctx;
+
+/**
+ * Open the image file for hole punching.
+ *
+ * @param fs        file system context.
+ * @param img_path  image file path.
+ * @return          true on success; false on failure.
+ */
+bool discard_init(fs_ctx *fs, const char *img_path);
+
+/**
+ * Start the discard thread.
+ *
+ * Must be called after FUSE has daemonized (threads do not survive fork()).
+ * Until the thread runs, or if it cannot be started, ranges are punched as
+ * soon as they are queued.
+ */
+void discard_start(fs_ctx *fs);
+
+/** Punch all pending ranges, stop the discard thread and free its state. */
+void discard_destroy(fs_ctx *fs);
+
+/** Queue a freed block range for discarding. */
+void discard_queue(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count);
+
+/**
+ * Cancel pending discards of a block range that is being allocated.
+ *
+ * Also clears the dirty bits of ranges punched since the last call; this is
+ * done here, by the file system thread, so that the dirty bitmap is never
+ * written concurrently.
+ */
+void discard_cancel(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count);
@@ -0,0 +1,125 @@
+/**
+ * a1fs FUSE driver common code implementation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Using 2.9.x FUSE API
+#define FUSE_USE_VERSION 29
+#include <fuse_common.h>
+
+#include "driver.h"
+#include "fs_ops.h"
+#include "stats.h"
+
+
+bool a1fs_driver_init(fs_ctx *fs, const a1fs_opts *opts)
+{
+	// Nothing to initialize if only printing help
+	if (opts->help)
+		return true;
+
+	fs_mount_opts mount_opts = {
+		.nodelalloc = opts->nodelalloc,
+		.discard = opts->discard,
+		.trace_path = opts->trace_file,
+	};
+	if (!fs_mount(fs, opts->img_path, &mount_opts))
+		return false;
+	fs->stats_file = opts->stats_file;
+	return true;
+}
+
+/**
+ * Dump the statistics on every SIGUSR1, to the stats_file mount option or to
+ * stderr (only visible when running in the foreground).
+ *
+ * @param arg  the file system context.
+ * @return     never returns.
+ */
+static void *stats_dump_thread(void *arg)
+{
+	fs_ctx *fs = (fs_ctx *)arg;
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	for (;;)
+	{
+		int sig;
+		if (sigwait(&set, &sig) != 0)
+			continue;
+		size_t len;
+		char *text = stats_snapshot(&fs->stats, &len);
+		if (text == NULL)
+			continue;
+		FILE *f = fs->stats_file != NULL ? fopen(fs->stats_file, "a") : stderr;
+		if (f != NULL)
+		{
+			fwrite(text, 1, len, f);
+			fputc('\n', f);
+			if (f != stderr)
+				fclose(f);
+			else
+				fflush(f);
+		}
+		free(text);
+	}
+	return NULL;
+}
+
+void a1fs_driver_start(fs_ctx *fs)
+{
+	// SIGUSR1 is only taken by the dump thread; block it before any thread
+	// is created so that they all inherit the mask
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, stats_dump_thread, fs) == 0)
+		pthread_detach(thread);
+
+	fs_start(fs);
+}
+
+void a1fs_stats_getattr(fs_ctx *fs, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_mode = S_IFREG | 0444;
+	st->st_nlink = 1;
+	st->st_size = stats_format(&fs->stats, NULL, 0);
+	clock_gettime(CLOCK_REALTIME, &st->st_mtim);
+}
+
+int a1fs_stats_open(fs_ctx *fs, struct fuse_file_info *fi)
+{
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+	size_t len;
+	char *text = stats_snapshot(&fs->stats, &len);
+	if (text == NULL)
+		return -ENOMEM;
+	fi->fh = (uintptr_t)text;
+	// the size reported by getattr() is already stale
+	fi->direct_io = 1;
+	return 0;
+}
+
+size_t a1fs_stats_read(const char *text, char *buf, size_t size, off_t offset)
+{
+	size_t len = strlen(text);
+	if ((size_t)offset >= len)
+		return 0;
+	if (size > len - offset)
+		size = len - offset;
+	memcpy(buf, text + offset, size);
+	return size;
+}
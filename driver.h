@@ -0,0 +1,84 @@
+/**
+ * a1fs FUSE driver common code header file.
+ *
+ * Shared by the two FUSE front ends over liba1fs: a1fs (a1fs.c), on the
+ * path-based high-level API, and a1fs-ll (a1fs_ll.c), on the inode-based
+ * low-level API. Both mount the image the same way, dump the statistics on
+ * SIGUSR1, and show them in the read-only file A1FS_STATS_NAME in the root
+ * directory, which is hidden from directory listings.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "fs_ctx.h"
+#include "options.h"
+
+struct fuse_file_info;
+
+/** Name of the statistics file in the root directory (see stats.h). */
+#define A1FS_STATS_NAME ".a1fs_stats"
+
+/**
+ * Initialize the file system.
+ *
+ * Called when the file system is mounted, before the FUSE main loop, since
+ * the FUSE init() callback cannot return errors.
+ *
+ * @param fs    file system context to initialize.
+ * @param opts  command line options.
+ * @return      true on success; false on failure.
+ */
+bool a1fs_driver_init(fs_ctx *fs, const a1fs_opts *opts);
+
+/**
+ * Finish initialization once FUSE is running.
+ *
+ * Must be called from the FUSE init() callback, after FUSE has daemonized,
+ * which is when background threads can be started (they would not survive
+ * the fork()). Starts the thread that dumps the statistics on SIGUSR1 and the
+ * background work of the file system (see fs_start()).
+ *
+ * @param fs  file system context.
+ */
+void a1fs_driver_start(fs_ctx *fs);
+
+/**
+ * Get the attributes of the statistics file: a read-only regular file whose
+ * size is the current length of its text.
+ *
+ * @param fs  file system context.
+ * @param st  pointer to the struct stat that receives the result.
+ */
+void a1fs_stats_getattr(fs_ctx *fs, struct stat *st);
+
+/**
+ * Open the statistics file: take a snapshot of its text, which is what reads
+ * of this open file return, and keep it in fi->fh. Reads bypass the page
+ * cache, since the size reported by a1fs_stats_getattr() is already stale.
+ *
+ * Errors:
+ *   EACCES  the file is not opened read-only.
+ *   ENOMEM  out of memory.
+ *
+ * @param fs  file system context.
+ * @param fi  the open file; free(fi->fh) when it is released.
+ * @return    0 on success; -errno on error.
+ */
+int a1fs_stats_open(fs_ctx *fs, struct fuse_file_info *fi);
+
+/**
+ * Read from a snapshot of the statistics text taken when the file was opened,
+ * so that a reader sees consistent numbers.
+ *
+ * @param text    the snapshot (see stats_snapshot()).
+ * @param buf     pointer to the buffer that receives the data.
+ * @param size    number of bytes requested.
+ * @param offset  offset from the beginning of the text.
+ * @return        number of bytes read.
+ */
+size_t a1fs_stats_read(const char *text, char *buf, size_t size, off_t offset);
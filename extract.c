@@ -0,0 +1,948 @@
+/**
+ * a1fs offline extractor.
+ *
+ * Copies files out of an unmounted image without going through the file
+ * system: the directory tree is walked straight from the mapped image, and
+ * file contents are copied a whole extent at a time, either into a directory
+ * (with copy_file_range() from the image file, several files in parallel) or
+ * as a tar stream on stdout. Holes and unwritten extents are skipped when
+ * extracting into a directory, so sparse files stay sparse.
+ *
+ * The image is only read. It should not be mounted while being extracted, and
+ * damaged inodes, extents and directory entries are reported and skipped;
+ * run fsck.a1fs to repair them.
+ */
+
+// copy_file_range() is a GNU extension
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "map.h"
+
+
+/** Largest number of extracting threads. */
+#define EXTRACT_MAX_THREADS 256
+
+/** Size of the tar output buffer. */
+#define TAR_BUF_SIZE (1 << 20)
+
+/** Tar block size. */
+#define TAR_BLOCK 512
+
+/** Command line options. */
+typedef struct extract_opts
+{
+	/** File system image file path. */
+	const char *img_path;
+	/** Directory to extract into; NULL with -t. */
+	const char *out_dir;
+	/** File or directory of the image to extract. */
+	const char *path;
+	/** Number of extracting threads. */
+	unsigned int n_threads;
+	/** Write a tar stream to stdout. */
+	bool tar;
+	/** Print a summary. */
+	bool verbose;
+
+	/** Print help and exit. */
+	bool help;
+
+} extract_opts;
+
+/** A file or directory to extract into the output directory. */
+typedef struct extract_item
+{
+	a1fs_ino_t ino;
+	/** Output path. */
+	char *path;
+
+} extract_item;
+
+/** A growable list of items. */
+typedef struct item_list
+{
+	extract_item *items;
+	size_t count;
+	size_t capacity;
+
+} item_list;
+
+/** Extractor state. */
+typedef struct extract_ctx
+{
+	/** Mapped image. */
+	void *image;
+	/** Image size in bytes. */
+	size_t size;
+	/** Superblock. */
+	a1fs_superblock *sb;
+	/** Image file, read with copy_file_range(). */
+	int img_fd;
+	/** Set once copy_file_range() has failed; data is written from the mapping. */
+	atomic_bool no_copy_range;
+	/** Inodes already extracted; guards against loops in a damaged tree. */
+	unsigned char *seen;
+
+	/** Files and directories found by the walk (directory output). */
+	item_list files;
+	item_list dirs;
+	/** Next file to extract. */
+	atomic_size_t next;
+
+	/** Tar output buffer. */
+	char *buf;
+	size_t buf_len;
+
+	/** Problems found; the affected files are skipped or incomplete. */
+	atomic_ulong errors;
+	/** Totals for the summary. */
+	atomic_ulong n_files;
+	atomic_ulong n_dirs;
+	atomic_ullong bytes;
+
+} extract_ctx;
+
+/** ustar header. */
+typedef struct tar_header
+{
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+
+} tar_header;
+
+static_assert(sizeof(tar_header) == TAR_BLOCK, "invalid tar header size");
+
+static const char *help_str = "\
+Usage: %s [options] image\n\
+\n\
+Extract files from an unmounted a1fs image, either into a directory (-C)\n\
+or as a tar stream written to stdout (-t).\n\
+\n\
+Options:\n\
+    -C dir   extract into dir; it is created if missing\n\
+    -t       write a tar stream to stdout\n\
+    -p path  extract only this file or directory of the image; default: /\n\
+    -j num   number of files extracted in parallel with -C;\n\
+             default: number of CPUs\n\
+    -v       print a summary to stderr\n\
+    -h       print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+static bool parse_args(int argc, char *argv[], extract_opts *opts)
+{
+	int o;
+	while ((o = getopt(argc, argv, "C:tp:j:vh")) != -1)
+	{
+		switch (o)
+		{
+		case 'C':
+			opts->out_dir = optarg;
+			break;
+		case 't':
+			opts->tar = true;
+			break;
+		case 'p':
+			opts->path = optarg;
+			break;
+		case 'j':
+			opts->n_threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'v':
+			opts->verbose = true;
+			break;
+
+		case 'h':
+			opts->help = true;
+			return true; // skip other arguments
+
+		case '?':
+			return false;
+		default:
+			return false;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		fprintf(stderr, "Missing image path\n");
+		return false;
+	}
+	opts->img_path = argv[optind];
+
+	if (opts->tar == (opts->out_dir != NULL))
+	{
+		fprintf(stderr, "Exactly one of -C and -t must be given\n");
+		return false;
+	}
+	if (opts->tar && isatty(STDOUT_FILENO))
+	{
+		fprintf(stderr, "Refusing to write a tar stream to a terminal\n");
+		return false;
+	}
+	if (opts->n_threads == 0 || opts->n_threads > EXTRACT_MAX_THREADS)
+	{
+		fprintf(stderr, "Number of threads must be between 1 and %d\n", EXTRACT_MAX_THREADS);
+		return false;
+	}
+	return true;
+}
+
+/** Report a problem; the affected file is skipped or left incomplete. */
+static void problem(extract_ctx *ctx, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	atomic_fetch_add(&ctx->errors, 1);
+}
+
+static a1fs_blk_t extent_len(const a1fs_extent *e)
+{
+	return e->count & ~A1FS_EXTENT_UNWRITTEN;
+}
+
+/** Check that an extent with data lies within the data blocks. */
+static bool extent_ok(const extract_ctx *ctx, const a1fs_extent *e)
+{
+	a1fs_blk_t len = extent_len(e);
+	return e->start >= ctx->sb->first_data_block && e->start < ctx->sb->blocks_count &&
+		   len <= ctx->sb->blocks_count - e->start;
+}
+
+/** Check that an inode is a file or directory with a valid extent table. */
+static bool inode_ok(const extract_ctx *ctx, a1fs_ino_t ino)
+{
+	if (ino >= ctx->sb->inodes_count)
+		return false;
+	const a1fs_inode *inode = a1fs_inode_at(ctx->image, ino);
+	return (S_ISDIR(inode->mode) || S_ISREG(inode->mode)) &&
+		   inode->extent_table >= ctx->sb->first_data_block && inode->extent_table < ctx->sb->blocks_count;
+}
+
+static a1fs_extent *extent_table(const extract_ctx *ctx, const a1fs_inode *inode)
+{
+	return (a1fs_extent *)(ctx->image + (size_t)inode->extent_table * A1FS_BLOCK_SIZE);
+}
+
+/** Number of extents to look at; never more than fit in the table. */
+static unsigned int extent_count(const a1fs_inode *inode)
+{
+	return inode->num_extents < A1FS_EXTENTS_MAX ? inode->num_extents : A1FS_EXTENTS_MAX;
+}
+
+/** Permissions to extract an inode with. */
+static mode_t out_mode(const a1fs_inode *inode)
+{
+	// files created through the file system carry no permission bits
+	if ((inode->mode & 07777) == 0)
+		return S_ISDIR(inode->mode) ? 0755 : 0644;
+	return inode->mode & 07777;
+}
+
+/**
+ * Call fn for each directory entry in use, until it returns false.
+ *
+ * @return  false if fn returned false.
+ */
+static bool for_each_dentry(extract_ctx *ctx, const a1fs_inode *dir,
+							bool (*fn)(extract_ctx *ctx, const a1fs_dir_rec *d, void *arg), void *arg)
+{
+	const a1fs_extent *table = extent_table(ctx, dir);
+	for (unsigned int i = 0; i < extent_count(dir); i++)
+	{
+		if (table[i].start == 0)
+			continue;
+		if (!extent_ok(ctx, &table[i]))
+		{
+			problem(ctx, "inode %u: directory extent %u is out of range", dir->inode, i);
+			continue;
+		}
+		for (a1fs_blk_t b = 0; b < extent_len(&table[i]); b++)
+		{
+			const unsigned char *block = ctx->image + (size_t)(table[i].start + b) * A1FS_BLOCK_SIZE;
+			a1fs_dir_rec d = {0};
+			while (a1fs_dir_next(ctx->sb->features, block, &d))
+			{
+				if (d.ino == 0)
+					continue;
+				if (d.name[0] == '\0' || strchr(d.name, '/') != NULL || strcmp(d.name, ".") == 0 ||
+					strcmp(d.name, "..") == 0)
+				{
+					problem(ctx, "inode %u: bad directory entry name", dir->inode);
+					continue;
+				}
+				if (!fn(ctx, &d, arg))
+					return false;
+			}
+			if (d.off < A1FS_BLOCK_SIZE)
+				problem(ctx, "inode %u: damaged directory entry", dir->inode);
+		}
+	}
+	return true;
+}
+
+/** Lookup state for resolve_dentry(). */
+typedef struct lookup
+{
+	const char *name;
+	size_t len;
+	a1fs_ino_t ino;
+	bool found;
+
+} lookup;
+
+static bool resolve_dentry(extract_ctx *ctx, const a1fs_dir_rec *d, void *arg)
+{
+	(void)ctx;
+	lookup *l = (lookup *)arg;
+	if (strncmp(d->name, l->name, l->len) != 0 || d->name[l->len] != '\0')
+		return true;
+	l->ino = d->ino;
+	l->found = true;
+	return false;
+}
+
+/**
+ * Find the inode of a path in the image.
+ *
+ * @return  true on success; false if not found (an error has been printed).
+ */
+static bool resolve(extract_ctx *ctx, const char *path, a1fs_ino_t *ino)
+{
+	a1fs_ino_t cur = 0;
+	const char *p = path;
+	for (;;)
+	{
+		while (*p == '/')
+			p++;
+		if (*p == '\0')
+			break;
+		size_t len = strcspn(p, "/");
+		if (!inode_ok(ctx, cur) || !S_ISDIR(a1fs_inode_at(ctx->image, cur)->mode))
+		{
+			fprintf(stderr, "%s: not a directory\n", path);
+			return false;
+		}
+		lookup l = {p, len, 0, false};
+		for_each_dentry(ctx, a1fs_inode_at(ctx->image, cur), resolve_dentry, &l);
+		if (!l.found)
+		{
+			fprintf(stderr, "%s: no such file or directory in the image\n", path);
+			return false;
+		}
+		cur = l.ino;
+		p += len;
+	}
+	if (!inode_ok(ctx, cur))
+	{
+		fprintf(stderr, "%s: inode %u is damaged\n", path, cur);
+		return false;
+	}
+	*ino = cur;
+	return true;
+}
+
+/** Join a directory path and a name; return NULL if the result is too long. */
+static char *join_path(extract_ctx *ctx, const char *dir, const char *name)
+{
+	size_t len = strlen(dir) + 1 + strlen(name);
+	if (len >= PATH_MAX)
+	{
+		problem(ctx, "%s/%s: path too long", dir, name);
+		return NULL;
+	}
+	char *path = malloc(len + 1);
+	if (path == NULL)
+	{
+		problem(ctx, "%s/%s: out of memory", dir, name);
+		return NULL;
+	}
+	sprintf(path, "%s%s%s", dir, *dir != '\0' ? "/" : "", name);
+	return path;
+}
+
+/** Mark an inode as extracted; return false if it already was. */
+static bool claim_inode(extract_ctx *ctx, a1fs_ino_t ino, const char *path)
+{
+	if (ctx->seen[ino])
+	{
+		problem(ctx, "%s: inode %u is linked more than once; skipped", path, ino);
+		return false;
+	}
+	ctx->seen[ino] = 1;
+	return true;
+}
+
+
+//
+// Directory output
+//
+
+static bool add_item(extract_ctx *ctx, item_list *list, a1fs_ino_t ino, char *path)
+{
+	if (list->count == list->capacity)
+	{
+		size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+		extract_item *items = realloc(list->items, capacity * sizeof(extract_item));
+		if (items == NULL)
+		{
+			problem(ctx, "%s: out of memory", path);
+			free(path);
+			return false;
+		}
+		list->items = items;
+		list->capacity = capacity;
+	}
+	list->items[list->count++] = (extract_item){ino, path};
+	return true;
+}
+
+static void free_items(item_list *list)
+{
+	for (size_t i = 0; i < list->count; i++)
+		free(list->items[i].path);
+	free(list->items);
+}
+
+static void walk_dir(extract_ctx *ctx, a1fs_ino_t ino, char *path);
+
+static bool walk_dentry(extract_ctx *ctx, const a1fs_dir_rec *d, void *arg)
+{
+	const char *dir_path = (const char *)arg;
+	char *path = join_path(ctx, dir_path, d->name);
+	if (path == NULL)
+		return true;
+	if (!inode_ok(ctx, d->ino))
+	{
+		problem(ctx, "%s: inode %u is damaged; skipped", path, d->ino);
+		free(path);
+		return true;
+	}
+	if (!claim_inode(ctx, d->ino, path))
+	{
+		free(path);
+		return true;
+	}
+	if (S_ISDIR(a1fs_inode_at(ctx->image, d->ino)->mode))
+		walk_dir(ctx, d->ino, path);
+	else
+		add_item(ctx, &ctx->files, d->ino, path);
+	return true;
+}
+
+/**
+ * Create a directory and everything below it, except for file contents; the
+ * files found are added to ctx->files. Takes ownership of path.
+ */
+static void walk_dir(extract_ctx *ctx, a1fs_ino_t ino, char *path)
+{
+	// the permissions are set once the directory is filled in
+	if (mkdir(path, 0700) != 0 && errno != EEXIST)
+	{
+		problem(ctx, "%s: %s", path, strerror(errno));
+		free(path);
+		return;
+	}
+	if (!add_item(ctx, &ctx->dirs, ino, path))
+		return;
+	atomic_fetch_add(&ctx->n_dirs, 1);
+	for_each_dentry(ctx, a1fs_inode_at(ctx->image, ino), walk_dentry, path);
+}
+
+/** Write a range of the image to a file; copy_file_range() if possible. */
+static bool copy_out(extract_ctx *ctx, int fd, uint64_t src, uint64_t dst, uint64_t len)
+{
+	if (!atomic_load_explicit(&ctx->no_copy_range, memory_order_relaxed))
+	{
+		loff_t in = src, out = dst;
+		while (len > 0)
+		{
+			ssize_t n = copy_file_range(ctx->img_fd, &in, fd, &out, len, 0);
+			if (n <= 0)
+			{
+				if (n < 0 && errno == EINTR)
+					continue;
+				// not supported between these files; fall back to writing
+				atomic_store(&ctx->no_copy_range, true);
+				break;
+			}
+			len -= n;
+		}
+		src = in;
+		dst = out;
+	}
+	const char *data = (const char *)ctx->image + src;
+	while (len > 0)
+	{
+		ssize_t n = pwrite(fd, data, len, dst);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += n;
+		dst += n;
+		len -= n;
+	}
+	return true;
+}
+
+/** Extract a file's contents, mode and mtime. */
+static void extract_file(extract_ctx *ctx, const extract_item *item)
+{
+	const a1fs_inode *inode = a1fs_inode_at(ctx->image, item->ino);
+	int fd = open(item->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+	{
+		problem(ctx, "%s: %s", item->path, strerror(errno));
+		return;
+	}
+
+	const a1fs_extent *table = extent_table(ctx, inode);
+	uint64_t pos = 0;
+	for (unsigned int i = 0; i < extent_count(inode) && pos < inode->size; i++)
+	{
+		uint64_t len = (uint64_t)extent_len(&table[i]) * A1FS_BLOCK_SIZE;
+		if (len > inode->size - pos)
+			len = inode->size - pos;
+		// holes and unwritten extents are left as holes in the output
+		if (table[i].start != 0 && !(table[i].count & A1FS_EXTENT_UNWRITTEN))
+		{
+			if (!extent_ok(ctx, &table[i]))
+				problem(ctx, "%s: extent %u is out of range; left as a hole", item->path, i);
+			else if (!copy_out(ctx, fd, (uint64_t)table[i].start * A1FS_BLOCK_SIZE, pos, len))
+			{
+				problem(ctx, "%s: %s", item->path, strerror(errno));
+				close(fd);
+				return;
+			}
+		}
+		pos += len;
+	}
+	if (pos < inode->size)
+		problem(ctx, "%s: size is past the end of its extents; padded with zeros", item->path);
+
+	struct timespec times[2] = {{0, UTIME_OMIT}, inode->mtime};
+	if (ftruncate(fd, inode->size) != 0 || fchmod(fd, out_mode(inode)) != 0 || futimens(fd, times) != 0)
+		problem(ctx, "%s: %s", item->path, strerror(errno));
+	close(fd);
+	atomic_fetch_add(&ctx->n_files, 1);
+	atomic_fetch_add(&ctx->bytes, inode->size);
+}
+
+static void *extract_thread(void *arg)
+{
+	extract_ctx *ctx = (extract_ctx *)arg;
+	for (;;)
+	{
+		size_t i = atomic_fetch_add(&ctx->next, 1);
+		if (i >= ctx->files.count)
+			break;
+		extract_file(ctx, &ctx->files.items[i]);
+	}
+	return NULL;
+}
+
+/** Extract an inode of the image into out_dir. */
+static void extract_to_dir(extract_ctx *ctx, a1fs_ino_t ino, const char *img_path, const char *out_dir,
+						   unsigned int n_threads)
+{
+	if (mkdir(out_dir, 0755) != 0 && errno != EEXIST)
+	{
+		problem(ctx, "%s: %s", out_dir, strerror(errno));
+		return;
+	}
+	ctx->seen[ino] = 1;
+	if (S_ISDIR(a1fs_inode_at(ctx->image, ino)->mode))
+	{
+		char *path = strdup(out_dir);
+		if (path == NULL)
+		{
+			problem(ctx, "%s: out of memory", out_dir);
+			return;
+		}
+		walk_dir(ctx, ino, path);
+	}
+	else
+	{
+		const char *slash = strrchr(img_path, '/');
+		char *path = join_path(ctx, out_dir, slash != NULL ? slash + 1 : img_path);
+		if (path != NULL)
+			add_item(ctx, &ctx->files, ino, path);
+	}
+
+	pthread_t threads[EXTRACT_MAX_THREADS];
+	unsigned int started = 0;
+	for (; started < n_threads - 1 && started + 1 < ctx->files.count; started++)
+	{
+		if (pthread_create(&threads[started], NULL, extract_thread, ctx) != 0)
+			break;
+	}
+	// this thread extracts too, which also covers a failed pthread_create()
+	extract_thread(ctx);
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	// Deepest directories first, since filling in a directory changes its mtime
+	for (size_t i = ctx->dirs.count; i-- > 0;)
+	{
+		const extract_item *item = &ctx->dirs.items[i];
+		const a1fs_inode *inode = a1fs_inode_at(ctx->image, item->ino);
+		struct timespec times[2] = {{0, UTIME_OMIT}, inode->mtime};
+		if (chmod(item->path, out_mode(inode)) != 0 || utimensat(AT_FDCWD, item->path, times, 0) != 0)
+			problem(ctx, "%s: %s", item->path, strerror(errno));
+	}
+}
+
+
+//
+// Tar output
+//
+
+static bool write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(fd, buf, len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool tar_flush(extract_ctx *ctx)
+{
+	bool ok = write_all(STDOUT_FILENO, ctx->buf, ctx->buf_len);
+	ctx->buf_len = 0;
+	return ok;
+}
+
+/** Append to the tar stream; large writes go straight from the image. */
+static bool tar_write(extract_ctx *ctx, const void *data, size_t len)
+{
+	if (ctx->buf_len + len <= TAR_BUF_SIZE)
+	{
+		memcpy(ctx->buf + ctx->buf_len, data, len);
+		ctx->buf_len += len;
+		return true;
+	}
+	if (!tar_flush(ctx))
+		return false;
+	if (len >= TAR_BUF_SIZE)
+		return write_all(STDOUT_FILENO, data, len);
+	memcpy(ctx->buf, data, len);
+	ctx->buf_len = len;
+	return true;
+}
+
+static bool tar_zeros(extract_ctx *ctx, uint64_t len)
+{
+	static const char zeros[64 * 1024];
+	while (len > 0)
+	{
+		size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+		if (!tar_write(ctx, zeros, n))
+			return false;
+		len -= n;
+	}
+	return true;
+}
+
+/** Pad the stream to a whole tar block after len bytes of data. */
+static bool tar_pad(extract_ctx *ctx, uint64_t len)
+{
+	return tar_zeros(ctx, (TAR_BLOCK - len % TAR_BLOCK) % TAR_BLOCK);
+}
+
+/** Store a number in octal, or in base-256 if it does not fit. */
+static void tar_number(char *field, size_t size, uint64_t value)
+{
+	if (value < 1ull << (3 * (size - 1)))
+	{
+		snprintf(field, size, "%0*lo", (int)size - 1, (unsigned long)value);
+		return;
+	}
+	memset(field, 0, size);
+	field[0] = (char)0x80;
+	for (size_t i = size - 1; i > 0 && value > 0; i--, value >>= 8)
+		field[i] = value & 0xff;
+}
+
+/** Write a header of given type; long names are preceded by a GNU long name entry. */
+static bool tar_header_write(extract_ctx *ctx, const char *name, char type, mode_t mode, uint64_t size,
+							 time_t mtime)
+{
+	size_t name_len = strlen(name);
+	if (name_len > sizeof(((tar_header *)0)->name))
+	{
+		if (!tar_header_write(ctx, "././@LongLink", 'L', 0, name_len + 1, 0) ||
+			!tar_write(ctx, name, name_len + 1) || !tar_pad(ctx, name_len + 1))
+			return false;
+	}
+
+	tar_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.name, name, name_len < sizeof(h.name) ? name_len : sizeof(h.name));
+	tar_number(h.mode, sizeof(h.mode), mode & 07777);
+	tar_number(h.uid, sizeof(h.uid), getuid());
+	tar_number(h.gid, sizeof(h.gid), getgid());
+	tar_number(h.size, sizeof(h.size), size);
+	tar_number(h.mtime, sizeof(h.mtime), mtime > 0 ? mtime : 0);
+	h.typeflag = type;
+	memcpy(h.magic, "ustar", 6);
+	memcpy(h.version, "00", 2);
+
+	memset(h.chksum, ' ', sizeof(h.chksum));
+	unsigned int sum = 0;
+	for (size_t i = 0; i < sizeof(h); i++)
+		sum += ((unsigned char *)&h)[i];
+	snprintf(h.chksum, sizeof(h.chksum), "%06o", sum);
+	return tar_write(ctx, &h, sizeof(h));
+}
+
+/** Write a file's header and contents; holes are written as zeros. */
+static bool tar_file(extract_ctx *ctx, a1fs_ino_t ino, const char *name)
+{
+	const a1fs_inode *inode = a1fs_inode_at(ctx->image, ino);
+	if (!tar_header_write(ctx, name, '0', out_mode(inode), inode->size, inode->mtime.tv_sec))
+		return false;
+
+	const a1fs_extent *table = extent_table(ctx, inode);
+	uint64_t pos = 0;
+	for (unsigned int i = 0; i < extent_count(inode) && pos < inode->size; i++)
+	{
+		uint64_t len = (uint64_t)extent_len(&table[i]) * A1FS_BLOCK_SIZE;
+		if (len > inode->size - pos)
+			len = inode->size - pos;
+		bool ok;
+		if (table[i].start == 0 || (table[i].count & A1FS_EXTENT_UNWRITTEN))
+			ok = tar_zeros(ctx, len);
+		else if (!extent_ok(ctx, &table[i]))
+		{
+			problem(ctx, "%s: extent %u is out of range; written as zeros", name, i);
+			ok = tar_zeros(ctx, len);
+		}
+		else
+			ok = tar_write(ctx, ctx->image + (size_t)table[i].start * A1FS_BLOCK_SIZE, len);
+		if (!ok)
+			return false;
+		pos += len;
+	}
+	// the size is already in the header
+	if (pos < inode->size)
+	{
+		problem(ctx, "%s: size is past the end of its extents; padded with zeros", name);
+		if (!tar_zeros(ctx, inode->size - pos))
+			return false;
+	}
+	atomic_fetch_add(&ctx->n_files, 1);
+	atomic_fetch_add(&ctx->bytes, inode->size);
+	return tar_pad(ctx, inode->size);
+}
+
+/** Walk state for tar_dentry(). */
+typedef struct tar_walk
+{
+	const char *dir;
+	/** Set on a write error, which ends the walk. */
+	bool failed;
+
+} tar_walk;
+
+static bool tar_tree(extract_ctx *ctx, a1fs_ino_t ino, const char *name);
+
+static bool tar_dentry(extract_ctx *ctx, const a1fs_dir_rec *d, void *arg)
+{
+	tar_walk *w = (tar_walk *)arg;
+	char *path = join_path(ctx, w->dir, d->name);
+	if (path == NULL)
+		return true;
+	if (!inode_ok(ctx, d->ino))
+		problem(ctx, "%s: inode %u is damaged; skipped", path, d->ino);
+	else if (claim_inode(ctx, d->ino, path) && !tar_tree(ctx, d->ino, path))
+		w->failed = true;
+	free(path);
+	return !w->failed;
+}
+
+/**
+ * Write an inode and everything below it to the tar stream.
+ *
+ * @return  false on a write error.
+ */
+static bool tar_tree(extract_ctx *ctx, a1fs_ino_t ino, const char *name)
+{
+	const a1fs_inode *inode = a1fs_inode_at(ctx->image, ino);
+	if (S_ISREG(inode->mode))
+		return tar_file(ctx, ino, name);
+
+	// directory names end with a slash; the top one is "./"
+	char dir_name[PATH_MAX + 1];
+	snprintf(dir_name, sizeof(dir_name), "%s/", *name != '\0' ? name : ".");
+	if (!tar_header_write(ctx, dir_name, '5', out_mode(inode), 0, inode->mtime.tv_sec))
+		return false;
+	atomic_fetch_add(&ctx->n_dirs, 1);
+	tar_walk w = {name, false};
+	for_each_dentry(ctx, inode, tar_dentry, &w);
+	return !w.failed;
+}
+
+/** Write an inode of the image as a tar stream to stdout. */
+static void extract_to_tar(extract_ctx *ctx, a1fs_ino_t ino, const char *img_path)
+{
+	ctx->buf = malloc(TAR_BUF_SIZE);
+	if (ctx->buf == NULL)
+	{
+		problem(ctx, "out of memory");
+		return;
+	}
+	ctx->seen[ino] = 1;
+	const char *slash = strrchr(img_path, '/');
+	const char *name = S_ISDIR(a1fs_inode_at(ctx->image, ino)->mode) ? "" : slash != NULL ? slash + 1 : img_path;
+	// the end of the archive is two zero blocks
+	if (!tar_tree(ctx, ino, name) || !tar_zeros(ctx, 2 * TAR_BLOCK) || !tar_flush(ctx))
+		problem(ctx, "stdout: %s", strerror(errno));
+	free(ctx->buf);
+}
+
+
+/** Check the superblock fields the extractor relies on. */
+static bool superblock_ok(const extract_ctx *ctx)
+{
+	const a1fs_superblock *sb = ctx->sb;
+	if (sb->magic != A1FS_MAGIC)
+	{
+		fprintf(stderr, "Image does not contain a1fs\n");
+		return false;
+	}
+	if (!a1fs_features_ok(sb))
+	{
+		fprintf(stderr, "Image uses unsupported features (0x%x)\n", sb->features);
+		return false;
+	}
+	if ((uint64_t)sb->blocks_count * A1FS_BLOCK_SIZE > ctx->size || sb->first_data_block >= sb->blocks_count ||
+		sb->inodes_count == 0 ||
+		!a1fs_inode_layout_ok(sb))
+	{
+		fprintf(stderr, "Superblock is damaged; run fsck.a1fs\n");
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	extract_opts opts = {
+		.path = "/",
+		.n_threads = cpus > 0 ? (cpus < EXTRACT_MAX_THREADS ? cpus : EXTRACT_MAX_THREADS) : 1,
+	};
+	if (!parse_args(argc, argv, &opts))
+	{
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help)
+	{
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	extract_ctx ctx = {0};
+	ctx.image = map_file(opts.img_path, A1FS_BLOCK_SIZE, &ctx.size);
+	if (ctx.image == NULL)
+		return 1;
+	ctx.sb = (a1fs_superblock *)ctx.image;
+	ctx.img_fd = -1;
+
+	int ret = 1;
+	a1fs_ino_t ino;
+	if (!superblock_ok(&ctx))
+		goto end;
+	ctx.seen = calloc(ctx.sb->inodes_count, 1);
+	if (ctx.seen == NULL)
+	{
+		perror("calloc");
+		goto end;
+	}
+	if (!resolve(&ctx, opts.path, &ino))
+		goto end;
+
+	if (opts.tar)
+		extract_to_tar(&ctx, ino, opts.path);
+	else
+	{
+		ctx.img_fd = open(opts.img_path, O_RDONLY);
+		if (ctx.img_fd < 0)
+		{
+			perror(opts.img_path);
+			goto end;
+		}
+		extract_to_dir(&ctx, ino, opts.path, opts.out_dir, opts.n_threads);
+	}
+
+	if (opts.verbose)
+	{
+		fprintf(stderr, "%lu files, %lu directories, %llu bytes, %lu problem%s\n", atomic_load(&ctx.n_files),
+				atomic_load(&ctx.n_dirs), atomic_load(&ctx.bytes), atomic_load(&ctx.errors),
+				atomic_load(&ctx.errors) == 1 ? "" : "s");
+	}
+	ret = atomic_load(&ctx.errors) > 0 ? 1 : 0;
+
+end:
+	if (ctx.img_fd >= 0)
+		close(ctx.img_fd);
+	free_items(&ctx.files);
+	free_items(&ctx.dirs);
+	free(ctx.seen);
+	munmap(ctx.image, ctx.size);
+	return ret;
+}
@@ -0,0 +1,101 @@
+/**
+ * a1fs image formatting implementation.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "a1fs.h"
+#include "format.h"
+#include "helper.h"
+
+
+bool fs_format(void *image, size_t size, size_t n_inodes, unsigned int features)
+{
+	//NOTE: the mode of the root directory inode should be set to S_IFDIR | 0777
+	if (image == NULL || size == 0 || n_inodes == 0)
+	{
+		return false;
+	}
+	uint64_t magic = A1FS_MAGIC;
+	size = (uint64_t)size;
+	unsigned int blocks_count = size / A1FS_BLOCK_SIZE;
+	unsigned int block_bitmap_count = ceil_divide(blocks_count, A1FS_BLOCK_SIZE * 8);
+	unsigned int inodes_count = n_inodes;
+	unsigned int inode_table_count = ceil_divide((sizeof(struct a1fs_inode) * inodes_count), A1FS_BLOCK_SIZE);
+	// The inode bitmap also covers the inodes that inode table chunks can add
+	// later, as far as the image has blocks for them
+	uint64_t max_inodes = (uint64_t)(inode_table_count + A1FS_INODE_CHUNKS_MAX * A1FS_INODE_CHUNK_BLOCKS) * A1FS_INODES_PER_BLOCK;
+	if (max_inodes > (uint64_t)blocks_count * A1FS_INODES_PER_BLOCK)
+		max_inodes = (uint64_t)blocks_count * A1FS_INODES_PER_BLOCK;
+	if (max_inodes < n_inodes)
+		max_inodes = n_inodes;
+	unsigned int inode_bitmap_count = ceil_divide(max_inodes, A1FS_BLOCK_SIZE * 8);
+
+	unsigned int first_ino_bitmap = 1;
+	unsigned int first_blo_bitmap = inode_bitmap_count + 1;
+	unsigned int first_ino = first_blo_bitmap + block_bitmap_count;
+	unsigned int first_data_block = first_ino + inode_table_count;
+
+	unsigned int free_blocks_count = blocks_count - inode_bitmap_count - block_bitmap_count - inode_table_count - 2;
+	unsigned int free_inodes_count = n_inodes - 1;
+
+	if (blocks_count < inode_bitmap_count + inode_table_count + block_bitmap_count + 2)
+		return false;
+	a1fs_superblock sb = {magic, size, first_ino_bitmap, first_blo_bitmap, first_ino, first_data_block, inode_bitmap_count, block_bitmap_count, inode_table_count, inodes_count, blocks_count, free_blocks_count, free_inodes_count,
+						  // only the root directory's extent table block has been used so far
+						  first_data_block + 1, 0, {0},
+						  // the rest of the inode table is initialized as it is used
+						  inode_table_count > 1 ? A1FS_INODES_PER_BLOCK : 0, 0, features};
+	if (!a1fs_features_ok(&sb))
+		return false;
+	// Only the metadata is written; the rest of the image is left as it is
+	// (see format.h)
+	memset(image, 0, A1FS_BLOCK_SIZE);
+	memcpy(image, &sb, sizeof(sb));
+	memset(image + A1FS_BLOCK_SIZE, 0, (inode_bitmap_count + block_bitmap_count) * A1FS_BLOCK_SIZE);
+	// the superblock, bitmaps, inode table and the root directory's extent table
+	unsigned int total = first_data_block + 1;
+	char *block_bitmap = (char *)(image + first_blo_bitmap * A1FS_BLOCK_SIZE);
+	char *inode_bitmap = (char *)(image + first_ino_bitmap * A1FS_BLOCK_SIZE);
+	memset(block_bitmap, 0xff, total / 8);
+	if (total % 8 != 0)
+		block_bitmap[total / 8] = (1 << total % 8) - 1;
+	memset(image + (size_t)first_ino * A1FS_BLOCK_SIZE, 0, A1FS_BLOCK_SIZE);
+	memset(image + (size_t)first_data_block * A1FS_BLOCK_SIZE, 0, A1FS_BLOCK_SIZE);
+
+	struct a1fs_inode *root = (struct a1fs_inode *)(image + first_ino * A1FS_BLOCK_SIZE);
+	root->mode = S_IFDIR | 0777;
+	root->links = 2;
+	root->size = 0;
+	clock_gettime(CLOCK_REALTIME, &(root->mtime));
+	root->inode = 0;
+	root->entry_count = 0;
+	root->num_extents = 0;
+	root->extent_table = first_ino + inode_table_count;
+	root->num_extents = 0;
+	inode_bitmap[0] |= 1 << 0;
+	
+	
+	return true;
+}
+
+bool fs_parse_dir_format(const char *name, unsigned int *features)
+{
+	if (strcmp(name, "fixed") == 0)
+		*features = 0;
+	else if (strcmp(name, "var") == 0)
+		*features = A1FS_FEATURE_DIRENT;
+	else if (strcmp(name, "hash") == 0)
+		*features = A1FS_FEATURE_DIRENT | A1FS_FEATURE_DIRENT_HASH;
+	else
+		return false;
+	return true;
+}
+
+const char *fs_dir_format_name(unsigned int features)
+{
+	if (!(features & A1FS_FEATURE_DIRENT))
+		return "fixed";
+	return (features & A1FS_FEATURE_DIRENT_HASH) ? "hash" : "var";
+}
@@ -0,0 +1,47 @@
+/**
+ * a1fs image formatting header file.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/**
+ * Format the image into an empty a1fs file system.
+ *
+ * The superblock, bitmaps and inode table are laid out from the start of the
+ * image, followed by the root directory's extent table block.
+ *
+ * Only the superblock, the bitmaps, the first inode table block and the root
+ * directory's extent table are written, so formatting takes the same time for
+ * any image size. The rest of the inode table is initialized as inodes are
+ * allocated. The data blocks are taken to be zeros (see clean_block_start in
+ * a1fs.h), as in a new sparse file; if they may not be, the caller has to zero
+ * them or clear the clean watermark.
+ *
+ * NOTE: Must update mtime of the root directory.
+ *
+ * @param image     pointer to the start of the image.
+ * @param size      image size in bytes.
+ * @param n_inodes  number of inodes.
+ * @param features  A1FS_FEATURE_* flags, e.g. the directory entry format.
+ * @return          true on success;
+ *                  false on error, e.g. the image is too small or the
+ *                  features are unknown.
+ */
+bool fs_format(void *image, size_t size, size_t n_inodes, unsigned int features);
+
+/**
+ * Parse the name of a directory entry format: "fixed" for a1fs_dentry (no
+ * features), "var" for a1fs_dirent, or "hash" for a1fs_dirent with name hashes.
+ *
+ * @param name      format name.
+ * @param features  pointer to the variable that receives the feature flags.
+ * @return          true on success; false if the name is unknown.
+ */
+bool fs_parse_dir_format(const char *name, unsigned int *features);
+
+/** Get the name of the directory entry format that the features select. */
+const char *fs_dir_format_name(unsigned int features);
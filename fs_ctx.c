@@ -16,11 +16,17 @@
  * CSC369 Assignment 1 - File system runtime context implementation.
  */
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "fs_ctx.h"
 #include "a1fs.h"
 #include "fs_ctx.h"
-#include "options.h"
 #include "map.h"
+#include "dalloc.h"
+#include "grow.h"
+#include "ncache.h"
 
 bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
 {
@@ -32,14 +38,88 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
 
 	//extract the super block from image address
 	struct a1fs_superblock *sb = (struct a1fs_superblock *)image;
+	if (size < A1FS_BLOCK_SIZE || sb->magic != A1FS_MAGIC || sb->size > size || !a1fs_inode_layout_ok(sb) ||
+		!a1fs_features_ok(sb))
+		return false;
 	fs->inode_bitmap_pointer = (unsigned char *)(image + sb->first_ino_bitmap * A1FS_BLOCK_SIZE);
 	fs->block_bitmap_pointer = (unsigned char *)(image + sb->first_blo_bitmap * A1FS_BLOCK_SIZE);
-	fs->inode_pointer = (unsigned char *)(image + sb->first_ino * A1FS_BLOCK_SIZE);
+	fs->img_path = NULL;
+	fs->delalloc = true;
+	fs->dalloc_bufs = NULL;
+	fs->dalloc_bytes = 0;
+	fs->reserved_blocks = 0;
+	fs->discard = NULL;
+	fs->trace = NULL;
+	fs->pins = NULL;
+	fs->n_pins = 0;
+	memset(&fs->stats, 0, sizeof(fs->stats));
+	fs->stats_file = NULL;
+
+	// Blocks past the clean watermark have never been allocated since mkfs;
+	// everything else may hold stale data
+	size_t bitmap_size = (sb->blocks_count + 7) / 8;
+	fs->dirty_bitmap = malloc(bitmap_size);
+	if (fs->dirty_bitmap == NULL)
+		return false;
+	memset(fs->dirty_bitmap, 0xff, bitmap_size);
+	unsigned int clean = sb->clean_block_start;
+	if (clean == 0)
+		clean = sb->blocks_count;
+	for (; clean < sb->blocks_count && clean % 8 != 0; clean++)
+	{
+		fs->dirty_bitmap[clean / 8] &= ~(1 << clean % 8);
+	}
+	if (clean < sb->blocks_count)
+		memset(fs->dirty_bitmap + clean / 8, 0, bitmap_size - clean / 8);
+	// last, so that a failed init leaves nothing to free
+	ncache_init(fs);
 	return true;
 }
 
+int fs_ctx_grow(fs_ctx *fs, void *image, size_t size)
+{
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)image;
+	fs->image = image;
+	fs->size = size;
+	fs->inode_bitmap_pointer = (unsigned char *)(image + sb->first_ino_bitmap * A1FS_BLOCK_SIZE);
+	fs->block_bitmap_pointer = (unsigned char *)(image + sb->first_blo_bitmap * A1FS_BLOCK_SIZE);
+
+	unsigned int old_count = sb->blocks_count;
+	unsigned char *dirty = realloc(fs->dirty_bitmap, (size / A1FS_BLOCK_SIZE + 7) / 8);
+	if (dirty == NULL)
+		return -ENOMEM;
+	fs->dirty_bitmap = dirty;
+	int ret = fs_grow(image, size);
+	if (ret != 0)
+		return ret;
+	fs->block_bitmap_pointer = (unsigned char *)(image + sb->first_blo_bitmap * A1FS_BLOCK_SIZE);
+
+	// New blocks are zeros, except for a moved block bitmap, which the clean
+	// watermark is past
+	for (size_t i = old_count; i < sb->blocks_count; i++)
+	{
+		if (sb->clean_block_start == 0 || i < sb->clean_block_start)
+			dirty[i / 8] |= 1 << i % 8;
+		else
+			dirty[i / 8] &= ~(1 << i % 8);
+	}
+	return 0;
+}
+
 void fs_ctx_destroy(fs_ctx *fs)
 {
 	//TODO: cleanup any resources allocated in fs_ctx_init()
-	(void)fs;
+	// Buffers must have been flushed by now; whatever is left is dropped
+	while (fs->dalloc_bufs != NULL)
+	{
+		dalloc_discard(fs, fs->dalloc_bufs->ino);
+	}
+	free(fs->dirty_bitmap);
+	fs->dirty_bitmap = NULL;
+	ncache_destroy(fs);
+	free(fs->pins);
+	fs->pins = NULL;
+	fs->n_pins = 0;
+	free(fs->img_path);
+	fs->img_path = NULL;
 }
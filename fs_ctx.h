@@ -18,13 +18,12 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 
-#include "options.h"
 #include "a1fs.h"
-#include "fs_ctx.h"
-#include "options.h"
 #include "map.h"
+#include "stats.h"
 
 
 /**
@@ -35,14 +34,46 @@ typedef struct fs_ctx {
 	void *image;
 	/** Image size in bytes. */
 	size_t size;
+	/** Image file path, for growing the image; NULL if not known. */
+	char *img_path;
 
 	//TODO: useful runtime state of the mounted file system should be cached
 	// here (NOT in global variables in a1fs.c)
 	unsigned char* inode_bitmap_pointer; 	/* pointer to inode bitmap */
 	unsigned char* block_bitmap_pointer;	/* pointer to block bitmap */
-	unsigned char* inode_pointer;	/* pointer to inode table */
 	unsigned char* data_block_pointer;	/* pointer to data block */
 
+	/** Whether appends go through delayed allocation (see dalloc.h). */
+	bool delalloc;
+	/** Delayed allocation buffers, one per file with buffered appends. */
+	struct dalloc_buf *dalloc_bufs;
+	/** Total number of bytes held in delayed allocation buffers. */
+	size_t dalloc_bytes;
+	/** Free blocks reserved for buffered data; not allocated yet. */
+	unsigned int reserved_blocks;
+	/**
+	 * Blocks that may hold non-zero data, one bit per block. Freed blocks are
+	 * not zeroed; they are zeroed when next allocated if their bit is set.
+	 */
+	unsigned char *dirty_bitmap;
+	/** Discard queue (see discard.h); NULL unless mounted with -o discard. */
+	struct discard_ctx *discard;
+	/** Operation trace (see trace.h); NULL unless mounted with -o trace. */
+	struct trace_ctx *trace;
+	/** Negative lookup cache (see ncache.h); NULL if out of memory. */
+	struct ncache_ctx *ncache;
+	/**
+	 * References to each inode by inode number (see fs_pin()); NULL until the
+	 * first. An unlinked inode with references is kept until they are gone.
+	 */
+	uint64_t *pins;
+	/** Number of inodes pins has room for. */
+	size_t n_pins;
+	/** Operation and engine statistics (see stats.h). */
+	fs_stats stats;
+	/** File that SIGUSR1 appends the statistics to; NULL for stderr. */
+	const char *stats_file;
+
 
 } fs_ctx;
 
@@ -56,6 +87,19 @@ typedef struct fs_ctx {
  */
 bool fs_ctx_init(fs_ctx *fs, void *image, size_t size);
 
+/**
+ * Grow the file system into a larger mapping of the image (see grow.h) and
+ * update the context to match.
+ *
+ * @param fs     pointer to the context to update.
+ * @param image  pointer to the start of the image, remapped at the new size.
+ * @param size   new image size in bytes.
+ * @return       0 on success; -errno on error, as fs_grow() or ENOMEM. On
+ *               error the file system is unchanged, but the context points
+ *               to the new mapping.
+ */
+int fs_ctx_grow(fs_ctx *fs, void *image, size_t size);
+
 /**
  * Destroy file system context.
  *
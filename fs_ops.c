@@ -0,0 +1,1668 @@
+/**
+ * a1fs file system operations (liba1fs) implementation.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <linux/falloc.h>
+
+#include "fs_ops.h"
+#include "helper.h"
+#include "dalloc.h"
+#include "trace.h"
+
+
+bool fs_mount(fs_ctx *fs, const char *img_path, const fs_mount_opts *opts)
+{
+	fs_mount_opts defaults = {0};
+	if (opts == NULL)
+		opts = &defaults;
+
+	size_t size;
+	void *image = map_file(img_path, A1FS_BLOCK_SIZE, &size);
+	if (!image)
+		return false;
+
+	if (!fs_ctx_init(fs, image, size))
+	{
+		munmap(image, size);
+		return false;
+	}
+	fs->img_path = strdup(img_path);
+	fs->delalloc = !opts->nodelalloc;
+	if (opts->discard && !discard_init(fs, img_path))
+	{
+		fs_ctx_destroy(fs);
+		munmap(image, size);
+		return false;
+	}
+	if (opts->trace_path != NULL && !trace_init(fs, opts->trace_path))
+	{
+		discard_destroy(fs);
+		fs_ctx_destroy(fs);
+		munmap(image, size);
+		return false;
+	}
+	return true;
+}
+
+void fs_start(fs_ctx *fs)
+{
+	discard_start(fs);
+	trace_start(fs);
+}
+
+void fs_unmount(fs_ctx *fs)
+{
+	if (fs->image == NULL)
+		return;
+	// pins do not outlive the mount; free what only they kept
+	for (size_t i = 0; i < fs->n_pins; i++)
+	{
+		fs_unpin(fs, i, fs->pins[i]);
+	}
+	dalloc_flush_all(fs);
+	discard_destroy(fs);
+	trace_destroy(fs);
+	munmap(fs->image, fs->size);
+	fs_ctx_destroy(fs);
+	fs->image = NULL;
+}
+
+/**
+ * Read the inode with given number.
+ *
+ * @param fs     file system context.
+ * @param ino    inode number.
+ * @param inode  pointer to the inode that receives the result.
+ * @return       0 on success; -ENOENT if the inode is not in use.
+ */
+static int get_inode(fs_ctx *fs, a1fs_ino_t ino, struct a1fs_inode *inode)
+{
+	if (get_inode_by_inodenumber(fs, ino, inode) != 0)
+		return -ENOENT;
+	return 0;
+}
+
+/**
+ * Read the inode of a regular file.
+ *
+ * @param fs     file system context.
+ * @param ino    inode number of the file.
+ * @param inode  pointer to the inode that receives the result.
+ * @return       0 on success; -EISDIR for a directory; -errno on error.
+ */
+static int get_file_inode(fs_ctx *fs, a1fs_ino_t ino, struct a1fs_inode *inode)
+{
+	int ret = get_inode(fs, ino, inode);
+	if (ret != 0)
+		return ret;
+	if (S_ISDIR(inode->mode))
+		return -EISDIR;
+	return 0;
+}
+
+/**
+ * Read the inode of a directory.
+ *
+ * @param fs     file system context.
+ * @param ino    inode number of the directory.
+ * @param inode  pointer to the inode that receives the result.
+ * @return       0 on success; -ENOTDIR if not a directory; -errno on error.
+ */
+static int get_dir_inode(fs_ctx *fs, a1fs_ino_t ino, struct a1fs_inode *inode)
+{
+	int ret = get_inode(fs, ino, inode);
+	if (ret != 0)
+		return ret;
+	if (!S_ISDIR(inode->mode))
+		return -ENOTDIR;
+	return 0;
+}
+
+/**
+ * Check that a new file or directory can be created in a directory.
+ *
+ * @param fs      file system context.
+ * @param parent  inode number of the directory.
+ * @param name    name of the new entry.
+ * @param inode   pointer to the inode that receives the directory.
+ * @return        0 on success; -errno on error.
+ */
+static int check_new_entry(fs_ctx *fs, a1fs_ino_t parent, const char *name, struct a1fs_inode *inode)
+{
+	// only the root directory has an empty name
+	if (name[0] == '\0')
+		return -EEXIST;
+	if (strlen(name) >= A1FS_NAME_MAX)
+		return -ENAMETOOLONG;
+	int ret = get_dir_inode(fs, parent, inode);
+	if (ret != 0)
+		return ret;
+	dentry_ref ref;
+	if (find_dentry(fs, inode, name, &ref))
+		return -EEXIST;
+	return 0;
+}
+
+/**
+ * Look up the parent directory of a path.
+ *
+ * @param fs      file system context.
+ * @param path    path to a file or directory.
+ * @param parent  pointer to the variable that receives the inode number.
+ * @return        0 on success; -errno on error.
+ */
+static int lookup_parent(fs_ctx *fs, const char *path, a1fs_ino_t *parent)
+{
+	if (strlen(path) >= A1FS_PATH_MAX)
+		return -ENAMETOOLONG;
+	return fs_lookup(fs, get_path(path), parent);
+}
+
+int fs_statfs(fs_ctx *fs, struct statvfs *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->f_bsize = A1FS_BLOCK_SIZE;
+	st->f_frsize = A1FS_BLOCK_SIZE;
+	st->f_namemax = A1FS_NAME_MAX;
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+	fsblkcnt_t f_blocks = sb->blocks_count;		 /* Blocks count */
+	fsblkcnt_t f_bfree = get_avail_blocks(fs);	 /* Free blocks count */
+	fsblkcnt_t f_bavail = get_avail_blocks(fs); /* Free blocks count */
+	fsfilcnt_t f_files = sb->inodes_count;		 /* Inodes count */
+	fsfilcnt_t f_ffree = sb->free_inodes_count;	 /* Free inodes count */
+	fsfilcnt_t f_favail = sb->free_inodes_count; /* Free inodes count */
+	st->f_blocks = f_blocks;
+	st->f_bfree = f_bfree;
+	st->f_bavail = f_bavail;
+	st->f_files = f_files;
+	st->f_ffree = f_ffree;
+	st->f_favail = f_favail;
+
+	return 0;
+}
+
+int fs_lookup(fs_ctx *fs, const char *path, a1fs_ino_t *ino)
+{
+	struct a1fs_inode inode;
+	int ret = get_inode_by_path(fs, path, &inode);
+	if (ret != 0)
+		return ret;
+	*ino = inode.inode;
+	return 0;
+}
+
+int fs_lookup_at(fs_ctx *fs, a1fs_ino_t parent, const char *name, a1fs_ino_t *ino)
+{
+	if (strlen(name) >= A1FS_NAME_MAX)
+		return -ENAMETOOLONG;
+	struct a1fs_inode dir;
+	int ret = get_dir_inode(fs, parent, &dir);
+	if (ret != 0)
+		return ret;
+	fs->stats.lookups++;
+	dentry_ref ref;
+	if (!find_dentry(fs, &dir, name, &ref))
+		return -ENOENT;
+	*ino = ref.rec.ino;
+	return 0;
+}
+
+uint32_t fs_generation(fs_ctx *fs, a1fs_ino_t ino)
+{
+	struct a1fs_inode inode;
+	if (get_inode(fs, ino, &inode) != 0)
+		return 0;
+	return inode.generation;
+}
+
+int fs_getattr(fs_ctx *fs, const char *path, struct stat *st)
+{
+	a1fs_ino_t ino;
+	int ret = fs_lookup(fs, path, &ino);
+	return ret != 0 ? ret : fs_getattr_ino(fs, ino, st);
+}
+
+/**
+ * Fill in the attributes of a file or directory from its inode.
+ *
+ * @param fs     file system context.
+ * @param inode  the inode.
+ * @param st     pointer to the struct stat that receives the result.
+ */
+static void fill_stat(fs_ctx *fs, struct a1fs_inode *inode, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_ino = inode->inode;
+	st->st_mode = inode->mode;	 /** File mode. */
+	st->st_nlink = inode->links; /* Reference count (number of hard links). */
+	st->st_size = dalloc_size(fs, inode);	/** File size in bytes. */
+	// holes are not backed by blocks; the extent table block is counted as
+	// metadata, and blocks reserved for buffered appends as data
+	uint64_t blocks = get_allocated_blocks(fs, inode) + 1;
+	dalloc_buf *dabuf = dalloc_find(fs, inode->inode);
+	if (dabuf != NULL)
+		blocks += dabuf->reserved;
+	st->st_blocks = blocks * (A1FS_BLOCK_SIZE / 512);
+	st->st_mtim = (struct timespec)inode->mtime;
+}
+
+int fs_getattr_ino(fs_ctx *fs, a1fs_ino_t ino, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	struct a1fs_inode inode;
+	int ret = get_inode(fs, ino, &inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	fill_stat(fs, &inode, st);
+	return 0;
+}
+
+int fs_readdir(fs_ctx *fs, const char *path, off_t offset, void *buf, fs_filldir_t filler)
+{
+	a1fs_ino_t ino;
+	int ret = fs_lookup(fs, path, &ino);
+	return ret != 0 ? ret : fs_readdir_ino(fs, ino, offset, buf, filler);
+}
+
+int fs_readdir_ino(fs_ctx *fs, a1fs_ino_t ino, off_t offset, void *buf, fs_filldir_t filler)
+{
+	struct a1fs_inode dir_inode;
+	int ret = get_dir_inode(fs, ino, &dir_inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	if (offset < 0)
+	{
+		return -EINVAL;
+	}
+	// a full buffer ends this call; the caller resumes from the offset of
+	// the last entry it took
+	struct stat st;
+	if (offset == 0)
+	{
+		fill_stat(fs, &dir_inode, &st);
+		if (filler(buf, ".", &st, 1) != 0)
+			return 0;
+	}
+	if (offset <= 1 && filler(buf, "..", NULL, 2) != 0)
+		return 0;
+
+	// An entry's offset is its position in the directory, in slots, plus 2
+	// (after "." and ".."); each entry is passed with the offset of the slot
+	// after it, where a listing resumed from it goes on. Skip the blocks
+	// before the first slot to list without reading them
+	uint32_t features = get_features(fs);
+	uint64_t slot = offset > 2 ? (uint64_t)offset - 2 : 0;
+	uint64_t per_block = A1FS_BLOCK_SIZE / a1fs_dir_slot_size(features);
+	uint64_t first = 0; // slot number of the first entry in the extent
+	struct a1fs_extent *extents = (struct a1fs_extent *)(fs->image + (size_t)dir_inode.extent_table * A1FS_BLOCK_SIZE);
+	for (uint32_t i = 0; i < dir_inode.num_extents; first += extent_len(&extents[i]) * per_block, i++)
+	{
+		uint64_t len = extent_len(&extents[i]);
+		if (extent_is_hole(&extents[i]) || slot >= first + len * per_block)
+		{
+			continue;
+		}
+		for (uint64_t b = slot > first ? (slot - first) / per_block : 0; b < len; b++)
+		{
+			unsigned char *block = get_blk(fs, extents[i].start + b);
+			uint64_t base = first + b * per_block;
+			a1fs_dir_rec rec = {0};
+			while (a1fs_dir_next(features, block, &rec))
+			{
+				uint64_t pos = base + rec.off / a1fs_dir_slot_size(features);
+				if (rec.ino == 0 || pos < slot)
+				{
+					continue;
+				}
+				// the attributes come from the inode table, with no path lookup
+				struct a1fs_inode inode;
+				bool have_stat = get_inode(fs, rec.ino, &inode) == 0;
+				if (have_stat)
+					fill_stat(fs, &inode, &st);
+				if (filler(buf, rec.name, have_stat ? &st : NULL, pos + 3) != 0)
+					return 0;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Undo the allocation of an inode and its extent table block, for a new file
+ * or directory that could not be linked into its parent.
+ *
+ * @param fs   file system context.
+ * @param ino  inode number.
+ */
+static void release_new_inode(fs_ctx *fs, a1fs_ino_t ino)
+{
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+	struct a1fs_inode *inode = a1fs_inode_at(fs->image, ino);
+	free_blk_range(fs, inode->extent_table, 1);
+	update_bitmap_by_index(fs->inode_bitmap_pointer, ino, 0);
+	sb->free_inodes_count++;
+	memset(inode, 0, sizeof(struct a1fs_inode));
+}
+
+/**
+ * Free a file or directory that has been unlinked from its parent: its data
+ * blocks, its extent table block and its inode. Buffered appends to a file are
+ * dropped along with it. An inode that is still pinned (see fs_pin()) is only
+ * marked as having no links; fs_unpin() frees it when the last pin goes.
+ *
+ * @param fs     file system context.
+ * @param inode  the inode, as read before it was unlinked.
+ */
+static void free_inode(fs_ctx *fs, const struct a1fs_inode *inode)
+{
+	if (inode->inode < fs->n_pins && fs->pins[inode->inode] > 0)
+	{
+		a1fs_inode_at(fs->image, inode->inode)->links = 0;
+		return;
+	}
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+	if (!S_ISDIR(inode->mode))
+		dalloc_discard(fs, inode->inode);
+	struct a1fs_extent *extent_table = get_extent_table(fs, inode);
+	for (unsigned int i = 0; i < inode->num_extents; i++)
+	{
+		free_extent(fs, &extent_table[i]);
+	}
+	free_blk_range(fs, inode->extent_table, 1);
+	update_bitmap_by_index(fs->inode_bitmap_pointer, inode->inode, 0);
+	sb->free_inodes_count++;
+	memset(a1fs_inode_at(fs->image, inode->inode), 0, sizeof(struct a1fs_inode));
+}
+
+int fs_pin(fs_ctx *fs, a1fs_ino_t ino, uint64_t n)
+{
+	if (ino >= fs->n_pins)
+	{
+		// room for every inode, so that this rarely has to grow again
+		struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+		size_t count = sb->inodes_count > ino ? sb->inodes_count : (size_t)ino + 1;
+		uint64_t *pins = realloc(fs->pins, count * sizeof(uint64_t));
+		if (pins == NULL)
+			return -ENOMEM;
+		memset(pins + fs->n_pins, 0, (count - fs->n_pins) * sizeof(uint64_t));
+		fs->pins = pins;
+		fs->n_pins = count;
+	}
+	fs->pins[ino] += n;
+	return 0;
+}
+
+void fs_unpin(fs_ctx *fs, a1fs_ino_t ino, uint64_t n)
+{
+	if (ino >= fs->n_pins || fs->pins[ino] == 0)
+		return;
+	fs->pins[ino] = n < fs->pins[ino] ? fs->pins[ino] - n : 0;
+	// an inode unlinked while pinned has no links left
+	struct a1fs_inode inode;
+	if (fs->pins[ino] == 0 && get_inode(fs, ino, &inode) == 0 && inode.links == 0)
+		free_inode(fs, &inode);
+}
+
+int fs_mkdir(fs_ctx *fs, const char *path, mode_t mode)
+{
+	a1fs_ino_t parent, ino;
+	int ret = lookup_parent(fs, path, &parent);
+	return ret != 0 ? ret : fs_mkdir_at(fs, parent, get_name(path), mode, &ino);
+}
+
+int fs_mkdir_at(fs_ctx *fs, a1fs_ino_t parent, const char *dir_name, mode_t mode, a1fs_ino_t *ino)
+{
+	mode = mode | S_IFDIR;
+
+	struct a1fs_inode parent_inode;
+	int ret = check_new_entry(fs, parent, dir_name, &parent_inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+
+	if (get_avail_blocks(fs) < 2)
+	{
+		return -ENOSPC;
+	}
+
+	unsigned char *inode_bitmap = fs->inode_bitmap_pointer;
+
+	// may take blocks for a new inode table chunk
+	int new_ino = get_free_ino(fs);
+	if (new_ino == -1)
+	{
+		return -ENOSPC;
+	}
+	int new_blk = alloc_blk(fs);
+	if (new_blk == -1)
+	{
+		return -ENOSPC;
+	}
+
+	update_bitmap_by_index(inode_bitmap, new_ino, 1);
+	sb->free_inodes_count--;
+	struct a1fs_inode *new_inode = a1fs_inode_at(fs->image, new_ino);
+	new_inode->mode = mode;
+	new_inode->links = 2;
+	new_inode->size = 0;
+	clock_gettime(CLOCK_REALTIME, &(new_inode->mtime));
+	new_inode->inode = new_ino;
+	new_inode->entry_count = 0;
+	new_inode->num_extents = 0;
+	new_inode->extent_table = new_blk;
+	new_inode->generation = sb->next_generation++;
+
+	ret = add_dentry(fs, &parent_inode, dir_name, new_ino);
+	if (ret != 0)
+	{
+		release_new_inode(fs, new_ino);
+		return ret;
+	}
+
+	// Update parant inode attribute
+	parent_inode.links++;
+	parent_inode.size += dentry_size(fs, dir_name);
+	clock_gettime(CLOCK_REALTIME, &(parent_inode.mtime));
+	parent_inode.entry_count++;
+	memcpy(a1fs_inode_at(fs->image, parent_inode.inode), &parent_inode, sizeof(struct a1fs_inode));
+
+	*ino = new_ino;
+	return 0;
+}
+
+int fs_rmdir(fs_ctx *fs, const char *path)
+{
+	a1fs_ino_t ino, parent;
+	int ret = fs_lookup(fs, path, &ino);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	if (ino == 0)
+	{
+		return -EBUSY;
+	}
+	ret = lookup_parent(fs, path, &parent);
+	return ret != 0 ? ret : fs_rmdir_at(fs, parent, get_name(path));
+}
+
+int fs_rmdir_at(fs_ctx *fs, a1fs_ino_t parent, const char *dir_name)
+{
+	struct a1fs_inode parent_inode;
+	int ret = get_dir_inode(fs, parent, &parent_inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	dentry_ref ref;
+	if (!find_dentry(fs, &parent_inode, dir_name, &ref))
+	{
+		return -ENOENT;
+	}
+	struct a1fs_inode dir_inode;
+	ret = get_dir_inode(fs, ref.rec.ino, &dir_inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	// Check if dir is empty
+	if (dir_inode.links > 2 || dir_inode.entry_count > 0)
+	{
+		return -ENOTEMPTY;
+	}
+
+	// Empty dentry; frees its block if it was the last entry in it
+	remove_dentry(fs, &parent_inode, &ref);
+	parent_inode.links--;
+	parent_inode.size -= dentry_size(fs, dir_name);
+	clock_gettime(CLOCK_REALTIME, &(parent_inode.mtime));
+	parent_inode.entry_count--;
+	memcpy(a1fs_inode_at(fs->image, parent_inode.inode), &parent_inode, sizeof(struct a1fs_inode));
+
+	free_inode(fs, &dir_inode);
+	return 0;
+}
+
+int fs_create(fs_ctx *fs, const char *path, mode_t mode)
+{
+	a1fs_ino_t parent, ino;
+	int ret = lookup_parent(fs, path, &parent);
+	return ret != 0 ? ret : fs_create_at(fs, parent, get_name(path), mode, &ino);
+}
+
+int fs_create_at(fs_ctx *fs, a1fs_ino_t parent, const char *file_name, mode_t mode, a1fs_ino_t *ino)
+{
+	assert(S_ISREG(mode));
+	(void)mode; // only regular files are created
+
+	struct a1fs_inode parent_inode;
+	int ret = check_new_entry(fs, parent, file_name, &parent_inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+	if (get_avail_blocks(fs) < 2)
+	{
+		return -ENOSPC;
+	}
+	unsigned char *inode_bitmap = fs->inode_bitmap_pointer;
+	// get the next free inode / block
+	int new_ino = get_free_ino(fs);
+	if (new_ino == -1)
+	{
+		return -ENOSPC;
+	}
+	int new_blk = alloc_blk(fs);
+	if (new_blk == -1)
+	{
+		return -ENOSPC;
+	}
+	// update the bitmap
+	update_bitmap_by_index(inode_bitmap, new_ino, 1);
+	sb->free_inodes_count--;
+	// create new inode for the file
+	struct a1fs_inode *new_inode = a1fs_inode_at(fs->image, new_ino);
+	new_inode->mode = S_IFREG;
+	new_inode->links = 1;
+	new_inode->size = 0;
+	clock_gettime(CLOCK_REALTIME, &(new_inode->mtime));
+	new_inode->inode = new_ino;
+	new_inode->num_extents = 0;
+	new_inode->extent_table = new_blk;
+	new_inode->generation = sb->next_generation++;
+	*ino = new_ino;
+	ret = add_dentry(fs, &parent_inode, file_name, new_ino);
+	if (ret != 0)
+	{
+		release_new_inode(fs, new_ino);
+		return ret;
+	}
+	parent_inode.entry_count++;
+	parent_inode.size += dentry_size(fs, file_name);
+	clock_gettime(CLOCK_REALTIME, &(parent_inode.mtime));
+	// write the parent inode into the image
+	memcpy(a1fs_inode_at(fs->image, parent_inode.inode), &parent_inode, sizeof(struct a1fs_inode));
+	return 0;
+}
+
+int fs_unlink(fs_ctx *fs, const char *path)
+{
+	a1fs_ino_t ino, parent;
+	// the root directory has no parent to remove it from
+	int ret = fs_lookup(fs, path, &ino);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	if (ino == 0)
+	{
+		return -EISDIR;
+	}
+	ret = lookup_parent(fs, path, &parent);
+	return ret != 0 ? ret : fs_unlink_at(fs, parent, get_name(path));
+}
+
+int fs_unlink_at(fs_ctx *fs, a1fs_ino_t parent, const char *file_name)
+{
+	struct a1fs_inode parent_inode;
+	int ret = get_dir_inode(fs, parent, &parent_inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	dentry_ref ref;
+	if (!find_dentry(fs, &parent_inode, file_name, &ref))
+	{
+		return -ENOENT;
+	}
+	struct a1fs_inode file_inode;
+	ret = get_file_inode(fs, ref.rec.ino, &file_inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	// reset the file's dentry; frees its block if it was the last entry in it
+	remove_dentry(fs, &parent_inode, &ref);
+	parent_inode.size -= dentry_size(fs, file_name);
+	clock_gettime(CLOCK_REALTIME, &(parent_inode.mtime));
+	parent_inode.entry_count--;
+	memcpy(a1fs_inode_at(fs->image, parent_inode.inode), &parent_inode, sizeof(struct a1fs_inode));
+
+	// buffered appends are dropped along with the file
+	free_inode(fs, &file_inode);
+	return 0;
+}
+
+/**
+ * Check if a directory is dir itself or anywhere in its subtree. Directories
+ * store no ".." entry to walk up from, so the subdirectories of dir are
+ * searched instead, breadth first, which only reads the subtree being moved.
+ *
+ * @param fs   file system context.
+ * @param dir  inode number of the directory at the top of the subtree.
+ * @param ino  inode number of the directory to look for.
+ * @return     1 if ino is in the subtree, 0 if not; -errno on error.
+ */
+static int in_subtree(fs_ctx *fs, a1fs_ino_t dir, a1fs_ino_t ino)
+{
+	if (dir == ino)
+		return 1;
+	// each directory is queued once, as directories form a tree
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+	a1fs_ino_t *queue = malloc(sb->inodes_count * sizeof(a1fs_ino_t));
+	if (queue == NULL)
+		return -ENOMEM;
+	uint32_t features = get_features(fs);
+	size_t head = 0, tail = 0;
+	queue[tail++] = dir;
+	int found = 0;
+	while (head < tail && !found)
+	{
+		struct a1fs_inode dir_inode;
+		if (get_inode(fs, queue[head++], &dir_inode) != 0)
+			continue;
+		struct a1fs_extent *table = get_extent_table(fs, &dir_inode);
+		for (unsigned int i = 0; i < dir_inode.num_extents && !found; i++)
+		{
+			for (a1fs_blk_t b = 0; !extent_is_hole(&table[i]) && b < extent_len(&table[i]) && !found; b++)
+			{
+				unsigned char *block = get_blk(fs, table[i].start + b);
+				a1fs_dir_rec rec = {0};
+				while (a1fs_dir_next(features, block, &rec))
+				{
+					struct a1fs_inode inode;
+					if (rec.ino == 0 || get_inode(fs, rec.ino, &inode) != 0 || !S_ISDIR(inode.mode))
+						continue;
+					if (rec.ino == ino)
+					{
+						found = 1;
+						break;
+					}
+					if (tail < sb->inodes_count)
+						queue[tail++] = rec.ino;
+				}
+			}
+		}
+	}
+	free(queue);
+	return found;
+}
+
+int fs_rename(fs_ctx *fs, const char *from, const char *to, unsigned int flags)
+{
+	a1fs_ino_t ino, parent, new_parent;
+	int ret = fs_lookup(fs, from, &ino);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	// the root directory cannot be moved or replaced
+	if (ino == 0 || strcmp(to, "/") == 0)
+	{
+		return -EBUSY;
+	}
+	// nor can a directory be moved into itself or its own subtree; the same
+	// goes for the other directory of an exchange
+	size_t from_len = strlen(from), to_len = strlen(to);
+	if ((strncmp(to, from, from_len) == 0 && to[from_len] == '/') ||
+		((flags & RENAME_EXCHANGE) && strncmp(from, to, to_len) == 0 && from[to_len] == '/'))
+	{
+		return -EINVAL;
+	}
+	ret = lookup_parent(fs, from, &parent);
+	if (ret == 0)
+	{
+		ret = lookup_parent(fs, to, &new_parent);
+	}
+	// get_name() returns a static buffer, so take both names in place
+	return ret != 0 ? ret : fs_rename_at(fs, parent, strrchr(from, '/') + 1, new_parent, strrchr(to, '/') + 1, flags);
+}
+
+int fs_rename_at(fs_ctx *fs, a1fs_ino_t parent, const char *name, a1fs_ino_t new_parent, const char *new_name,
+				 unsigned int flags)
+{
+	if ((flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) != 0 ||
+		((flags & RENAME_NOREPLACE) && (flags & RENAME_EXCHANGE)))
+	{
+		return -EINVAL;
+	}
+	// only the root directory has an empty name
+	if (name[0] == '\0' || new_name[0] == '\0')
+	{
+		return -EBUSY;
+	}
+	if (strlen(new_name) >= A1FS_NAME_MAX)
+	{
+		return -ENAMETOOLONG;
+	}
+	// a move within one directory makes all its changes to one copy of it
+	struct a1fs_inode old_dir, new_dir_buf;
+	struct a1fs_inode *new_dir = &old_dir;
+	int ret = get_dir_inode(fs, parent, &old_dir);
+	if (ret == 0 && new_parent != parent)
+	{
+		new_dir = &new_dir_buf;
+		ret = get_dir_inode(fs, new_parent, new_dir);
+	}
+	if (ret != 0)
+	{
+		return ret;
+	}
+	dentry_ref from, to;
+	if (!find_dentry(fs, &old_dir, name, &from))
+	{
+		return -ENOENT;
+	}
+	struct a1fs_inode inode, target;
+	ret = get_inode(fs, from.rec.ino, &inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	// a directory cannot be moved into itself or its own subtree
+	if (S_ISDIR(inode.mode) && new_parent != parent)
+	{
+		ret = in_subtree(fs, inode.inode, new_parent);
+		if (ret != 0)
+		{
+			return ret < 0 ? ret : -EINVAL;
+		}
+	}
+	bool exists = find_dentry(fs, new_dir, new_name, &to);
+	if (exists && (flags & RENAME_NOREPLACE))
+	{
+		return -EEXIST;
+	}
+	if (!exists && (flags & RENAME_EXCHANGE))
+	{
+		return -ENOENT;
+	}
+	// there are no hard links, so this is the same entry
+	if (exists && to.rec.ino == from.rec.ino)
+	{
+		return 0;
+	}
+	if (exists)
+	{
+		ret = get_inode(fs, to.rec.ino, &target);
+		if (ret != 0)
+		{
+			return ret;
+		}
+		if (flags & RENAME_EXCHANGE)
+		{
+			// nor can the other directory of an exchange
+			if (S_ISDIR(target.mode) && new_parent != parent)
+			{
+				ret = in_subtree(fs, target.inode, parent);
+				if (ret != 0)
+				{
+					return ret < 0 ? ret : -EINVAL;
+				}
+			}
+		}
+		else if (S_ISDIR(inode.mode) && !S_ISDIR(target.mode))
+		{
+			return -ENOTDIR;
+		}
+		else if (!S_ISDIR(inode.mode) && S_ISDIR(target.mode))
+		{
+			return -EISDIR;
+		}
+		else if (S_ISDIR(target.mode) && (target.links > 2 || target.entry_count > 0))
+		{
+			return -ENOTEMPTY;
+		}
+	}
+
+	// Only entries change; the data and inodes of what is moved stay put
+	uint32_t features = get_features(fs);
+	int moved_dirs = S_ISDIR(inode.mode) ? 1 : 0;
+	int target_dirs = exists && S_ISDIR(target.mode) ? 1 : 0;
+	if (flags & RENAME_EXCHANGE)
+	{
+		// the two entries swap inodes; names and sizes stay the same
+		a1fs_dir_set_ino(features, get_blk(fs, from.blk), from.rec.off, target.inode);
+		a1fs_dir_set_ino(features, get_blk(fs, to.blk), to.rec.off, inode.inode);
+		old_dir.links += target_dirs - moved_dirs;
+		new_dir->links += moved_dirs - target_dirs;
+	}
+	else
+	{
+		if (exists)
+		{
+			// the replaced entry is reused, so nothing is allocated
+			a1fs_dir_set_ino(features, get_blk(fs, to.blk), to.rec.off, inode.inode);
+		}
+		else
+		{
+			ret = add_dentry(fs, new_dir, new_name, inode.inode);
+			if (ret != 0)
+			{
+				return ret;
+			}
+			new_dir->size += dentry_size(fs, new_name);
+			new_dir->entry_count++;
+			// the new entry may have taken free space after the old one
+			if (new_dir == &old_dir)
+			{
+				find_dentry(fs, &old_dir, name, &from);
+			}
+		}
+		remove_dentry(fs, &old_dir, &from);
+		old_dir.size -= dentry_size(fs, name);
+		old_dir.entry_count--;
+		old_dir.links -= moved_dirs;
+		new_dir->links += moved_dirs - target_dirs;
+	}
+	clock_gettime(CLOCK_REALTIME, &(old_dir.mtime));
+	new_dir->mtime = old_dir.mtime;
+	memcpy(a1fs_inode_at(fs->image, old_dir.inode), &old_dir, sizeof(struct a1fs_inode));
+	if (new_dir != &old_dir)
+	{
+		memcpy(a1fs_inode_at(fs->image, new_dir->inode), new_dir, sizeof(struct a1fs_inode));
+	}
+	if (exists && !(flags & RENAME_EXCHANGE))
+	{
+		free_inode(fs, &target);
+	}
+	return 0;
+}
+
+int fs_utimens(fs_ctx *fs, const char *path, const struct timespec times[2])
+{
+	a1fs_ino_t ino;
+	int ret = fs_lookup(fs, path, &ino);
+	return ret != 0 ? ret : fs_utimens_ino(fs, ino, times);
+}
+
+int fs_utimens_ino(fs_ctx *fs, a1fs_ino_t ino, const struct timespec times[2])
+{
+	struct a1fs_inode inode;
+	int ret = get_inode(fs, ino, &inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	// if there is time
+	if (times)
+	{
+		inode.mtime.tv_sec = times[1].tv_sec;
+		inode.mtime.tv_nsec = times[1].tv_nsec;
+		memcpy(a1fs_inode_at(fs->image, inode.inode), &inode, sizeof(struct a1fs_inode));
+	}
+	else
+	// if no input time
+	{
+		clock_gettime(CLOCK_REALTIME, &(inode.mtime));
+		memcpy(a1fs_inode_at(fs->image, inode.inode), &inode, sizeof(struct a1fs_inode));
+	}
+	return 0;
+}
+
+/**
+ * Set the size of the file described by inode.
+ *
+ * Growing the file only records a hole over the part of the new range that is
+ * not mapped yet, so no blocks are allocated or zeroed until the range is
+ * written; blocks preallocated past the old end of file (FALLOC_FL_KEEP_SIZE)
+ * stay, and writes fill them in place. Shrinking releases every
+ * block past the new end of file and zeroes the tail of the new last block,
+ * so that a later extension reads back zeros. The caller must write the inode
+ * back into the inode table.
+ *
+ * @param fs     file system context.
+ * @param inode  inode of the file.
+ * @param size   new file size in bytes.
+ * @return       0 on success; -errno on error.
+ */
+static int set_inode_size(fs_ctx *fs, struct a1fs_inode *inode, uint64_t size)
+{
+	uint64_t new_blocks = (size + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+	if (new_blocks > A1FS_EXTENT_LEN_MAX)
+	{
+		return -EFBIG;
+	}
+	uint64_t file_blocks = get_file_blocks(fs, inode);
+
+	// Extend: cover the new range past the mapped blocks with a hole
+	if (size >= inode->size)
+	{
+		if (new_blocks > file_blocks)
+		{
+			struct a1fs_extent hole = {0, new_blocks - file_blocks};
+			int ret = replace_extent_range(fs, inode, file_blocks, hole.count, hole);
+			if (ret != 0)
+			{
+				return ret;
+			}
+		}
+	}
+	// Shrink: release the blocks past the new end of file
+	else if (new_blocks < file_blocks)
+	{
+		struct a1fs_extent none = {0, 0};
+		free_extent_range(fs, inode, new_blocks, file_blocks - new_blocks);
+		replace_extent_range(fs, inode, new_blocks, file_blocks - new_blocks, none);
+	}
+
+	// Bytes past the end of file in the last block must read back as zeros
+	if (size < inode->size && size % A1FS_BLOCK_SIZE != 0)
+	{
+		a1fs_blk_t offset;
+		int idx = find_extent(fs, inode, size / A1FS_BLOCK_SIZE, &offset);
+		struct a1fs_extent *extent = &get_extent_table(fs, inode)[idx];
+		if (!extent_is_hole(extent) && !extent_is_unwritten(extent))
+		{
+			unsigned char *block = fs->image + (size_t)(extent->start + offset) * A1FS_BLOCK_SIZE;
+			memset(block + size % A1FS_BLOCK_SIZE, 0, A1FS_BLOCK_SIZE - size % A1FS_BLOCK_SIZE);
+		}
+	}
+	inode->size = size;
+	clock_gettime(CLOCK_REALTIME, &(inode->mtime));
+	return 0;
+}
+
+int fs_truncate(fs_ctx *fs, const char *path, off_t size)
+{
+	a1fs_ino_t ino;
+	int ret = fs_lookup(fs, path, &ino);
+	return ret != 0 ? ret : fs_truncate_ino(fs, ino, size);
+}
+
+int fs_truncate_ino(fs_ctx *fs, a1fs_ino_t ino, off_t size)
+{
+	if (size < 0)
+	{
+		return -EINVAL;
+	}
+	struct a1fs_inode file_inode;
+	int ret = get_file_inode(fs, ino, &file_inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	// buffered appends must be on disk before the extents change, unless
+	// they are all cut off (which also works when they cannot be flushed)
+	dalloc_buf *dabuf = dalloc_find(fs, file_inode.inode);
+	if (dabuf != NULL && (uint64_t)size <= dabuf->start)
+	{
+		dalloc_discard(fs, file_inode.inode);
+	}
+	ret = dalloc_flush(fs, file_inode.inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	get_inode_by_inodenumber(fs, file_inode.inode, &file_inode);
+	ret = set_inode_size(fs, &file_inode, size);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	memcpy(a1fs_inode_at(fs->image, file_inode.inode), &file_inode, sizeof(struct a1fs_inode));
+	return 0;
+}
+
+int fs_read(fs_ctx *fs, const char *path, char *buf, size_t size, off_t offset)
+{
+	a1fs_ino_t ino;
+	int ret = fs_lookup(fs, path, &ino);
+	return ret != 0 ? ret : fs_read_ino(fs, ino, buf, size, offset);
+}
+
+int fs_read_ino(fs_ctx *fs, a1fs_ino_t ino, char *buf, size_t size, off_t offset)
+{
+	struct a1fs_inode inode;
+	// find the file inode we want to read
+	int ret = get_file_inode(fs, ino, &inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	if (offset < 0)
+	{
+		return -EINVAL;
+	}
+	uint64_t file_size = dalloc_size(fs, &inode);
+	if ((uint64_t)offset >= file_size)
+	{
+		return 0;
+	}
+	if (size > file_size - offset)
+	{
+		size = file_size - offset;
+	}
+	struct a1fs_extent *extent_table = get_extent_table(fs, &inode);
+	size_t done = 0;
+	while (done < size)
+	{
+		uint64_t pos = offset + done;
+		size_t block_offset = pos % A1FS_BLOCK_SIZE;
+		size_t n = A1FS_BLOCK_SIZE - block_offset;
+		if (n > size - done)
+		{
+			n = size - done;
+		}
+		a1fs_blk_t extent_offset;
+		int idx = find_extent(fs, &inode, pos / A1FS_BLOCK_SIZE, &extent_offset);
+		// holes and unwritten extents read as zeros
+		if (idx < 0 || extent_is_hole(&extent_table[idx]) || extent_is_unwritten(&extent_table[idx]))
+		{
+			memset(buf + done, 0, n);
+		}
+		else
+		{
+			unsigned char *block = fs->image + (size_t)(extent_table[idx].start + extent_offset) * A1FS_BLOCK_SIZE;
+			memcpy(buf + done, block + block_offset, n);
+		}
+		done += n;
+	}
+	// appended data that is not on disk yet
+	dalloc_read(fs, inode.inode, buf, size, offset);
+	return size;
+}
+
+int fs_write(fs_ctx *fs, const char *path, const char *buf, size_t size, off_t offset)
+{
+	if (size == 0)
+		return 0;
+	if (offset < 0)
+		return -EINVAL;
+	a1fs_ino_t ino;
+	int ret = fs_lookup(fs, path, &ino);
+	return ret != 0 ? ret : fs_write_ino(fs, ino, buf, size, offset);
+}
+
+int fs_write_ino(fs_ctx *fs, a1fs_ino_t ino, const char *buf, size_t size, off_t offset)
+{
+	if (size == 0)
+		return 0;
+	if (offset < 0)
+		return -EINVAL;
+	struct a1fs_inode file_inode;
+	// find the file inode we want to write
+	int ret = get_file_inode(fs, ino, &file_inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	// appends are buffered and allocated later in one piece
+	int buffered = dalloc_write(fs, &file_inode, buf, size, offset);
+	if (buffered != 0)
+	{
+		return buffered;
+	}
+	// a write past EOF extends the file with a hole first
+	uint64_t old_size = file_inode.size;
+	uint64_t old_blocks = get_file_blocks(fs, &file_inode);
+	if (file_inode.size < size + offset)
+	{
+		ret = set_inode_size(fs, &file_inode, size + offset);
+		if (ret != 0)
+		{
+			return ret;
+		}
+	}
+	struct a1fs_extent *extent_table = get_extent_table(fs, &file_inode);
+	size_t done = 0;
+	ret = 0;
+	while (done < size)
+	{
+		uint64_t pos = offset + done;
+		uint64_t lblk = pos / A1FS_BLOCK_SIZE;
+		size_t block_offset = pos % A1FS_BLOCK_SIZE;
+		size_t n = A1FS_BLOCK_SIZE - block_offset;
+		if (n > size - done)
+		{
+			n = size - done;
+		}
+		a1fs_blk_t extent_offset;
+		int idx = find_extent(fs, &file_inode, lblk, &extent_offset);
+		struct a1fs_extent extent = extent_table[idx];
+		a1fs_blk_t blk = extent.start + extent_offset;
+
+		// Only the written range of the block is copied; holes and unwritten
+		// blocks need the rest of the block zeroed and a written mapping
+		if (extent_is_hole(&extent) || extent_is_unwritten(&extent))
+		{
+			if (extent_is_hole(&extent))
+			{
+				int new_blk = alloc_blk_near(fs, get_goal_blk(fs, &file_inode, lblk));
+				if (new_blk == -1)
+				{
+					ret = -ENOSPC;
+					break;
+				}
+				blk = new_blk;
+			}
+			struct a1fs_extent written = {blk, 1};
+			ret = replace_extent_range(fs, &file_inode, lblk, 1, written);
+			if (ret != 0)
+			{
+				if (extent_is_hole(&extent))
+					free_blk_range(fs, blk, 1);
+				break;
+			}
+			zero_new_blk(fs, blk, block_offset, block_offset + n);
+		}
+		memcpy(fs->image + (size_t)blk * A1FS_BLOCK_SIZE + block_offset, buf + done, n);
+		done += n;
+	}
+	// A short or failed write only extends the file up to what it wrote; the
+	// hole added past that is dropped again
+	if (done < size && file_inode.size > old_size)
+	{
+		uint64_t end = offset + done;
+		file_inode.size = done > 0 && end > old_size ? end : old_size;
+		uint64_t keep = (file_inode.size + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+		if (keep < old_blocks)
+		{
+			keep = old_blocks;
+		}
+		uint64_t file_blocks = get_file_blocks(fs, &file_inode);
+		if (file_blocks > keep)
+		{
+			struct a1fs_extent none = {0, 0};
+			replace_extent_range(fs, &file_inode, keep, file_blocks - keep, none);
+		}
+	}
+	clock_gettime(CLOCK_REALTIME, &(file_inode.mtime));
+	memcpy(a1fs_inode_at(fs->image, file_inode.inode), &file_inode, sizeof(struct a1fs_inode));
+	return done > 0 ? (int)done : ret;
+}
+
+/**
+ * Zero out len bytes of a file starting at offset. The range must lie within
+ * a single block. Holes and unwritten blocks already read as zeros and are
+ * left alone.
+ *
+ * @param fs      file system context.
+ * @param inode   inode of the file.
+ * @param offset  offset from the beginning of the file.
+ * @param len     number of bytes to zero.
+ */
+static void zero_file_bytes(fs_ctx *fs, struct a1fs_inode *inode, uint64_t offset, size_t len)
+{
+	if (len == 0)
+		return;
+	a1fs_blk_t extent_offset;
+	int idx = find_extent(fs, inode, offset / A1FS_BLOCK_SIZE, &extent_offset);
+	if (idx < 0)
+		return;
+	struct a1fs_extent *extent = &get_extent_table(fs, inode)[idx];
+	if (!extent_is_hole(extent) && !extent_is_unwritten(extent))
+	{
+		unsigned char *block = fs->image + (size_t)(extent->start + extent_offset) * A1FS_BLOCK_SIZE;
+		memset(block + offset % A1FS_BLOCK_SIZE, 0, len);
+	}
+}
+
+int fs_fallocate(fs_ctx *fs, const char *path, int mode, off_t offset, off_t length)
+{
+	a1fs_ino_t ino;
+	int ret = fs_lookup(fs, path, &ino);
+	return ret != 0 ? ret : fs_fallocate_ino(fs, ino, mode, offset, length);
+}
+
+int fs_fallocate_ino(fs_ctx *fs, a1fs_ino_t ino, int mode, off_t offset, off_t length)
+{
+	if (offset < 0 || length <= 0)
+		return -EINVAL;
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	if ((mode & FALLOC_FL_PUNCH_HOLE) &&
+		(!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE)))
+		return -EOPNOTSUPP;
+
+	uint64_t end = (uint64_t)offset + length;
+	uint64_t first_blk = offset / A1FS_BLOCK_SIZE;
+	uint64_t end_blk = (end + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+	if (end_blk > A1FS_EXTENT_LEN_MAX)
+		return -EFBIG;
+
+	struct a1fs_inode file_inode;
+	int ret = get_file_inode(fs, ino, &file_inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	ret = dalloc_flush(fs, file_inode.inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	get_inode_by_inodenumber(fs, file_inode.inode, &file_inode);
+
+	// Blocks only partially covered by the range keep their mapping; the
+	// covered bytes are zeroed in place
+	uint64_t full_start = (offset + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+	uint64_t full_end = end / A1FS_BLOCK_SIZE;
+	if (mode & FALLOC_FL_PUNCH_HOLE)
+	{
+		if (full_start < full_end)
+		{
+			ret = punch_extent_range(fs, &file_inode, full_start, full_end - full_start);
+		}
+	}
+	else
+	{
+		ret = prealloc_extent_range(fs, &file_inode, first_blk, end_blk - first_blk);
+		if (ret == 0 && (mode & FALLOC_FL_ZERO_RANGE) && full_start < full_end)
+		{
+			ret = unwrite_extent_range(fs, &file_inode, full_start, full_end - full_start);
+		}
+	}
+	if (ret == 0 && (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)))
+	{
+		if (full_start > full_end)
+		{
+			// the whole range lies within one block
+			zero_file_bytes(fs, &file_inode, offset, length);
+		}
+		else
+		{
+			zero_file_bytes(fs, &file_inode, offset, full_start * A1FS_BLOCK_SIZE - offset);
+			zero_file_bytes(fs, &file_inode, full_end * A1FS_BLOCK_SIZE, end - full_end * A1FS_BLOCK_SIZE);
+		}
+	}
+	if (ret == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && end > file_inode.size)
+	{
+		file_inode.size = end;
+	}
+	if (ret == 0 && (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)))
+	{
+		clock_gettime(CLOCK_REALTIME, &(file_inode.mtime));
+	}
+	// the extent table may have changed even on failure
+	memcpy(a1fs_inode_at(fs->image, file_inode.inode), &file_inode, sizeof(struct a1fs_inode));
+	return ret;
+}
+
+int fs_getxattr(fs_ctx *fs, const char *path, const char *name, char *value, size_t size)
+{
+	a1fs_ino_t ino;
+	int ret = fs_lookup(fs, path, &ino);
+	return ret != 0 ? ret : fs_getxattr_ino(fs, ino, name, value, size);
+}
+
+int fs_getxattr_ino(fs_ctx *fs, a1fs_ino_t ino, const char *name, char *value, size_t size)
+{
+	struct a1fs_inode inode;
+	int ret = get_inode(fs, ino, &inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	if (strcmp(name, "user.a1fs.extents") != 0)
+		return -ENODATA;
+	char str[16];
+	int len = snprintf(str, sizeof(str), "%u", inode.num_extents);
+	if (size == 0)
+		return len;
+	if (size < (size_t)len)
+		return -ERANGE;
+	memcpy(value, str, len);
+	return len;
+}
+
+/** Count the runs of mapped blocks of a file that are contiguous on disk. */
+static unsigned int count_fragments(fs_ctx *fs, const struct a1fs_inode *inode)
+{
+	struct a1fs_extent *table = get_extent_table(fs, inode);
+	unsigned int fragments = 0;
+	a1fs_blk_t prev_end = 0;
+	for (unsigned int i = 0; i < inode->num_extents; i++)
+	{
+		if (extent_is_hole(&table[i]))
+			continue;
+		if (table[i].start != prev_end)
+			fragments++;
+		prev_end = table[i].start + extent_len(&table[i]);
+	}
+	return fragments;
+}
+
+/**
+ * Build the extent list of a file whose mapped blocks are placed one after
+ * another starting at start, or left where they are if start is 0.
+ * Return the number of extents in the list
+ */
+static unsigned int defrag_extent_list(fs_ctx *fs, const struct a1fs_inode *inode, a1fs_blk_t start,
+									   struct a1fs_extent *list)
+{
+	struct a1fs_extent *table = get_extent_table(fs, inode);
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < inode->num_extents; i++)
+	{
+		struct a1fs_extent e = table[i];
+		if (start != 0 && !extent_is_hole(&e))
+		{
+			e.start = start;
+			start += extent_len(&e);
+		}
+		// never more extents than the table already has
+		extent_push(list, &n, e);
+	}
+	return n;
+}
+
+/**
+ * Pack the entries of a directory, in order, from the start of its first
+ * block. Each entry lands at or before its old place, so it never overwrites
+ * one still to be moved.
+ *
+ * @param fs      file system context.
+ * @param blks    block numbers of the directory, in directory order.
+ * @param blocks  number of blocks.
+ * @param write   false to only count the blocks the entries would fill.
+ * @return        number of blocks the packed entries fill.
+ */
+static uint64_t pack_dir(fs_ctx *fs, const a1fs_blk_t *blks, uint64_t blocks, bool write)
+{
+	uint32_t features = get_features(fs);
+	uint64_t to = 0;  // block being filled
+	uint32_t end = 0; // where the next entry goes in it
+	uint32_t last = 0;
+	for (uint64_t from = 0; from < blocks; from++)
+	{
+		unsigned char *src = get_blk(fs, blks[from]);
+		a1fs_dir_rec rec = {0};
+		while (a1fs_dir_next(features, src, &rec))
+		{
+			if (rec.ino == 0)
+				continue;
+			uint32_t size = a1fs_dirent_size(features, rec.name_len);
+			if (end + size > A1FS_BLOCK_SIZE)
+			{
+				// the last entry of a full block takes the rest of it
+				if (write)
+					a1fs_dir_set_len(features, get_blk(fs, blks[to]), last, A1FS_BLOCK_SIZE - last);
+				to++;
+				end = 0;
+			}
+			if (write && (to != from || end != rec.off))
+			{
+				// the source may overlap the destination
+				char name[A1FS_NAME_MAX];
+				memcpy(name, rec.name, rec.name_len + 1);
+				a1fs_dir_write(features, get_blk(fs, blks[to]), end, size, rec.ino, name);
+				// a fixed-size slot is freed; variable-length space left
+				// behind is taken by the last entry of the block or freed
+				if (!(features & A1FS_FEATURE_DIRENT))
+					a1fs_dir_write(features, src, rec.off, rec.len, 0, "");
+			}
+			else if (write)
+			{
+				a1fs_dir_set_len(features, src, rec.off, size);
+			}
+			last = end;
+			end += size;
+		}
+	}
+	if (end == 0)
+		return to;
+	if (write)
+		a1fs_dir_set_len(features, get_blk(fs, blks[to]), last, A1FS_BLOCK_SIZE - last);
+	return to + 1;
+}
+
+/**
+ * Repack the entries of a directory into its first blocks, keeping their
+ * order, and free the blocks left empty, if its entries take fewer than
+ * A1FS_DIR_REPACK_FILL percent of its space. The remaining blocks keep their
+ * place on disk, and holes left by freed blocks are dropped from the extent
+ * table.
+ *
+ * @param fs         file system context.
+ * @param dir_inode  inode of the directory; written back if changed.
+ * @param info       request flags; receives the layout before and after.
+ * @return           0 on success; -ENOMEM if out of memory.
+ */
+static int defrag_dir(fs_ctx *fs, struct a1fs_inode *dir_inode, a1fs_defrag_info *info)
+{
+	// a directory's size is the space its entries take
+	uint64_t blocks = get_allocated_blocks(fs, dir_inode);
+	info->extents_before = info->extents_after = dir_inode->num_extents;
+	info->fragments_before = info->fragments_after = count_fragments(fs, dir_inode);
+	info->blocks_moved = 0;
+	info->blocks_freed = 0;
+	if ((info->flags & A1FS_DEFRAG_QUERY) || blocks == 0 ||
+		dir_inode->size * 100 >= blocks * A1FS_BLOCK_SIZE * A1FS_DIR_REPACK_FILL)
+	{
+		return 0;
+	}
+
+	// Block numbers in directory order
+	a1fs_blk_t *blks = (a1fs_blk_t *)malloc(blocks * sizeof(a1fs_blk_t));
+	if (blks == NULL)
+	{
+		return -ENOMEM;
+	}
+	struct a1fs_extent *table = get_extent_table(fs, dir_inode);
+	uint64_t n = 0;
+	for (unsigned int i = 0; i < dir_inode->num_extents; i++)
+	{
+		for (a1fs_blk_t b = 0; !extent_is_hole(&table[i]) && b < extent_len(&table[i]); b++)
+			blks[n++] = table[i].start + b;
+	}
+	uint64_t needed = pack_dir(fs, blks, blocks, false);
+	if (needed >= blocks)
+	{
+		free(blks);
+		return 0;
+	}
+	pack_dir(fs, blks, blocks, true);
+
+	// The first blocks hold every entry now; never more extents than before
+	struct a1fs_extent list[A1FS_EXTENTS_MAX];
+	unsigned int count = 0;
+	for (uint64_t b = 0; b < needed; b++)
+	{
+		struct a1fs_extent e = {blks[b], 1};
+		extent_push(list, &count, e);
+	}
+	for (uint64_t b = needed; b < blocks; b++)
+	{
+		free_blk_range(fs, blks[b], 1);
+	}
+	free(blks);
+	memcpy(table, list, sizeof(struct a1fs_extent) * count);
+	dir_inode->num_extents = count;
+	memcpy(a1fs_inode_at(fs->image, dir_inode->inode), dir_inode, sizeof(struct a1fs_inode));
+
+	info->extents_after = count;
+	info->fragments_after = count_fragments(fs, dir_inode);
+	info->blocks_freed = blocks - needed;
+	return 0;
+}
+
+int fs_defrag(fs_ctx *fs, const char *path, a1fs_defrag_info *info)
+{
+	a1fs_ino_t ino;
+	int ret = fs_lookup(fs, path, &ino);
+	return ret != 0 ? ret : fs_defrag_ino(fs, ino, info);
+}
+
+int fs_defrag_ino(fs_ctx *fs, a1fs_ino_t ino, a1fs_defrag_info *info)
+{
+	struct a1fs_inode file_inode;
+	int ret = get_inode(fs, ino, &file_inode);
+	if (ret != 0)
+	{
+		return ret;
+	}
+	if (S_ISDIR(file_inode.mode))
+	{
+		return defrag_dir(fs, &file_inode, info);
+	}
+	if (!(info->flags & A1FS_DEFRAG_QUERY))
+	{
+		ret = dalloc_flush(fs, file_inode.inode);
+		if (ret != 0)
+		{
+			return ret;
+		}
+		get_inode_by_inodenumber(fs, file_inode.inode, &file_inode);
+	}
+	info->extents_before = info->extents_after = file_inode.num_extents;
+	info->fragments_before = info->fragments_after = count_fragments(fs, &file_inode);
+	info->blocks_moved = 0;
+	info->blocks_freed = 0;
+	if (info->flags & A1FS_DEFRAG_QUERY)
+	{
+		return 0;
+	}
+
+	struct a1fs_extent list[A1FS_EXTENTS_MAX];
+	bool move = info->fragments_before > 1;
+	if (!move && defrag_extent_list(fs, &file_inode, 0, list) == file_inode.num_extents)
+	{
+		return 0;
+	}
+
+	// The new extent table goes right before the data, in the same run
+	uint64_t blocks = move ? get_allocated_blocks(fs, &file_inode) : 0;
+	if (blocks + 1 > get_avail_blocks(fs))
+	{
+		return -ENOSPC;
+	}
+	int start = get_blk_by_length(fs, blocks + 1);
+	if (start == -1)
+	{
+		return -ENOSPC;
+	}
+	claim_blk_range(fs, start, blocks + 1);
+	a1fs_blk_t table_blk = start;
+	unsigned int n = defrag_extent_list(fs, &file_inode, move ? table_blk + 1 : 0, list);
+
+	// Copy the data; unwritten extents read as zeros wherever they are
+	struct a1fs_extent *old = get_extent_table(fs, &file_inode);
+	for (unsigned int i = 0, j = 0; move && i < file_inode.num_extents; i++)
+	{
+		if (extent_is_hole(&old[i]))
+			continue;
+		a1fs_blk_t len = extent_len(&old[i]);
+		a1fs_blk_t to = table_blk + 1 + j;
+		if (!extent_is_unwritten(&old[i]))
+		{
+			memcpy(fs->image + (size_t)to * A1FS_BLOCK_SIZE, fs->image + (size_t)old[i].start * A1FS_BLOCK_SIZE,
+				   (size_t)len * A1FS_BLOCK_SIZE);
+			for (a1fs_blk_t b = 0; b < len; b++)
+				update_bitmap_by_index(fs->dirty_bitmap, to + b, 1);
+		}
+		j += len;
+	}
+	struct a1fs_extent *table = (struct a1fs_extent *)(fs->image + (size_t)table_blk * A1FS_BLOCK_SIZE);
+	memset(table, 0, A1FS_BLOCK_SIZE);
+	memcpy(table, list, sizeof(struct a1fs_extent) * n);
+	update_bitmap_by_index(fs->dirty_bitmap, table_blk, 1);
+
+	// Switch to the new table, then release what the old one described
+	struct a1fs_inode old_inode = file_inode;
+	file_inode.extent_table = table_blk;
+	file_inode.num_extents = n;
+	memcpy(a1fs_inode_at(fs->image, file_inode.inode), &file_inode, sizeof(struct a1fs_inode));
+	if (move)
+	{
+		free_extent_range(fs, &old_inode, 0, get_file_blocks(fs, &old_inode));
+	}
+	free_blk_range(fs, old_inode.extent_table, 1);
+
+	info->extents_after = n;
+	info->fragments_after = count_fragments(fs, &file_inode);
+	info->blocks_moved = blocks;
+	return 0;
+}
+
+int fs_flush(fs_ctx *fs, const char *path)
+{
+	a1fs_ino_t ino;
+	if (fs_lookup(fs, path, &ino) != 0)
+	{
+		// already removed; unlink dropped its buffer
+		return 0;
+	}
+	return fs_flush_ino(fs, ino);
+}
+
+int fs_flush_ino(fs_ctx *fs, a1fs_ino_t ino)
+{
+	// nothing to do for an inode without a buffer, even one not in use
+	return dalloc_flush(fs, ino);
+}
+
+int fs_fsync(fs_ctx *fs, const char *path)
+{
+	int ret = fs_flush(fs, path);
+	if (ret != 0)
+		return ret;
+	if (msync(fs->image, fs->size, MS_SYNC) != 0)
+		return -EIO;
+	return 0;
+}
+
+int fs_fsync_ino(fs_ctx *fs, a1fs_ino_t ino)
+{
+	int ret = fs_flush_ino(fs, ino);
+	if (ret != 0)
+		return ret;
+	if (msync(fs->image, fs->size, MS_SYNC) != 0)
+		return -EIO;
+	return 0;
+}
+
+int fs_resize(fs_ctx *fs, uint64_t size)
+{
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+	if (size % A1FS_BLOCK_SIZE != 0 || size < sb->size)
+		return -EINVAL;
+	if (size == sb->size)
+		return 0;
+	if (size / A1FS_BLOCK_SIZE > UINT32_MAX)
+		return -EFBIG;
+	if (fs->img_path == NULL)
+		return -ENOTSUP;
+
+	// The image file may be longer than the file system; it ends up exactly
+	// as long as the new size
+	size_t old_size = fs->size;
+	int fd = open(fs->img_path, O_RDWR);
+	if (fd < 0)
+		return -errno;
+	int ret = ftruncate(fd, size) != 0 ? -errno : 0;
+	close(fd);
+	if (ret != 0)
+		return ret;
+	// Nothing holds pointers into the image between operations, so the
+	// mapping is free to move
+	void *image = mremap(fs->image, old_size, size, MREMAP_MAYMOVE);
+	if (image == MAP_FAILED)
+	{
+		ret = -errno;
+		if (truncate(fs->img_path, old_size) != 0)
+			perror(fs->img_path);
+		return ret;
+	}
+	ret = fs_ctx_grow(fs, image, size);
+	if (ret != 0)
+		return ret;
+	return msync(fs->image, fs->size, MS_SYNC) != 0 ? -EIO : 0;
+}
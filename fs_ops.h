@@ -0,0 +1,541 @@
+/**
+ * a1fs file system operations (liba1fs) header file.
+ *
+ * The file system engine as a C API over fs_ctx, independent of FUSE. The a1fs
+ * FUSE driver (a1fs.c) is a thin adapter on top of it; the same calls can be
+ * made in-process by benchmarks, batch tools, or any program embedding a1fs.
+ *
+ * All path arguments are absolute paths within the a1fs file system and start
+ * with a '/' that corresponds to the a1fs root directory. Paths to directories
+ * (except for the root directory - "/") do not end in a trailing '/'.
+ *
+ * Unlike FUSE callbacks, these functions do not rely on the caller having
+ * checked the path with a getattr() first. The context is not thread-safe;
+ * calls must be serialized by the caller.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "a1fs.h"
+#include "defrag.h"
+#include "fs_ctx.h"
+
+
+/** fs_rename() flags, as for renameat2(); older C libraries do not define them. */
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+/** Mount options. */
+typedef struct fs_mount_opts {
+	/** Allocate blocks at write time instead of delaying allocation. */
+	bool nodelalloc;
+	/** Punch freed blocks out of the image file. */
+	bool discard;
+	/** File to record an operation trace to (see trace.h); NULL for none. */
+	const char *trace_path;
+
+} fs_mount_opts;
+
+/**
+ * Function that receives the directory entries listed by fs_readdir(). Has the
+ * same signature as fuse_fill_dir_t, so a FUSE filler can be passed directly.
+ *
+ * @param buf   the buffer passed to fs_readdir().
+ * @param name  entry name.
+ * @param st    entry attributes, as from fs_getattr(); NULL for "..".
+ * @param off   offset of the next entry, to resume the listing from.
+ * @return      0 to continue; non-zero if the buffer is full.
+ */
+typedef int (*fs_filldir_t)(void *buf, const char *name, const struct stat *st, off_t off);
+
+
+/**
+ * Map an image file and initialize the file system context.
+ *
+ * @param fs        file system context to initialize.
+ * @param img_path  a1fs image file path.
+ * @param opts      mount options; NULL for defaults.
+ * @return          true on success; false on failure.
+ */
+bool fs_mount(fs_ctx *fs, const char *img_path, const fs_mount_opts *opts);
+
+/**
+ * Start background work (e.g. the discard and trace threads).
+ *
+ * Must be called in the process that serves requests; the FUSE driver calls it
+ * after daemonizing. Without it, background work is done synchronously.
+ *
+ * @param fs  file system context.
+ */
+void fs_start(fs_ctx *fs);
+
+/**
+ * Write out buffered data, unmap the image and destroy the context.
+ *
+ * @param fs  file system context.
+ */
+void fs_unmount(fs_ctx *fs);
+
+/**
+ * Get file system statistics, as statvfs() does.
+ *
+ * @param fs  file system context.
+ * @param st  pointer to the struct statvfs that receives the result.
+ * @return    0 on success; -errno on error.
+ */
+int fs_statfs(fs_ctx *fs, struct statvfs *st);
+
+/**
+ * Look up the inode number of a path.
+ *
+ * Errors:
+ *   ENAMETOOLONG  the path or one of its components is too long.
+ *   ENOENT        a component of the path does not exist.
+ *   ENOTDIR       a component of the path prefix is not a directory.
+ *
+ * @param fs    file system context.
+ * @param path  path to a file or directory.
+ * @param ino   pointer to the variable that receives the inode number.
+ * @return      0 on success; -errno on error.
+ */
+int fs_lookup(fs_ctx *fs, const char *path, a1fs_ino_t *ino);
+
+/**
+ * Get file or directory attributes, as lstat() does. st_dev, st_uid, st_gid,
+ * st_rdev, st_blksize, st_atim and st_ctim are not set. st_ino is the a1fs
+ * inode number.
+ *
+ * Errors: same as fs_lookup().
+ *
+ * @param fs    file system context.
+ * @param path  path to a file or directory.
+ * @param st    pointer to the struct stat that receives the result.
+ * @return      0 on success; -errno on error.
+ */
+int fs_getattr(fs_ctx *fs, const char *path, struct stat *st);
+
+/**
+ * List a directory. Calls filler(buf, name, st, off) for each entry, including
+ * "." and "..", with the attributes of the entry read straight from the inode
+ * table, so that listing with attributes costs no path lookups.
+ *
+ * "." is at offset 0, ".." at 1, and the entry at directory position i at
+ * i + 2, where the position is the entry's byte offset through the directory's
+ * extents in order, in units of a1fs_dir_slot_size() (an entry slot with fixed
+ * size entries). Each
+ * entry is passed the offset of the one after it. The listing starts at the
+ * given offset, and stops early without error when filler() returns non-zero
+ * (its buffer is full), so a long listing is read in parts, each resuming
+ * where the last one stopped. An offset stays valid while other entries are
+ * added or removed.
+ *
+ * Errors:
+ *   ENOTDIR  path is not a directory.
+ *   EINVAL   offset is negative.
+ *   and those of fs_lookup().
+ *
+ * @param fs      file system context.
+ * @param path    path to the directory.
+ * @param offset  offset of the first entry to list; 0 for all.
+ * @param buf     buffer passed to filler.
+ * @param filler  function called for each directory entry.
+ * @return        0 on success; -errno on error.
+ */
+int fs_readdir(fs_ctx *fs, const char *path, off_t offset, void *buf, fs_filldir_t filler);
+
+/**
+ * Create a directory.
+ *
+ * Errors:
+ *   EEXIST        path already exists.
+ *   ENOSPC        not enough free space in the file system.
+ *   ENAMETOOLONG  the new name is too long.
+ *   and those of fs_lookup() for the parent directory.
+ *
+ * @param fs    file system context.
+ * @param path  path to the directory to create.
+ * @param mode  file mode bits.
+ * @return      0 on success; -errno on error.
+ */
+int fs_mkdir(fs_ctx *fs, const char *path, mode_t mode);
+
+/**
+ * Remove an empty directory.
+ *
+ * Errors:
+ *   ENOTEMPTY  the directory is not empty.
+ *   ENOTDIR    path is not a directory.
+ *   EBUSY      path is the root directory.
+ *   and those of fs_lookup().
+ *
+ * @param fs    file system context.
+ * @param path  path to the directory to remove.
+ * @return      0 on success; -errno on error.
+ */
+int fs_rmdir(fs_ctx *fs, const char *path);
+
+/**
+ * Create a regular file.
+ *
+ * Errors: same as fs_mkdir().
+ *
+ * @param fs    file system context.
+ * @param path  path to the file to create.
+ * @param mode  file mode bits; must describe a regular file.
+ * @return      0 on success; -errno on error.
+ */
+int fs_create(fs_ctx *fs, const char *path, mode_t mode);
+
+/**
+ * Remove a file.
+ *
+ * Errors:
+ *   EISDIR  path is a directory.
+ *   and those of fs_lookup().
+ *
+ * @param fs    file system context.
+ * @param path  path to the file to remove.
+ * @return      0 on success; -errno on error.
+ */
+int fs_unlink(fs_ctx *fs, const char *path);
+
+/**
+ * Rename a file or directory, as renameat2() does.
+ *
+ * Only directory entries change: the entry is moved (or, if to exists, the
+ * entry of to is pointed at from's inode and what to named is freed), so
+ * renaming takes the same time for a file of any size, and a reader of to sees
+ * either the old or the new file. Moving a directory to another parent moves
+ * a link from one parent to the other. With RENAME_NOREPLACE, an existing to is
+ * an error; with RENAME_EXCHANGE, from and to must both exist and swap places.
+ *
+ * Errors:
+ *   EINVAL        flags are not valid, or from is a directory and to is in
+ *                 its subtree (or, with RENAME_EXCHANGE, the other way
+ *                 around).
+ *   ENOMEM        out of memory.
+ *   EBUSY         from or to is the root directory.
+ *   EEXIST        to exists and flags has RENAME_NOREPLACE.
+ *   ENOENT        from does not exist, or to does not and flags has
+ *                 RENAME_EXCHANGE.
+ *   ENOTDIR       from is a directory and to is not.
+ *   EISDIR        to is a directory and from is not.
+ *   ENOTEMPTY     to is a directory that is not empty.
+ *   ENOSPC        not enough free space for the new entry.
+ *   ENAMETOOLONG  the new name is too long.
+ *   and those of fs_lookup() for the parent directories.
+ *
+ * @param fs     file system context.
+ * @param from   path to the file or directory to rename.
+ * @param to     its new path.
+ * @param flags  0, RENAME_NOREPLACE or RENAME_EXCHANGE.
+ * @return       0 on success; -errno on error.
+ */
+int fs_rename(fs_ctx *fs, const char *from, const char *to, unsigned int flags);
+
+/**
+ * Change the modification time of a file or directory, as utimensat() does.
+ *
+ * Errors: same as fs_lookup().
+ *
+ * @param fs     file system context.
+ * @param path   path to the file or directory.
+ * @param times  timestamps array (times[1] is mtime); NULL for current time.
+ * @return       0 on success; -errno on error.
+ */
+int fs_utimens(fs_ctx *fs, const char *path, const struct timespec times[2]);
+
+/**
+ * Change the size of a file. Extending only records a hole, which reads as
+ * zeros.
+ *
+ * Errors:
+ *   EINVAL  size is negative.
+ *   EFBIG   size exceeds the maximum file size.
+ *   ENOSPC  not enough free space in the file system.
+ *   EISDIR  path is a directory.
+ *   and those of fs_lookup().
+ *
+ * @param fs    file system context.
+ * @param path  path to the file.
+ * @param size  new file size in bytes.
+ * @return      0 on success; -errno on error.
+ */
+int fs_truncate(fs_ctx *fs, const char *path, off_t size);
+
+/**
+ * Read data from a file, as pread() does. Holes read as zeros.
+ *
+ * Errors:
+ *   EINVAL  offset is negative.
+ *   EISDIR  path is a directory.
+ *   and those of fs_lookup().
+ *
+ * @param fs      file system context.
+ * @param path    path to the file.
+ * @param buf     pointer to the buffer that receives the data.
+ * @param size    number of bytes requested.
+ * @param offset  offset from the beginning of the file.
+ * @return        number of bytes read; 0 if offset is beyond EOF;
+ *                -errno on error.
+ */
+int fs_read(fs_ctx *fs, const char *path, char *buf, size_t size, off_t offset);
+
+/**
+ * Write data to a file, as pwrite() does, extending it if needed.
+ *
+ * Errors:
+ *   EINVAL  offset is negative.
+ *   ENOSPC  not enough free space in the file system, or too many extents.
+ *   EFBIG   the write extends past the maximum file size.
+ *   EISDIR  path is a directory.
+ *   and those of fs_lookup().
+ *
+ * @param fs      file system context.
+ * @param path    path to the file.
+ * @param buf     pointer to the buffer containing the data.
+ * @param size    number of bytes to write.
+ * @param offset  offset from the beginning of the file.
+ * @return        number of bytes written; -errno on error.
+ */
+int fs_write(fs_ctx *fs, const char *path, const char *buf, size_t size, off_t offset);
+
+/**
+ * Allocate or deallocate space in a file, as fallocate() does. Supported modes
+ * are 0, FALLOC_FL_KEEP_SIZE, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE and
+ * FALLOC_FL_ZERO_RANGE (optionally with FALLOC_FL_KEEP_SIZE).
+ *
+ * Errors:
+ *   EINVAL      offset is negative or length is not positive.
+ *   EOPNOTSUPP  mode is not supported.
+ *   EFBIG       offset + length exceeds the maximum file size.
+ *   ENOSPC      not enough free space in the file system, or too many extents.
+ *   EISDIR      path is a directory.
+ *   and those of fs_lookup().
+ *
+ * @param fs      file system context.
+ * @param path    path to the file.
+ * @param mode    fallocate mode flags.
+ * @param offset  offset from the beginning of the file.
+ * @param length  length of the range in bytes.
+ * @return        0 on success; -errno on error.
+ */
+int fs_fallocate(fs_ctx *fs, const char *path, int mode, off_t offset, off_t length);
+
+/**
+ * Get an extended attribute value. The only attribute is the read-only
+ * "user.a1fs.extents", the number of extents in the file's extent table.
+ *
+ * Errors:
+ *   ENODATA  the attribute does not exist.
+ *   ERANGE   the value buffer is too small.
+ *   and those of fs_lookup().
+ *
+ * @param fs     file system context.
+ * @param path   path to the file or directory.
+ * @param name   attribute name.
+ * @param value  buffer that receives the value.
+ * @param size   buffer size; 0 to query the value size.
+ * @return       value size on success; -errno on error.
+ */
+int fs_getxattr(fs_ctx *fs, const char *path, const char *name, char *value, size_t size);
+
+/**
+ * Move a file's data blocks into one contiguous run and rewrite its extent
+ * table (see defrag.h). Files already in one run only get their extent table
+ * compacted, if that saves extents. A directory that is mostly free space
+ * has its entries repacked into its first blocks and the rest freed. With
+ * A1FS_DEFRAG_QUERY in info->flags, only the current layout is reported.
+ *
+ * Errors:
+ *   ENOMEM  out of memory while repacking a directory.
+ *   ENOSPC  there is no free run large enough for the file.
+ *   and those of fs_lookup().
+ *
+ * @param fs    file system context.
+ * @param path  path to the file or directory.
+ * @param info  request flags; receives the layout before and after.
+ * @return      0 on success; -errno on error.
+ */
+int fs_defrag(fs_ctx *fs, const char *path, a1fs_defrag_info *info);
+
+/**
+ * Write out the appends to a file buffered by delayed allocation. A path that
+ * no longer exists is not an error.
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param fs    file system context.
+ * @param path  path to the file.
+ * @return      0 on success; -errno on error.
+ */
+int fs_flush(fs_ctx *fs, const char *path);
+
+/**
+ * Flush a file and write the whole image mapping back to the image file.
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *   EIO     msync() failed.
+ *
+ * @param fs    file system context.
+ * @param path  path to the file.
+ * @return      0 on success; -errno on error.
+ */
+int fs_fsync(fs_ctx *fs, const char *path);
+
+/**
+ * Grow the file system to a new size: extend the image file, remap it and add
+ * the new blocks as free space (see grow.h). The new space can be used as soon
+ * as the call returns.
+ *
+ * Errors:
+ *   EINVAL   the size is not a multiple of the block size, or is smaller
+ *            than the file system.
+ *   EFBIG    the size needs more blocks than a block number can address.
+ *   ENOTSUP  the image file path is not known.
+ *   and those of fs_grow(), ftruncate() and mremap().
+ *
+ * @param fs    file system context.
+ * @param size  new file system size in bytes.
+ * @return      0 on success; -errno on error.
+ */
+int fs_resize(fs_ctx *fs, uint64_t size);
+
+
+/*
+ * Inode-based calls, for front ends that keep inode numbers between calls
+ * (such as the FUSE low-level driver, a1fs_ll.c) and need not resolve a path
+ * on every operation. Each behaves as the path-based call of the same name,
+ * with the file given by its inode number, and a new or removed entry by the
+ * inode number of its directory and its name. An inode number that is not in
+ * use fails with ENOENT.
+ */
+
+/**
+ * Look up a name in a directory.
+ *
+ * Errors:
+ *   ENAMETOOLONG  the name is too long.
+ *   ENOENT        the directory has no such entry, or parent is not in use.
+ *   ENOTDIR       parent is not a directory.
+ *
+ * @param fs      file system context.
+ * @param parent  inode number of the directory.
+ * @param name    entry name.
+ * @param ino     pointer to the variable that receives the inode number.
+ * @return        0 on success; -errno on error.
+ */
+int fs_lookup_at(fs_ctx *fs, a1fs_ino_t parent, const char *name, a1fs_ino_t *ino);
+
+/**
+ * Get the generation of an inode, which changes each time its inode number is
+ * reused for a new file or directory. Together with the inode number, it
+ * identifies a file for the whole life of the file system.
+ *
+ * @param fs   file system context.
+ * @param ino  inode number.
+ * @return     inode generation; 0 if the inode is not in use.
+ */
+uint32_t fs_generation(fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Pin an inode, for a caller that keeps referring to it by number after its
+ * last name may be gone (the FUSE low-level driver holds one pin per lookup
+ * the kernel has not forgotten and one per open file). Unlinking a pinned file
+ * or directory, or renaming over it, removes its name and sets its link count
+ * to 0 but keeps its inode and data in place, and calls by inode number go on
+ * working, until fs_unpin() drops the last pin. fs_unmount() drops all pins.
+ *
+ * Errors:
+ *   ENOMEM  out of memory.
+ *
+ * @param fs   file system context.
+ * @param ino  inode number.
+ * @param n    number of pins to add.
+ * @return     0 on success; -errno on error.
+ */
+int fs_pin(fs_ctx *fs, a1fs_ino_t ino, uint64_t n);
+
+/**
+ * Drop pins taken with fs_pin(); an inode with no links is freed with its last
+ * pin.
+ *
+ * @param fs   file system context.
+ * @param ino  inode number.
+ * @param n    number of pins to drop.
+ */
+void fs_unpin(fs_ctx *fs, a1fs_ino_t ino, uint64_t n);
+
+/** Same as fs_getattr(), by inode number. */
+int fs_getattr_ino(fs_ctx *fs, a1fs_ino_t ino, struct stat *st);
+
+/** Same as fs_readdir(), by inode number. */
+int fs_readdir_ino(fs_ctx *fs, a1fs_ino_t ino, off_t offset, void *buf, fs_filldir_t filler);
+
+/**
+ * Same as fs_mkdir(), in the directory parent. The inode number of the new
+ * directory is stored in *ino.
+ */
+int fs_mkdir_at(fs_ctx *fs, a1fs_ino_t parent, const char *name, mode_t mode, a1fs_ino_t *ino);
+
+/** Same as fs_rmdir(), for the entry name of the directory parent. */
+int fs_rmdir_at(fs_ctx *fs, a1fs_ino_t parent, const char *name);
+
+/**
+ * Same as fs_create(), in the directory parent. The inode number of the new
+ * file is stored in *ino.
+ */
+int fs_create_at(fs_ctx *fs, a1fs_ino_t parent, const char *name, mode_t mode, a1fs_ino_t *ino);
+
+/** Same as fs_unlink(), for the entry name of the directory parent. */
+int fs_unlink_at(fs_ctx *fs, a1fs_ino_t parent, const char *name);
+
+/**
+ * Same as fs_rename(), for the entry name of the directory parent and the
+ * entry new_name of new_parent. Directories have no link to their parent, so
+ * moving a directory to another parent searches its subtree for new_parent
+ * (and an exchange searches the subtree of the other directory for parent).
+ */
+int fs_rename_at(fs_ctx *fs, a1fs_ino_t parent, const char *name, a1fs_ino_t new_parent, const char *new_name,
+				 unsigned int flags);
+
+/** Same as fs_utimens(), by inode number. */
+int fs_utimens_ino(fs_ctx *fs, a1fs_ino_t ino, const struct timespec times[2]);
+
+/** Same as fs_truncate(), by inode number. */
+int fs_truncate_ino(fs_ctx *fs, a1fs_ino_t ino, off_t size);
+
+/** Same as fs_read(), by inode number. */
+int fs_read_ino(fs_ctx *fs, a1fs_ino_t ino, char *buf, size_t size, off_t offset);
+
+/** Same as fs_write(), by inode number. */
+int fs_write_ino(fs_ctx *fs, a1fs_ino_t ino, const char *buf, size_t size, off_t offset);
+
+/** Same as fs_fallocate(), by inode number. */
+int fs_fallocate_ino(fs_ctx *fs, a1fs_ino_t ino, int mode, off_t offset, off_t length);
+
+/** Same as fs_getxattr(), by inode number. */
+int fs_getxattr_ino(fs_ctx *fs, a1fs_ino_t ino, const char *name, char *value, size_t size);
+
+/** Same as fs_defrag(), by inode number. */
+int fs_defrag_ino(fs_ctx *fs, a1fs_ino_t ino, a1fs_defrag_info *info);
+
+/** Same as fs_flush(), by inode number. An inode not in use is not an error. */
+int fs_flush_ino(fs_ctx *fs, a1fs_ino_t ino);
+
+/** Same as fs_fsync(), by inode number. */
+int fs_fsync_ino(fs_ctx *fs, a1fs_ino_t ino);
@@ -0,0 +1,986 @@
+/**
+ * a1fs file system checker.
+ *
+ * Checks that the superblock, inode table, extent tables, directories, bitmaps
+ * and free counts of an unmounted image agree, and repairs what it can:
+ *
+ *   1. The superblock geometry is checked; it cannot be repaired.
+ *   2. The inode table is scanned in parallel. Each in-use inode's mode,
+ *      extent table and extents are checked, and the blocks it references are
+ *      marked in a shared bitmap with atomic word-wide operations; blocks
+ *      marked twice are remembered as shared.
+ *   3. Damaged inodes are repaired (or cleared), and blocks shared by several
+ *      inodes are given to the lowest-numbered one.
+ *   4. The directory tree is walked from the root. Entries that point to free
+ *      or damaged inodes, or to an inode that is already linked, are removed;
+ *      entry counts, sizes and link counts are fixed. In-use inodes that are
+ *      not reachable from the root are cleared.
+ *   5. The block and inode bitmaps are rebuilt in parallel from the reachable
+ *      inodes, compared with the ones on disk a word at a time, and the free
+ *      counts and clean watermark are recomputed from them.
+ */
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "map.h"
+
+
+/** Number of inodes a scanning thread takes at a time. */
+#define FSCK_BATCH 1024
+
+/** Largest number of scanning threads. */
+#define FSCK_MAX_THREADS 256
+
+/** Exit codes, as for e2fsck. */
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+/** Inode state flags. */
+#define INO_USED 0x01		/* inode bitmap bit is set */
+#define INO_BAD 0x02		/* damaged beyond repair or unreachable; cleared */
+#define INO_BAD_EXTENTS 0x04 /* some extents are empty or out of range */
+#define INO_BAD_COUNT 0x08	/* more extents than fit in the extent table */
+#define INO_BAD_NUMBER 0x10	/* the inode number field is wrong */
+#define INO_BAD_SIZE 0x20	/* a file is larger than its extents */
+#define INO_REACHED 0x40	/* linked from the directory tree */
+
+/** Command line options. */
+typedef struct fsck_opts
+{
+	/** File system image file path. */
+	const char *img_path;
+	/** Number of scanning threads. */
+	unsigned int n_threads;
+	/** Only report problems, do not change the image. */
+	bool no_change;
+	/** Print the time taken by each pass. */
+	bool verbose;
+
+	/** Print help and exit. */
+	bool help;
+
+} fsck_opts;
+
+/** Checker state. */
+typedef struct fsck_ctx
+{
+	/** Mapped image. */
+	void *image;
+	/** Image size in bytes. */
+	size_t size;
+	/** Superblock. */
+	a1fs_superblock *sb;
+	/** On-disk inode bitmap. */
+	unsigned char *inode_bitmap;
+	/** On-disk block bitmap. */
+	unsigned char *block_bitmap;
+	/**
+	 * Metadata blocks among the data blocks (a moved block bitmap and inode
+	 * table chunks), one bit per block.
+	 */
+	_Atomic uint64_t *meta;
+	/** Whether problems are repaired. */
+	bool repair;
+	/** Number of scanning threads. */
+	unsigned int n_threads;
+
+	/** INO_* flags of each inode. */
+	unsigned char *state;
+	/** Blocks referenced by the scanned inodes, one bit per block. */
+	_Atomic uint64_t *claimed;
+	/** Blocks referenced more than once. */
+	_Atomic uint64_t *shared;
+	/** Number of 64-bit words in a block bitmap. */
+	size_t block_words;
+
+	/** Problems found. */
+	uint64_t errors;
+	/** Problems that could not be repaired. */
+	uint64_t unfixed;
+
+} fsck_ctx;
+
+static const char *help_str = "\
+Usage: %s [options] image\n\
+\n\
+Check an a1fs image and repair the problems found. The image must not be\n\
+mounted.\n\
+\n\
+Options:\n\
+    -n      check only; do not change the image\n\
+    -j num  number of scanning threads; default: number of CPUs\n\
+    -v      print the time taken by each pass\n\
+    -h      print help and exit\n\
+\n\
+Exit status: 0 no problems, 1 problems repaired, 4 problems left\n\
+uncorrected, 8 operational error.\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+static bool parse_args(int argc, char *argv[], fsck_opts *opts)
+{
+	int o;
+	while ((o = getopt(argc, argv, "nj:vh")) != -1)
+	{
+		switch (o)
+		{
+		case 'n':
+			opts->no_change = true;
+			break;
+		case 'j':
+			opts->n_threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'v':
+			opts->verbose = true;
+			break;
+
+		case 'h':
+			opts->help = true;
+			return true; // skip other arguments
+
+		case '?':
+			return false;
+		default:
+			return false;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		fprintf(stderr, "Missing image path\n");
+		return false;
+	}
+	opts->img_path = argv[optind];
+
+	if (opts->n_threads == 0 || opts->n_threads > FSCK_MAX_THREADS)
+	{
+		fprintf(stderr, "Number of threads must be between 1 and %d\n", FSCK_MAX_THREADS);
+		return false;
+	}
+	return true;
+}
+
+/** Current time in seconds. */
+static double now_secs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Report a problem.
+ *
+ * @return  true if it should be repaired; false with -n.
+ */
+static bool problem(fsck_ctx *ctx, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf(ctx->repair ? "; fixed\n" : "\n");
+	ctx->errors++;
+	if (!ctx->repair)
+		ctx->unfixed++;
+	return ctx->repair;
+}
+
+/** Report a problem that cannot be repaired. */
+static void fatal_problem(fsck_ctx *ctx, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("; cannot fix\n");
+	ctx->errors++;
+	ctx->unfixed++;
+}
+
+static bool test_bit(const unsigned char *bitmap, uint64_t idx)
+{
+	return (bitmap[idx / 8] >> (idx % 8)) & 1;
+}
+
+/** Mask of the bits [off, off + n) of a word; n > 0. */
+static uint64_t word_mask(unsigned int off, unsigned int n)
+{
+	return (n == 64 ? ~0ull : (1ull << n) - 1) << off;
+}
+
+/**
+ * Set a range of bits, a word at a time. Bits that were already set are also
+ * set in shared, if not NULL.
+ *
+ * @return  true if any of the bits was already set.
+ */
+static bool mark_range(_Atomic uint64_t *bits, _Atomic uint64_t *shared, uint64_t start, uint64_t count)
+{
+	bool overlap = false;
+	while (count > 0)
+	{
+		unsigned int off = start % 64;
+		unsigned int n = count < 64 - off ? count : 64 - off;
+		uint64_t mask = word_mask(off, n);
+		uint64_t old = atomic_fetch_or_explicit(&bits[start / 64], mask, memory_order_relaxed);
+		if ((old & mask) != 0)
+		{
+			overlap = true;
+			if (shared != NULL)
+				atomic_fetch_or_explicit(&shared[start / 64], old & mask, memory_order_relaxed);
+		}
+		start += n;
+		count -= n;
+	}
+	return overlap;
+}
+
+/** Check if any bit of a range is set. */
+static bool range_any(_Atomic uint64_t *bits, uint64_t start, uint64_t count)
+{
+	while (count > 0)
+	{
+		unsigned int off = start % 64;
+		unsigned int n = count < 64 - off ? count : 64 - off;
+		if ((atomic_load_explicit(&bits[start / 64], memory_order_relaxed) & word_mask(off, n)) != 0)
+			return true;
+		start += n;
+		count -= n;
+	}
+	return false;
+}
+
+static a1fs_blk_t extent_len(const a1fs_extent *e)
+{
+	return e->count & ~A1FS_EXTENT_UNWRITTEN;
+}
+
+/** Check whether a run of blocks overlaps metadata kept among the data blocks. */
+static bool in_metadata(const fsck_ctx *ctx, a1fs_blk_t start, a1fs_blk_t len)
+{
+	return range_any(ctx->meta, start, len);
+}
+
+/** Check that an extent is not empty and lies within the data blocks. */
+static bool extent_ok(const fsck_ctx *ctx, const a1fs_extent *e)
+{
+	a1fs_blk_t len = extent_len(e);
+	if (len == 0)
+		return false;
+	if (e->start == 0)
+		return true;
+	return e->start >= ctx->sb->first_data_block && e->start < ctx->sb->blocks_count &&
+		   len <= ctx->sb->blocks_count - e->start && !in_metadata(ctx, e->start, len);
+}
+
+/** Check that a block can hold an extent table. */
+static bool table_ok(const fsck_ctx *ctx, a1fs_blk_t blk)
+{
+	return blk >= ctx->sb->first_data_block && blk < ctx->sb->blocks_count && !in_metadata(ctx, blk, 1);
+}
+
+static a1fs_extent *extent_table(const fsck_ctx *ctx, const a1fs_inode *inode)
+{
+	return (a1fs_extent *)(ctx->image + (size_t)inode->extent_table * A1FS_BLOCK_SIZE);
+}
+
+/** Number of extents to look at; never more than fit in the table. */
+static unsigned int extent_count(const a1fs_inode *inode)
+{
+	return inode->num_extents < A1FS_EXTENTS_MAX ? inode->num_extents : A1FS_EXTENTS_MAX;
+}
+
+/**
+ * Check an in-use inode and mark the blocks it references.
+ *
+ * @param ctx     checker state.
+ * @param ino     inode number.
+ * @param bits    bitmap in which to mark the blocks.
+ * @param shared  bitmap that receives blocks marked before; may be NULL.
+ * @return        INO_* flags describing the problems found.
+ */
+static unsigned char scan_inode(fsck_ctx *ctx, a1fs_ino_t ino, _Atomic uint64_t *bits, _Atomic uint64_t *shared)
+{
+	const a1fs_inode *inode = a1fs_inode_at(ctx->image, ino);
+	if (!S_ISDIR(inode->mode) && !S_ISREG(inode->mode))
+		return INO_BAD;
+	if (!table_ok(ctx, inode->extent_table))
+		return INO_BAD;
+
+	unsigned char flags = 0;
+	if (inode->inode != ino)
+		flags |= INO_BAD_NUMBER;
+	if (inode->num_extents > A1FS_EXTENTS_MAX)
+		flags |= INO_BAD_COUNT;
+
+	mark_range(bits, shared, inode->extent_table, 1);
+	const a1fs_extent *table = extent_table(ctx, inode);
+	uint64_t file_blocks = 0;
+	for (unsigned int i = 0; i < extent_count(inode); i++)
+	{
+		// out of range extents are turned into holes of the same length
+		file_blocks += extent_len(&table[i]);
+		if (!extent_ok(ctx, &table[i]))
+		{
+			flags |= INO_BAD_EXTENTS;
+			continue;
+		}
+		if (table[i].start != 0)
+			mark_range(bits, shared, table[i].start, extent_len(&table[i]));
+	}
+	if (S_ISREG(inode->mode) && inode->size > file_blocks * A1FS_BLOCK_SIZE)
+		flags |= INO_BAD_SIZE;
+	return flags;
+}
+
+/** A pass over the inode table, shared by the scanning threads. */
+typedef struct scan_job
+{
+	fsck_ctx *ctx;
+	/** Called for each inode. */
+	void (*fn)(fsck_ctx *ctx, a1fs_ino_t ino);
+	/** First inode of the next batch. */
+	atomic_uint next;
+
+} scan_job;
+
+static void *scan_thread(void *arg)
+{
+	scan_job *job = (scan_job *)arg;
+	unsigned int n = job->ctx->sb->inodes_count;
+	for (;;)
+	{
+		unsigned int first = atomic_fetch_add(&job->next, FSCK_BATCH);
+		if (first >= n)
+			break;
+		unsigned int last = n - first < FSCK_BATCH ? n : first + FSCK_BATCH;
+		for (unsigned int ino = first; ino < last; ino++)
+			job->fn(job->ctx, ino);
+	}
+	return NULL;
+}
+
+/** Call fn for every inode, spreading batches of inodes over the threads. */
+static void scan_parallel(fsck_ctx *ctx, void (*fn)(fsck_ctx *ctx, a1fs_ino_t ino))
+{
+	scan_job job = {ctx, fn, 0};
+	pthread_t threads[FSCK_MAX_THREADS];
+	unsigned int started = 0;
+	for (; started < ctx->n_threads - 1; started++)
+	{
+		if (pthread_create(&threads[started], NULL, scan_thread, &job) != 0)
+			break;
+	}
+	// this thread does its share too, which also covers a failed pthread_create()
+	scan_thread(&job);
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/** Pass 2 callback: check an inode and claim its blocks. */
+static void pass2_inode(fsck_ctx *ctx, a1fs_ino_t ino)
+{
+	if (!test_bit(ctx->inode_bitmap, ino))
+	{
+		ctx->state[ino] = 0;
+		return;
+	}
+	ctx->state[ino] = INO_USED | scan_inode(ctx, ino, ctx->claimed, ctx->shared);
+}
+
+/** Pass 5 callback: mark the blocks of a reachable inode. */
+static void pass5_inode(fsck_ctx *ctx, a1fs_ino_t ino)
+{
+	if (ctx->state[ino] & INO_REACHED)
+		scan_inode(ctx, ino, ctx->claimed, NULL);
+}
+
+/**
+ * Check where the block bitmap is: right after the inode bitmap, or moved into
+ * the data blocks by a1fs-resize, leaving its old slot before the inode table.
+ */
+static bool bitmap_layout_ok(const a1fs_superblock *sb)
+{
+	a1fs_blk_t slot = sb->first_ino_bitmap + sb->inode_bitmap_count;
+	if (sb->first_blo_bitmap == slot)
+		return sb->first_ino == sb->first_blo_bitmap + sb->block_bitmap_count;
+	return sb->first_ino > slot && sb->first_blo_bitmap >= sb->first_ino + sb->inode_table_count &&
+		   (uint64_t)sb->first_blo_bitmap + sb->block_bitmap_count <= sb->blocks_count;
+}
+
+/** Pass 1: check the superblock geometry. */
+static bool pass1_superblock(fsck_ctx *ctx)
+{
+	a1fs_superblock *sb = ctx->sb;
+	if (sb->magic != A1FS_MAGIC)
+	{
+		fatal_problem(ctx, "superblock: bad magic number");
+		return false;
+	}
+	if (!a1fs_features_ok(sb))
+	{
+		fatal_problem(ctx, "superblock: unsupported features 0x%x", sb->features);
+		return false;
+	}
+	if (sb->size > ctx->size || (uint64_t)sb->blocks_count * A1FS_BLOCK_SIZE > ctx->size)
+	{
+		fatal_problem(ctx, "superblock: file system is larger than the image (%lu blocks, %zu bytes)",
+					  (unsigned long)sb->blocks_count, ctx->size);
+		return false;
+	}
+	if (sb->inodes_count == 0 || sb->first_ino_bitmap != 1 ||
+		!bitmap_layout_ok(sb) ||
+		sb->first_data_block != sb->first_ino + sb->inode_table_count ||
+		sb->first_data_block >= sb->blocks_count ||
+		(uint64_t)sb->inode_bitmap_count * A1FS_BLOCK_SIZE * 8 < sb->inodes_count ||
+		(uint64_t)sb->block_bitmap_count * A1FS_BLOCK_SIZE * 8 < sb->blocks_count ||
+		!a1fs_inode_layout_ok(sb))
+	{
+		fatal_problem(ctx, "superblock: inconsistent layout");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Record the metadata blocks among the data blocks; they must not overlap.
+ * Pass 1 must have succeeded.
+ */
+static bool mark_metadata(fsck_ctx *ctx)
+{
+	a1fs_superblock *sb = ctx->sb;
+	if (sb->first_blo_bitmap >= sb->first_data_block)
+		mark_range(ctx->meta, NULL, sb->first_blo_bitmap, sb->block_bitmap_count);
+	for (unsigned int i = 0; i < sb->inode_chunks_count; i++)
+	{
+		if (mark_range(ctx->meta, NULL, sb->inode_chunks[i], A1FS_INODE_CHUNK_BLOCKS))
+		{
+			fatal_problem(ctx, "superblock: inode table chunk %u at block %u overlaps other metadata", i,
+						  sb->inode_chunks[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
+/** Clear an inode; its bitmap bit and blocks are released in pass 5. */
+static void clear_inode(fsck_ctx *ctx, a1fs_ino_t ino)
+{
+	ctx->state[ino] |= INO_BAD;
+	if (ctx->repair)
+		memset(a1fs_inode_at(ctx->image, ino), 0, sizeof(a1fs_inode));
+}
+
+/** Pass 3: repair the problems found by the inode scan. */
+static void pass3_inodes(fsck_ctx *ctx)
+{
+	for (a1fs_ino_t ino = 0; ino < ctx->sb->inodes_count; ino++)
+	{
+		unsigned char st = ctx->state[ino];
+		if (!(st & INO_USED) || st == INO_USED)
+			continue;
+		a1fs_inode *inode = a1fs_inode_at(ctx->image, ino);
+		if (st & INO_BAD)
+		{
+			if (ino == 0)
+				continue; // reported in pass 4
+			if (problem(ctx, "inode %u: bad mode 0%o or extent table block %u", ino, inode->mode,
+						inode->extent_table))
+				clear_inode(ctx, ino);
+			else
+				ctx->state[ino] |= INO_BAD;
+			continue;
+		}
+		if ((st & INO_BAD_NUMBER) && problem(ctx, "inode %u: inode number field is %u", ino, inode->inode))
+			inode->inode = ino;
+		if ((st & INO_BAD_COUNT) &&
+			problem(ctx, "inode %u: %u extents, at most %zu fit", ino, inode->num_extents, A1FS_EXTENTS_MAX))
+			inode->num_extents = A1FS_EXTENTS_MAX;
+		if ((st & INO_BAD_EXTENTS) && problem(ctx, "inode %u: empty or out of range extents", ino))
+		{
+			// empty extents are dropped; out of range ones become holes
+			a1fs_extent *table = extent_table(ctx, inode);
+			unsigned int n = 0;
+			for (unsigned int i = 0; i < extent_count(inode); i++)
+			{
+				a1fs_blk_t len = extent_len(&table[i]);
+				if (len == 0)
+					continue;
+				if (!extent_ok(ctx, &table[i]))
+					table[i] = (a1fs_extent){0, len};
+				table[n++] = table[i];
+			}
+			inode->num_extents = n;
+		}
+		if (st & INO_BAD_SIZE)
+		{
+			uint64_t blocks = 0;
+			const a1fs_extent *table = extent_table(ctx, inode);
+			for (unsigned int i = 0; i < extent_count(inode); i++)
+				blocks += extent_len(&table[i]);
+			if (problem(ctx, "inode %u: size %lu is past the end of its extents (%lu blocks)", ino,
+						(unsigned long)inode->size, (unsigned long)blocks))
+				inode->size = blocks * A1FS_BLOCK_SIZE;
+		}
+	}
+}
+
+/**
+ * Pass 3, continued: give blocks referenced by more than one inode to the
+ * lowest-numbered one. Other inodes lose the extents that overlap them (they
+ * become holes), or are cleared if it is their extent table.
+ */
+static void pass3_shared(fsck_ctx *ctx)
+{
+	bool any = false;
+	for (size_t i = 0; i < ctx->block_words && !any; i++)
+		any = atomic_load_explicit(&ctx->shared[i], memory_order_relaxed) != 0;
+	if (!any)
+		return;
+
+	// the claims are made again, in inode order
+	for (size_t i = 0; i < ctx->block_words; i++)
+		atomic_store_explicit(&ctx->claimed[i], 0, memory_order_relaxed);
+	for (a1fs_ino_t ino = 0; ino < ctx->sb->inodes_count; ino++)
+	{
+		if (!(ctx->state[ino] & INO_USED) || (ctx->state[ino] & INO_BAD))
+			continue;
+		a1fs_inode *inode = a1fs_inode_at(ctx->image, ino);
+		if (range_any(ctx->claimed, inode->extent_table, 1))
+		{
+			if (problem(ctx, "inode %u: extent table block %u is used by another inode", ino, inode->extent_table))
+				clear_inode(ctx, ino);
+			else
+				ctx->state[ino] |= INO_BAD;
+			continue;
+		}
+		mark_range(ctx->claimed, NULL, inode->extent_table, 1);
+
+		a1fs_extent *table = extent_table(ctx, inode);
+		for (unsigned int i = 0; i < extent_count(inode); i++)
+		{
+			a1fs_extent *e = &table[i];
+			if (e->start == 0 || !extent_ok(ctx, e))
+				continue;
+			if (range_any(ctx->claimed, e->start, extent_len(e)))
+			{
+				if (problem(ctx, "inode %u: extent %u (blocks %u-%u) overlaps another inode", ino, i,
+							e->start, e->start + extent_len(e) - 1))
+					*e = (a1fs_extent){0, extent_len(e)};
+				continue;
+			}
+			mark_range(ctx->claimed, NULL, e->start, extent_len(e));
+		}
+	}
+}
+
+/** Check if a dentry name is a valid path component. */
+static bool name_ok(const char *name)
+{
+	return name[0] != '\0' && strchr(name, '/') == NULL && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
+}
+
+/**
+ * Free a directory entry. A variable-length entry gives its space to the one
+ * before it in the block (at prev, or itself if it is the first), as when the
+ * file system removes it.
+ */
+static void clear_entry(fsck_ctx *ctx, unsigned char *block, uint32_t prev, const a1fs_dir_rec *rec)
+{
+	uint32_t features = ctx->sb->features;
+	if ((features & A1FS_FEATURE_DIRENT) && prev != rec->off)
+		a1fs_dir_set_len(features, block, prev, rec->off + rec->len - prev);
+	else
+		a1fs_dir_write(features, block, rec->off, rec->len, 0, "");
+}
+
+/**
+ * Pass 4: walk the directory tree from the root, breadth first.
+ *
+ * @return  false if the root directory is damaged.
+ */
+static bool pass4_directories(fsck_ctx *ctx)
+{
+	unsigned char root = ctx->state[0];
+	if (!(root & INO_USED) || (root & INO_BAD) || !S_ISDIR(a1fs_inode_at(ctx->image, 0)->mode))
+	{
+		fatal_problem(ctx, "root directory: inode 0 is free or damaged");
+		return false;
+	}
+
+	a1fs_ino_t *queue = malloc(ctx->sb->inodes_count * sizeof(a1fs_ino_t));
+	if (queue == NULL)
+	{
+		perror("malloc");
+		return false;
+	}
+	uint32_t features = ctx->sb->features;
+	size_t head = 0, tail = 0;
+	queue[tail++] = 0;
+	ctx->state[0] |= INO_REACHED;
+	while (head < tail)
+	{
+		a1fs_ino_t dir = queue[head++];
+		a1fs_inode *inode = a1fs_inode_at(ctx->image, dir);
+		const a1fs_extent *table = extent_table(ctx, inode);
+		unsigned int entries = 0, subdirs = 0;
+		uint64_t bytes = 0;
+		for (unsigned int i = 0; i < extent_count(inode); i++)
+		{
+			if (table[i].start == 0 || !extent_ok(ctx, &table[i]))
+				continue;
+			for (a1fs_blk_t b = 0; b < extent_len(&table[i]); b++)
+			{
+				unsigned char *block = ctx->image + (size_t)(table[i].start + b) * A1FS_BLOCK_SIZE;
+				a1fs_dir_rec rec = {0};
+				uint32_t prev = 0;
+				for (;;)
+				{
+					if (!a1fs_dir_next(features, block, &rec))
+					{
+						if (rec.off >= A1FS_BLOCK_SIZE)
+							break;
+						// a fixed-size entry with no terminated name is skipped;
+						// a damaged variable-length one ends the block, as the
+						// rest of it cannot be found
+						bool varlen = features & A1FS_FEATURE_DIRENT;
+						if (problem(ctx, "directory %u: block %u has a damaged entry at offset %u", dir,
+									table[i].start + b, rec.off))
+						{
+							if (!varlen)
+								memset(block + rec.off, 0, sizeof(a1fs_dentry));
+							else if (rec.off == 0)
+								a1fs_dir_write(features, block, 0, A1FS_BLOCK_SIZE, 0, "");
+							else
+								a1fs_dir_set_len(features, block, prev, A1FS_BLOCK_SIZE - prev);
+						}
+						if (varlen)
+							break;
+						rec.len = sizeof(a1fs_dentry);
+						continue;
+					}
+					// position of the entry in the extent, in slots
+					size_t j = ((size_t)b * A1FS_BLOCK_SIZE + rec.off) / a1fs_dir_slot_size(features);
+					if (rec.ino == 0)
+					{
+						// a free slot must be all zeros to be reused by mkdir()
+						if (!(features & A1FS_FEATURE_DIRENT) && rec.name[0] != '\0' &&
+							problem(ctx, "directory %u: stale name in free entry", dir))
+							memset(block + rec.off, 0, sizeof(a1fs_dentry));
+						prev = rec.off;
+						continue;
+					}
+					const char *why = NULL;
+					if (!name_ok(rec.name))
+						why = "has an invalid name";
+					else if ((features & A1FS_FEATURE_DIRENT_HASH) && rec.hash != a1fs_name_hash(rec.name, rec.name_len))
+						why = "has a wrong name hash";
+					else if (rec.ino >= ctx->sb->inodes_count || !(ctx->state[rec.ino] & INO_USED))
+						why = "points to a free inode";
+					else if (ctx->state[rec.ino] & INO_BAD)
+						why = "points to a cleared inode";
+					else if (ctx->state[rec.ino] & INO_REACHED)
+						why = "is a second link to its inode";
+					if (why != NULL)
+					{
+						if (problem(ctx, "directory %u: entry %zu (inode %u) %s", dir, j, rec.ino, why))
+						{
+							clear_entry(ctx, block, prev, &rec);
+							// merged into the entry before it, which stays prev
+							if ((features & A1FS_FEATURE_DIRENT) && prev != rec.off)
+								continue;
+						}
+						prev = rec.off;
+						continue;
+					}
+
+					a1fs_inode *child = a1fs_inode_at(ctx->image, rec.ino);
+					ctx->state[rec.ino] |= INO_REACHED;
+					entries++;
+					bytes += a1fs_dirent_size(features, rec.name_len);
+					if (S_ISDIR(child->mode))
+					{
+						subdirs++;
+						queue[tail++] = rec.ino;
+					}
+					else if (child->links != 1 &&
+							 problem(ctx, "inode %u: link count %u, should be 1", rec.ino, child->links))
+						child->links = 1;
+					prev = rec.off;
+				}
+			}
+		}
+
+		if ((unsigned int)inode->entry_count != entries &&
+			problem(ctx, "directory %u: entry count %d, should be %u", dir, inode->entry_count, entries))
+			inode->entry_count = entries;
+		// the size is the space the entries take
+		if (inode->size != bytes &&
+			problem(ctx, "directory %u: size %lu, should be %lu", dir, (unsigned long)inode->size,
+					(unsigned long)bytes))
+			inode->size = bytes;
+		if (inode->links != 2 + subdirs &&
+			problem(ctx, "directory %u: link count %u, should be %u", dir, inode->links, 2 + subdirs))
+			inode->links = 2 + subdirs;
+	}
+	free(queue);
+
+	for (a1fs_ino_t ino = 0; ino < ctx->sb->inodes_count; ino++)
+	{
+		unsigned char st = ctx->state[ino];
+		if ((st & INO_USED) && !(st & (INO_BAD | INO_REACHED)))
+		{
+			if (problem(ctx, "inode %u: not linked from any directory", ino))
+				clear_inode(ctx, ino);
+			else
+				ctx->state[ino] |= INO_BAD;
+		}
+	}
+	return true;
+}
+
+/**
+ * Compare a rebuilt bitmap with the one on disk and fix the differences.
+ *
+ * @param ctx     checker state.
+ * @param what    "block" or "inode".
+ * @param disk    on-disk bitmap.
+ * @param bits    rebuilt bitmap.
+ * @param n_bits  number of bits.
+ * @return        number of set bits in the rebuilt bitmap.
+ */
+static uint64_t fix_bitmap(fsck_ctx *ctx, const char *what, unsigned char *disk, const uint64_t *bits, uint64_t n_bits)
+{
+	uint64_t used = 0, missing = 0, extra = 0;
+	for (uint64_t w = 0; w * 64 < n_bits; w++)
+	{
+		unsigned int n = n_bits - w * 64 < 64 ? n_bits - w * 64 : 64;
+		size_t bytes = (n + 7) / 8;
+		uint64_t on_disk = 0;
+		memcpy(&on_disk, disk + w * 8, bytes);
+		uint64_t mask = word_mask(0, n);
+		uint64_t want = bits[w] & mask;
+		used += __builtin_popcountll(want);
+		uint64_t diff = (on_disk ^ want) & mask;
+		if (diff == 0)
+			continue;
+		missing += __builtin_popcountll(diff & want);
+		extra += __builtin_popcountll(diff & on_disk);
+		if (ctx->repair)
+		{
+			// keep the bits past the end of the bitmap as they are
+			uint64_t fixed = (on_disk & ~mask) | want;
+			memcpy(disk + w * 8, &fixed, bytes);
+		}
+	}
+	if (missing > 0)
+		problem(ctx, "%s bitmap: %lu in-use %ss marked free", what, (unsigned long)missing, what);
+	if (extra > 0)
+		problem(ctx, "%s bitmap: %lu unused %ss marked in use", what, (unsigned long)extra, what);
+	return used;
+}
+
+/** Pass 5: rebuild the bitmaps and free counts from the reachable inodes. */
+static void pass5_bitmaps(fsck_ctx *ctx)
+{
+	a1fs_superblock *sb = ctx->sb;
+	for (size_t i = 0; i < ctx->block_words; i++)
+		atomic_store_explicit(&ctx->claimed[i], 0, memory_order_relaxed);
+	// superblock, bitmaps and inode table
+	mark_range(ctx->claimed, NULL, 0, sb->first_data_block);
+	for (size_t i = 0; i < ctx->block_words; i++)
+	{
+		uint64_t meta = atomic_load_explicit(&ctx->meta[i], memory_order_relaxed);
+		atomic_fetch_or_explicit(&ctx->claimed[i], meta, memory_order_relaxed);
+	}
+	scan_parallel(ctx, pass5_inode);
+
+	// _Atomic uint64_t has the same representation as uint64_t
+	const uint64_t *blocks = (const uint64_t *)ctx->claimed;
+	uint64_t used_blocks = fix_bitmap(ctx, "block", ctx->block_bitmap, blocks, sb->blocks_count);
+
+	size_t inode_words = (sb->inodes_count + 63) / 64;
+	uint64_t *inodes = calloc(inode_words, sizeof(uint64_t));
+	if (inodes == NULL)
+	{
+		perror("calloc");
+		ctx->unfixed++;
+		return;
+	}
+	for (a1fs_ino_t ino = 0; ino < sb->inodes_count; ino++)
+	{
+		if (ctx->state[ino] & INO_REACHED)
+			inodes[ino / 64] |= 1ull << (ino % 64);
+	}
+	uint64_t used_inodes = fix_bitmap(ctx, "inode", ctx->inode_bitmap, inodes, sb->inodes_count);
+
+	// inodes of the fixed table past the inode watermark must be free, or they
+	// may be zeroed when the next inode is allocated
+	if (sb->uninit_inode_start != 0)
+	{
+		uint64_t table_inodes = a1fs_table_inodes(sb);
+		uint64_t used_end = 0;
+		for (uint64_t ino = table_inodes < sb->inodes_count ? table_inodes : sb->inodes_count; ino > 0; ino--)
+		{
+			if (inodes[(ino - 1) / 64] & (1ull << ((ino - 1) % 64)))
+			{
+				used_end = ino;
+				break;
+			}
+		}
+		if (sb->uninit_inode_start > table_inodes)
+		{
+			if (problem(ctx, "superblock: inode watermark %u is past the inode table", sb->uninit_inode_start))
+				sb->uninit_inode_start = 0;
+		}
+		else if (sb->uninit_inode_start < used_end &&
+				 problem(ctx, "superblock: inode watermark %u is below in-use inode %lu", sb->uninit_inode_start,
+						 (unsigned long)(used_end - 1)))
+		{
+			uint64_t end = (used_end + A1FS_INODES_PER_BLOCK - 1) / A1FS_INODES_PER_BLOCK * A1FS_INODES_PER_BLOCK;
+			sb->uninit_inode_start = end < table_inodes ? end : 0;
+		}
+	}
+	free(inodes);
+
+	if (sb->free_blocks_count != sb->blocks_count - used_blocks &&
+		problem(ctx, "superblock: free blocks count %u, should be %lu", sb->free_blocks_count,
+				(unsigned long)(sb->blocks_count - used_blocks)))
+		sb->free_blocks_count = sb->blocks_count - used_blocks;
+	if (sb->free_inodes_count != sb->inodes_count - used_inodes &&
+		problem(ctx, "superblock: free inodes count %u, should be %lu", sb->free_inodes_count,
+				(unsigned long)(sb->inodes_count - used_inodes)))
+		sb->free_inodes_count = sb->inodes_count - used_inodes;
+
+	// every block past the watermark must be free, or it may be taken for zeroed
+	if (sb->clean_block_start != 0)
+	{
+		uint64_t end = 0;
+		for (size_t w = ctx->block_words; w > 0; w--)
+		{
+			if (blocks[w - 1] != 0)
+			{
+				end = (w - 1) * 64 + 64 - __builtin_clzll(blocks[w - 1]);
+				break;
+			}
+		}
+		if (sb->clean_block_start < end &&
+			problem(ctx, "superblock: clean watermark %u is below in-use block %lu", sb->clean_block_start,
+					(unsigned long)(end - 1)))
+			sb->clean_block_start = end;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	fsck_opts opts = {
+		.n_threads = cpus > 0 ? (cpus < FSCK_MAX_THREADS ? cpus : FSCK_MAX_THREADS) : 1,
+	};
+	if (!parse_args(argc, argv, &opts))
+	{
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return FSCK_ERROR;
+	}
+	if (opts.help)
+	{
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return FSCK_OK;
+	}
+
+	fsck_ctx ctx = {0};
+	ctx.image = map_file(opts.img_path, A1FS_BLOCK_SIZE, &ctx.size);
+	if (ctx.image == NULL)
+		return FSCK_ERROR;
+	ctx.sb = (a1fs_superblock *)ctx.image;
+	ctx.repair = !opts.no_change;
+	ctx.n_threads = opts.n_threads;
+
+	int ret = FSCK_ERROR;
+	double t0 = now_secs();
+	if (!pass1_superblock(&ctx))
+	{
+		ret = FSCK_UNCORRECTED;
+		goto end;
+	}
+	a1fs_superblock *sb = ctx.sb;
+	ctx.inode_bitmap = (unsigned char *)ctx.image + (size_t)sb->first_ino_bitmap * A1FS_BLOCK_SIZE;
+	ctx.block_bitmap = (unsigned char *)ctx.image + (size_t)sb->first_blo_bitmap * A1FS_BLOCK_SIZE;
+	ctx.block_words = ((size_t)sb->blocks_count + 63) / 64;
+	ctx.state = calloc(sb->inodes_count, 1);
+	ctx.claimed = calloc(ctx.block_words, sizeof(uint64_t));
+	ctx.shared = calloc(ctx.block_words, sizeof(uint64_t));
+	ctx.meta = calloc(ctx.block_words, sizeof(uint64_t));
+	if (ctx.state == NULL || ctx.claimed == NULL || ctx.shared == NULL || ctx.meta == NULL)
+	{
+		perror("calloc");
+		goto end;
+	}
+	if (!mark_metadata(&ctx))
+	{
+		ret = FSCK_UNCORRECTED;
+		goto end;
+	}
+
+	double t1 = now_secs();
+	scan_parallel(&ctx, pass2_inode);
+	double t2 = now_secs();
+	pass3_inodes(&ctx);
+	pass3_shared(&ctx);
+	double t3 = now_secs();
+	if (!pass4_directories(&ctx))
+	{
+		ret = FSCK_UNCORRECTED;
+		goto end;
+	}
+	double t4 = now_secs();
+	pass5_bitmaps(&ctx);
+	double t5 = now_secs();
+	if (ctx.repair && ctx.errors > 0 && msync(ctx.image, ctx.size, MS_SYNC) != 0)
+	{
+		perror("msync");
+		goto end;
+	}
+
+	if (opts.verbose)
+	{
+		printf("pass 1 (superblock): %.3f s\n", t1 - t0);
+		printf("pass 2 (inode scan, %u threads): %.3f s\n", ctx.n_threads, t2 - t1);
+		printf("pass 3 (inode repair): %.3f s\n", t3 - t2);
+		printf("pass 4 (directories): %.3f s\n", t4 - t3);
+		printf("pass 5 (bitmaps, %u threads): %.3f s\n", ctx.n_threads, t5 - t4);
+	}
+	printf("%s: %u/%u inodes, %u/%u blocks, %lu problem%s%s\n", opts.img_path,
+		   sb->inodes_count - sb->free_inodes_count, sb->inodes_count,
+		   sb->blocks_count - sb->free_blocks_count, sb->blocks_count, (unsigned long)ctx.errors,
+		   ctx.errors == 1 ? "" : "s", ctx.errors == 0 ? "" : ctx.unfixed > 0 ? " (not all fixed)" : " (fixed)");
+	ret = ctx.unfixed > 0 ? FSCK_UNCORRECTED : ctx.errors > 0 ? FSCK_FIXED : FSCK_OK;
+
+end:
+	free(ctx.state);
+	free(ctx.claimed);
+	free(ctx.shared);
+	free(ctx.meta);
+	munmap(ctx.image, ctx.size);
+	return ret;
+}
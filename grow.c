@@ -0,0 +1,81 @@
+/**
+ * a1fs image growing implementation.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "a1fs.h"
+#include "grow.h"
+
+
+static void set_bits(unsigned char *bitmap, uint64_t start, uint64_t end, bool value)
+{
+	for (uint64_t i = start; i < end; i++)
+	{
+		if (value)
+			bitmap[i / 8] |= 1 << i % 8;
+		else
+			bitmap[i / 8] &= ~(1 << i % 8);
+	}
+}
+
+int fs_grow(void *image, size_t size)
+{
+	a1fs_superblock *sb = (a1fs_superblock *)image;
+	if (size % A1FS_BLOCK_SIZE != 0 || size < (uint64_t)sb->blocks_count * A1FS_BLOCK_SIZE)
+		return -EINVAL;
+	if (size / A1FS_BLOCK_SIZE > UINT32_MAX)
+		return -EFBIG;
+
+	a1fs_blk_t old_count = sb->blocks_count;
+	a1fs_blk_t new_count = size / A1FS_BLOCK_SIZE;
+	a1fs_blk_t added = new_count - old_count;
+	unsigned char *bitmap = (unsigned char *)image + (size_t)sb->first_blo_bitmap * A1FS_BLOCK_SIZE;
+	uint64_t bits_per_block = A1FS_BLOCK_SIZE * 8;
+
+	if (new_count <= sb->block_bitmap_count * bits_per_block)
+	{
+		// the bitmap has room; the bits past the old end should be clear
+		// already, but nothing reads them, so do not rely on it
+		set_bits(bitmap, old_count, new_count, false);
+		sb->free_blocks_count += added;
+		sb->blocks_count = new_count;
+		sb->size = size;
+		return 0;
+	}
+
+	// Write a larger bitmap at the start of the new blocks
+	a1fs_blk_t count = (new_count + bits_per_block - 1) / bits_per_block;
+	if (added < count)
+		return -ENOSPC;
+	a1fs_blk_t start = old_count;
+	unsigned char *new_bitmap = (unsigned char *)image + (size_t)start * A1FS_BLOCK_SIZE;
+	memset(new_bitmap, 0, (size_t)count * A1FS_BLOCK_SIZE);
+	memcpy(new_bitmap, bitmap, old_count / 8);
+	for (a1fs_blk_t i = old_count / 8 * 8; i < old_count; i++)
+	{
+		if (bitmap[i / 8] & (1 << i % 8))
+			new_bitmap[i / 8] |= 1 << i % 8;
+	}
+	set_bits(new_bitmap, start, (uint64_t)start + count, true);
+	a1fs_blk_t freed = 0;
+	if (sb->first_blo_bitmap >= sb->first_data_block)
+	{
+		// moved by an earlier resize; the metadata area keeps its own slot
+		set_bits(new_bitmap, sb->first_blo_bitmap, (uint64_t)sb->first_blo_bitmap + sb->block_bitmap_count, false);
+		freed = sb->block_bitmap_count;
+	}
+
+	// The new bitmap blocks are in use, so the clean watermark must be past
+	// them; the rest of the new blocks are zeros
+	if (sb->clean_block_start != 0 && sb->clean_block_start < start + count)
+		sb->clean_block_start = start + count;
+	sb->first_blo_bitmap = start;
+	sb->block_bitmap_count = count;
+	sb->free_blocks_count += added - count + freed;
+	sb->blocks_count = new_count;
+	sb->size = size;
+	return 0;
+}
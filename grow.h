@@ -0,0 +1,40 @@
+/**
+ * a1fs image growing header file.
+ *
+ * An image is grown by extending the backing file and then calling fs_grow()
+ * on a mapping of the whole, extended file. The new blocks are added to the
+ * block bitmap as free blocks. The bitmap's last block usually has room for
+ * them; when it does not, a larger bitmap is written at the start of the new
+ * blocks and the superblock is switched to it. The old bitmap blocks stay
+ * allocated if they were in the metadata area and are freed if they were in
+ * the data blocks (from an earlier move). The superblock is updated last.
+ *
+ * a1fs-resize grows unmounted images; a mounted file system is grown with the
+ * A1FS_IOC_RESIZE ioctl on any file or directory in it (see fs_resize() in
+ * fs_ops.h). Shrinking is not supported. The number of inodes stays the same.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+
+/** Grow the mounted file system to the given size in bytes. */
+#define A1FS_IOC_RESIZE _IOW('a', 2, uint64_t)
+
+/**
+ * Grow the file system in an image to the given size.
+ *
+ * Errors:
+ *   EINVAL  the size is not a multiple of the block size, or is smaller than
+ *           the file system.
+ *   EFBIG   the size needs more blocks than a block number can address.
+ *   ENOSPC  the bitmap has to move but the new blocks cannot hold it.
+ *
+ * @param image  pointer to the start of the image; at least size bytes.
+ * @param size   new file system size in bytes.
+ * @return       0 on success; -errno on error.
+ */
+int fs_grow(void *image, size_t size);
@@ -9,8 +9,9 @@
 
 #include "a1fs.h"
 #include "fs_ctx.h"
-#include "options.h"
 #include "map.h"
+#include "discard.h"
+#include "ncache.h"
 #define check_bit(var, pos) ((var) & (1 << (pos)))
 
 // just like ceil()
@@ -24,108 +25,18 @@ static inline int ceil_divide(int a, int b)
     return ans;
 }
 
-// find the inode with given inode number
+// find the inode with given inode number, in the fixed table or a chunk
 static inline int get_inode_by_inodenumber(fs_ctx *fs, unsigned int inode_num, struct a1fs_inode *inode)
 {
-    if (check_bit((fs->inode_bitmap_pointer)[inode_num / 8], inode_num % 8) > 0)
+    struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+    if (inode_num < sb->inodes_count && check_bit((fs->inode_bitmap_pointer)[inode_num / 8], inode_num % 8) > 0)
     {
-        *inode = *(struct a1fs_inode *)((fs->inode_pointer) + sizeof(struct a1fs_inode) * inode_num);
+        *inode = *a1fs_inode_at(fs->image, inode_num);
         return 0;
     }
     return 1;
 }
 
-// find the inode with given path
-static inline int get_inode_by_path(void *image, fs_ctx *fs, const char *path, struct a1fs_inode *inode)
-{
-    if (path[0] != '/')
-    {
-        return -ENOTDIR;
-    }
-    if (strlen(path) >= A1FS_PATH_MAX)
-        return -ENAMETOOLONG;
-
-    char copy[A1FS_PATH_MAX];
-    strncpy(copy, path, strlen(path) + 1);
-    char *p = strtok(copy, "/");
-    if (p == NULL)
-    {
-        if (get_inode_by_inodenumber(fs, 0, inode) != 0)
-        {
-            return -ENOTDIR;
-        }
-        return 0;
-    }
-    struct a1fs_inode curr_inode;
-    get_inode_by_inodenumber(fs, 0, &curr_inode);
-    while (p != NULL)
-    {
-        bool notfound = true;
-        if (strlen(p) > A1FS_NAME_MAX)
-        {
-            return -ENOENT;
-        }
-        for (unsigned int i = 0; i < curr_inode.num_extents; i++)
-        {
-            if (!(notfound))
-            {
-                break;
-            }
-            struct a1fs_extent *curr_extent = (struct a1fs_extent *)(image + curr_inode.extent_table * A1FS_BLOCK_SIZE + sizeof(struct a1fs_extent) * i);
-            for (unsigned int j = 0; j < (curr_extent->count * A1FS_BLOCK_SIZE) / sizeof(struct a1fs_dentry); j++)
-            {
-                struct a1fs_dentry *curr_entry = (struct a1fs_dentry *)(image + curr_extent->start * A1FS_BLOCK_SIZE + sizeof(struct a1fs_dentry) * j);
-                if (strcmp(p, curr_entry->name) == 0)
-                {
-                    p = strtok(NULL, "/");
-                    notfound = false;
-                    if (p == NULL)
-                    {
-                        if (get_inode_by_inodenumber(fs, curr_entry->ino, &curr_inode) != 0)
-                        {   
-                            return -ENOTDIR;
-                        }
-                    }
-                    else
-                    {
-                        if (get_inode_by_inodenumber(fs, curr_entry->ino, &curr_inode) != 0)
-                        {
-                            return -ENOTDIR;
-                        }
-                        if (!(curr_inode.mode & S_IFDIR))
-                        {
-                            return -ENOTDIR;
-                        }
-                    }
-                    break;
-                }
-            }
-        }
-
-        if (notfound)
-        {
-            return -ENOENT;
-        }
-    }
-    *inode = curr_inode;
-    return 0;
-}
-
-/** return free inode number, return -1 if not available */
-static inline int get_free_ino(fs_ctx *fs)
-{
-    struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
-    int inodes_count = sb->inodes_count;
-    for (int i = 0; i < inodes_count; i++)
-    {
-        if (check_bit((fs->inode_bitmap_pointer)[i / 8], i % 8) == 0)
-        {
-            return i;
-        }
-    }
-    return -1;
-}
-
 /** return free block number, return -1 if not available */
 static inline int get_free_blk(fs_ctx *fs)
 {
@@ -135,9 +46,11 @@ static inline int get_free_blk(fs_ctx *fs)
     {
         if (check_bit((fs->block_bitmap_pointer)[i / 8], i % 8) == 0)
         {
+            fs->stats.bitmap_bits_scanned += i + 1;
             return i;
         }
     }
+    fs->stats.bitmap_bits_scanned += blocks_count;
     return -1;
 }
 
@@ -195,42 +108,37 @@ static inline char *get_path(const char *path)
  * Priority 2: find the first appeared enough free blocks
  * Return -1 if there are no enough free blocks
  */
- 
-static inline int get_blk_by_length(fs_ctx* fs, unsigned int extend_blocks){
+static inline int get_blk_by_length(fs_ctx* fs, unsigned int extend_blocks)
+{
     struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
     unsigned int blocks_count = sb->blocks_count;
-    int found  = -1;
-    unsigned int last_block = -1;
+    int found = -1;
+    unsigned int run = 0;
+    // index right after the last used block
+    unsigned int last_block = 0;
+    if (extend_blocks == 0)
+        return -1;
+    fs->stats.allocs++;
+    fs->stats.bitmap_bits_scanned += blocks_count;
     for (unsigned int i = 0; i < blocks_count; i++)
-    {   
-        
-        if (check_bit((fs->block_bitmap_pointer)[i / 8], i % 8) == 0 && found == -1)
-        {   
-            if (i + extend_blocks > blocks_count) return -1;
-                
-            found = i;
-            for (unsigned int j = i + 1; j < i + extend_blocks - 1; j++){
-
-                if (check_bit((fs->block_bitmap_pointer)[j / 8], j % 8) > 0){
-                    found = -1;
-                    break;
-                }
+    {
+        if (check_bit((fs->block_bitmap_pointer)[i / 8], i % 8) == 0)
+        {
+            run++;
+            if (run == extend_blocks && found == -1)
+            {
+                found = i + 1 - extend_blocks;
             }
-
         }
-        if (check_bit((fs->block_bitmap_pointer)[i / 8], i % 8) > 0){
-            last_block = i;
+        else
+        {
+            run = 0;
+            last_block = i + 1;
         }
     }
-    last_block ++;
-    if (last_block + extend_blocks > blocks_count) return found;
-    for (unsigned int k = last_block; k < last_block + extend_blocks; k++){
-        if (check_bit((fs->block_bitmap_pointer)[k / 8], k % 8) > 0){
-            return found;
-            }
-    }
-    return last_block;
-    
+    if (blocks_count - last_block >= extend_blocks)
+        return last_block;
+    return found;
 }
 
 /**
@@ -242,28 +150,813 @@ static inline int get_consecutive_blk(fs_ctx* fs, unsigned int* longest_blocks_c
 {
     struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
     unsigned int blocks_count = sb->blocks_count;
-    int max = 0;
-    unsigned int i = 0;
+    unsigned int max = 0;
+    unsigned int run = 0;
     int start = -1;
-    while(i < blocks_count){
-        int count = 0;
-        if (check_bit((fs->block_bitmap_pointer)[i / 8], i % 8) == 0){
-            for (unsigned int j = i; j < blocks_count; j++){
-                if (check_bit((fs->block_bitmap_pointer)[j / 8], i % 8) == 0){
-                    count++;
-                }
-                else{
-                    break;
-                }
-            }
-            if (count > max){
-                start = i;
-                max = count;
+    fs->stats.allocs++;
+    fs->stats.bitmap_bits_scanned += blocks_count;
+    for (unsigned int i = 0; i < blocks_count; i++)
+    {
+        if (check_bit((fs->block_bitmap_pointer)[i / 8], i % 8) == 0)
+        {
+            run++;
+            if (run > max)
+            {
+                max = run;
+                start = i + 1 - run;
             }
-            i += count;
         }
-        else count++;
+        else
+        {
+            run = 0;
+        }
     }
     *longest_blocks_count = max;
     return start;
-}
\ No newline at end of file
+}
+
+/** Number of blocks in the extent, without the flag bits */
+static inline a1fs_blk_t extent_len(const struct a1fs_extent *e)
+{
+    return e->count & ~A1FS_EXTENT_UNWRITTEN;
+}
+
+/** Check if the extent is a hole (not backed by any blocks) */
+static inline bool extent_is_hole(const struct a1fs_extent *e)
+{
+    return e->start == 0;
+}
+
+/** Check if the extent is allocated but has never been written */
+static inline bool extent_is_unwritten(const struct a1fs_extent *e)
+{
+    return (e->count & A1FS_EXTENT_UNWRITTEN) != 0;
+}
+
+/** Get the extent table of given inode */
+static inline struct a1fs_extent *get_extent_table(fs_ctx *fs, const struct a1fs_inode *inode)
+{
+    return (struct a1fs_extent *)(fs->image + (size_t)inode->extent_table * A1FS_BLOCK_SIZE);
+}
+
+/** Get the superblock features, which pick the directory entry format */
+static inline uint32_t get_features(fs_ctx *fs)
+{
+    return ((struct a1fs_superblock *)fs->image)->features;
+}
+
+/** Get a block of the image */
+static inline unsigned char *get_blk(fs_ctx *fs, a1fs_blk_t blk)
+{
+    return (unsigned char *)fs->image + (size_t)blk * A1FS_BLOCK_SIZE;
+}
+
+/** An entry found in a directory */
+typedef struct dentry_ref
+{
+    /** Block the entry is in */
+    a1fs_blk_t blk;
+    /** Offset of the entry before it in the block; its own if it is the first */
+    uint32_t prev;
+    /** The entry */
+    a1fs_dir_rec rec;
+} dentry_ref;
+
+/**
+ * Find the entry with given name in a directory
+ * With name hashes, an entry's name is only compared if its hash matches
+ * Names that are not found are cached (see ncache.h), so that looking one up
+ * again skips the scan
+ * Return true and fill in ref if found, false if there is none
+ */
+static inline bool find_dentry(fs_ctx *fs, const struct a1fs_inode *dir, const char *name, dentry_ref *ref)
+{
+    if (ncache_lookup(fs, dir->inode, name))
+    {
+        fs->stats.negative_hits++;
+        return false;
+    }
+    uint32_t features = get_features(fs);
+    uint32_t name_len = strlen(name);
+    uint32_t hash = (features & A1FS_FEATURE_DIRENT_HASH) ? a1fs_name_hash(name, name_len) : 0;
+    struct a1fs_extent *table = get_extent_table(fs, dir);
+    for (unsigned int i = 0; i < dir->num_extents; i++)
+    {
+        // blocks freed from the middle of a directory leave holes
+        if (extent_is_hole(&table[i]))
+            continue;
+        for (a1fs_blk_t b = 0; b < extent_len(&table[i]); b++)
+        {
+            unsigned char *block = get_blk(fs, table[i].start + b);
+            a1fs_dir_rec rec = {0};
+            uint32_t prev = 0;
+            while (a1fs_dir_next(features, block, &rec))
+            {
+                fs->stats.dentries_scanned++;
+                if (rec.ino != 0 && rec.hash == hash && rec.name_len == name_len &&
+                    memcmp(name, rec.name, name_len) == 0)
+                {
+                    ref->blk = table[i].start + b;
+                    ref->prev = prev;
+                    ref->rec = rec;
+                    return true;
+                }
+                prev = rec.off;
+            }
+        }
+    }
+    ncache_add(fs, dir->inode, name);
+    return false;
+}
+
+/**
+ * Space the entry for a name takes in a directory's size, which is the sum
+ * over its entries
+ */
+static inline uint64_t dentry_size(fs_ctx *fs, const char *name)
+{
+    return a1fs_dirent_size(get_features(fs), strlen(name));
+}
+
+// find the inode with given path
+static inline int get_inode_by_path(fs_ctx *fs, const char *path, struct a1fs_inode *inode)
+{
+    if (path[0] != '/')
+    {
+        return -ENOTDIR;
+    }
+    if (strlen(path) >= A1FS_PATH_MAX)
+        return -ENAMETOOLONG;
+
+    char copy[A1FS_PATH_MAX];
+    strncpy(copy, path, strlen(path) + 1);
+    char *p = strtok(copy, "/");
+    if (p == NULL)
+    {
+        if (get_inode_by_inodenumber(fs, 0, inode) != 0)
+        {
+            return -ENOTDIR;
+        }
+        return 0;
+    }
+    struct a1fs_inode curr_inode;
+    get_inode_by_inodenumber(fs, 0, &curr_inode);
+    fs->stats.lookups++;
+    while (p != NULL)
+    {
+        if (strlen(p) > A1FS_NAME_MAX)
+        {
+            return -ENOENT;
+        }
+        dentry_ref ref;
+        if (!find_dentry(fs, &curr_inode, p, &ref))
+        {
+            return -ENOENT;
+        }
+        p = strtok(NULL, "/");
+        if (get_inode_by_inodenumber(fs, ref.rec.ino, &curr_inode) != 0)
+        {
+            return -ENOTDIR;
+        }
+        if (p != NULL && !(curr_inode.mode & S_IFDIR))
+        {
+            return -ENOTDIR;
+        }
+    }
+    *inode = curr_inode;
+    return 0;
+}
+
+/** Return the number of logical blocks covered by the extents of given inode, holes included */
+static inline uint64_t get_file_blocks(fs_ctx *fs, const struct a1fs_inode *inode)
+{
+    struct a1fs_extent *table = get_extent_table(fs, inode);
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < inode->num_extents; i++)
+    {
+        total += extent_len(&table[i]);
+    }
+    return total;
+}
+
+/** Return the number of data blocks actually allocated to given inode */
+static inline uint64_t get_allocated_blocks(fs_ctx *fs, const struct a1fs_inode *inode)
+{
+    struct a1fs_extent *table = get_extent_table(fs, inode);
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < inode->num_extents; i++)
+    {
+        if (!extent_is_hole(&table[i]))
+            total += extent_len(&table[i]);
+    }
+    return total;
+}
+
+/**
+ * Find the extent that maps logical block lblk of given inode
+ * Set offset to the position of lblk inside that extent
+ * Return the extent index, -1 if lblk is past the last extent
+ */
+static inline int find_extent(fs_ctx *fs, const struct a1fs_inode *inode, uint64_t lblk, a1fs_blk_t *offset)
+{
+    struct a1fs_extent *table = get_extent_table(fs, inode);
+    uint64_t pos = 0;
+    fs->stats.extent_lookups++;
+    for (unsigned int i = 0; i < inode->num_extents; i++)
+    {
+        a1fs_blk_t len = extent_len(&table[i]);
+        if (lblk < pos + len)
+        {
+            *offset = lblk - pos;
+            fs->stats.extents_walked += i + 1;
+            return i;
+        }
+        pos += len;
+    }
+    fs->stats.extents_walked += inode->num_extents;
+    return -1;
+}
+
+/**
+ * Mark count blocks starting at start as used
+ * Moves the clean watermark past them, since their contents are no longer
+ * known to be zero once they have been handed out
+ */
+static inline void claim_blk_range(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count)
+{
+    struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+    if (fs->discard != NULL)
+        discard_cancel(fs, start, count);
+    for (a1fs_blk_t i = 0; i < count; i++)
+    {
+        update_bitmap_by_index(fs->block_bitmap_pointer, start + i, 1);
+    }
+    sb->free_blocks_count -= count;
+    if (sb->clean_block_start != 0 && start + count > sb->clean_block_start)
+        sb->clean_block_start = start + count;
+}
+
+/**
+ * Mark the given range of blocks free
+ * The blocks are not zeroed here; they are remembered as dirty and zeroed
+ * when next allocated, so freeing costs the same for any file size
+ */
+static inline void free_blk_range(fs_ctx *fs, a1fs_blk_t start, a1fs_blk_t count)
+{
+    struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+    for (a1fs_blk_t i = 0; i < count; i++)
+    {
+        update_bitmap_by_index(fs->block_bitmap_pointer, start + i, 0);
+        update_bitmap_by_index(fs->dirty_bitmap, start + i, 1);
+    }
+    sb->free_blocks_count += count;
+    if (fs->discard != NULL)
+        discard_queue(fs, start, count);
+}
+
+/**
+ * Zero the parts of a newly mapped block outside [from, to), which the caller
+ * is about to write. Blocks known to be zero already are left alone
+ */
+static inline void zero_new_blk(fs_ctx *fs, a1fs_blk_t blk, size_t from, size_t to)
+{
+    if (check_bit(fs->dirty_bitmap[blk / 8], blk % 8) > 0)
+    {
+        unsigned char *block = fs->image + (size_t)blk * A1FS_BLOCK_SIZE;
+        memset(block, 0, from);
+        memset(block + to, 0, A1FS_BLOCK_SIZE - to);
+    }
+    update_bitmap_by_index(fs->dirty_bitmap, blk, 1);
+}
+
+/** Return the number of free blocks that are not reserved for delayed allocation */
+static inline unsigned int get_avail_blocks(fs_ctx *fs)
+{
+    struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+    return sb->free_blocks_count - fs->reserved_blocks;
+}
+
+/**
+ * Initialize the fixed inode table up to the end of the block that holds ino,
+ * if mkfs left that part uninitialized, and move the watermark past it.
+ * Every inode past the watermark is free, so the whole range can be zeroed.
+ */
+static inline void init_inode_table(fs_ctx *fs, unsigned int ino)
+{
+    struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+    unsigned int start = sb->uninit_inode_start;
+    if (start == 0 || ino < start || ino >= a1fs_table_inodes(sb))
+        return;
+    unsigned int end = (ino / A1FS_INODES_PER_BLOCK + 1) * A1FS_INODES_PER_BLOCK;
+    memset(a1fs_inode_at(fs->image, start), 0, (size_t)(end - start) * sizeof(struct a1fs_inode));
+    sb->uninit_inode_start = end;
+}
+
+/**
+ * Add inodes once all of them are in use: first the unused slots at the end of
+ * the fixed inode table, then a new inode table chunk from the data blocks.
+ * A chunk is only taken if it leaves a couple of blocks for the new entry
+ * Return the first new inode number or -1 if the inode table cannot grow
+ */
+static inline int grow_inode_table(fs_ctx *fs)
+{
+    struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+    unsigned int first = sb->inodes_count;
+    uint64_t table_inodes = a1fs_table_inodes(sb);
+    unsigned int added = first < table_inodes ? table_inodes - first : A1FS_INODE_CHUNK_INODES;
+    if ((uint64_t)sb->inode_bitmap_count * A1FS_BLOCK_SIZE * 8 < (uint64_t)first + added)
+        return -1;
+    if (first < table_inodes)
+        init_inode_table(fs, table_inodes - 1);
+    else
+    {
+        if (sb->inode_chunks_count >= A1FS_INODE_CHUNKS_MAX || get_avail_blocks(fs) < A1FS_INODE_CHUNK_BLOCKS + 2)
+            return -1;
+        int blk = get_blk_by_length(fs, A1FS_INODE_CHUNK_BLOCKS);
+        if (blk == -1)
+            return -1;
+        claim_blk_range(fs, blk, A1FS_INODE_CHUNK_BLOCKS);
+        for (int i = 0; i < A1FS_INODE_CHUNK_BLOCKS; i++)
+        {
+            update_bitmap_by_index(fs->dirty_bitmap, blk + i, 1);
+        }
+        sb->inode_chunks[sb->inode_chunks_count++] = blk;
+    }
+    for (unsigned int i = first; i < first + added; i++)
+    {
+        update_bitmap_by_index(fs->inode_bitmap_pointer, i, 0);
+    }
+    sb->inodes_count += added;
+    sb->free_inodes_count += added;
+    for (unsigned int i = first; i < first + added; i++)
+    {
+        memset(a1fs_inode_at(fs->image, i), 0, sizeof(struct a1fs_inode));
+    }
+    return first;
+}
+
+/** return free inode number, growing the inode table if needed; -1 if not available */
+static inline int get_free_ino(fs_ctx *fs)
+{
+    struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+    int inodes_count = sb->inodes_count;
+    fs->stats.allocs++;
+    if (sb->free_inodes_count > 0)
+    {
+        for (int i = 0; i < inodes_count; i++)
+        {
+            if (check_bit((fs->inode_bitmap_pointer)[i / 8], i % 8) == 0)
+            {
+                fs->stats.bitmap_bits_scanned += i + 1;
+                init_inode_table(fs, i);
+                return i;
+            }
+        }
+        fs->stats.bitmap_bits_scanned += inodes_count;
+    }
+    return grow_inode_table(fs);
+}
+
+/** Check if blocks [start, start + count) exist and are all free */
+static inline bool blk_range_is_free(fs_ctx *fs, a1fs_blk_t start, unsigned int count)
+{
+    struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+    if (start == 0 || start >= sb->blocks_count || count > sb->blocks_count - start)
+        return false;
+    for (a1fs_blk_t i = start; i < start + count; i++)
+    {
+        if (check_bit((fs->block_bitmap_pointer)[i / 8], i % 8) > 0)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Get the block that would continue the mapping of the file at logical block
+ * lblk, i.e. the block right after the nearest mapped block before lblk.
+ * Allocating there lets the extent grow in place instead of adding a new one.
+ * Return 0 if the file has no mapped blocks before lblk
+ */
+static inline a1fs_blk_t get_goal_blk(fs_ctx *fs, const struct a1fs_inode *inode, uint64_t lblk)
+{
+    struct a1fs_extent *table = get_extent_table(fs, inode);
+    a1fs_blk_t goal = 0;
+    uint64_t pos = 0;
+    for (unsigned int i = 0; i < inode->num_extents && pos < lblk; i++)
+    {
+        if (!extent_is_hole(&table[i]))
+            goal = table[i].start + (lblk - pos);
+        pos += extent_len(&table[i]);
+    }
+    return goal;
+}
+
+/**
+ * Allocate a single free block, preferring goal and then the first free block
+ * after it, so that consecutive allocations for a file stay contiguous
+ * Return the block number or -1 if not available
+ */
+static inline int alloc_blk_near(fs_ctx *fs, a1fs_blk_t goal)
+{
+    struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+    int blk = -1;
+    if (get_avail_blocks(fs) == 0)
+        return -1;
+    fs->stats.allocs++;
+    a1fs_blk_t i = goal;
+    for (; i < sb->blocks_count; i++)
+    {
+        if (check_bit((fs->block_bitmap_pointer)[i / 8], i % 8) == 0)
+        {
+            blk = i;
+            break;
+        }
+    }
+    fs->stats.bitmap_bits_scanned += (blk != -1 ? i + 1 : i) - goal;
+    if (blk == -1)
+        blk = get_free_blk(fs);
+    if (blk == -1)
+        return -1;
+    claim_blk_range(fs, blk, 1);
+    return blk;
+}
+
+/** Allocate a single free block, return its number or -1 if not available */
+static inline int alloc_blk(fs_ctx *fs)
+{
+    return alloc_blk_near(fs, 0);
+}
+
+/** Release the blocks backing an extent; holes own no blocks */
+static inline void free_extent(fs_ctx *fs, const struct a1fs_extent *e)
+{
+    if (!extent_is_hole(e))
+    {
+        free_blk_range(fs, e->start, extent_len(e));
+    }
+}
+
+/** Release the blocks mapped to logical blocks [lblk, lblk + len) by the given extent list */
+static inline void free_extent_list_range(fs_ctx *fs, const struct a1fs_extent *list, unsigned int n, uint64_t lblk, uint64_t len)
+{
+    uint64_t end = lblk + len;
+    uint64_t pos = 0;
+    for (unsigned int i = 0; i < n && pos < end; i++)
+    {
+        uint64_t next = pos + extent_len(&list[i]);
+        uint64_t from = pos > lblk ? pos : lblk;
+        uint64_t to = next < end ? next : end;
+        if (from < to && !extent_is_hole(&list[i]))
+        {
+            free_blk_range(fs, list[i].start + (from - pos), to - from);
+        }
+        pos = next;
+    }
+}
+
+/** Release the blocks mapped to logical blocks [lblk, lblk + len) of given inode */
+static inline void free_extent_range(fs_ctx *fs, const struct a1fs_inode *inode, uint64_t lblk, uint64_t len)
+{
+    free_extent_list_range(fs, get_extent_table(fs, inode), inode->num_extents, lblk, len);
+}
+
+/** Return the part of extent e that starts offset blocks in and is len blocks long */
+static inline struct a1fs_extent extent_slice(const struct a1fs_extent *e, a1fs_blk_t offset, a1fs_blk_t len)
+{
+    struct a1fs_extent slice;
+    slice.start = extent_is_hole(e) ? 0 : e->start + offset;
+    slice.count = len | (e->count & A1FS_EXTENT_UNWRITTEN);
+    return slice;
+}
+
+/**
+ * Append extent e to the list, merging it into the last extent when both are
+ * holes or both map physically adjacent blocks in the same (unwritten) state.
+ * Return false if the list is full
+ */
+static inline bool extent_push(struct a1fs_extent *list, unsigned int *n, struct a1fs_extent e)
+{
+    a1fs_blk_t len = extent_len(&e);
+    if (len == 0)
+        return true;
+    if (*n > 0)
+    {
+        struct a1fs_extent *last = &list[*n - 1];
+        a1fs_blk_t last_len = extent_len(last);
+        if (extent_is_hole(last) == extent_is_hole(&e) &&
+            extent_is_unwritten(last) == extent_is_unwritten(&e) &&
+            (extent_is_hole(&e) || last->start + last_len == e.start) &&
+            last_len <= A1FS_EXTENT_LEN_MAX - len)
+        {
+            last->count += len;
+            return true;
+        }
+    }
+    if (*n >= A1FS_EXTENTS_MAX)
+        return false;
+    list[(*n)++] = e;
+    return true;
+}
+
+/**
+ * Replace logical blocks [lblk, lblk + len) of given inode with extent e,
+ * which must be len blocks long (or empty to just drop the range). The range
+ * must start within (or right after) the blocks covered by the extent table.
+ * Blocks that were mapped in the range are not released.
+ * Neighbouring extents are merged where possible.
+ * Return 0 on success, -ENOSPC if the extent table would overflow
+ */
+static inline int replace_extent_range(fs_ctx *fs, struct a1fs_inode *inode, uint64_t lblk, uint64_t len, struct a1fs_extent e)
+{
+    struct a1fs_extent *table = get_extent_table(fs, inode);
+    struct a1fs_extent list[A1FS_EXTENTS_MAX];
+    unsigned int n = 0;
+    bool ok = true;
+    bool inserted = false;
+    uint64_t end = lblk + len;
+    uint64_t pos = 0;
+    for (unsigned int i = 0; i < inode->num_extents && ok; i++)
+    {
+        struct a1fs_extent curr = table[i];
+        uint64_t next = pos + extent_len(&curr);
+        if (pos < lblk)
+        {
+            uint64_t to = next < lblk ? next : lblk;
+            ok = extent_push(list, &n, extent_slice(&curr, 0, to - pos));
+        }
+        if (ok && !inserted && next > lblk)
+        {
+            ok = extent_push(list, &n, e);
+            inserted = true;
+        }
+        if (ok && next > end)
+        {
+            uint64_t from = pos > end ? pos : end;
+            ok = extent_push(list, &n, extent_slice(&curr, from - pos, next - from));
+        }
+        pos = next;
+    }
+    if (ok && !inserted)
+    {
+        ok = extent_push(list, &n, e);
+    }
+    if (!ok)
+    {
+        return -ENOSPC;
+    }
+    memcpy(table, list, sizeof(struct a1fs_extent) * n);
+    inode->num_extents = n;
+    return 0;
+}
+
+/**
+ * Back every hole in logical blocks [lblk, lblk + len) of given inode with
+ * unwritten blocks, extending the extent table past its end if needed.
+ * Each hole is filled with as few runs as possible, preferring a single
+ * run from get_blk_by_length(). Blocks that are already mapped are kept.
+ * Return 0 on success, -ENOSPC if out of blocks or extents
+ */
+static inline int prealloc_extent_range(fs_ctx *fs, struct a1fs_inode *inode, uint64_t lblk, uint64_t len)
+{
+    struct a1fs_extent *table = get_extent_table(fs, inode);
+    uint64_t end = lblk + len;
+    uint64_t file_blocks = get_file_blocks(fs, inode);
+    if (end > file_blocks)
+    {
+        struct a1fs_extent hole = {0, end - file_blocks};
+        int ret = replace_extent_range(fs, inode, file_blocks, hole.count, hole);
+        if (ret != 0)
+            return ret;
+    }
+
+    // Count the blocks needed up front so that we fail before allocating
+    uint64_t needed = 0;
+    for (uint64_t pos = lblk; pos < end;)
+    {
+        a1fs_blk_t offset;
+        struct a1fs_extent *extent = &table[find_extent(fs, inode, pos, &offset)];
+        uint64_t next = pos + extent_len(extent) - offset;
+        if (next > end)
+            next = end;
+        if (extent_is_hole(extent))
+            needed += next - pos;
+        pos = next;
+    }
+    if (needed > get_avail_blocks(fs))
+        return -ENOSPC;
+
+    uint64_t pos = lblk;
+    while (pos < end)
+    {
+        a1fs_blk_t offset;
+        struct a1fs_extent *extent = &table[find_extent(fs, inode, pos, &offset)];
+        uint64_t next = pos + extent_len(extent) - offset;
+        if (next > end)
+            next = end;
+        if (!extent_is_hole(extent))
+        {
+            pos = next;
+            continue;
+        }
+        unsigned int count = next - pos;
+        // Continue the previous extent if possible, so the file stays in one piece
+        a1fs_blk_t goal = get_goal_blk(fs, inode, pos);
+        int start = blk_range_is_free(fs, goal, count) ? (int)goal : get_blk_by_length(fs, count);
+        if (start == -1)
+        {
+            // No run is long enough, take the longest one available
+            start = get_consecutive_blk(fs, &count);
+            if (start == -1)
+                return -ENOSPC;
+        }
+        struct a1fs_extent unwritten = {start, count | A1FS_EXTENT_UNWRITTEN};
+        int ret = replace_extent_range(fs, inode, pos, count, unwritten);
+        if (ret != 0)
+            return ret;
+        claim_blk_range(fs, start, count);
+        pos += count;
+    }
+    return 0;
+}
+
+/**
+ * Turn logical blocks [lblk, lblk + len) of given inode into a hole and
+ * release the blocks that were mapped there. The range is clipped to the
+ * blocks covered by the extent table.
+ * Return 0 on success, -ENOSPC if the extent table would overflow
+ */
+static inline int punch_extent_range(fs_ctx *fs, struct a1fs_inode *inode, uint64_t lblk, uint64_t len)
+{
+    uint64_t file_blocks = get_file_blocks(fs, inode);
+    if (lblk >= file_blocks)
+        return 0;
+    if (len > file_blocks - lblk)
+        len = file_blocks - lblk;
+
+    struct a1fs_extent old[A1FS_EXTENTS_MAX];
+    unsigned int old_count = inode->num_extents;
+    memcpy(old, get_extent_table(fs, inode), sizeof(struct a1fs_extent) * old_count);
+    struct a1fs_extent hole = {0, len};
+    int ret = replace_extent_range(fs, inode, lblk, len, hole);
+    if (ret != 0)
+        return ret;
+    free_extent_list_range(fs, old, old_count, lblk, len);
+    return 0;
+}
+
+/**
+ * Mark the written blocks in logical blocks [lblk, lblk + len) of given
+ * inode as unwritten, so that they read as zeros without touching the data.
+ * Return 0 on success, -ENOSPC if the extent table would overflow
+ */
+static inline int unwrite_extent_range(fs_ctx *fs, struct a1fs_inode *inode, uint64_t lblk, uint64_t len)
+{
+    struct a1fs_extent *table = get_extent_table(fs, inode);
+    uint64_t end = lblk + len;
+    uint64_t file_blocks = get_file_blocks(fs, inode);
+    if (end > file_blocks)
+        end = file_blocks;
+    uint64_t pos = lblk;
+    while (pos < end)
+    {
+        a1fs_blk_t offset;
+        struct a1fs_extent *extent = &table[find_extent(fs, inode, pos, &offset)];
+        uint64_t next = pos + extent_len(extent) - offset;
+        if (next > end)
+            next = end;
+        if (!extent_is_hole(extent) && !extent_is_unwritten(extent))
+        {
+            struct a1fs_extent unwritten = {extent->start + offset, (next - pos) | A1FS_EXTENT_UNWRITTEN};
+            int ret = replace_extent_range(fs, inode, pos, next - pos, unwritten);
+            if (ret != 0)
+                return ret;
+        }
+        pos = next;
+    }
+    return 0;
+}
+
+/**
+ * Back logical block lblk of a directory, a hole left by a freed block or the
+ * block right after its end, with a new zeroed block placed near the blocks
+ * before it, so that it extends their extent when it can
+ * Return the new block number, -1 if out of blocks or extents
+ */
+static inline int add_dir_blk(fs_ctx *fs, struct a1fs_inode *dir_inode, uint64_t lblk)
+{
+    int blk = alloc_blk_near(fs, get_goal_blk(fs, dir_inode, lblk));
+    if (blk == -1)
+        return -1;
+    struct a1fs_extent extent = {blk, 1};
+    if (replace_extent_range(fs, dir_inode, lblk, 1, extent) != 0)
+    {
+        free_blk_range(fs, blk, 1);
+        return -1;
+    }
+    // the caller writes the first entry; free fixed-size slots are zeroed
+    zero_new_blk(fs, blk, 0, 0);
+    return blk;
+}
+
+/**
+ * Add an entry to a directory, in the first free entry or free space after an
+ * entry that is large enough, or else in a new block that fills its first hole
+ * or goes at its end
+ * The caller updates the directory's entry count, size and mtime and writes
+ * dir_inode back
+ * Return 0 on success, -ENOSPC if out of blocks or extents
+ */
+static inline int add_dentry(fs_ctx *fs, struct a1fs_inode *dir_inode, const char *name, a1fs_ino_t ino)
+{
+    // names cached as missing in this directory may be the one being added
+    ncache_dir_changed(fs, dir_inode->inode);
+    uint32_t features = get_features(fs);
+    uint32_t need = a1fs_dirent_size(features, strlen(name));
+    struct a1fs_extent *table = get_extent_table(fs, dir_inode);
+    uint64_t pos = 0;
+    uint64_t hole = UINT64_MAX;
+    for (unsigned int i = 0; i < dir_inode->num_extents; i++)
+    {
+        a1fs_blk_t len = extent_len(&table[i]);
+        if (extent_is_hole(&table[i]))
+        {
+            if (hole == UINT64_MAX)
+                hole = pos;
+            pos += len;
+            continue;
+        }
+        for (a1fs_blk_t b = 0; b < len; b++)
+        {
+            unsigned char *block = get_blk(fs, table[i].start + b);
+            a1fs_dir_rec rec = {0};
+            while (a1fs_dir_next(features, block, &rec))
+            {
+                if (rec.ino == 0 && rec.len >= need)
+                {
+                    a1fs_dir_write(features, block, rec.off, rec.len, ino, name);
+                    return 0;
+                }
+                // split the free space off the end of a variable-length entry
+                uint32_t used = a1fs_dirent_size(features, rec.name_len);
+                if (rec.ino != 0 && rec.len - used >= need)
+                {
+                    a1fs_dir_set_len(features, block, rec.off, used);
+                    a1fs_dir_write(features, block, rec.off + used, rec.len - used, ino, name);
+                    return 0;
+                }
+            }
+        }
+        pos += len;
+    }
+    int blk = add_dir_blk(fs, dir_inode, hole != UINT64_MAX ? hole : pos);
+    if (blk == -1)
+        return -ENOSPC;
+    // the new entry takes the whole block; free fixed-size slots are zeroed
+    a1fs_dir_write(features, get_blk(fs, blk), 0, A1FS_BLOCK_SIZE, ino, name);
+    return 0;
+}
+
+/**
+ * Remove an entry from a directory. A block left with no entries is freed and
+ * becomes a hole in the extent table, so that the entries after it keep their
+ * positions (which are the readdir offsets); holes merge with their neighbours
+ * and a hole at the end is dropped. If the extent table has no room to split
+ * an extent, the empty block is kept
+ * The caller updates the directory's entry count, size and mtime and writes
+ * dir_inode back
+ */
+static inline void remove_dentry(fs_ctx *fs, struct a1fs_inode *dir_inode, const dentry_ref *ref)
+{
+    uint32_t features = get_features(fs);
+    a1fs_blk_t blk = ref->blk;
+    unsigned char *block = get_blk(fs, blk);
+    // a variable-length entry gives its space to the one before it
+    if ((features & A1FS_FEATURE_DIRENT) && ref->prev != ref->rec.off)
+        a1fs_dir_set_len(features, block, ref->prev, ref->rec.off + ref->rec.len - ref->prev);
+    else
+        a1fs_dir_write(features, block, ref->rec.off, ref->rec.len, 0, "");
+    a1fs_dir_rec rec = {0};
+    while (a1fs_dir_next(features, block, &rec))
+    {
+        if (rec.ino != 0)
+            return;
+    }
+
+    struct a1fs_extent *table = get_extent_table(fs, dir_inode);
+    uint64_t pos = 0;
+    for (unsigned int i = 0; i < dir_inode->num_extents; i++)
+    {
+        a1fs_blk_t len = extent_len(&table[i]);
+        if (!extent_is_hole(&table[i]) && blk >= table[i].start && blk - table[i].start < len)
+        {
+            struct a1fs_extent hole = {0, 1};
+            if (replace_extent_range(fs, dir_inode, pos + (blk - table[i].start), 1, hole) != 0)
+                return;
+            free_blk_range(fs, blk, 1);
+            if (dir_inode->num_extents > 0 && extent_is_hole(&table[dir_inode->num_extents - 1]))
+                dir_inode->num_extents--;
+            return;
+        }
+        pos += len;
+    }
+}
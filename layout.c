@@ -0,0 +1,540 @@
+/**
+ * a1fs layout and fragmentation report.
+ *
+ * Reads an unmounted image and reports how its space is laid out, as JSON
+ * lines (one object per line, like a1fs-bench):
+ *
+ *   - "summary": block and inode usage, free space runs and the largest free
+ *     extent, inode table utilization, file fragmentation and directory fill;
+ *   - "free_runs": a histogram of free space run lengths, one line per
+ *     power-of-two bucket;
+ *   - "file_extents": a histogram of data fragments per file;
+ *   - "file": one line per file or directory, most fragmented first (-f, -a).
+ *
+ * A fragment is a run of extents that are contiguous on disk; a file written
+ * in one go has a single fragment even if it is described by several extents.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "map.h"
+
+
+/** Number of power-of-two histogram buckets; enough for any 32-bit length. */
+#define LAYOUT_BUCKETS 33
+
+/** Command line options. */
+typedef struct layout_opts
+{
+	/** File system image file path. */
+	const char *img_path;
+	/** Number of most fragmented files to list. */
+	size_t n_worst;
+	/** List every file. */
+	bool all;
+
+	/** Print help and exit. */
+	bool help;
+
+} layout_opts;
+
+/** Per-file layout. */
+typedef struct file_layout
+{
+	a1fs_ino_t ino;
+	/** Extents in the extent table, holes included. */
+	uint32_t extents;
+	/** Runs of extents contiguous on disk. */
+	uint32_t fragments;
+	/** Data blocks. */
+	uint64_t blocks;
+
+} file_layout;
+
+/** A power-of-two histogram: bucket i counts values in [2^i, 2^(i+1)). */
+typedef struct histogram
+{
+	uint64_t count[LAYOUT_BUCKETS];
+	uint64_t sum[LAYOUT_BUCKETS];
+
+} histogram;
+
+/** Report state. */
+typedef struct layout_ctx
+{
+	/** Mapped image. */
+	void *image;
+	/** Image size in bytes. */
+	size_t size;
+	/** Superblock. */
+	a1fs_superblock *sb;
+	const unsigned char *inode_bitmap;
+	const unsigned char *block_bitmap;
+
+	/** Parent directory and name of each linked inode, for file paths. */
+	a1fs_ino_t *parent;
+	const char **name;
+
+	/** Layout of each file and directory in use. */
+	file_layout *files;
+	size_t n_files;
+
+} layout_ctx;
+
+static const char *help_str = "\
+Usage: %s [options] image\n\
+\n\
+Report the layout of an unmounted a1fs image as JSON lines: free space\n\
+runs, the largest free extent, inode table utilization, extents and\n\
+fragments per file, and how full directory blocks are.\n\
+\n\
+Options:\n\
+    -f num  list the num most fragmented files; default: 10\n\
+    -a      list every file, most fragmented first\n\
+    -h      print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+static bool parse_args(int argc, char *argv[], layout_opts *opts)
+{
+	int o;
+	while ((o = getopt(argc, argv, "f:ah")) != -1)
+	{
+		switch (o)
+		{
+		case 'f':
+			opts->n_worst = strtoul(optarg, NULL, 10);
+			break;
+		case 'a':
+			opts->all = true;
+			break;
+
+		case 'h':
+			opts->help = true;
+			return true; // skip other arguments
+
+		case '?':
+			return false;
+		default:
+			return false;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		fprintf(stderr, "Missing image path\n");
+		return false;
+	}
+	opts->img_path = argv[optind];
+	return true;
+}
+
+static bool test_bit(const unsigned char *bitmap, uint64_t idx)
+{
+	return (bitmap[idx / 8] >> (idx % 8)) & 1;
+}
+
+static a1fs_blk_t extent_len(const a1fs_extent *e)
+{
+	return e->count & ~A1FS_EXTENT_UNWRITTEN;
+}
+
+/** Check that an extent with data lies within the data blocks. */
+static bool extent_ok(const layout_ctx *ctx, const a1fs_extent *e)
+{
+	a1fs_blk_t len = extent_len(e);
+	return e->start >= ctx->sb->first_data_block && e->start < ctx->sb->blocks_count &&
+		   len <= ctx->sb->blocks_count - e->start;
+}
+
+/** Check that an inode is a file or directory with a valid extent table. */
+static bool inode_ok(const layout_ctx *ctx, a1fs_ino_t ino)
+{
+	if (ino >= ctx->sb->inodes_count || !test_bit(ctx->inode_bitmap, ino))
+		return false;
+	const a1fs_inode *inode = a1fs_inode_at(ctx->image, ino);
+	return (S_ISDIR(inode->mode) || S_ISREG(inode->mode)) &&
+		   inode->extent_table >= ctx->sb->first_data_block && inode->extent_table < ctx->sb->blocks_count;
+}
+
+static const a1fs_extent *extent_table(const layout_ctx *ctx, const a1fs_inode *inode)
+{
+	return (const a1fs_extent *)(ctx->image + (size_t)inode->extent_table * A1FS_BLOCK_SIZE);
+}
+
+/** Number of extents to look at; never more than fit in the table. */
+static unsigned int extent_count(const a1fs_inode *inode)
+{
+	return inode->num_extents < A1FS_EXTENTS_MAX ? inode->num_extents : A1FS_EXTENTS_MAX;
+}
+
+static void hist_add(histogram *h, uint64_t value)
+{
+	int b = value > 0 ? 63 - __builtin_clzll(value) : 0;
+	if (b >= LAYOUT_BUCKETS)
+		b = LAYOUT_BUCKETS - 1;
+	h->count[b]++;
+	h->sum[b] += value;
+}
+
+static double ratio(uint64_t num, uint64_t den)
+{
+	return den > 0 ? (double)num / den : 0;
+}
+
+/** Print a string as a JSON string literal. */
+static void json_string(const char *s)
+{
+	putchar('"');
+	for (; *s != '\0'; s++)
+	{
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+/** Print the path of a linked inode; unlinked inodes get "?". */
+static void json_path(const layout_ctx *ctx, a1fs_ino_t ino)
+{
+	char path[A1FS_PATH_MAX];
+	size_t pos = sizeof(path) - 1;
+	path[pos] = '\0';
+	if (ino == 0)
+		path[--pos] = '/';
+	for (a1fs_ino_t cur = ino; cur != 0; cur = ctx->parent[cur])
+	{
+		const char *name = ctx->name[cur];
+		size_t len = name != NULL ? strlen(name) : 1;
+		if (len + 1 > pos)
+			break;
+		pos -= len;
+		memcpy(path + pos, name != NULL ? name : "?", len);
+		path[--pos] = '/';
+		if (name == NULL)
+			break;
+	}
+	json_string(path + pos);
+}
+
+/** Record the parent and name of every inode reachable from the root. */
+static void walk_tree(layout_ctx *ctx)
+{
+	a1fs_ino_t *queue = malloc(ctx->sb->inodes_count * sizeof(a1fs_ino_t));
+	unsigned char *seen = calloc(ctx->sb->inodes_count, 1);
+	if (queue == NULL || seen == NULL)
+	{
+		free(queue);
+		free(seen);
+		return;
+	}
+	size_t head = 0, tail = 0;
+	queue[tail++] = 0;
+	seen[0] = 1;
+	while (head < tail)
+	{
+		a1fs_ino_t dir = queue[head++];
+		if (!inode_ok(ctx, dir) || !S_ISDIR(a1fs_inode_at(ctx->image, dir)->mode))
+			continue;
+		const a1fs_inode *inode = a1fs_inode_at(ctx->image, dir);
+		const a1fs_extent *table = extent_table(ctx, inode);
+		for (unsigned int i = 0; i < extent_count(inode); i++)
+		{
+			if (table[i].start == 0 || !extent_ok(ctx, &table[i]))
+				continue;
+			for (a1fs_blk_t b = 0; b < extent_len(&table[i]); b++)
+			{
+				const unsigned char *block = ctx->image + (size_t)(table[i].start + b) * A1FS_BLOCK_SIZE;
+				a1fs_dir_rec rec = {0};
+				while (a1fs_dir_next(ctx->sb->features, block, &rec))
+				{
+					a1fs_ino_t ino = rec.ino;
+					if (ino == 0 || ino >= ctx->sb->inodes_count || seen[ino])
+						continue;
+					seen[ino] = 1;
+					ctx->parent[ino] = dir;
+					ctx->name[ino] = rec.name;
+					queue[tail++] = ino;
+				}
+			}
+		}
+	}
+	free(queue);
+	free(seen);
+}
+
+/** Scan the block bitmap for runs of free blocks. */
+static void report_free_space(const layout_ctx *ctx, histogram *runs, uint64_t *n_runs, a1fs_blk_t *largest,
+							  a1fs_blk_t *largest_start)
+{
+	const a1fs_superblock *sb = ctx->sb;
+	a1fs_blk_t run = 0;
+	for (a1fs_blk_t b = 0; b <= sb->blocks_count; b++)
+	{
+		if (b < sb->blocks_count && !test_bit(ctx->block_bitmap, b))
+		{
+			run++;
+			continue;
+		}
+		if (run == 0)
+			continue;
+		hist_add(runs, run);
+		(*n_runs)++;
+		if (run > *largest)
+		{
+			*largest = run;
+			*largest_start = b - run;
+		}
+		run = 0;
+	}
+}
+
+static int cmp_fragments(const void *a, const void *b)
+{
+	const file_layout *fa = (const file_layout *)a, *fb = (const file_layout *)b;
+	if (fa->fragments != fb->fragments)
+		return fa->fragments < fb->fragments ? 1 : -1;
+	if (fa->extents != fb->extents)
+		return fa->extents < fb->extents ? 1 : -1;
+	return fa->ino < fb->ino ? -1 : fa->ino > fb->ino;
+}
+
+static void print_histogram(const char *kind, const char *what, const histogram *h)
+{
+	for (int b = 0; b < LAYOUT_BUCKETS; b++)
+	{
+		if (h->count[b] == 0)
+			continue;
+		printf("{\"layout\":\"%s\",\"min\":%llu,\"max\":%llu,\"count\":%lu,\"%s\":%lu}\n", kind, 1ull << b,
+			   (2ull << b) - 1, (unsigned long)h->count[b], what, (unsigned long)h->sum[b]);
+	}
+}
+
+/** Check the superblock fields the report relies on. */
+static bool superblock_ok(const layout_ctx *ctx)
+{
+	const a1fs_superblock *sb = ctx->sb;
+	if (sb->magic != A1FS_MAGIC)
+	{
+		fprintf(stderr, "Image does not contain a1fs\n");
+		return false;
+	}
+	if (!a1fs_features_ok(sb))
+	{
+		fprintf(stderr, "Image uses unsupported features (0x%x)\n", sb->features);
+		return false;
+	}
+	if ((uint64_t)sb->blocks_count * A1FS_BLOCK_SIZE > ctx->size || sb->first_data_block >= sb->blocks_count ||
+		sb->inodes_count == 0 ||
+		!a1fs_inode_layout_ok(sb) ||
+		(uint64_t)sb->block_bitmap_count * A1FS_BLOCK_SIZE * 8 < sb->blocks_count ||
+		(uint64_t)sb->first_blo_bitmap + sb->block_bitmap_count > sb->blocks_count ||
+		(uint64_t)sb->inode_bitmap_count * A1FS_BLOCK_SIZE * 8 < sb->inodes_count)
+	{
+		fprintf(stderr, "Superblock is damaged; run fsck.a1fs\n");
+		return false;
+	}
+	return true;
+}
+
+static void report(layout_ctx *ctx, const layout_opts *opts)
+{
+	const a1fs_superblock *sb = ctx->sb;
+
+	// Free space
+	histogram free_runs = {0};
+	uint64_t n_free_runs = 0;
+	a1fs_blk_t largest = 0, largest_start = 0;
+	report_free_space(ctx, &free_runs, &n_free_runs, &largest, &largest_start);
+	uint64_t free_blocks = 0;
+	for (int b = 0; b < LAYOUT_BUCKETS; b++)
+		free_blocks += free_runs.sum[b];
+
+	// Inodes, files and directories
+	uint64_t inodes_used = 0, table_blocks_used = 0, highest_ino = 0;
+	uint64_t n_regular = 0, n_dirs = 0, n_empty = 0, n_fragmented = 0, file_fragments = 0, file_extents = 0;
+	uint64_t dir_blocks = 0, dir_slots = 0, dir_used = 0, dir_entries = 0, dir_empty_blocks = 0, dirs_under_half = 0;
+	histogram fragments = {0};
+	bool block_used = false;
+	for (a1fs_ino_t ino = 0; ino < sb->inodes_count; ino++)
+	{
+		if (ino % A1FS_INODES_PER_BLOCK == 0)
+			block_used = false;
+		if (!test_bit(ctx->inode_bitmap, ino))
+			continue;
+		inodes_used++;
+		highest_ino = ino;
+		if (!block_used)
+		{
+			table_blocks_used++;
+			block_used = true;
+		}
+		if (!inode_ok(ctx, ino))
+			continue;
+
+		const a1fs_inode *inode = a1fs_inode_at(ctx->image, ino);
+		const a1fs_extent *table = extent_table(ctx, inode);
+		bool is_dir = S_ISDIR(inode->mode);
+		file_layout *fl = &ctx->files[ctx->n_files++];
+		*fl = (file_layout){ino, extent_count(inode), 0, 0};
+		uint64_t slots = 0, used = 0, entries = 0;
+		a1fs_blk_t prev_end = 0;
+		for (unsigned int i = 0; i < extent_count(inode); i++)
+		{
+			if (table[i].start == 0 || !extent_ok(ctx, &table[i]))
+				continue;
+			a1fs_blk_t len = extent_len(&table[i]);
+			if (table[i].start != prev_end)
+				fl->fragments++;
+			prev_end = table[i].start + len;
+			fl->blocks += len;
+			if (!is_dir)
+				continue;
+
+			// the fill counts slots taken, as entries may differ in size
+			const uint32_t slot_size = a1fs_dir_slot_size(ctx->sb->features);
+			for (a1fs_blk_t blk = 0; blk < len; blk++)
+			{
+				const unsigned char *block = ctx->image + (size_t)(table[i].start + blk) * A1FS_BLOCK_SIZE;
+				a1fs_dir_rec rec = {0};
+				size_t in_block = 0;
+				while (a1fs_dir_next(ctx->sb->features, block, &rec))
+				{
+					if (rec.ino == 0)
+						continue;
+					in_block++;
+					used += a1fs_dirent_size(ctx->sb->features, rec.name_len) / slot_size;
+				}
+				entries += in_block;
+				if (in_block == 0)
+					dir_empty_blocks++;
+			}
+			slots += (uint64_t)len * A1FS_BLOCK_SIZE / slot_size;
+		}
+
+		if (is_dir)
+		{
+			n_dirs++;
+			dir_blocks += fl->blocks;
+			dir_slots += slots;
+			dir_used += used;
+			dir_entries += entries;
+			if (fl->blocks > 1 && used * 2 < slots)
+				dirs_under_half++;
+			continue;
+		}
+		n_regular++;
+		file_extents += fl->extents;
+		if (fl->fragments == 0)
+		{
+			n_empty++;
+			continue;
+		}
+		file_fragments += fl->fragments;
+		if (fl->fragments > 1)
+			n_fragmented++;
+		hist_add(&fragments, fl->fragments);
+	}
+	uint64_t with_data = n_regular - n_empty;
+
+	printf("{\"layout\":\"summary\",\"blocks\":%u,\"free_blocks\":%lu,\"first_data_block\":%u,"
+		   "\"clean_block_start\":%u,\"free_runs\":%lu,\"largest_free_run\":%u,\"largest_free_run_start\":%u,"
+		   "\"mean_free_run\":%.1f,\"free_in_largest_run\":%.4f,",
+		   sb->blocks_count, (unsigned long)free_blocks, sb->first_data_block, sb->clean_block_start,
+		   (unsigned long)n_free_runs, largest, largest_start, ratio(free_blocks, n_free_runs),
+		   ratio(largest, free_blocks));
+	printf("\"inodes\":%u,\"inodes_used\":%lu,\"inode_utilization\":%.4f,\"highest_inode\":%lu,"
+		   "\"inode_table_blocks\":%u,\"inode_chunks\":%u,\"inode_table_blocks_used\":%lu,",
+		   sb->inodes_count, (unsigned long)inodes_used, ratio(inodes_used, sb->inodes_count),
+		   (unsigned long)highest_ino, sb->inode_table_count + sb->inode_chunks_count * A1FS_INODE_CHUNK_BLOCKS,
+		   sb->inode_chunks_count, (unsigned long)table_blocks_used);
+	printf("\"files\":%lu,\"empty_files\":%lu,\"fragmented_files\":%lu,\"fragmented_ratio\":%.4f,"
+		   "\"extents_per_file\":%.2f,\"fragments_per_file\":%.2f,",
+		   (unsigned long)n_regular, (unsigned long)n_empty, (unsigned long)n_fragmented,
+		   ratio(n_fragmented, with_data), ratio(file_extents, n_regular), ratio(file_fragments, with_data));
+	printf("\"dirs\":%lu,\"dir_blocks\":%lu,\"dir_slots\":%lu,\"dir_entries\":%lu,\"dir_fill\":%.4f,"
+		   "\"dir_empty_blocks\":%lu,\"dirs_under_half_full\":%lu}\n",
+		   (unsigned long)n_dirs, (unsigned long)dir_blocks, (unsigned long)dir_slots, (unsigned long)dir_entries,
+		   ratio(dir_used, dir_slots), (unsigned long)dir_empty_blocks, (unsigned long)dirs_under_half);
+
+	print_histogram("free_runs", "blocks", &free_runs);
+	print_histogram("file_extents", "fragments", &fragments);
+
+	size_t n_list = opts->all ? ctx->n_files : opts->n_worst < ctx->n_files ? opts->n_worst : ctx->n_files;
+	qsort(ctx->files, ctx->n_files, sizeof(file_layout), cmp_fragments);
+	for (size_t i = 0; i < n_list; i++)
+	{
+		const file_layout *fl = &ctx->files[i];
+		const a1fs_inode *inode = a1fs_inode_at(ctx->image, fl->ino);
+		printf("{\"layout\":\"file\",\"ino\":%u,\"type\":\"%s\",\"path\":", fl->ino,
+			   S_ISDIR(inode->mode) ? "dir" : "file");
+		json_path(ctx, fl->ino);
+		printf(",\"size\":%lu,\"blocks\":%lu,\"extents\":%u,\"fragments\":%u}\n", (unsigned long)inode->size,
+			   (unsigned long)fl->blocks, fl->extents, fl->fragments);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	layout_opts opts = {.n_worst = 10};
+	if (!parse_args(argc, argv, &opts))
+	{
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help)
+	{
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	layout_ctx ctx = {0};
+	ctx.image = map_file(opts.img_path, A1FS_BLOCK_SIZE, &ctx.size);
+	if (ctx.image == NULL)
+		return 1;
+	ctx.sb = (a1fs_superblock *)ctx.image;
+
+	int ret = 1;
+	if (!superblock_ok(&ctx))
+		goto end;
+	a1fs_superblock *sb = ctx.sb;
+	ctx.inode_bitmap = (const unsigned char *)ctx.image + (size_t)sb->first_ino_bitmap * A1FS_BLOCK_SIZE;
+	ctx.block_bitmap = (const unsigned char *)ctx.image + (size_t)sb->first_blo_bitmap * A1FS_BLOCK_SIZE;
+	ctx.parent = calloc(sb->inodes_count, sizeof(a1fs_ino_t));
+	ctx.name = calloc(sb->inodes_count, sizeof(const char *));
+	ctx.files = malloc(sb->inodes_count * sizeof(file_layout));
+	if (ctx.parent == NULL || ctx.name == NULL || ctx.files == NULL)
+	{
+		perror("malloc");
+		goto end;
+	}
+
+	walk_tree(&ctx);
+	report(&ctx, &opts);
+	ret = 0;
+
+end:
+	free(ctx.parent);
+	free(ctx.name);
+	free(ctx.files);
+	munmap(ctx.image, ctx.size);
+	return ret;
+}
@@ -16,17 +16,22 @@
  * CSC369 Assignment 1 - a1fs formatting tool.
  */
 
+// fallocate() is a GNU extension
+#define _GNU_SOURCE
+
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
-#include <time.h>
-#include "helper.h"
+#include <linux/falloc.h>
 
 #include "a1fs.h"
+#include "format.h"
 #include "map.h"
+#include "populate.h"
 
 /** Command line options. */
 typedef struct mkfs_opts
@@ -42,36 +47,55 @@ typedef struct mkfs_opts
 	bool force;
 	/** Zero out image contents. */
 	bool zero;
+	/** Directory to copy into the image; NULL for an empty file system. */
+	const char *src_dir;
+	/** Number of threads that copy file data. */
+	unsigned int n_threads;
+	/** Feature flags (the directory entry format). */
+	unsigned int features;
 
 } mkfs_opts;
 
 static const char *help_str = "\
-Usage: %s options image\n\
+Usage: %s [options] image\n\
 \n\
 Format the image file into a1fs file system. The file must exist and\n\
 its size must be a multiple of a1fs block size - %zu bytes.\n\
 \n\
 Options:\n\
-    -i num  number of inodes; required argument\n\
+    -i num  number of inodes in the initial inode table; more are\n\
+            added from free blocks as needed; default: %zu, or what\n\
+            the tree needs with -d\n\
     -h      print help and exit\n\
     -f      force format - overwrite existing a1fs file system\n\
     -z      zero out image contents\n\
+    -d dir  copy the contents of dir into the image\n\
+    -j num  number of threads that copy file data with -d;\n\
+            defaults to the number of CPUs\n\
+    -e fmt  directory entry format: fixed (%zu bytes per entry),\n\
+            var (sized to the name) or hash (var with a stored name\n\
+            hash, compared before the name); default: fixed\n\
 ";
 
 static void print_help(FILE *f, const char *progname)
 {
-	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE);
+	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE, A1FS_INODES_PER_BLOCK, sizeof(a1fs_dentry));
 }
 
 static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 {
 	char o;
-	while ((o = getopt(argc, argv, "i:hfvz")) != -1)
+	while ((o = getopt(argc, argv, "i:hfvzd:j:e:")) != -1)
 	{
 		switch (o)
 		{
 		case 'i':
 			opts->n_inodes = strtoul(optarg, NULL, 10);
+			if (opts->n_inodes == 0)
+			{
+				fprintf(stderr, "Invalid number of inodes\n");
+				return false;
+			}
 			break;
 
 		case 'h':
@@ -83,6 +107,24 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 		case 'z':
 			opts->zero = true;
 			break;
+		case 'd':
+			opts->src_dir = optarg;
+			break;
+		case 'j':
+			opts->n_threads = strtoul(optarg, NULL, 10);
+			if (opts->n_threads == 0)
+			{
+				fprintf(stderr, "Invalid number of threads\n");
+				return false;
+			}
+			break;
+		case 'e':
+			if (!fs_parse_dir_format(optarg, &opts->features))
+			{
+				fprintf(stderr, "Unknown directory entry format %s\n", optarg);
+				return false;
+			}
+			break;
 
 		case '?':
 			return false;
@@ -97,12 +139,6 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 		return false;
 	}
 	opts->img_path = argv[optind];
-
-	if (opts->n_inodes == 0)
-	{
-		fprintf(stderr, "Missing or invalid number of inodes\n");
-		return false;
-	}
 	return true;
 }
 
@@ -118,11 +154,40 @@ static bool a1fs_is_present(void *image)
 	return true;
 }
 
+/**
+ * Punch a range out of the image file so that it reads as zeros, without
+ * writing it. Return false if the file system holding the image cannot.
+ */
+static bool punch_range(const char *img_path, off_t start, off_t len)
+{
+	if (len <= 0)
+		return true;
+	int fd = open(img_path, O_RDWR);
+	if (fd < 0)
+		return false;
+	bool ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, len) == 0;
+	close(fd);
+	return ret;
+}
+
+/**
+ * Make the data blocks of a freshly formatted image read as zeros, as
+ * fs_format() expects. If they cannot be punched out, the clean watermark is
+ * cleared instead, and blocks are zeroed as they are allocated.
+ */
+static void clear_data_blocks(void *image, const mkfs_opts *opts)
+{
+	a1fs_superblock *sb = (a1fs_superblock *)image;
+	if (opts->zero)
+		return; // the whole image is zeros already
+	off_t start = (off_t)(sb->first_data_block + 1) * A1FS_BLOCK_SIZE;
+	if (!punch_range(opts->img_path, start, (off_t)sb->blocks_count * A1FS_BLOCK_SIZE - start))
+		sb->clean_block_start = 0;
+}
+
 /**
  * Format the image into a1fs.
  *
- * NOTE: Must update mtime of the root directory.
- *
  * @param image  pointer to the start of the image.
  * @param size   image size in bytes.
  * @param opts   command line options.
@@ -131,71 +196,39 @@ static bool a1fs_is_present(void *image)
  */
 static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 {
-	//TODO: initialize the superblock and create an empty root directory
-	//NOTE: the mode of the root directory inode should be set to S_IFDIR | 0777
-	if (image == NULL || size == 0 || opts == NULL)
+	if (opts->src_dir == NULL)
 	{
-		return false;
+		// The inode table grows into the data blocks as files are created
+		if (opts->n_inodes == 0)
+			opts->n_inodes = A1FS_INODES_PER_BLOCK;
+		if (!fs_format(image, size, opts->n_inodes, opts->features))
+			return false;
+		clear_data_blocks(image, opts);
+		return true;
 	}
-	memset(image, 0, size);
-	uint64_t magic = A1FS_MAGIC;
-	size = (uint64_t)size;
-	unsigned int blocks_count = size / A1FS_BLOCK_SIZE;
-	unsigned int inode_bitmap_count = ceil_divide(opts->n_inodes, A1FS_BLOCK_SIZE * 8);
-	unsigned int block_bitmap_count = ceil_divide(blocks_count, A1FS_BLOCK_SIZE * 8);
-	unsigned int inodes_count = opts->n_inodes;
-	unsigned int inode_table_count = ceil_divide((sizeof(struct a1fs_inode) * inodes_count), A1FS_BLOCK_SIZE);
-
-	unsigned int first_ino_bitmap = 1;
-	unsigned int first_blo_bitmap = inode_bitmap_count + 1;
-	unsigned int first_ino = first_blo_bitmap + block_bitmap_count;
-	unsigned int first_data_block = first_ino + inode_table_count;
-
-	unsigned int free_blocks_count = blocks_count - inode_bitmap_count - block_bitmap_count - inode_table_count - 2;
-	unsigned int free_inodes_count = opts->n_inodes - 1;
-
-	if (blocks_count < inode_bitmap_count + inode_table_count + block_bitmap_count + 2)
+
+	pop_tree tree;
+	if (!populate_scan(&tree, opts->src_dir, opts->features))
 		return false;
-	a1fs_superblock sb = {magic, size, first_ino_bitmap, first_blo_bitmap, first_ino, first_data_block, inode_bitmap_count, block_bitmap_count, inode_table_count, inodes_count, blocks_count, free_blocks_count, free_inodes_count};
-	memcpy(image, &sb, sizeof(sb));
-	memset(image + A1FS_BLOCK_SIZE, 0, (inode_bitmap_count + block_bitmap_count) * A1FS_BLOCK_SIZE);
-	int total = inode_bitmap_count + block_bitmap_count + inode_table_count + 1;
-	unsigned int total_byte = ceil_divide(total, 8);
-	char *block_bitmap = (char *)(image + first_blo_bitmap * A1FS_BLOCK_SIZE);
-	char *inode_bitmap = (char *)(image + first_ino_bitmap * A1FS_BLOCK_SIZE);
-	for (unsigned int i = 0; i < total_byte; i++)
+	if (opts->n_inodes == 0)
 	{
-		int bit = 0;
-		while (total >= 0 && bit < 8)
-		{
-			block_bitmap[i] |= 1 << bit;
-			bit++;
-			total--;
-		}
+		// Fill up the last inode table block
+		opts->n_inodes = (tree.count + A1FS_INODES_PER_BLOCK - 1) / A1FS_INODES_PER_BLOCK * A1FS_INODES_PER_BLOCK;
 	}
-	for (unsigned int i = 0; i < inodes_count; i++)
+	if (opts->n_threads == 0)
 	{
-		a1fs_inode init_inode = {0};
-		memcpy(image + (1 + inode_bitmap_count + block_bitmap_count) * A1FS_BLOCK_SIZE +
-				   i * sizeof(struct a1fs_inode),
-			   &init_inode, sizeof(struct a1fs_inode));
+		long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		opts->n_threads = n_cpus > 0 ? n_cpus : 1;
 	}
 
-	struct a1fs_inode *root = (struct a1fs_inode *)(image + first_ino * A1FS_BLOCK_SIZE);
-	root->mode = S_IFDIR | 0777;
-	root->links = 2;
-	root->size = 0;
-	clock_gettime(CLOCK_REALTIME, &(root->mtime));
-	root->inode = 0;
-	root->entry_count = 0;
-	root->num_extents = 0;
-	root->extent_table = first_ino + inode_table_count;
-	root->num_extents = 0;
-	inode_bitmap[0] |= 1 << 0;
-	block_bitmap[root->extent_table / 8] |= 1 << root->extent_table % 8;
-	
-	
-	return true;
+	bool ret = fs_format(image, size, opts->n_inodes, opts->features);
+	if (ret)
+	{
+		clear_data_blocks(image, opts);
+		ret = populate_write(image, &tree, opts->n_threads);
+	}
+	populate_free(&tree);
+	return ret;
 }
 
 int main(int argc, char *argv[])
@@ -228,7 +261,9 @@ int main(int argc, char *argv[])
 		goto end;
 	}
 
-	if (opts.zero)
+	// Zeroing by punching the whole file out takes no time; writing zeros is
+	// the fallback
+	if (opts.zero && !punch_range(opts.img_path, 0, size))
 		memset(image, 0, size);
 	if (!mkfs(image, size, &opts))
 	{
@@ -0,0 +1,85 @@
+/**
+ * a1fs negative lookup cache implementation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ncache.h"
+
+
+/** Slot of a name in a directory. */
+static ncache_entry *slot_of(ncache_ctx *nc, a1fs_ino_t dir, uint32_t hash)
+{
+	return &nc->entries[(hash ^ dir * 2654435761u) & (NCACHE_SIZE - 1)];
+}
+
+/** Current generation of a directory. */
+static uint64_t dir_gen(const ncache_ctx *nc, a1fs_ino_t dir)
+{
+	return dir < nc->n_gens ? nc->gens[dir] : 0;
+}
+
+void ncache_init(fs_ctx *fs)
+{
+	// zeroed: every slot unused, every directory at generation 0
+	fs->ncache = calloc(1, sizeof(ncache_ctx));
+}
+
+void ncache_destroy(fs_ctx *fs)
+{
+	if (fs->ncache == NULL)
+		return;
+	free(fs->ncache->gens);
+	free(fs->ncache);
+	fs->ncache = NULL;
+}
+
+bool ncache_lookup(fs_ctx *fs, a1fs_ino_t dir, const char *name)
+{
+	ncache_ctx *nc = fs->ncache;
+	uint32_t len = strlen(name);
+	if (nc == NULL || len == 0 || len >= A1FS_NAME_MAX)
+		return false;
+	uint32_t hash = a1fs_name_hash(name, len);
+	const ncache_entry *e = slot_of(nc, dir, hash);
+	return e->dir == dir && e->hash == hash && e->gen == dir_gen(nc, dir) && memcmp(e->name, name, len + 1) == 0;
+}
+
+void ncache_add(fs_ctx *fs, a1fs_ino_t dir, const char *name)
+{
+	ncache_ctx *nc = fs->ncache;
+	uint32_t len = strlen(name);
+	if (nc == NULL || len == 0 || len >= A1FS_NAME_MAX)
+		return;
+	uint32_t hash = a1fs_name_hash(name, len);
+	ncache_entry *e = slot_of(nc, dir, hash);
+	e->dir = dir;
+	e->hash = hash;
+	e->gen = dir_gen(nc, dir);
+	memcpy(e->name, name, len + 1);
+}
+
+void ncache_dir_changed(fs_ctx *fs, a1fs_ino_t dir)
+{
+	ncache_ctx *nc = fs->ncache;
+	if (nc == NULL)
+		return;
+	if (dir >= nc->n_gens)
+	{
+		// room for every inode, including those inode table chunks add
+		a1fs_superblock *sb = (a1fs_superblock *)fs->image;
+		size_t n = sb->inodes_count > dir ? sb->inodes_count : (size_t)dir + 1;
+		uint64_t *gens = realloc(nc->gens, n * sizeof(uint64_t));
+		if (gens == NULL)
+		{
+			// no generation to bump; forget every miss instead
+			memset(nc->entries, 0, sizeof(nc->entries));
+			return;
+		}
+		memset(gens + nc->n_gens, 0, (n - nc->n_gens) * sizeof(uint64_t));
+		nc->gens = gens;
+		nc->n_gens = n;
+	}
+	nc->gens[dir]++;
+}
@@ -0,0 +1,81 @@
+/**
+ * a1fs negative lookup cache header file.
+ *
+ * Names looked up and not found are remembered per directory, so that probing
+ * for the same missing name again (as build tools and language runtimes do)
+ * costs a hash table lookup instead of a scan of the whole directory. Each
+ * directory has a generation number that is bumped whenever an entry is added
+ * to it; a cached miss only counts while its directory is at the generation it
+ * was recorded at. Removing entries cannot turn a miss into a hit, so it does
+ * not bump the generation. The cache is in memory only and direct-mapped: a
+ * new miss replaces whatever was cached in its slot.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+
+/** Number of cached misses; a power of two. */
+#define NCACHE_SIZE 4096
+
+/** A name known to be missing from a directory. */
+typedef struct ncache_entry
+{
+	/** Inode number of the directory. */
+	a1fs_ino_t dir;
+	/** Hash of the name (see a1fs_name_hash()). */
+	uint32_t hash;
+	/** Generation of the directory when the miss was recorded. */
+	uint64_t gen;
+	/** The name; empty for an unused slot. */
+	char name[A1FS_NAME_MAX];
+
+} ncache_entry;
+
+/** Negative lookup cache state. */
+typedef struct ncache_ctx
+{
+	ncache_entry entries[NCACHE_SIZE];
+	/** Generation of each directory, indexed by inode number. */
+	uint64_t *gens;
+	/** Number of inodes gens has room for. */
+	size_t n_gens;
+
+} ncache_ctx;
+
+/**
+ * Set up the cache. Without memory for it, the file system works uncached.
+ *
+ * @param fs  file system context.
+ */
+void ncache_init(fs_ctx *fs);
+
+/** Free the cache. */
+void ncache_destroy(fs_ctx *fs);
+
+/**
+ * Check if a name is known to be missing from a directory.
+ *
+ * @param fs    file system context.
+ * @param dir   inode number of the directory.
+ * @param name  the name.
+ * @return      true if a lookup of the name would not find it.
+ */
+bool ncache_lookup(fs_ctx *fs, a1fs_ino_t dir, const char *name);
+
+/** Remember that a lookup did not find a name in a directory. */
+void ncache_add(fs_ctx *fs, a1fs_ino_t dir, const char *name);
+
+/**
+ * Forget the misses cached for a directory; called whenever an entry is added
+ * to it.
+ *
+ * @param fs   file system context.
+ * @param dir  inode number of the directory.
+ */
+void ncache_dir_changed(fs_ctx *fs, a1fs_ino_t dir);
@@ -31,6 +31,12 @@
 static const struct fuse_opt opt_spec[] = {
 	A1FS_OPT("-h"    , help),
 	A1FS_OPT("--help", help),
+	A1FS_OPT("nodelalloc", nodelalloc),
+	A1FS_OPT("discard", discard),
+	A1FS_OPT("stats_file=%s", stats_file),
+	A1FS_OPT("trace=%s", trace_file),
+	A1FS_OPT("cache", cache),
+	A1FS_OPT("cache_timeout=%u", cache_timeout),
 	FUSE_OPT_END
 };
 
@@ -44,6 +50,19 @@ general options:\n\
     -o opt,[opt...]        mount options\n\
     -h   --help            print help\n\
 \n\
+a1fs options:\n\
+    -o nodelalloc          allocate blocks on every write instead of\n\
+                           buffering appends until close/fsync\n\
+    -o discard             punch freed blocks out of the image file\n\
+    -o stats_file=FILE     append statistics to FILE on SIGUSR1\n\
+                           (default: stderr); they can also be read\n\
+                           from /.a1fs_stats in the mounted file system\n\
+    -o trace=FILE          record every operation to FILE for a1fs-replay\n\
+    -o cache               let the kernel cache names, attributes and\n\
+                           file data across opens\n\
+    -o cache_timeout=SECS  how long names and attributes are cached\n\
+                           with -o cache (default: %u)\n\
+\n\
 ";
 
 // Callback for fuse_opt_parse()
@@ -66,7 +85,7 @@ bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 
 	//NOTE: printing to stderr to keep it consistent with FUSE
 	if (opts->help) {
-		fprintf(stderr, help_str, args->argv[0]);
+		fprintf(stderr, help_str, args->argv[0], A1FS_CACHE_TIMEOUT);
 		fuse_opt_add_arg(args, "-ho");
 	}
 	if (!opts->help && !opts->img_path) {
@@ -23,12 +23,27 @@
 #include <fuse_opt.h>
 
 
+/** Default time the kernel keeps names and attributes with -o cache, in seconds. */
+#define A1FS_CACHE_TIMEOUT 60
+
 /** a1fs command line options. */
 typedef struct a1fs_opts {
 	/** a1fs image file path. */
 	const char *img_path;
 	/** Print help and exit. FUSE option. */
 	int help;
+	/** Allocate blocks at write time instead of delaying allocation. */
+	int nodelalloc;
+	/** Punch freed blocks out of the image file. */
+	int discard;
+	/** File that SIGUSR1 appends the statistics to. */
+	const char *stats_file;
+	/** File to record an operation trace to. */
+	const char *trace_file;
+	/** Let the kernel cache attributes, names and file data. */
+	int cache;
+	/** How long the kernel keeps names and attributes, in seconds. */
+	unsigned int cache_timeout;
 
 } a1fs_opts;
 
@@ -0,0 +1,503 @@
+/**
+ * a1fs image population (mkfs.a1fs -d) implementation.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "populate.h"
+
+
+/** Files larger than this are copied in chunks of this size by several threads. */
+#define POP_CHUNK_SIZE (64ull << 20)
+
+/** Maximum number of copying threads. */
+#define POP_MAX_THREADS 256
+
+/** Number of blocks needed to hold size bytes. */
+static uint64_t blocks_of(uint64_t size)
+{
+	return (size + A1FS_BLOCK_SIZE - 1) / A1FS_BLOCK_SIZE;
+}
+
+/**
+ * Lay out the entries of a directory in order, packed as the file system packs
+ * them, and write them if blocks is not NULL.
+ *
+ * @param tree    scanned tree.
+ * @param node    the directory.
+ * @param blocks  pointer to the zeroed directory blocks; NULL to only count.
+ * @param bytes   pointer to the variable that receives the directory size.
+ * @return        number of blocks the entries fill.
+ */
+static uint64_t dir_layout(const pop_tree *tree, const pop_node *node, unsigned char *blocks, uint64_t *bytes)
+{
+	uint64_t n = 0;
+	uint32_t end = 0; // where the next entry goes in block n
+	uint32_t last = 0;
+	*bytes = 0;
+	for (uint32_t i = 0; i < node->n_children; i++)
+	{
+		const pop_node *child = &tree->nodes[node->first_child + i];
+		uint32_t size = a1fs_dirent_size(tree->features, strlen(child->name));
+		if (end + size > A1FS_BLOCK_SIZE)
+		{
+			// the last entry of a full block takes the rest of it
+			if (blocks != NULL)
+				a1fs_dir_set_len(tree->features, blocks + n * A1FS_BLOCK_SIZE, last, A1FS_BLOCK_SIZE - last);
+			n++;
+			end = 0;
+		}
+		if (blocks != NULL)
+			a1fs_dir_write(tree->features, blocks + n * A1FS_BLOCK_SIZE, end, size, node->first_child + i, child->name);
+		last = end;
+		end += size;
+		*bytes += size;
+	}
+	if (end == 0)
+		return n;
+	if (blocks != NULL)
+		a1fs_dir_set_len(tree->features, blocks + n * A1FS_BLOCK_SIZE, last, A1FS_BLOCK_SIZE - last);
+	return n + 1;
+}
+
+/** Number of blocks a file or directory needs. */
+static uint64_t node_blocks(const pop_tree *tree, const pop_node *node)
+{
+	uint64_t bytes;
+	return S_ISDIR(node->mode) ? dir_layout(tree, node, NULL, &bytes) : blocks_of(node->size);
+}
+
+/** Append a node to the tree; return its index, or -1 if out of memory. */
+static long add_node(pop_tree *tree, char *path, const struct stat *st)
+{
+	if (tree->count == tree->capacity)
+	{
+		size_t capacity = tree->capacity ? tree->capacity * 2 : 1024;
+		pop_node *nodes = realloc(tree->nodes, capacity * sizeof(pop_node));
+		if (nodes == NULL)
+			return -1;
+		tree->nodes = nodes;
+		tree->capacity = capacity;
+	}
+	pop_node *node = &tree->nodes[tree->count];
+	memset(node, 0, sizeof(*node));
+	node->path = path;
+	const char *slash = strrchr(path, '/');
+	node->name = slash != NULL ? slash + 1 : path;
+	node->mode = (S_ISDIR(st->st_mode) ? S_IFDIR : S_IFREG) | (st->st_mode & 07777);
+	node->size = S_ISREG(st->st_mode) ? (uint64_t)st->st_size : 0;
+	node->mtime = st->st_mtim;
+	return tree->count++;
+}
+
+static int cmp_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Read the names in a directory, sorted.
+ *
+ * @param path   directory path.
+ * @param names  pointer to the variable that receives the array of names.
+ * @return       number of names; -1 on failure.
+ */
+static long read_names(const char *path, char ***names)
+{
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+	char **list = NULL;
+	size_t n = 0, capacity = 0;
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL)
+	{
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (n == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 64;
+			char **grown = realloc(list, capacity * sizeof(char *));
+			if (grown == NULL)
+				goto fail;
+			list = grown;
+		}
+		if ((list[n] = strdup(de->d_name)) == NULL)
+			goto fail;
+		n++;
+	}
+	closedir(dir);
+	qsort(list, n, sizeof(char *), cmp_names);
+	*names = list;
+	return n;
+
+fail:
+	perror("read_names");
+	for (size_t i = 0; i < n; i++)
+		free(list[i]);
+	free(list);
+	closedir(dir);
+	return -1;
+}
+
+/** Add the children of directory node idx to the tree. */
+static bool scan_dir(pop_tree *tree, size_t idx)
+{
+	char **names;
+	long n = read_names(tree->nodes[idx].path, &names);
+	if (n < 0)
+		return false;
+
+	bool ok = true;
+	tree->nodes[idx].first_child = tree->count;
+	for (long i = 0; i < n; i++)
+	{
+		// the tree may have been reallocated
+		const char *dir_path = tree->nodes[idx].path;
+		if (ok && strlen(names[i]) >= A1FS_NAME_MAX)
+		{
+			fprintf(stderr, "%s/%s: name too long\n", dir_path, names[i]);
+			ok = false;
+		}
+		char *path = ok ? malloc(strlen(dir_path) + strlen(names[i]) + 2) : NULL;
+		if (ok && path == NULL)
+		{
+			perror("malloc");
+			ok = false;
+		}
+		if (!ok)
+		{
+			free(names[i]);
+			continue;
+		}
+		sprintf(path, "%s/%s", dir_path, names[i]);
+		free(names[i]);
+
+		struct stat st;
+		if (lstat(path, &st) != 0)
+		{
+			perror(path);
+			free(path);
+			ok = false;
+			continue;
+		}
+		if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+		{
+			fprintf(stderr, "%s: not a regular file or directory; skipped\n", path);
+			free(path);
+			continue;
+		}
+		if (add_node(tree, path, &st) < 0)
+		{
+			perror("add_node");
+			free(path);
+			ok = false;
+			continue;
+		}
+		tree->nodes[idx].n_children++;
+	}
+	free(names);
+	return ok;
+}
+
+bool populate_scan(pop_tree *tree, const char *src_dir, unsigned int features)
+{
+	memset(tree, 0, sizeof(*tree));
+	tree->features = features;
+	struct stat st;
+	if (stat(src_dir, &st) != 0)
+	{
+		perror(src_dir);
+		return false;
+	}
+	if (!S_ISDIR(st.st_mode))
+	{
+		fprintf(stderr, "%s: not a directory\n", src_dir);
+		return false;
+	}
+	char *path = strdup(src_dir);
+	if (path == NULL || add_node(tree, path, &st) < 0)
+	{
+		perror("populate_scan");
+		free(path);
+		return false;
+	}
+	tree->nodes[0].name = "";
+
+	// Breadth first, so that the children of each directory are consecutive
+	for (size_t i = 0; i < tree->count; i++)
+	{
+		if (S_ISDIR(tree->nodes[i].mode) && !scan_dir(tree, i))
+		{
+			populate_free(tree);
+			return false;
+		}
+	}
+
+	tree->blocks = 0;
+	for (size_t i = 0; i < tree->count; i++)
+	{
+		const pop_node *node = &tree->nodes[i];
+		// the root's extent table is allocated by fs_format()
+		if (i > 0)
+			tree->blocks++;
+		tree->blocks += node_blocks(tree, node);
+	}
+	return true;
+}
+
+void populate_free(pop_tree *tree)
+{
+	for (size_t i = 0; i < tree->count; i++)
+		free(tree->nodes[i].path);
+	free(tree->nodes);
+	memset(tree, 0, sizeof(*tree));
+}
+
+/** Set count bits of a bitmap starting at start. */
+static void set_bit_range(unsigned char *bitmap, uint64_t start, uint64_t count)
+{
+	for (; count > 0 && start % 8 != 0; start++, count--)
+		bitmap[start / 8] |= 1 << start % 8;
+	memset(bitmap + start / 8, 0xff, count / 8);
+	start += count / 8 * 8;
+	for (count %= 8; count > 0; start++, count--)
+		bitmap[start / 8] |= 1 << start % 8;
+}
+
+/** Write the inode, extent table and directory entries of a node. */
+static void write_node(void *image, const pop_tree *tree, size_t idx)
+{
+	const pop_node *node = &tree->nodes[idx];
+	a1fs_inode *inode = a1fs_inode_at(image, idx);
+	bool is_dir = S_ISDIR(node->mode);
+	uint64_t bytes = node->size;
+	uint64_t blocks = is_dir ? dir_layout(tree, node, NULL, &bytes) : blocks_of(bytes);
+
+	// the root keeps the mode given to it by fs_format()
+	mode_t mode = idx == 0 ? inode->mode : node->mode;
+	memset(inode, 0, sizeof(*inode));
+	inode->mode = mode;
+	inode->links = 1;
+	inode->size = bytes;
+	inode->mtime = node->mtime;
+	inode->inode = idx;
+	inode->num_extents = blocks > 0 ? 1 : 0;
+	inode->extent_table = node->table_blk;
+
+	a1fs_extent *table = (a1fs_extent *)(image + (size_t)node->table_blk * A1FS_BLOCK_SIZE);
+	memset(table, 0, A1FS_BLOCK_SIZE);
+	if (blocks > 0)
+		table[0] = (a1fs_extent){node->data_blk, blocks};
+
+	if (!is_dir)
+		return;
+	inode->links = 2;
+	inode->entry_count = node->n_children;
+	unsigned char *dir_blocks = image + (size_t)node->data_blk * A1FS_BLOCK_SIZE;
+	// free fixed-size slots are recognized by being zeroed
+	memset(dir_blocks, 0, blocks * A1FS_BLOCK_SIZE);
+	if (blocks > 0)
+		dir_layout(tree, node, dir_blocks, &bytes);
+	for (uint32_t i = 0; i < node->n_children; i++)
+	{
+		if (S_ISDIR(tree->nodes[node->first_child + i].mode))
+			inode->links++;
+	}
+}
+
+/** A piece of a file to copy. */
+typedef struct copy_chunk {
+	const pop_node *node;
+	uint64_t offset;
+	uint64_t len;
+
+} copy_chunk;
+
+/** File data copy, shared by the copying threads. */
+typedef struct copy_job {
+	void *image;
+	copy_chunk *chunks;
+	size_t n_chunks;
+	/** Index of the next chunk to copy. */
+	atomic_size_t next;
+	/** Set if any copy failed. */
+	atomic_bool failed;
+
+} copy_job;
+
+/** Copy a chunk of a file into its blocks. */
+static bool copy_chunk_data(void *image, const copy_chunk *c)
+{
+	int fd = open(c->node->path, O_RDONLY);
+	if (fd < 0)
+	{
+		perror(c->node->path);
+		return false;
+	}
+	char *dst = image + (size_t)c->node->data_blk * A1FS_BLOCK_SIZE + c->offset;
+	uint64_t done = 0;
+	while (done < c->len)
+	{
+		ssize_t n = pread(fd, dst + done, c->len - done, c->offset + done);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror(c->node->path);
+			close(fd);
+			return false;
+		}
+		if (n == 0)
+		{
+			fprintf(stderr, "%s: file shrank while copying; padded with zeros\n", c->node->path);
+			memset(dst + done, 0, c->len - done);
+			break;
+		}
+		done += n;
+	}
+	close(fd);
+
+	// the rest of the last block reads as zeros
+	uint64_t end = c->offset + c->len;
+	if (end == c->node->size && end % A1FS_BLOCK_SIZE != 0)
+		memset(dst + c->len, 0, A1FS_BLOCK_SIZE - end % A1FS_BLOCK_SIZE);
+	return true;
+}
+
+static void *copy_thread(void *arg)
+{
+	copy_job *job = (copy_job *)arg;
+	for (;;)
+	{
+		size_t i = atomic_fetch_add(&job->next, 1);
+		if (i >= job->n_chunks)
+			break;
+		if (!copy_chunk_data(job->image, &job->chunks[i]))
+			atomic_store(&job->failed, true);
+	}
+	return NULL;
+}
+
+/** Copy the contents of all files, largest chunks spread over n_threads threads. */
+static bool copy_files(void *image, const pop_tree *tree, unsigned int n_threads)
+{
+	size_t n_chunks = 0;
+	for (size_t i = 0; i < tree->count; i++)
+	{
+		if (S_ISREG(tree->nodes[i].mode))
+			n_chunks += (tree->nodes[i].size + POP_CHUNK_SIZE - 1) / POP_CHUNK_SIZE;
+	}
+	copy_job job = {.image = image, .n_chunks = n_chunks};
+	atomic_init(&job.next, 0);
+	atomic_init(&job.failed, false);
+	job.chunks = malloc((n_chunks > 0 ? n_chunks : 1) * sizeof(copy_chunk));
+	if (job.chunks == NULL)
+	{
+		perror("malloc");
+		return false;
+	}
+	size_t k = 0;
+	for (size_t i = 0; i < tree->count; i++)
+	{
+		const pop_node *node = &tree->nodes[i];
+		if (!S_ISREG(node->mode))
+			continue;
+		for (uint64_t off = 0; off < node->size; off += POP_CHUNK_SIZE)
+		{
+			uint64_t len = node->size - off < POP_CHUNK_SIZE ? node->size - off : POP_CHUNK_SIZE;
+			job.chunks[k++] = (copy_chunk){node, off, len};
+		}
+	}
+
+	if (n_threads > POP_MAX_THREADS)
+		n_threads = POP_MAX_THREADS;
+	pthread_t threads[POP_MAX_THREADS];
+	unsigned int started = 0;
+	for (; started + 1 < n_threads; started++)
+	{
+		if (pthread_create(&threads[started], NULL, copy_thread, &job) != 0)
+			break;
+	}
+	// this thread copies too, which also covers a failed pthread_create()
+	copy_thread(&job);
+	for (unsigned int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(job.chunks);
+	return !atomic_load(&job.failed);
+}
+
+bool populate_write(void *image, pop_tree *tree, unsigned int n_threads)
+{
+	a1fs_superblock *sb = (a1fs_superblock *)image;
+	if (tree->count > sb->inodes_count)
+	{
+		fprintf(stderr, "Not enough inodes: the tree has %zu files and directories\n", tree->count);
+		return false;
+	}
+	if (tree->blocks > sb->free_blocks_count)
+	{
+		fprintf(stderr, "Image too small: the tree needs %lu more blocks\n",
+				(unsigned long)(tree->blocks - sb->free_blocks_count));
+		return false;
+	}
+
+	// Extent tables, then directory entries, then file data
+	a1fs_blk_t first = sb->first_data_block + 1;
+	a1fs_blk_t next = first;
+	tree->nodes[0].table_blk = sb->first_data_block;
+	for (size_t i = 1; i < tree->count; i++)
+		tree->nodes[i].table_blk = next++;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (size_t i = 0; i < tree->count; i++)
+		{
+			pop_node *node = &tree->nodes[i];
+			bool is_dir = S_ISDIR(node->mode);
+			if (is_dir != (pass == 0))
+				continue;
+			uint64_t blocks = node_blocks(tree, node);
+			if (blocks > A1FS_EXTENT_LEN_MAX)
+			{
+				fprintf(stderr, "%s: too large for a single extent\n", node->path);
+				return false;
+			}
+			node->data_blk = blocks > 0 ? next : 0;
+			next += blocks;
+		}
+	}
+
+	// fs_format() leaves all but the first inode table block uninitialized
+	uint64_t init_end = (tree->count + A1FS_INODES_PER_BLOCK - 1) / A1FS_INODES_PER_BLOCK * A1FS_INODES_PER_BLOCK;
+	if (sb->uninit_inode_start != 0 && sb->uninit_inode_start < init_end)
+	{
+		memset(a1fs_inode_at(image, sb->uninit_inode_start), 0,
+			   (init_end - sb->uninit_inode_start) * sizeof(a1fs_inode));
+		sb->uninit_inode_start = init_end;
+	}
+	for (size_t i = 0; i < tree->count; i++)
+		write_node(image, tree, i);
+
+	unsigned char *inode_bitmap = image + (size_t)sb->first_ino_bitmap * A1FS_BLOCK_SIZE;
+	unsigned char *block_bitmap = image + (size_t)sb->first_blo_bitmap * A1FS_BLOCK_SIZE;
+	set_bit_range(inode_bitmap, 0, tree->count);
+	set_bit_range(block_bitmap, first, next - first);
+	sb->free_inodes_count -= tree->count - 1;
+	sb->free_blocks_count -= next - first;
+	if (sb->clean_block_start != 0 && sb->clean_block_start < next)
+		sb->clean_block_start = next;
+
+	return copy_files(image, tree, n_threads);
+}
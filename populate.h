@@ -0,0 +1,89 @@
+/**
+ * a1fs image population (mkfs.a1fs -d) header file.
+ *
+ * Copies a directory tree into a freshly formatted image without going through
+ * the file system: the tree is scanned first, then every inode, extent table
+ * and directory entry is written in one pass, and the file contents are copied
+ * by several threads straight into the image mapping.
+ *
+ * Blocks are laid out sequentially after the root directory's extent table:
+ * all extent tables, then all directory entry blocks (so lookups stay within a
+ * small area), then file data. Every directory and file gets a single
+ * contiguous extent. Inode numbers follow a breadth-first walk of the tree, so
+ * the children of a directory have consecutive inodes.
+ *
+ * Only regular files and directories are copied; other file types are skipped
+ * with a warning.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "a1fs.h"
+
+
+/** A file or directory of the source tree. */
+typedef struct pop_node {
+	/** Source path. */
+	char *path;
+	/** Name within the parent directory; points into path. */
+	const char *name;
+	/** File mode. */
+	mode_t mode;
+	/** File size in bytes (files only). */
+	uint64_t size;
+	/** Last modification time. */
+	struct timespec mtime;
+	/** Index of the first child; children are consecutive (directories only). */
+	uint32_t first_child;
+	/** Number of children (directories only). */
+	uint32_t n_children;
+	/** Extent table block. */
+	a1fs_blk_t table_blk;
+	/** First block of the data or directory entries; 0 if none. */
+	a1fs_blk_t data_blk;
+
+} pop_node;
+
+/** A scanned source tree; node i becomes inode i, node 0 is the root. */
+typedef struct pop_tree {
+	pop_node *nodes;
+	size_t count;
+	size_t capacity;
+	/** Blocks needed on top of a freshly formatted image. */
+	uint64_t blocks;
+	/** Feature flags the image is formatted with (the directory entry format). */
+	unsigned int features;
+
+} pop_tree;
+
+
+/**
+ * Scan a directory tree.
+ *
+ * @param tree      tree to initialize.
+ * @param src_dir   path to the source directory.
+ * @param features  feature flags the image is to be formatted with.
+ * @return          true on success; false on failure (an error has been printed).
+ */
+bool populate_scan(pop_tree *tree, const char *src_dir, unsigned int features);
+
+/**
+ * Write a scanned tree into an image formatted by fs_format() with the features
+ * given to populate_scan().
+ *
+ * @param image      pointer to the start of the image.
+ * @param tree       scanned tree.
+ * @param n_threads  number of threads that copy file data.
+ * @return           true on success; false on failure, e.g. the image has too
+ *                   few inodes or blocks (an error has been printed).
+ */
+bool populate_write(void *image, pop_tree *tree, unsigned int n_threads);
+
+/** Free a scanned tree. */
+void populate_free(pop_tree *tree);
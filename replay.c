@@ -0,0 +1,426 @@
+/**
+ * a1fs trace replay.
+ *
+ * Reads an operation trace recorded with -o trace=FILE (see trace.h) and
+ * replays it in-process (no kernel mount) against a freshly formatted scratch
+ * image, either as fast as possible or with the original timing. Results are
+ * printed to stdout as JSON lines, like a1fs-bench: the throughput of the whole
+ * replay, then one object per operation type with its latency percentiles and
+ * the number of calls whose result differed from the recorded one.
+ *
+ * Data written by the trace is not recorded; writes are replayed with filler
+ * bytes of the recorded size.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "format.h"
+#include "fs_ops.h"
+#include "map.h"
+#include "stats.h"
+#include "trace.h"
+
+
+/** Command line options. */
+typedef struct replay_opts
+{
+	/** Trace file path. */
+	const char *trace_path;
+	/** Scratch image file path. */
+	const char *img_path;
+	/** Scratch image size in bytes. */
+	size_t img_size;
+	/** Number of inodes in the scratch image. */
+	size_t n_inodes;
+	/** Feature flags of the scratch image (the directory entry format). */
+	unsigned int features;
+	/** Wait for each operation's original start time. */
+	bool timing;
+	/** Mount options. */
+	fs_mount_opts mount;
+
+	/** Print help and exit. */
+	bool help;
+
+} replay_opts;
+
+static const char *help_str = "\
+Usage: %s [options] trace\n\
+\n\
+Replay an a1fs operation trace (recorded with -o trace=FILE) in-process on a\n\
+freshly formatted scratch image and print throughput and latencies as JSON\n\
+lines to stdout. The trace should start from an empty file system; operations\n\
+on files that existed before it was recorded fail and count as mismatches.\n\
+\n\
+Options:\n\
+    -t        replay with the original timing instead of at full speed\n\
+    -f path   scratch image file; default: /tmp/a1fs-replay.img (removed\n\
+              when done)\n\
+    -s size   scratch image size in bytes; default: 256 MiB\n\
+    -i num    number of inodes; default: 4096\n\
+    -e fmt    directory entry format: fixed, var or hash (see mkfs.a1fs);\n\
+              default: fixed\n\
+    -o opt    mount option: nodelalloc or discard; may be repeated\n\
+    -h        print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname);
+}
+
+static bool parse_args(int argc, char *argv[], replay_opts *opts)
+{
+	int o;
+	while ((o = getopt(argc, argv, "tf:s:i:e:o:h")) != -1)
+	{
+		switch (o)
+		{
+		case 't':
+			opts->timing = true;
+			break;
+		case 'f':
+			opts->img_path = optarg;
+			break;
+		case 's':
+			opts->img_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'i':
+			opts->n_inodes = strtoul(optarg, NULL, 10);
+			break;
+		case 'e':
+			if (!fs_parse_dir_format(optarg, &opts->features))
+			{
+				fprintf(stderr, "Unknown directory entry format %s\n", optarg);
+				return false;
+			}
+			break;
+		case 'o':
+			if (strcmp(optarg, "nodelalloc") == 0)
+				opts->mount.nodelalloc = true;
+			else if (strcmp(optarg, "discard") == 0)
+				opts->mount.discard = true;
+			else
+			{
+				fprintf(stderr, "Unknown mount option %s\n", optarg);
+				return false;
+			}
+			break;
+
+		case 'h':
+			opts->help = true;
+			return true; // skip other arguments
+
+		case '?':
+			return false;
+		default:
+			return false;
+		}
+	}
+
+	if (optind != argc - 1)
+	{
+		fprintf(stderr, "Missing trace file\n");
+		return false;
+	}
+	opts->trace_path = argv[optind];
+
+	if (opts->img_size < 8 * A1FS_BLOCK_SIZE || opts->n_inodes == 0)
+	{
+		fprintf(stderr, "Invalid image size or number of inodes\n");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Format a fresh scratch image and mount it.
+ *
+ * @param fs    file system context to initialize.
+ * @param opts  command line options.
+ * @return      true on success; false on failure.
+ */
+static bool replay_setup(fs_ctx *fs, const replay_opts *opts)
+{
+	// Start from an empty sparse file so earlier runs leave nothing behind
+	int fd = open(opts->img_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		perror(opts->img_path);
+		return false;
+	}
+	if (ftruncate(fd, opts->img_size) != 0)
+	{
+		perror("ftruncate");
+		close(fd);
+		return false;
+	}
+	close(fd);
+
+	size_t size;
+	void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
+	if (image == NULL)
+		return false;
+	bool formatted = fs_format(image, size, opts->n_inodes, opts->features);
+	munmap(image, size);
+	if (!formatted)
+	{
+		fprintf(stderr, "Failed to format the image\n");
+		return false;
+	}
+
+	memset(fs, 0, sizeof(*fs));
+	if (!fs_mount(fs, opts->img_path, &opts->mount))
+	{
+		fprintf(stderr, "Failed to mount the image\n");
+		return false;
+	}
+	fs_start(fs);
+	return true;
+}
+
+/** fs_readdir() filler that only counts the entries. */
+static int count_filler(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	(void)name; // unused
+	(void)st;	// unused
+	(void)off;	// unused
+	(*(size_t *)buf)++;
+	return 0;
+}
+
+/** Buffer for read and write data, grown to the largest request. */
+typedef struct data_buf
+{
+	char *data;
+	size_t size;
+
+} data_buf;
+
+/** Make the buffer at least size bytes; return false if out of memory. */
+static bool data_reserve(data_buf *buf, size_t size)
+{
+	if (size <= buf->size)
+		return true;
+	char *data = realloc(buf->data, size);
+	if (data == NULL)
+		return false;
+	memset(data + buf->size, 0xa1, size - buf->size);
+	buf->data = data;
+	buf->size = size;
+	return true;
+}
+
+/**
+ * Replay one operation.
+ *
+ * @param fs    file system context.
+ * @param rec   the recorded operation.
+ * @param path  the recorded path; for a rename, followed by the new path.
+ * @param buf   data buffer.
+ * @return      the operation's return value.
+ */
+static int replay_op(fs_ctx *fs, const trace_rec *rec, const char *path, data_buf *buf)
+{
+	switch ((stats_op)rec->op)
+	{
+	case STATS_STATFS:
+	{
+		struct statvfs st;
+		return fs_statfs(fs, &st);
+	}
+	case STATS_GETATTR:
+	{
+		struct stat st;
+		return fs_getattr(fs, path, &st);
+	}
+	case STATS_READDIR:
+	{
+		size_t entries = 0;
+		return fs_readdir(fs, path, rec->offset, &entries, count_filler);
+	}
+	case STATS_MKDIR:
+		return fs_mkdir(fs, path, rec->mode);
+	case STATS_RMDIR:
+		return fs_rmdir(fs, path);
+	case STATS_CREATE:
+		return fs_create(fs, path, rec->mode);
+	case STATS_UNLINK:
+		return fs_unlink(fs, path);
+	case STATS_UTIMENS:
+		return fs_utimens(fs, path, NULL);
+	case STATS_TRUNCATE:
+		return fs_truncate(fs, path, rec->size);
+	case STATS_READ:
+		if (!data_reserve(buf, rec->size))
+			return -ENOMEM;
+		return fs_read(fs, path, buf->data, rec->size, rec->offset);
+	case STATS_WRITE:
+		if (!data_reserve(buf, rec->size))
+			return -ENOMEM;
+		return fs_write(fs, path, buf->data, rec->size, rec->offset);
+	case STATS_FALLOCATE:
+		return fs_fallocate(fs, path, rec->mode, rec->offset, rec->size);
+	case STATS_GETXATTR:
+		if (!data_reserve(buf, rec->size))
+			return -ENOMEM;
+		// the only attribute there is
+		return fs_getxattr(fs, path, "user.a1fs.extents", buf->data, rec->size);
+	case STATS_FLUSH:
+	case STATS_RELEASE:
+		return fs_flush(fs, path);
+	case STATS_FSYNC:
+		return fs_fsync(fs, path);
+	case STATS_DEFRAG:
+	{
+		a1fs_defrag_info info = {.flags = rec->mode};
+		return fs_defrag(fs, path, &info);
+	}
+	case STATS_RESIZE:
+		return fs_resize(fs, rec->size);
+	case STATS_RENAME:
+		// the new path follows the old one
+		if (strlen(path) >= rec->path_len)
+			return -EINVAL;
+		return fs_rename(fs, path, path + strlen(path) + 1, rec->mode);
+	default:
+		return -ENOSYS;
+	}
+}
+
+/** Sleep until the given stats_now() time. */
+static void sleep_until(uint64_t deadline)
+{
+	uint64_t now = stats_now();
+	if (now >= deadline)
+		return;
+	uint64_t ns = deadline - now;
+	struct timespec ts = {ns / 1000000000, ns % 1000000000};
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+/** Print the results of the replay. */
+static void replay_report(const fs_stats *stats, const uint64_t *mismatches, size_t ops,
+						  uint64_t bytes, uint64_t elapsed, uint64_t trace_ns, uint64_t max_lag)
+{
+	double secs = elapsed / 1e9;
+	uint64_t total_mismatches = 0;
+	for (int op = 0; op < STATS_OP_COUNT; op++)
+		total_mismatches += mismatches[op];
+
+	printf("{\"bench\":\"replay\",\"ops\":%zu,\"secs\":%.6f,\"ops_per_sec\":%.1f,"
+		   "\"mib_per_sec\":%.1f,\"trace_secs\":%.6f,\"max_lag_ns\":%lu,\"mismatches\":%lu}\n",
+		   ops, secs, secs > 0 ? ops / secs : 0, secs > 0 ? bytes / (double)(1 << 20) / secs : 0,
+		   trace_ns / 1e9, (unsigned long)max_lag, (unsigned long)total_mismatches);
+	for (int op = 0; op < STATS_OP_COUNT; op++)
+	{
+		const stats_hist *h = &stats->ops[op];
+		if (h->count == 0)
+			continue;
+		printf("{\"bench\":\"replay_op\",\"op\":\"%s\",\"ops\":%lu,\"errors\":%lu,\"mismatches\":%lu,"
+			   "\"mean_ns\":%lu,\"p50_ns\":%lu,\"p90_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,"
+			   "\"max_ns\":%lu}\n",
+			   stats_op_name(op), (unsigned long)h->count, (unsigned long)h->errors,
+			   (unsigned long)mismatches[op], (unsigned long)(h->total_ns / h->count),
+			   (unsigned long)stats_percentile(h, 50), (unsigned long)stats_percentile(h, 90),
+			   (unsigned long)stats_percentile(h, 99), (unsigned long)stats_percentile(h, 99.9),
+			   (unsigned long)h->max_ns);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	replay_opts opts = {
+		.img_path = "/tmp/a1fs-replay.img",
+		.img_size = 256 << 20,
+		.n_inodes = 4096,
+	};
+	if (!parse_args(argc, argv, &opts))
+	{
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help)
+	{
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	trace_header hdr;
+	FILE *trace = trace_open(opts.trace_path, &hdr);
+	if (trace == NULL)
+		return 1;
+	if (hdr.dropped > 0)
+		fprintf(stderr, "Warning: %lu records were dropped while tracing\n", (unsigned long)hdr.dropped);
+
+	printf("{\"bench\":\"replay_config\",\"img_size\":%zu,\"n_inodes\":%zu,\"timing\":\"%s\","
+		   "\"dropped\":%lu,\"dir_format\":\"%s\",\"delalloc\":%s,\"discard\":%s}\n",
+		   opts.img_size, opts.n_inodes, opts.timing ? "original" : "full",
+		   (unsigned long)hdr.dropped, fs_dir_format_name(opts.features), opts.mount.nodelalloc ? "false" : "true",
+		   opts.mount.discard ? "true" : "false");
+
+	fs_ctx fs;
+	if (!replay_setup(&fs, &opts))
+	{
+		fclose(trace);
+		unlink(opts.img_path);
+		return 1;
+	}
+
+	trace_rec rec;
+	// room for both paths of a rename
+	char path[2 * A1FS_PATH_MAX];
+	data_buf buf = {0};
+	uint64_t mismatches[STATS_OP_COUNT] = {0};
+	size_t ops = 0;
+	uint64_t bytes = 0;
+	uint64_t trace_ns = 0;
+	uint64_t max_lag = 0;
+	int ret;
+	uint64_t start = stats_now();
+	while ((ret = trace_next(trace, &rec, path, sizeof(path))) == 1)
+	{
+		if (opts.timing)
+		{
+			uint64_t deadline = start + rec.start_ns;
+			sleep_until(deadline);
+			uint64_t lag = stats_now() - deadline;
+			if (lag > max_lag)
+				max_lag = lag;
+		}
+		uint64_t t0 = stats_now();
+		int result = replay_op(&fs, &rec, path, &buf);
+		stats_record(&fs.stats, rec.op, t0, result);
+
+		if (result != rec.result)
+			mismatches[rec.op]++;
+		if ((rec.op == STATS_READ || rec.op == STATS_WRITE) && result > 0)
+			bytes += result;
+		trace_ns = rec.start_ns + rec.duration_ns;
+		ops++;
+	}
+	// writing out buffered appends is part of the work
+	fs_unmount(&fs);
+	uint64_t elapsed = stats_now() - start;
+	if (ret < 0)
+		fprintf(stderr, "%s: truncated or corrupt trace after %zu records\n", opts.trace_path, ops);
+
+	replay_report(&fs.stats, mismatches, ops, bytes, elapsed, trace_ns, max_lag);
+	free(buf.data);
+	fclose(trace);
+	unlink(opts.img_path);
+	return ret < 0 ? 1 : 0;
+}
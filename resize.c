@@ -0,0 +1,284 @@
+/**
+ * a1fs resize tool.
+ *
+ * Grows an a1fs file system. Given an image file, the file is extended and the
+ * file system grown in place (see grow.h); the image must not be mounted.
+ * Given a directory on a mounted a1fs file system, the request is sent to the
+ * driver with the A1FS_IOC_RESIZE ioctl, which does the same on its image and
+ * makes the new space available right away.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "grow.h"
+#include "map.h"
+
+
+/** Command line options. */
+typedef struct resize_opts
+{
+	/** Image file, or a directory on a mounted file system. */
+	const char *path;
+	/** New size in bytes, or the number of bytes to add if relative. */
+	uint64_t size;
+	bool relative;
+
+	/** Print help and exit. */
+	bool help;
+
+} resize_opts;
+
+static const char *help_str = "\
+Usage: %s [options] image|mountpoint size\n\
+\n\
+Grow an a1fs file system to size bytes, or by size bytes if it starts\n\
+with '+'. The size may end in K, M, G or T and is rounded down to a\n\
+multiple of the block size - %zu bytes. Shrinking is not supported.\n\
+\n\
+An image file is extended and grown in place; it must not be mounted.\n\
+A directory on a mounted a1fs file system grows that file system while\n\
+it stays in use.\n\
+\n\
+Options:\n\
+    -h      print help and exit\n\
+";
+
+static void print_help(FILE *f, const char *progname)
+{
+	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE);
+}
+
+/** Parse a size with an optional '+' prefix and K/M/G/T suffix. */
+static bool parse_size(const char *str, uint64_t *size, bool *relative)
+{
+	*relative = str[0] == '+';
+	if (*relative)
+		str++;
+	char *end;
+	errno = 0;
+	unsigned long long n = strtoull(str, &end, 10);
+	if (errno != 0 || end == str || str[0] == '-')
+		return false;
+	int shift = 0;
+	switch (*end)
+	{
+	case 'T':
+		shift += 10; // fall through
+	case 'G':
+		shift += 10; // fall through
+	case 'M':
+		shift += 10; // fall through
+	case 'K':
+		shift += 10;
+		end++;
+		break;
+	}
+	if (*end != '\0' || (shift > 0 && n > UINT64_MAX >> shift))
+		return false;
+	*size = (uint64_t)n << shift;
+	return true;
+}
+
+static bool parse_args(int argc, char *argv[], resize_opts *opts)
+{
+	int o;
+	while ((o = getopt(argc, argv, "h")) != -1)
+	{
+		switch (o)
+		{
+		case 'h':
+			opts->help = true;
+			return true; // skip other arguments
+
+		case '?':
+			return false;
+		default:
+			return false;
+		}
+	}
+
+	if (optind + 2 != argc)
+	{
+		fprintf(stderr, optind >= argc ? "Missing image path\n" : optind + 1 == argc ? "Missing size\n" : "Too many arguments\n");
+		return false;
+	}
+	opts->path = argv[optind];
+	if (!parse_size(argv[optind + 1], &opts->size, &opts->relative))
+	{
+		fprintf(stderr, "Invalid size: %s\n", argv[optind + 1]);
+		return false;
+	}
+	return true;
+}
+
+/** Work out the new size in bytes from the current one. */
+static uint64_t new_size(const resize_opts *opts, uint64_t old_size)
+{
+	uint64_t size = opts->relative ? old_size + opts->size : opts->size;
+	return size / A1FS_BLOCK_SIZE * A1FS_BLOCK_SIZE;
+}
+
+static void print_error(const char *path, int err)
+{
+	switch (err)
+	{
+	case EINVAL:
+		fprintf(stderr, "%s: new size is smaller than the file system\n", path);
+		break;
+	case EFBIG:
+		fprintf(stderr, "%s: new size needs more than %lu blocks\n", path, (unsigned long)UINT32_MAX);
+		break;
+	case ENOSPC:
+		fprintf(stderr, "%s: too few new blocks to hold a larger block bitmap; grow by more\n", path);
+		break;
+	default:
+		fprintf(stderr, "%s: %s\n", path, strerror(err));
+		break;
+	}
+}
+
+static void print_result(const char *path, uint64_t old_size, uint64_t size)
+{
+	if (size == old_size)
+		printf("%s: already %lu bytes\n", path, (unsigned long)size);
+	else
+		printf("%s: grown from %lu to %lu bytes\n", path, (unsigned long)old_size, (unsigned long)size);
+}
+
+/** Grow a mounted file system; return false on error. */
+static bool resize_mounted(const resize_opts *opts)
+{
+	struct statvfs st;
+	if (statvfs(opts->path, &st) != 0)
+	{
+		perror(opts->path);
+		return false;
+	}
+	uint64_t old_size = (uint64_t)st.f_blocks * st.f_frsize;
+	uint64_t size = new_size(opts, old_size);
+
+	int fd = open(opts->path, O_RDONLY);
+	if (fd < 0)
+	{
+		perror(opts->path);
+		return false;
+	}
+	if (ioctl(fd, A1FS_IOC_RESIZE, &size) != 0)
+	{
+		if (errno == ENOTTY || errno == ENOSYS)
+			fprintf(stderr, "%s: not on an a1fs file system\n", opts->path);
+		else
+			print_error(opts->path, errno);
+		close(fd);
+		return false;
+	}
+	close(fd);
+	print_result(opts->path, old_size, size);
+	return true;
+}
+
+/** Grow the file system in an unmounted image; return false on error. */
+static bool resize_image(const resize_opts *opts, off_t file_size)
+{
+	int fd = open(opts->path, O_RDWR);
+	if (fd < 0)
+	{
+		perror(opts->path);
+		return false;
+	}
+	a1fs_superblock sb;
+	if (pread(fd, &sb, sizeof(sb), 0) != sizeof(sb) || sb.magic != A1FS_MAGIC)
+	{
+		fprintf(stderr, "%s: image does not contain a1fs\n", opts->path);
+		close(fd);
+		return false;
+	}
+	uint64_t old_size = (uint64_t)sb.blocks_count * A1FS_BLOCK_SIZE;
+	uint64_t size = new_size(opts, old_size);
+	if (size < old_size)
+	{
+		print_error(opts->path, EINVAL);
+		close(fd);
+		return false;
+	}
+	if (size / A1FS_BLOCK_SIZE > UINT32_MAX)
+	{
+		print_error(opts->path, EFBIG);
+		close(fd);
+		return false;
+	}
+	// The file may already be longer than the file system
+	if ((uint64_t)file_size < size && ftruncate(fd, size) != 0)
+	{
+		perror(opts->path);
+		close(fd);
+		return false;
+	}
+	close(fd);
+
+	size_t map_size;
+	void *image = map_file(opts->path, A1FS_BLOCK_SIZE, &map_size);
+	if (image == NULL)
+	{
+		if (truncate(opts->path, file_size) != 0)
+			perror(opts->path);
+		return false;
+	}
+	int ret = fs_grow(image, size);
+	if (ret == 0 && msync(image, map_size, MS_SYNC) != 0)
+		ret = -errno;
+	munmap(image, map_size);
+	if (ret != 0)
+	{
+		print_error(opts->path, -ret);
+		if ((uint64_t)file_size < size && truncate(opts->path, file_size) != 0)
+			perror(opts->path);
+		return false;
+	}
+	print_result(opts->path, old_size, size);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	resize_opts opts = {0}; // defaults are all 0
+	if (!parse_args(argc, argv, &opts))
+	{
+		// Invalid arguments, print help to stderr
+		print_help(stderr, argv[0]);
+		return 1;
+	}
+	if (opts.help)
+	{
+		// Help requested, print it to stdout
+		print_help(stdout, argv[0]);
+		return 0;
+	}
+
+	struct stat st;
+	if (stat(opts.path, &st) != 0)
+	{
+		perror(opts.path);
+		return 1;
+	}
+	if (S_ISDIR(st.st_mode))
+		return resize_mounted(&opts) ? 0 : 1;
+	if (!S_ISREG(st.st_mode))
+	{
+		fprintf(stderr, "%s: not an image file or a directory\n", opts.path);
+		return 1;
+	}
+	return resize_image(&opts, st.st_size) ? 0 : 1;
+}
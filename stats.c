@@ -0,0 +1,189 @@
+/**
+ * a1fs runtime statistics implementation.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "stats.h"
+
+
+/** Operation names, indexed by stats_op. */
+static const char *op_names[STATS_OP_COUNT] = {
+	[STATS_STATFS] = "statfs",
+	[STATS_GETATTR] = "getattr",
+	[STATS_READDIR] = "readdir",
+	[STATS_MKDIR] = "mkdir",
+	[STATS_RMDIR] = "rmdir",
+	[STATS_CREATE] = "create",
+	[STATS_UNLINK] = "unlink",
+	[STATS_UTIMENS] = "utimens",
+	[STATS_TRUNCATE] = "truncate",
+	[STATS_READ] = "read",
+	[STATS_WRITE] = "write",
+	[STATS_FALLOCATE] = "fallocate",
+	[STATS_GETXATTR] = "getxattr",
+	[STATS_FLUSH] = "flush",
+	[STATS_RELEASE] = "release",
+	[STATS_FSYNC] = "fsync",
+	[STATS_DEFRAG] = "defrag",
+	[STATS_RESIZE] = "resize",
+	[STATS_LOOKUP] = "lookup",
+	[STATS_RENAME] = "rename",
+};
+
+/** Histogram bucket of a latency. */
+static unsigned int bucket_of(uint64_t ns)
+{
+	if (ns < (1u << STATS_SUB_BITS))
+		return ns;
+	if (ns >= (1ull << STATS_MAX_BITS))
+		return STATS_BUCKETS - 1;
+	unsigned int exp = 63 - __builtin_clzll(ns);
+	unsigned int sub = (ns >> (exp - STATS_SUB_BITS)) & ((1u << STATS_SUB_BITS) - 1);
+	return ((exp - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + sub;
+}
+
+/** Largest latency that falls into a bucket. */
+static uint64_t bucket_max(unsigned int idx)
+{
+	if (idx < (1u << STATS_SUB_BITS))
+		return idx;
+	if (idx == STATS_BUCKETS - 1)
+		return UINT64_MAX;
+	unsigned int exp = (idx >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+	uint64_t sub = idx & ((1u << STATS_SUB_BITS) - 1);
+	uint64_t width = 1ull << (exp - STATS_SUB_BITS);
+	return (1ull << exp) + (sub + 1) * width - 1;
+}
+
+uint64_t stats_percentile(const stats_hist *h, double p)
+{
+	uint64_t rank = (uint64_t)(p / 100 * h->count + 0.5);
+	if (rank == 0)
+		rank = 1;
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < STATS_BUCKETS; i++)
+	{
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return bucket_max(i) < h->max_ns ? bucket_max(i) : h->max_ns;
+	}
+	return h->max_ns;
+}
+
+const char *stats_op_name(stats_op op)
+{
+	return op < STATS_OP_COUNT ? op_names[op] : "unknown";
+}
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_record(fs_stats *stats, stats_op op, uint64_t start, int ret)
+{
+	uint64_t ns = stats_now() - start;
+	stats_hist *h = &stats->ops[op];
+	h->count++;
+	if (ret < 0)
+		h->errors++;
+	h->total_ns += ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->buckets[bucket_of(ns)]++;
+}
+
+/** Output buffer for stats_format(). */
+typedef struct out_buf {
+	char *buf;
+	size_t size;
+	size_t len;
+} out_buf;
+
+/** Append formatted text, keeping count of the full length. */
+static void out_printf(out_buf *out, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	size_t left = out->len < out->size ? out->size - out->len : 0;
+	int n = vsnprintf(left > 0 ? out->buf + out->len : NULL, left, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		out->len += n;
+}
+
+/** Ratio of two counters, 0 if the denominator is 0. */
+static double ratio(uint64_t a, uint64_t b)
+{
+	return b > 0 ? (double)a / b : 0;
+}
+
+size_t stats_format(const fs_stats *stats, char *buf, size_t size)
+{
+	out_buf out = {buf, size, 0};
+	if (size > 0)
+		buf[0] = '\0';
+
+	out_printf(&out, "%-10s %12s %8s %12s %10s %10s %10s %10s %10s\n", "op", "count",
+			   "errors", "mean_ns", "p50_ns", "p90_ns", "p99_ns", "p999_ns", "max_ns");
+	for (int op = 0; op < STATS_OP_COUNT; op++)
+	{
+		const stats_hist *h = &stats->ops[op];
+		if (h->count == 0)
+			continue;
+		out_printf(&out, "%-10s %12lu %8lu %12lu %10lu %10lu %10lu %10lu %10lu\n", op_names[op],
+				   (unsigned long)h->count, (unsigned long)h->errors,
+				   (unsigned long)(h->total_ns / h->count),
+				   (unsigned long)stats_percentile(h, 50), (unsigned long)stats_percentile(h, 90),
+				   (unsigned long)stats_percentile(h, 99), (unsigned long)stats_percentile(h, 99.9),
+				   (unsigned long)h->max_ns);
+	}
+
+	out_printf(&out, "\n");
+	for (int op = 0; op < STATS_OP_COUNT; op++)
+	{
+		const stats_hist *h = &stats->ops[op];
+		if (h->count == 0)
+			continue;
+		out_printf(&out, "hist %s", op_names[op]);
+		for (unsigned int i = 0; i < STATS_BUCKETS; i++)
+		{
+			if (h->buckets[i] != 0)
+				out_printf(&out, " %lu:%lu", (unsigned long)bucket_max(i), (unsigned long)h->buckets[i]);
+		}
+		out_printf(&out, "\n");
+	}
+
+	out_printf(&out, "\n");
+	out_printf(&out, "lookups %lu\n", (unsigned long)stats->lookups);
+	out_printf(&out, "dentries_scanned %lu\n", (unsigned long)stats->dentries_scanned);
+	out_printf(&out, "dentries_per_lookup %.1f\n", ratio(stats->dentries_scanned, stats->lookups));
+	out_printf(&out, "negative_hits %lu\n", (unsigned long)stats->negative_hits);
+	out_printf(&out, "allocs %lu\n", (unsigned long)stats->allocs);
+	out_printf(&out, "bitmap_bits_scanned %lu\n", (unsigned long)stats->bitmap_bits_scanned);
+	out_printf(&out, "bitmap_bits_per_alloc %.1f\n", ratio(stats->bitmap_bits_scanned, stats->allocs));
+	out_printf(&out, "extent_lookups %lu\n", (unsigned long)stats->extent_lookups);
+	out_printf(&out, "extents_walked %lu\n", (unsigned long)stats->extents_walked);
+	out_printf(&out, "extents_per_lookup %.1f\n", ratio(stats->extents_walked, stats->extent_lookups));
+	return out.len;
+}
+
+char *stats_snapshot(const fs_stats *stats, size_t *len)
+{
+	size_t size = stats_format(stats, NULL, 0) + 1;
+	// the counters may move between the two calls; leave some slack
+	size += size / 4;
+	char *buf = malloc(size);
+	if (buf == NULL)
+		return NULL;
+	*len = stats_format(stats, buf, size);
+	if (*len >= size)
+		*len = size - 1;
+	return buf;
+}
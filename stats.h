@@ -0,0 +1,143 @@
+/**
+ * a1fs runtime statistics header file.
+ *
+ * Every file system operation handled by the FUSE driver is counted and its
+ * latency recorded in a log-linear (HDR-style) histogram: exact below 8 ns,
+ * then 8 sub-buckets per power of two, i.e. within 12.5% of the true value.
+ * The engine also counts the work done by its inner loops: directory entries
+ * scanned per path lookup, bitmap bits scanned per allocation and extents
+ * walked per block lookup.
+ *
+ * The counters are only updated by the thread that serves requests. Readers on
+ * other threads (the SIGUSR1 dump) may see a slightly stale snapshot.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * Operations with a latency histogram. The values are also stored in operation
+ * traces (see trace.h); add new operations at the end.
+ */
+typedef enum stats_op {
+	STATS_STATFS,
+	STATS_GETATTR,
+	STATS_READDIR,
+	STATS_MKDIR,
+	STATS_RMDIR,
+	STATS_CREATE,
+	STATS_UNLINK,
+	STATS_UTIMENS,
+	STATS_TRUNCATE,
+	STATS_READ,
+	STATS_WRITE,
+	STATS_FALLOCATE,
+	STATS_GETXATTR,
+	STATS_FLUSH,
+	STATS_RELEASE,
+	STATS_FSYNC,
+	STATS_DEFRAG,
+	STATS_RESIZE,
+	STATS_LOOKUP,
+	STATS_RENAME,
+	STATS_OP_COUNT
+} stats_op;
+
+/** log2 of the number of sub-buckets per power of two. */
+#define STATS_SUB_BITS 3
+
+/** Latencies of 2^STATS_MAX_BITS ns (about 18 minutes) or more share a bucket. */
+#define STATS_MAX_BITS 40
+
+/** Number of histogram buckets. */
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+/** Call count and latency histogram of one operation. */
+typedef struct stats_hist {
+	/** Number of calls. */
+	uint64_t count;
+	/** Number of calls that returned an error. */
+	uint64_t errors;
+	/** Sum of the latencies in nanoseconds. */
+	uint64_t total_ns;
+	/** Largest latency in nanoseconds. */
+	uint64_t max_ns;
+	/** Number of calls per latency bucket. */
+	uint64_t buckets[STATS_BUCKETS];
+
+} stats_hist;
+
+/** Runtime statistics of a mounted file system. */
+typedef struct fs_stats {
+	/** Per-operation histograms. */
+	stats_hist ops[STATS_OP_COUNT];
+
+	/** Number of path lookups. */
+	uint64_t lookups;
+	/** Directory entries compared during path lookups. */
+	uint64_t dentries_scanned;
+	/** Directory searches answered by the negative lookup cache. */
+	uint64_t negative_hits;
+	/** Number of inode and block allocations. */
+	uint64_t allocs;
+	/** Inode and block bitmap bits examined during allocations. */
+	uint64_t bitmap_bits_scanned;
+	/** Number of logical to physical block lookups. */
+	uint64_t extent_lookups;
+	/** Extents walked during block lookups. */
+	uint64_t extents_walked;
+
+} fs_stats;
+
+
+/** Current time in nanoseconds, for stats_record(). */
+uint64_t stats_now(void);
+
+/**
+ * Record a completed operation.
+ *
+ * @param stats  statistics to update.
+ * @param op     the operation.
+ * @param start  stats_now() when the operation started.
+ * @param ret    the operation's return value; negative on error.
+ */
+void stats_record(fs_stats *stats, stats_op op, uint64_t start, int ret);
+
+/** Name of an operation, as shown in the statistics. */
+const char *stats_op_name(stats_op op);
+
+/**
+ * Latency at a percentile of a histogram, as the upper bound of its bucket
+ * (capped at the largest latency seen).
+ *
+ * @param h  histogram.
+ * @param p  percentile, 0-100.
+ * @return   latency in nanoseconds.
+ */
+uint64_t stats_percentile(const stats_hist *h, double p);
+
+/**
+ * Render the statistics as text, as snprintf() does.
+ *
+ * One line per operation that has been called, with count, errors, mean and
+ * percentile latencies; then a line per non-empty histogram with its buckets
+ * as "upper_bound_ns:count"; then the engine counters.
+ *
+ * @param stats  statistics to render.
+ * @param buf    buffer that receives the text; may be NULL if size is 0.
+ * @param size   buffer size.
+ * @return       length of the full text, which was truncated if >= size.
+ */
+size_t stats_format(const fs_stats *stats, char *buf, size_t size);
+
+/**
+ * Render the statistics into a newly allocated buffer.
+ *
+ * @param stats  statistics to render.
+ * @param len    pointer to the variable that receives the text length.
+ * @return       the text (to be freed by the caller); NULL on failure.
+ */
+char *stats_snapshot(const fs_stats *stats, size_t *len);
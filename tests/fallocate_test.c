@@ -0,0 +1,69 @@
+/**
+ * a1fs fallocate() regression tests.
+ *
+ * Blocks preallocated past EOF with FALLOC_FL_KEEP_SIZE must survive the
+ * writes that grow the file into them: appends fill the preallocated run in
+ * place instead of allocating new blocks.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <string.h>
+#include <linux/falloc.h>
+
+#include "test.h"
+
+
+/** Appends into a KEEP_SIZE preallocation use the preallocated blocks. */
+static void test_keep_size_append(bool nodelalloc)
+{
+	fs_ctx fs;
+	fs_mount_opts opts = {.nodelalloc = nodelalloc};
+	test_mount(&fs, 1024, 16, 0, &opts);
+	CHECK(fs_create(&fs, "/f", S_IFREG | 0644) == 0);
+
+	static char block[A1FS_BLOCK_SIZE];
+	memset(block, 'x', sizeof(block));
+	CHECK(fs_write(&fs, "/f", block, sizeof(block), 0) == A1FS_BLOCK_SIZE);
+	CHECK(fs_flush(&fs, "/f") == 0);
+	CHECK(fs_fallocate(&fs, "/f", FALLOC_FL_KEEP_SIZE, 0, 16 * A1FS_BLOCK_SIZE) == 0);
+	struct stat st;
+	CHECK(fs_getattr(&fs, "/f", &st) == 0);
+	CHECK(st.st_size == A1FS_BLOCK_SIZE);
+	fsblkcnt_t free_blocks = test_free_blocks(&fs);
+
+	// grow the file through the preallocated run, a block at a time
+	for (off_t offset = A1FS_BLOCK_SIZE; offset < 16 * A1FS_BLOCK_SIZE; offset += A1FS_BLOCK_SIZE)
+	{
+		CHECK(fs_write(&fs, "/f", block, sizeof(block), offset) == A1FS_BLOCK_SIZE);
+		CHECK(fs_flush(&fs, "/f") == 0);
+		CHECK(test_free_blocks(&fs) == free_blocks);
+	}
+	// growing with truncate keeps the preallocation too
+	CHECK(fs_truncate(&fs, "/f", 0) == 0);
+	CHECK(fs_fallocate(&fs, "/f", FALLOC_FL_KEEP_SIZE, 0, 16 * A1FS_BLOCK_SIZE) == 0);
+	free_blocks = test_free_blocks(&fs);
+	CHECK(fs_truncate(&fs, "/f", 8 * A1FS_BLOCK_SIZE) == 0);
+	CHECK(test_free_blocks(&fs) == free_blocks);
+
+	// the run is still one extent, and reads back as zeros
+	char extents[16];
+	int len = fs_getxattr(&fs, "/f", "user.a1fs.extents", extents, sizeof(extents) - 1);
+	CHECK(len > 0);
+	extents[len] = '\0';
+	CHECK(strcmp(extents, "1") == 0);
+	char back[A1FS_BLOCK_SIZE];
+	CHECK(fs_read(&fs, "/f", back, sizeof(back), 7 * A1FS_BLOCK_SIZE) == A1FS_BLOCK_SIZE);
+	for (size_t i = 0; i < sizeof(back); i++)
+		CHECK(back[i] == 0);
+	test_unmount(&fs);
+}
+
+int main(void)
+{
+	test_keep_size_append(false);
+	test_keep_size_append(true);
+	printf("fallocate_test: ok\n");
+	return 0;
+}
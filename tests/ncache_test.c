@@ -0,0 +1,62 @@
+/**
+ * a1fs negative lookup cache regression tests.
+ *
+ * A name whose miss is cached must be found as soon as it is created, whether
+ * by create(), mkdir() or rename(), through both path and inode lookups.
+ */
+
+#include <errno.h>
+
+#include "test.h"
+
+
+/** Look up path, the entry name of dir, twice; the second miss is a cache hit. */
+static void miss_twice(fs_ctx *fs, a1fs_ino_t dir, const char *path, const char *name)
+{
+	a1fs_ino_t ino;
+	CHECK(fs_lookup(fs, path, &ino) == -ENOENT);
+	uint64_t hits = fs->stats.negative_hits;
+	CHECK(fs_lookup_at(fs, dir, name, &ino) == -ENOENT);
+	CHECK(fs->stats.negative_hits == hits + 1);
+}
+
+/** Check that path, the entry name of dir, is found by both lookups. */
+static void found(fs_ctx *fs, a1fs_ino_t dir, const char *path, const char *name)
+{
+	a1fs_ino_t ino, ino_at;
+	CHECK(fs_lookup(fs, path, &ino) == 0);
+	CHECK(fs_lookup_at(fs, dir, name, &ino_at) == 0);
+	CHECK(ino == ino_at);
+}
+
+static void test_hit_then_create(unsigned int features)
+{
+	fs_ctx fs;
+	fs_mount_opts opts = {0};
+	test_mount(&fs, 256, 16, features, &opts);
+	CHECK(fs_mkdir(&fs, "/d", S_IFDIR | 0755) == 0);
+	a1fs_ino_t dir;
+	CHECK(fs_lookup(&fs, "/d", &dir) == 0);
+
+	miss_twice(&fs, dir, "/d/f", "f");
+	CHECK(fs_create(&fs, "/d/f", S_IFREG | 0644) == 0);
+	found(&fs, dir, "/d/f", "f");
+
+	miss_twice(&fs, dir, "/d/e", "e");
+	CHECK(fs_mkdir(&fs, "/d/e", S_IFDIR | 0755) == 0);
+	found(&fs, dir, "/d/e", "e");
+
+	miss_twice(&fs, dir, "/d/g", "g");
+	CHECK(fs_rename(&fs, "/d/f", "/d/g", 0) == 0);
+	found(&fs, dir, "/d/g", "g");
+	miss_twice(&fs, dir, "/d/f", "f");
+	test_unmount(&fs);
+}
+
+int main(void)
+{
+	for (size_t i = 0; i < TEST_DIR_FORMATS; i++)
+		test_hit_then_create(test_dir_formats[i]);
+	printf("ncache_test: ok\n");
+	return 0;
+}
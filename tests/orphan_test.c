@@ -0,0 +1,119 @@
+/**
+ * a1fs pinned inode regression tests.
+ *
+ * A file unlinked or renamed over while it is pinned (looked up or open in the
+ * low-level driver) must keep its inode and data, readable by inode number,
+ * until the last pin is dropped, and only then be freed.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "test.h"
+
+
+/** Write a block of data to path and return its inode number. */
+static a1fs_ino_t make_file(fs_ctx *fs, const char *path, char fill)
+{
+	static char block[A1FS_BLOCK_SIZE];
+	memset(block, fill, sizeof(block));
+	CHECK(fs_create(fs, path, S_IFREG | 0644) == 0);
+	CHECK(fs_write(fs, path, block, sizeof(block), 0) == A1FS_BLOCK_SIZE);
+	CHECK(fs_flush(fs, path) == 0);
+	a1fs_ino_t ino;
+	CHECK(fs_lookup_at(fs, 0, path + 1, &ino) == 0);
+	return ino;
+}
+
+/** Check that the file ino is an orphan that still holds its data. */
+static void check_orphan(fs_ctx *fs, a1fs_ino_t ino, char fill)
+{
+	struct stat st;
+	CHECK(fs_getattr_ino(fs, ino, &st) == 0);
+	CHECK(st.st_nlink == 0);
+	CHECK(st.st_size == A1FS_BLOCK_SIZE);
+	char back[A1FS_BLOCK_SIZE];
+	CHECK(fs_read_ino(fs, ino, back, sizeof(back), 0) == A1FS_BLOCK_SIZE);
+	for (size_t i = 0; i < sizeof(back); i++)
+		CHECK(back[i] == fill);
+}
+
+/** Unlinking a pinned file keeps it until the last pin is dropped. */
+static void test_unlink_pinned(void)
+{
+	fs_ctx fs;
+	fs_mount_opts opts = {0};
+	test_mount(&fs, 256, 16, 0, &opts);
+	// keeps the root directory block, which would go with its last entry
+	CHECK(fs_create(&fs, "/keep", S_IFREG | 0644) == 0);
+	fsblkcnt_t free_blocks = test_free_blocks(&fs);
+	a1fs_ino_t ino = make_file(&fs, "/f", 'a');
+	fsblkcnt_t used_blocks = free_blocks - test_free_blocks(&fs);
+	CHECK(fs_pin(&fs, ino, 2) == 0);
+
+	CHECK(fs_unlink(&fs, "/f") == 0);
+	a1fs_ino_t found;
+	CHECK(fs_lookup_at(&fs, 0, "f", &found) == -ENOENT);
+	CHECK(test_free_blocks(&fs) == free_blocks - used_blocks);
+	check_orphan(&fs, ino, 'a');
+
+	fs_unpin(&fs, ino, 1);
+	check_orphan(&fs, ino, 'a');
+	fs_unpin(&fs, ino, 1);
+	struct stat st;
+	CHECK(fs_getattr_ino(&fs, ino, &st) == -ENOENT);
+	CHECK(test_free_blocks(&fs) == free_blocks);
+	test_unmount(&fs);
+}
+
+/** Renaming over a pinned file keeps the replaced file until it is unpinned. */
+static void test_rename_over_pinned(void)
+{
+	fs_ctx fs;
+	fs_mount_opts opts = {0};
+	test_mount(&fs, 256, 16, 0, &opts);
+	a1fs_ino_t from = make_file(&fs, "/f", 'a');
+	fsblkcnt_t free_blocks = test_free_blocks(&fs);
+	a1fs_ino_t to = make_file(&fs, "/g", 'b');
+	fsblkcnt_t used_blocks = free_blocks - test_free_blocks(&fs);
+	CHECK(fs_pin(&fs, to, 1) == 0);
+
+	CHECK(fs_rename(&fs, "/f", "/g", 0) == 0);
+	a1fs_ino_t found;
+	CHECK(fs_lookup_at(&fs, 0, "g", &found) == 0);
+	CHECK(found == from);
+	CHECK(test_free_blocks(&fs) == free_blocks - used_blocks);
+	check_orphan(&fs, to, 'b');
+
+	fs_unpin(&fs, to, 1);
+	CHECK(test_free_blocks(&fs) == free_blocks);
+	test_unmount(&fs);
+}
+
+/** A pinned file that still has its name is not freed when unpinned. */
+static void test_unpin_linked(void)
+{
+	fs_ctx fs;
+	fs_mount_opts opts = {0};
+	test_mount(&fs, 256, 16, 0, &opts);
+	a1fs_ino_t ino = make_file(&fs, "/f", 'a');
+	CHECK(fs_pin(&fs, ino, 3) == 0);
+	fs_unpin(&fs, ino, 3);
+	struct stat st;
+	CHECK(fs_getattr(&fs, "/f", &st) == 0);
+	CHECK(st.st_nlink == 1);
+
+	// orphans left at unmount are freed with the pins
+	CHECK(fs_pin(&fs, ino, 1) == 0);
+	CHECK(fs_unlink(&fs, "/f") == 0);
+	test_unmount(&fs);
+}
+
+int main(void)
+{
+	test_unlink_pinned();
+	test_rename_over_pinned();
+	test_unpin_linked();
+	printf("orphan_test: ok\n");
+	return 0;
+}
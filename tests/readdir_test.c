@@ -0,0 +1,105 @@
+/**
+ * a1fs readdir() regression tests.
+ *
+ * A listing split over many calls, each resumed from the offset passed with
+ * the last entry taken, must return every entry exactly once, in every
+ * directory format, also when entries are removed between the calls.
+ */
+
+#include <string.h>
+
+#include "test.h"
+
+
+#define N_FILES 200
+
+/** A filler that takes up to max entries, like a small reply buffer. */
+typedef struct listing
+{
+	/** Number of times each file was listed, by file number. */
+	int seen[N_FILES];
+	/** Entries other than the files, "." and "..". */
+	int other;
+	/** Entries taken in this call, and how many fit. */
+	int taken, max;
+	/** Offset passed with the last entry taken. */
+	off_t next;
+
+} listing;
+
+static int take(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	(void)st; // unused
+	listing *l = buf;
+	if (l->taken == l->max)
+		return 1;
+	CHECK(off > l->next);
+	l->taken++;
+	l->next = off;
+	int n;
+	if (sscanf(name, "file%d", &n) == 1 && n >= 0 && n < N_FILES)
+		l->seen[n]++;
+	else if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+		l->other++;
+	return 0;
+}
+
+/** Path of file n; the names differ in length for variable-length entries. */
+static void file_path(char *path, int n)
+{
+	sprintf(path, "/d/file%d%.*s", n, n % 37, "_____________________________________");
+}
+
+/** List /d a few entries at a time, dropping every third file after a call. */
+static void test_resume(unsigned int features)
+{
+	fs_ctx fs;
+	fs_mount_opts opts = {0};
+	test_mount(&fs, 1024, N_FILES + 8, features, &opts);
+	CHECK(fs_mkdir(&fs, "/d", S_IFDIR | 0755) == 0);
+	char path[64];
+	for (int n = 0; n < N_FILES; n++)
+	{
+		file_path(path, n);
+		CHECK(fs_create(&fs, path, S_IFREG | 0644) == 0);
+	}
+
+	static listing l;
+	memset(&l, 0, sizeof(l));
+	l.max = 7;
+	bool removed[N_FILES] = {0};
+	int calls = 0;
+	do
+	{
+		l.taken = 0;
+		CHECK(fs_readdir(&fs, "/d", l.next, &l, take) == 0);
+		calls++;
+		// entries not listed yet go away; they must not show up later
+		if (calls == 3)
+		{
+			for (int n = 0; n < N_FILES; n += 3)
+			{
+				if (l.seen[n] == 0)
+				{
+					file_path(path, n);
+					CHECK(fs_unlink(&fs, path) == 0);
+					removed[n] = true;
+				}
+			}
+		}
+	} while (l.taken > 0);
+
+	CHECK(calls > (N_FILES - N_FILES / 3) / l.max);
+	CHECK(l.other == 0);
+	for (int n = 0; n < N_FILES; n++)
+		CHECK(l.seen[n] == (removed[n] ? 0 : 1));
+	test_unmount(&fs);
+}
+
+int main(void)
+{
+	for (size_t i = 0; i < TEST_DIR_FORMATS; i++)
+		test_resume(test_dir_formats[i]);
+	printf("readdir_test: ok\n");
+	return 0;
+}
@@ -0,0 +1,73 @@
+/**
+ * a1fs rename() regression tests.
+ *
+ * A directory must not be moved anywhere into its own subtree, however deep,
+ * and neither side of an exchange may end up inside the other; the tree must
+ * be left as it was.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+
+#include "test.h"
+
+
+/** Look up a path that must exist. */
+static a1fs_ino_t lookup(fs_ctx *fs, const char *path)
+{
+	a1fs_ino_t ino;
+	CHECK(fs_lookup(fs, path, &ino) == 0);
+	return ino;
+}
+
+/** Check that /d/e/f/g is still where it was made. */
+static void check_tree(fs_ctx *fs)
+{
+	lookup(fs, "/d/e/f/g");
+	struct stat st;
+	CHECK(fs_getattr(fs, "/d", &st) == 0);
+	CHECK(st.st_nlink == 3);
+	CHECK(fs_getattr(fs, "/", &st) == 0);
+	CHECK(st.st_nlink == 3);
+}
+
+static void test_into_subtree(unsigned int features)
+{
+	fs_ctx fs;
+	fs_mount_opts opts = {0};
+	test_mount(&fs, 256, 16, features, &opts);
+	CHECK(fs_mkdir(&fs, "/d", S_IFDIR | 0755) == 0);
+	CHECK(fs_mkdir(&fs, "/d/e", S_IFDIR | 0755) == 0);
+	CHECK(fs_mkdir(&fs, "/d/e/f", S_IFDIR | 0755) == 0);
+	CHECK(fs_mkdir(&fs, "/d/e/f/g", S_IFDIR | 0755) == 0);
+	a1fs_ino_t e = lookup(&fs, "/d/e"), f = lookup(&fs, "/d/e/f");
+
+	// by path, and by inode number as the low-level driver calls it
+	CHECK(fs_rename(&fs, "/d", "/d/e/x", 0) == -EINVAL);
+	CHECK(fs_rename_at(&fs, 0, "d", e, "x", 0) == -EINVAL);
+	CHECK(fs_rename_at(&fs, 0, "d", f, "x", 0) == -EINVAL);
+	CHECK(fs_rename_at(&fs, 0, "d", f, "g", RENAME_EXCHANGE) == -EINVAL);
+	check_tree(&fs);
+
+	// exchanging with an ancestor of the entry's own directory
+	CHECK(fs_rename_at(&fs, f, "g", 0, "d", RENAME_EXCHANGE) == -EINVAL);
+	CHECK(fs_rename(&fs, "/d/e/f/g", "/d", RENAME_EXCHANGE) == -EINVAL);
+	check_tree(&fs);
+
+	// moves out of the subtree still work
+	CHECK(fs_rename_at(&fs, e, "f", 0, "f", 0) == 0);
+	lookup(&fs, "/f/g");
+	CHECK(fs_rename_at(&fs, 0, "d", f, "d", 0) == 0);
+	lookup(&fs, "/f/d/e");
+	test_unmount(&fs);
+}
+
+int main(void)
+{
+	for (size_t i = 0; i < TEST_DIR_FORMATS; i++)
+		test_into_subtree(test_dir_formats[i]);
+	printf("rename_test: ok\n");
+	return 0;
+}
@@ -0,0 +1,85 @@
+/**
+ * a1fs regression test helpers.
+ *
+ * Each test is a program that runs the engine in-process through liba1fs on a
+ * scratch image, as a1fs-bench does, and exits with a non-zero status at the
+ * first check that fails. `make test` builds and runs them all.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "format.h"
+#include "fs_ops.h"
+#include "map.h"
+
+
+/** Fail the test unless cond holds. */
+#define CHECK(cond)                                                                 \
+	do                                                                              \
+	{                                                                               \
+		if (!(cond))                                                                \
+		{                                                                           \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			exit(1);                                                                \
+		}                                                                           \
+	} while (0)
+
+/** Directory entry formats that tests of directory operations run with. */
+static const unsigned int test_dir_formats[] = {
+	0,
+	A1FS_FEATURE_DIRENT,
+	A1FS_FEATURE_DIRENT | A1FS_FEATURE_DIRENT_HASH,
+};
+
+#define TEST_DIR_FORMATS (sizeof(test_dir_formats) / sizeof(test_dir_formats[0]))
+
+/** Scratch image path; unique per test process. */
+static char test_img_path[64];
+
+/**
+ * Format a scratch image and mount it.
+ *
+ * @param fs        file system context to initialize.
+ * @param n_blocks  image size in blocks.
+ * @param n_inodes  number of inodes.
+ * @param features  A1FS_FEATURE_* flags.
+ * @param opts      mount options; NULL for defaults.
+ */
+static inline void test_mount(fs_ctx *fs, size_t n_blocks, size_t n_inodes, unsigned int features,
+							  const fs_mount_opts *opts)
+{
+	snprintf(test_img_path, sizeof(test_img_path), "/tmp/a1fs-test-%d.img", (int)getpid());
+	int fd = open(test_img_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	CHECK(fd >= 0);
+	CHECK(ftruncate(fd, n_blocks * A1FS_BLOCK_SIZE) == 0);
+	close(fd);
+
+	size_t size;
+	void *image = map_file(test_img_path, A1FS_BLOCK_SIZE, &size);
+	CHECK(image != NULL);
+	CHECK(fs_format(image, size, n_inodes, features));
+	munmap(image, size);
+	CHECK(fs_mount(fs, test_img_path, opts));
+}
+
+/** Unmount the scratch image and remove it. */
+static inline void test_unmount(fs_ctx *fs)
+{
+	fs_unmount(fs);
+	unlink(test_img_path);
+}
+
+/** Number of free blocks, as statvfs() reports it. */
+static inline fsblkcnt_t test_free_blocks(fs_ctx *fs)
+{
+	struct statvfs st;
+	CHECK(fs_statfs(fs, &st) == 0);
+	return st.f_bfree;
+}
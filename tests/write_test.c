@@ -0,0 +1,135 @@
+/**
+ * a1fs write regression tests.
+ *
+ * A write that runs out of space must not leave the file longer than the data
+ * it wrote: a failed write leaves the size alone, and a short write extends the
+ * file only up to the end of what it wrote. Appends that were buffered for
+ * delayed allocation and acknowledged must reach the disk, even when free
+ * space is too fragmented for the file's extent table.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "test.h"
+
+
+/** Fill the file system with one-block writes to path until it is full. */
+static void fill(fs_ctx *fs, const char *path)
+{
+	static char block[A1FS_BLOCK_SIZE];
+	CHECK(fs_create(fs, path, S_IFREG | 0644) == 0);
+	off_t offset = 0;
+	int ret;
+	while ((ret = fs_write(fs, path, block, sizeof(block), offset)) == (int)sizeof(block))
+	{
+		offset += ret;
+	}
+	CHECK(ret == -ENOSPC);
+}
+
+/** A write past EOF that cannot allocate any block leaves the size alone. */
+static void test_enospc_size(void)
+{
+	fs_ctx fs;
+	fs_mount_opts opts = {.nodelalloc = true};
+	test_mount(&fs, 256, 16, 0, &opts);
+	CHECK(fs_create(&fs, "/f", S_IFREG | 0644) == 0);
+	fill(&fs, "/fill");
+
+	char data[100];
+	memset(data, 'x', sizeof(data));
+	CHECK(fs_write(&fs, "/f", data, sizeof(data), 1000000) == -ENOSPC);
+	struct stat st;
+	CHECK(fs_getattr(&fs, "/f", &st) == 0);
+	CHECK(st.st_size == 0);
+	test_unmount(&fs);
+}
+
+/** A write that gets only part of its blocks extends the file to what it wrote. */
+static void test_short_write_size(void)
+{
+	fs_ctx fs;
+	fs_mount_opts opts = {.nodelalloc = true};
+	test_mount(&fs, 256, 16, 0, &opts);
+	CHECK(fs_create(&fs, "/f", S_IFREG | 0644) == 0);
+	fill(&fs, "/fill");
+
+	// free exactly one block
+	struct stat st;
+	CHECK(fs_getattr(&fs, "/fill", &st) == 0);
+	CHECK(fs_truncate(&fs, "/fill", st.st_size - A1FS_BLOCK_SIZE) == 0);
+	CHECK(test_free_blocks(&fs) == 1);
+
+	static char data[3 * A1FS_BLOCK_SIZE];
+	memset(data, 'x', sizeof(data));
+	CHECK(fs_write(&fs, "/f", data, sizeof(data), 0) == A1FS_BLOCK_SIZE);
+	CHECK(fs_getattr(&fs, "/f", &st) == 0);
+	CHECK(st.st_size == A1FS_BLOCK_SIZE);
+
+	// the data written is all there is, and reads back
+	char back[2 * A1FS_BLOCK_SIZE];
+	CHECK(fs_read(&fs, "/f", back, sizeof(back), 0) == A1FS_BLOCK_SIZE);
+	CHECK(memcmp(back, data, A1FS_BLOCK_SIZE) == 0);
+	test_unmount(&fs);
+}
+
+/**
+ * Appends into free space fragmented into one-block runs fail at write() once
+ * the extent table cannot map them; all the data acknowledged before that is
+ * flushed and reads back.
+ */
+static void test_fragmented_append(void)
+{
+	fs_ctx fs;
+	fs_mount_opts opts = {0};
+	test_mount(&fs, 4096, 2048, 0, &opts);
+	static char block[A1FS_BLOCK_SIZE];
+	char path[32];
+	for (int i = 0; i < 1964; i++)
+	{
+		snprintf(path, sizeof(path), "/s%d", i);
+		CHECK(fs_create(&fs, path, S_IFREG | 0644) == 0);
+		CHECK(fs_write(&fs, path, block, sizeof(block), 0) == A1FS_BLOCK_SIZE);
+		CHECK(fs_flush(&fs, path) == 0);
+	}
+	for (int i = 0; i < 1964; i += 2)
+	{
+		snprintf(path, sizeof(path), "/s%d", i);
+		CHECK(fs_unlink(&fs, path) == 0);
+	}
+
+	CHECK(fs_create(&fs, "/big", S_IFREG | 0644) == 0);
+	int n = 0, ret = 0;
+	for (; n < 1400; n++)
+	{
+		memset(block, n % 251 + 1, sizeof(block));
+		ret = fs_write(&fs, "/big", block, sizeof(block), (off_t)n * A1FS_BLOCK_SIZE);
+		if (ret != A1FS_BLOCK_SIZE)
+			break;
+	}
+	// there is free space for all of it, but not extents
+	CHECK(n > 0 && n < 1400);
+	CHECK(ret == -ENOSPC);
+	CHECK(fs_flush(&fs, "/big") == 0);
+	struct stat st;
+	CHECK(fs_getattr(&fs, "/big", &st) == 0);
+	CHECK(st.st_size == (off_t)n * A1FS_BLOCK_SIZE);
+	char back[A1FS_BLOCK_SIZE];
+	for (int i = 0; i < n; i++)
+	{
+		CHECK(fs_read(&fs, "/big", back, sizeof(back), (off_t)i * A1FS_BLOCK_SIZE) == A1FS_BLOCK_SIZE);
+		CHECK((unsigned char)back[0] == i % 251 + 1 && (unsigned char)back[sizeof(back) - 1] == i % 251 + 1);
+	}
+	test_unmount(&fs);
+}
+
+int main(void)
+{
+	test_enospc_size();
+	test_short_write_size();
+	test_fragmented_append();
+	printf("write_test: ok\n");
+	return 0;
+}
@@ -0,0 +1,241 @@
+/**
+ * a1fs operation trace implementation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+
+/** Size of a record with a path of given length, padded to 8 bytes. */
+static size_t rec_len(size_t path_len)
+{
+	return (sizeof(trace_rec) + path_len + 7) & ~(size_t)7;
+}
+
+/** Write a whole buffer to a file; return false on error. */
+static bool write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(fd, buf, len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+/** Copy bytes into the ring at given position, wrapping around its end. */
+static void ring_put(trace_ctx *t, uint64_t pos, const void *data, size_t len)
+{
+	size_t off = pos & (TRACE_RING_SIZE - 1);
+	size_t first = len < TRACE_RING_SIZE - off ? len : TRACE_RING_SIZE - off;
+	memcpy(t->ring + off, data, first);
+	memcpy(t->ring, (const char *)data + first, len - first);
+}
+
+/** Write out everything the recording thread has published so far. */
+static void drain(trace_ctx *t)
+{
+	uint64_t tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&t->head, memory_order_acquire);
+	while (tail != head)
+	{
+		size_t off = tail & (TRACE_RING_SIZE - 1);
+		size_t len = head - tail;
+		if (len > TRACE_RING_SIZE - off)
+			len = TRACE_RING_SIZE - off;
+		// The records are lost either way; keep going so the ring does not fill up
+		if (!write_all(t->fd, t->ring + off, len))
+			perror("trace: write");
+		tail += len;
+	}
+	// Only now may the recording thread reuse the space
+	atomic_store_explicit(&t->tail, tail, memory_order_release);
+}
+
+/** Writer thread: drain the ring periodically until stopped. */
+static void *trace_thread(void *arg)
+{
+	trace_ctx *t = (trace_ctx *)arg;
+	struct timespec delay = {0, TRACE_FLUSH_MS * 1000000L};
+	while (!atomic_load(&t->stop))
+	{
+		drain(t);
+		nanosleep(&delay, NULL);
+	}
+	return NULL;
+}
+
+bool trace_init(fs_ctx *fs, const char *path)
+{
+	trace_ctx *t = calloc(1, sizeof(trace_ctx));
+	if (t == NULL)
+		return false;
+	t->ring = malloc(TRACE_RING_SIZE);
+	if (t->ring == NULL)
+	{
+		free(t);
+		return false;
+	}
+	t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (t->fd < 0)
+	{
+		perror(path);
+		free(t->ring);
+		free(t);
+		return false;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	trace_header hdr = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.rec_size = sizeof(trace_rec),
+		.start_time = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+	};
+	if (!write_all(t->fd, (const char *)&hdr, sizeof(hdr)))
+	{
+		perror(path);
+		close(t->fd);
+		free(t->ring);
+		free(t);
+		return false;
+	}
+	t->base_ns = stats_now();
+	atomic_init(&t->head, 0);
+	atomic_init(&t->tail, 0);
+	atomic_init(&t->stop, false);
+	fs->trace = t;
+	return true;
+}
+
+void trace_start(fs_ctx *fs)
+{
+	trace_ctx *t = fs->trace;
+	if (t == NULL)
+		return;
+	if (pthread_create(&t->thread, NULL, trace_thread, t) != 0)
+	{
+		fprintf(stderr, "Failed to start the trace thread; tracing synchronously\n");
+		return;
+	}
+	t->running = true;
+}
+
+void trace_destroy(fs_ctx *fs)
+{
+	trace_ctx *t = fs->trace;
+	if (t == NULL)
+		return;
+	if (t->running)
+	{
+		atomic_store(&t->stop, true);
+		pthread_join(t->thread, NULL);
+	}
+
+	drain(t);
+	if (t->dropped > 0)
+	{
+		fprintf(stderr, "trace: %lu records dropped\n", (unsigned long)t->dropped);
+		if (pwrite(t->fd, &t->dropped, sizeof(t->dropped), offsetof(trace_header, dropped)) < 0)
+			perror("trace: pwrite");
+	}
+	close(t->fd);
+	free(t->ring);
+	free(t);
+	fs->trace = NULL;
+}
+
+void trace_record(trace_ctx *t, stats_op op, uint64_t start, int ret, const char *path,
+				  int64_t offset, uint64_t size, uint32_t mode)
+{
+	static const char zeros[8] = {0};
+	uint64_t end = stats_now();
+	if (path == NULL)
+		path = "";
+	size_t path_len = strnlen(path, UINT16_MAX);
+	// the new path of a rename follows the old one
+	if (op == STATS_RENAME && path_len < UINT16_MAX)
+		path_len += 1 + strnlen(path + path_len + 1, UINT16_MAX - path_len - 1);
+	size_t len = rec_len(path_len);
+
+	uint64_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&t->tail, memory_order_acquire);
+	if (TRACE_RING_SIZE - (head - tail) < len)
+	{
+		t->dropped++;
+		return;
+	}
+
+	trace_rec rec = {
+		.start_ns = start - t->base_ns,
+		.duration_ns = end - start,
+		.offset = offset,
+		.size = size,
+		.result = ret,
+		.mode = mode,
+		.op = op,
+		.path_len = path_len,
+	};
+	ring_put(t, head, &rec, sizeof(rec));
+	ring_put(t, head + sizeof(rec), path, path_len);
+	ring_put(t, head + sizeof(rec) + path_len, zeros, len - sizeof(rec) - path_len);
+	// Publish the record to the writer thread
+	atomic_store_explicit(&t->head, head + len, memory_order_release);
+
+	if (!t->running)
+		drain(t);
+}
+
+FILE *trace_open(const char *path, trace_header *hdr)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+	{
+		perror(path);
+		return NULL;
+	}
+	if (fread(hdr, sizeof(*hdr), 1, f) != 1 || hdr->magic != TRACE_MAGIC)
+	{
+		fprintf(stderr, "%s: not an a1fs trace\n", path);
+		fclose(f);
+		return NULL;
+	}
+	if (hdr->version != TRACE_VERSION || hdr->rec_size != sizeof(trace_rec))
+	{
+		fprintf(stderr, "%s: unsupported trace version %u\n", path, hdr->version);
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+int trace_next(FILE *f, trace_rec *rec, char *path, size_t path_size)
+{
+	if (fread(rec, sizeof(*rec), 1, f) != 1)
+		return feof(f) && !ferror(f) ? 0 : -1;
+	if (rec->op >= STATS_OP_COUNT || rec->path_len >= path_size)
+		return -1;
+	if (fread(path, 1, rec->path_len, f) != rec->path_len)
+		return -1;
+	path[rec->path_len] = '\0';
+
+	char pad[8];
+	size_t pad_len = rec_len(rec->path_len) - sizeof(*rec) - rec->path_len;
+	if (fread(pad, 1, pad_len, f) != pad_len)
+		return -1;
+	return 1;
+}
@@ -0,0 +1,166 @@
+/**
+ * a1fs operation trace header file.
+ *
+ * When mounted with -o trace=FILE, every file system operation handled by the
+ * FUSE driver is appended to FILE as a binary record: operation, path, offset,
+ * size, mode, start time, duration and result. a1fs-replay reads the trace back
+ * and replays it against a fresh image.
+ *
+ * Records are copied into a lock-free single-producer single-consumer ring
+ * buffer by the thread that serves requests and written out in batches by a
+ * background thread, so tracing costs a memcpy() per operation. If the writer
+ * falls behind and the ring is full, records are dropped (and counted in the
+ * trace header) rather than stalling the file system.
+ *
+ * File layout: a trace_header, then records. Each record is a trace_rec
+ * followed by path_len bytes of path (not NUL-terminated), padded to a
+ * multiple of 8 bytes. A rename's path is the old path, a NUL and the new path.
+ * All fields are in host byte order.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "fs_ctx.h"
+#include "stats.h"
+
+
+/** Trace file magic number ("A1FSTRCE"). */
+#define TRACE_MAGIC 0x4543525453463141ull
+
+/** Trace file format version. */
+#define TRACE_VERSION 1
+
+/** Ring buffer size in bytes; must be a power of two. */
+#define TRACE_RING_SIZE (4u << 20)
+
+/** How often the writer thread drains the ring, in milliseconds. */
+#define TRACE_FLUSH_MS 10
+
+/** Trace file header. */
+typedef struct trace_header {
+	/** Must be TRACE_MAGIC. */
+	uint64_t magic;
+	/** Must be TRACE_VERSION. */
+	uint32_t version;
+	/** Size of struct trace_rec. */
+	uint32_t rec_size;
+	/** Wall clock time when tracing started, in nanoseconds since the epoch. */
+	uint64_t start_time;
+	/** Number of records dropped because the ring was full. */
+	uint64_t dropped;
+
+} trace_header;
+
+/** Trace record of one operation. */
+typedef struct trace_rec {
+	/** Start time in nanoseconds since tracing started. */
+	uint64_t start_ns;
+	/** Latency in nanoseconds. */
+	uint64_t duration_ns;
+	/** Offset (read, write, fallocate); 0 otherwise. */
+	int64_t offset;
+	/**
+	 * Request size (read, write, getxattr), length (fallocate) or new size
+	 * (truncate, resize); 0 otherwise.
+	 */
+	uint64_t size;
+	/** Return value of the operation. */
+	int32_t result;
+	/** Mode (mkdir, create), fallocate mode flags or rename flags; 0 otherwise. */
+	uint32_t mode;
+	/** The operation, as a stats_op value. */
+	uint16_t op;
+	/** Length of the path that follows. */
+	uint16_t path_len;
+	uint32_t pad;
+
+} trace_rec;
+
+/** Trace recorder state. */
+typedef struct trace_ctx {
+	/** Trace file descriptor. */
+	int fd;
+	/** stats_now() when tracing started. */
+	uint64_t base_ns;
+	/** Ring buffer of TRACE_RING_SIZE bytes. */
+	char *ring;
+	/** Bytes produced so far; only advanced by the recording thread. */
+	_Atomic uint64_t head;
+	/** Bytes written out so far; only advanced by the writer thread. */
+	_Atomic uint64_t tail;
+	/** Records dropped because the ring was full; recording thread only. */
+	uint64_t dropped;
+	/** Background thread that writes the ring out. */
+	pthread_t thread;
+	/** Whether the background thread is running. */
+	bool running;
+	/** Set to stop the thread once the ring is drained. */
+	atomic_bool stop;
+
+} trace_ctx;
+
+
+/**
+ * Create the trace file and set up the recorder.
+ *
+ * @param fs    file system context.
+ * @param path  trace file path; an existing file is overwritten.
+ * @return      true on success; false on failure.
+ */
+bool trace_init(fs_ctx *fs, const char *path);
+
+/**
+ * Start the writer thread.
+ *
+ * Must be called after FUSE has daemonized (threads do not survive fork()).
+ * Until the thread runs, or if it cannot be started, records are written to
+ * the file as they are made.
+ */
+void trace_start(fs_ctx *fs);
+
+/** Write out the remaining records, stop the writer thread and close the trace. */
+void trace_destroy(fs_ctx *fs);
+
+/**
+ * Record a completed operation.
+ *
+ * @param t       trace recorder.
+ * @param op      the operation.
+ * @param start   stats_now() when the operation started.
+ * @param ret     the operation's return value.
+ * @param path    path the operation was called on; for a rename, the old
+ *                path, a NUL and the new path.
+ * @param offset  offset, if any.
+ * @param size    size or length, if any.
+ * @param mode    mode bits, if any.
+ */
+void trace_record(trace_ctx *t, stats_op op, uint64_t start, int ret, const char *path,
+				  int64_t offset, uint64_t size, uint32_t mode);
+
+/**
+ * Open a trace file for reading and check its header.
+ *
+ * @param path  trace file path.
+ * @param hdr   pointer to the header that receives the result.
+ * @return      the open file; NULL on failure (an error has been printed).
+ */
+FILE *trace_open(const char *path, trace_header *hdr);
+
+/**
+ * Read the next record of a trace.
+ *
+ * @param f          file returned by trace_open().
+ * @param rec        pointer to the record that receives the result.
+ * @param path       buffer that receives the NUL-terminated path.
+ * @param path_size  path buffer size.
+ * @return           1 if a record was read; 0 at the end of the trace;
+ *                   -1 if the trace is truncated or corrupt.
+ */
+int trace_next(FILE *f, trace_rec *rec, char *path, size_t path_size);